@@ -0,0 +1,625 @@
+/*
+ * kvbench - load generator and latency benchmark for the kvstore daemon.
+ *
+ * Opens many concurrent connections, authenticates each one once and
+ * drives a configurable read/write mix with pipelining. Latencies go
+ * into a log-linear (HdrHistogram-style) histogram per connection, merged
+ * at the end for p50/p99/p99.9. --json prints one machine-readable line
+ * for regression tracking.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../user/proto_bin.h"
+
+#define BENCH_MAX_CONNS 4096
+#define BENCH_MAX_PIPELINE 1024
+#define BENCH_RBUF_SIZE (64 * 1024)
+
+/* Log-linear histogram: 2^HIST_SUB_BITS linear sub-buckets per power of two (<1% error) */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram;
+
+typedef struct {
+    const char *host;
+    int port;
+    const char *user;
+    const char *pass;
+    int conns;
+    int pipeline;
+    int duration;
+    long requests;              /* total across connections, 0 = use duration */
+    double read_ratio;
+    long keyspace;
+    int value_size;
+    double zipf;
+    int binary;
+    int populate;
+    int json;
+} bench_opts;
+
+typedef struct {
+    int id;
+    int fd;
+    uint64_t rng;
+    long ops;
+    long errors;
+    long quota;
+    histogram hist;
+    char rbuf[BENCH_RBUF_SIZE];
+    size_t rpos;
+    size_t rlen;
+} bench_conn;
+
+static bench_opts opts = {
+    .host = "127.0.0.1",
+    .port = 5555,
+    .conns = 16,
+    .pipeline = 1,
+    .duration = 10,
+    .read_ratio = 0.9,
+    .keyspace = 10000,
+    .value_size = 16,
+    .zipf = 0.0,
+};
+
+static volatile int stop_flag;
+static char token[64];
+static char value_buf[64];
+
+/* Zipfian generator constants (Gray et al., as used by YCSB) */
+static double zipf_zetan, zipf_eta, zipf_alpha;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- Histogram ---- */
+
+static int hist_index(uint64_t v)
+{
+    int msb, shift;
+
+    if (v < HIST_SUB)
+        return (int)v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int idx)
+{
+    int shift, sub;
+
+    if (idx < HIST_SUB)
+        return (uint64_t)idx;
+    shift = idx / HIST_SUB - 1;
+    sub = idx % HIST_SUB;
+    return (uint64_t)(HIST_SUB + sub) << shift;
+}
+
+static void hist_record(histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += (double)v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(histogram *dst, const histogram *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const histogram *h, double p)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    target = (uint64_t)ceil(p / 100.0 * (double)h->total);
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/* ---- Key selection ---- */
+
+static uint64_t rng_next(uint64_t *s)
+{
+    /* xorshift64* */
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_double(uint64_t *s)
+{
+    return (double)(rng_next(s) >> 11) / (double)(1ULL << 53);
+}
+
+static void zipf_init(long n, double theta)
+{
+    double zeta2 = 0;
+    long i;
+
+    zipf_zetan = 0;
+    for (i = 1; i <= n; i++)
+        zipf_zetan += 1.0 / pow((double)i, theta);
+    for (i = 1; i <= 2; i++)
+        zeta2 += 1.0 / pow((double)i, theta);
+    zipf_alpha = 1.0 / (1.0 - theta);
+    zipf_eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+static long next_key(uint64_t *rng)
+{
+    double u, uz;
+
+    if (opts.zipf <= 0)
+        return (long)(rng_next(rng) % (uint64_t)opts.keyspace);
+
+    u = rng_double(rng);
+    uz = u * zipf_zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, opts.zipf))
+        return 1;
+    return (long)((double)opts.keyspace * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha)) %
+           opts.keyspace;
+}
+
+/* ---- Connection handling ---- */
+
+static int bench_connect(void)
+{
+    struct addrinfo hints, *res;
+    char port[16];
+    int fd, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", opts.port);
+    if (getaddrinfo(opts.host, port, &hints, &res) != 0) {
+        fprintf(stderr, "kvbench: cannot resolve %s\n", opts.host);
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("kvbench: connect");
+        if (fd >= 0)
+            close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Top up the receive buffer; unread bytes are rbuf[rpos..rlen) */
+static int refill(bench_conn *bc)
+{
+    ssize_t n;
+
+    if (bc->rpos > 0) {
+        memmove(bc->rbuf, bc->rbuf + bc->rpos, bc->rlen - bc->rpos);
+        bc->rlen -= bc->rpos;
+        bc->rpos = 0;
+    }
+    n = read(bc->fd, bc->rbuf + bc->rlen, sizeof(bc->rbuf) - bc->rlen);
+    if (n <= 0)
+        return -1;
+    bc->rlen += (size_t)n;
+    return 0;
+}
+
+/* Read one text line (without "\n") through the connection buffer */
+static int read_line(bench_conn *bc, char *line, size_t linelen)
+{
+    for (;;) {
+        char *start = bc->rbuf + bc->rpos;
+        char *nl = memchr(start, '\n', bc->rlen - bc->rpos);
+        if (nl) {
+            size_t len = (size_t)(nl - start);
+            size_t copy = len < linelen - 1 ? len : linelen - 1;
+            memcpy(line, start, copy);
+            line[copy] = '\0';
+            bc->rpos += len + 1;
+            return 0;
+        }
+        if (refill(bc) < 0)
+            return -1;
+    }
+}
+
+/* Make sure at least want unread bytes are buffered */
+static int fill(bench_conn *bc, size_t want)
+{
+    while (bc->rlen - bc->rpos < want) {
+        if (refill(bc) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * AUTH, then optional BINARY. The first connection logs in with the
+ * password; the rest reuse its session token so PAM runs only once.
+ */
+static int bench_handshake(bench_conn *bc)
+{
+    char line[256];
+
+    if (token[0])
+        snprintf(line, sizeof(line), "AUTH-TOKEN %s\n", token);
+    else
+        snprintf(line, sizeof(line), "AUTH %s %s\n", opts.user, opts.pass);
+    if (send_all(bc->fd, line, strlen(line)) < 0 || read_line(bc, line, sizeof(line)) < 0)
+        return -1;
+    if (strncmp(line, "AUTH OK", 7) != 0) {
+        fprintf(stderr, "kvbench: authentication failed: %s\n", line);
+        return -1;
+    }
+    if (!token[0])
+        sscanf(line, "AUTH OK %63s", token);
+
+    if (opts.binary) {
+        if (send_all(bc->fd, "BINARY\n", 7) < 0 || read_line(bc, line, sizeof(line)) < 0)
+            return -1;
+        if (strcmp(line, "BINARY OK") != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static size_t encode_request(char *out, int is_read, long key, uint32_t id)
+{
+    char k[32];
+    int klen = snprintf(k, sizeof(k), "bench%ld", key);
+
+    if (!opts.binary) {
+        if (is_read)
+            return (size_t)sprintf(out, "lookup %s\n", k);
+        return (size_t)sprintf(out, "insert %s %s\n", k, value_buf);
+    }
+
+    kv_bin_hdr h;
+    size_t vlen = is_read ? 0 : (size_t)opts.value_size;
+
+    h.magic = KV_BIN_MAGIC_REQ;
+    h.opcode = is_read ? KV_BIN_OP_GET : KV_BIN_OP_SET;
+    h.status = 0;
+    h.request_id = htonl(id);
+    h.key_len = htons((uint16_t)klen);
+    h.reserved = 0;
+    h.value_len = htonl((uint32_t)vlen);
+    memcpy(out, &h, sizeof(h));
+    memcpy(out + sizeof(h), k, (size_t)klen);
+    memcpy(out + sizeof(h) + klen, value_buf, vlen);
+    return sizeof(h) + (size_t)klen + vlen;
+}
+
+/* Read one response; returns 0 if it indicates success, 1 on a server error, -1 on I/O error */
+static int read_response(bench_conn *bc)
+{
+    if (!opts.binary) {
+        char line[512];
+        if (read_line(bc, line, sizeof(line)) < 0)
+            return -1;
+        return strncmp(line, "ERROR", 5) == 0;
+    }
+
+    kv_bin_hdr h;
+    size_t payload;
+
+    if (fill(bc, KV_BIN_HDR_LEN) < 0)
+        return -1;
+    memcpy(&h, bc->rbuf + bc->rpos, sizeof(h));
+    payload = ntohs(h.key_len) + ntohl(h.value_len);
+    if (fill(bc, KV_BIN_HDR_LEN + payload) < 0)
+        return -1;
+    bc->rpos += KV_BIN_HDR_LEN + payload;
+    h.status = ntohs(h.status);
+    return h.status != KV_BIN_OK && h.status != KV_BIN_NOT_FOUND;
+}
+
+static void *bench_worker(void *arg)
+{
+    bench_conn *bc = arg;
+    char *sbuf = malloc((size_t)opts.pipeline * 160);
+    uint32_t next_id = 1;
+
+    if (!sbuf)
+        return NULL;
+
+    while (!stop_flag && (bc->quota == 0 || bc->ops < bc->quota)) {
+        size_t slen = 0;
+        uint64_t start;
+        int i, batch = opts.pipeline;
+
+        if (bc->quota && bc->quota - bc->ops < batch)
+            batch = (int)(bc->quota - bc->ops);
+
+        for (i = 0; i < batch; i++) {
+            int is_read = rng_double(&bc->rng) < opts.read_ratio;
+            slen += encode_request(sbuf + slen, is_read, next_key(&bc->rng), next_id++);
+        }
+
+        /* Closed loop: each request's latency runs from the batch send to its reply */
+        start = now_ns();
+        if (send_all(bc->fd, sbuf, slen) < 0) {
+            bc->errors += batch;
+            break;
+        }
+        for (i = 0; i < batch; i++) {
+            int r = read_response(bc);
+            if (r < 0) {
+                bc->errors += batch - i;
+                goto out;
+            }
+            hist_record(&bc->hist, now_ns() - start);
+            bc->ops++;
+            bc->errors += r;
+        }
+    }
+out:
+    free(sbuf);
+    return NULL;
+}
+
+static void populate_keys(bench_conn *bc)
+{
+    char *sbuf = malloc(BENCH_MAX_PIPELINE * 160);
+    long k = 0;
+
+    if (!sbuf)
+        return;
+    while (k < opts.keyspace) {
+        size_t slen = 0;
+        int i, batch = 0;
+
+        for (; k < opts.keyspace && batch < BENCH_MAX_PIPELINE; k++, batch++)
+            slen += encode_request(sbuf + slen, 0, k, (uint32_t)k);
+        if (send_all(bc->fd, sbuf, slen) < 0)
+            break;
+        for (i = 0; i < batch; i++) {
+            if (read_response(bc) < 0)
+                goto out;
+        }
+    }
+out:
+    free(sbuf);
+}
+
+static void print_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s -u USER [OPTIONS]\n"
+        "  -H, --host HOST        Server address (default: 127.0.0.1)\n"
+        "  -p, --port PORT        Server port (default: 5555)\n"
+        "  -u, --user USER        Login user\n"
+        "  -a, --pass PASS        Login password (default: $KVBENCH_PASS)\n"
+        "  -c, --conns N          Concurrent connections (default: 16)\n"
+        "  -P, --pipeline N       Requests in flight per connection (default: 1)\n"
+        "  -d, --duration SECS    Run time (default: 10)\n"
+        "  -n, --requests N       Stop after N requests in total instead\n"
+        "  -r, --read-ratio F     Fraction of lookups, 0..1 (default: 0.9)\n"
+        "  -k, --keyspace N       Number of distinct keys (default: 10000)\n"
+        "  -v, --value-size N     Value bytes, 1..63 (default: 16)\n"
+        "  -z, --zipf THETA       Zipfian skew, 0 = uniform (default: 0)\n"
+        "  -B, --binary           Use the binary protocol\n"
+        "  -L, --populate         Insert every key before the run\n"
+        "  -j, --json             Print one JSON line\n"
+        "  -h, --help             Show this help\n",
+        prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        {"host",       required_argument, NULL, 'H'},
+        {"port",       required_argument, NULL, 'p'},
+        {"user",       required_argument, NULL, 'u'},
+        {"pass",       required_argument, NULL, 'a'},
+        {"conns",      required_argument, NULL, 'c'},
+        {"pipeline",   required_argument, NULL, 'P'},
+        {"duration",   required_argument, NULL, 'd'},
+        {"requests",   required_argument, NULL, 'n'},
+        {"read-ratio", required_argument, NULL, 'r'},
+        {"keyspace",   required_argument, NULL, 'k'},
+        {"value-size", required_argument, NULL, 'v'},
+        {"zipf",       required_argument, NULL, 'z'},
+        {"binary",     no_argument,       NULL, 'B'},
+        {"populate",   no_argument,       NULL, 'L'},
+        {"json",       no_argument,       NULL, 'j'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    bench_conn **conns;
+    pthread_t *threads;
+    histogram *total;
+    long ops = 0, errors = 0;
+    uint64_t start, elapsed;
+    int opt, i, started = 0;
+
+    while ((opt = getopt_long(argc, argv, "H:p:u:a:c:P:d:n:r:k:v:z:BLjh", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': opts.host = optarg; break;
+            case 'p': opts.port = atoi(optarg); break;
+            case 'u': opts.user = optarg; break;
+            case 'a': opts.pass = optarg; break;
+            case 'c': opts.conns = atoi(optarg); break;
+            case 'P': opts.pipeline = atoi(optarg); break;
+            case 'd': opts.duration = atoi(optarg); break;
+            case 'n': opts.requests = atol(optarg); break;
+            case 'r': opts.read_ratio = atof(optarg); break;
+            case 'k': opts.keyspace = atol(optarg); break;
+            case 'v': opts.value_size = atoi(optarg); break;
+            case 'z': opts.zipf = atof(optarg); break;
+            case 'B': opts.binary = 1; break;
+            case 'L': opts.populate = 1; break;
+            case 'j': opts.json = 1; break;
+            case 'h':
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (!opts.pass)
+        opts.pass = getenv("KVBENCH_PASS");
+    if (!opts.user || !opts.pass) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    if (opts.conns < 1 || opts.conns > BENCH_MAX_CONNS ||
+        opts.pipeline < 1 || opts.pipeline > BENCH_MAX_PIPELINE ||
+        opts.value_size < 1 || opts.value_size > 63 || opts.keyspace < 1 ||
+        opts.zipf < 0 || opts.zipf == 1.0) {
+        fprintf(stderr, "kvbench: option out of range (zipf must not be exactly 1)\n");
+        exit(1);
+    }
+
+    memset(value_buf, 'x', (size_t)opts.value_size);
+    if (opts.zipf > 0)
+        zipf_init(opts.keyspace, opts.zipf);
+
+    conns = calloc((size_t)opts.conns, sizeof(*conns));
+    threads = calloc((size_t)opts.conns, sizeof(*threads));
+    total = calloc(1, sizeof(*total));
+    if (!conns || !threads || !total)
+        exit(1);
+
+    for (i = 0; i < opts.conns; i++) {
+        bench_conn *bc = calloc(1, sizeof(*bc));
+
+        if (!bc)
+            exit(1);
+        bc->id = i;
+        bc->rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1) ^ now_ns();
+        bc->fd = bench_connect();
+        if (bc->fd < 0)
+            exit(1);
+        if (bench_handshake(bc) < 0)
+            exit(1);
+        if (opts.requests)
+            bc->quota = opts.requests / opts.conns + (i < opts.requests % opts.conns);
+        conns[i] = bc;
+    }
+
+    if (opts.populate)
+        populate_keys(conns[0]);
+
+    start = now_ns();
+    for (i = 0; i < opts.conns; i++) {
+        if (pthread_create(&threads[i], NULL, bench_worker, conns[i]) != 0) {
+            perror("kvbench: pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    if (!opts.requests) {
+        sleep((unsigned)opts.duration);
+        stop_flag = 1;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < opts.conns; i++) {
+        hist_merge(total, &conns[i]->hist);
+        ops += conns[i]->ops;
+        errors += conns[i]->errors;
+        close(conns[i]->fd);
+    }
+
+    double secs = (double)elapsed / 1e9;
+    double mean_us = total->total ? total->sum / (double)total->total / 1000.0 : 0;
+
+    if (opts.json) {
+        printf("{\"proto\":\"%s\",\"conns\":%d,\"pipeline\":%d,\"read_ratio\":%.3f,"
+               "\"keyspace\":%ld,\"value_size\":%d,\"zipf\":%.3f,\"seconds\":%.3f,"
+               "\"ops\":%ld,\"errors\":%ld,\"ops_per_sec\":%.1f,"
+               "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+               "\"p999\":%.1f,\"max\":%.1f}}\n",
+               opts.binary ? "binary" : "text", opts.conns, opts.pipeline, opts.read_ratio,
+               opts.keyspace, opts.value_size, opts.zipf, secs, ops, errors, ops / secs, mean_us,
+               hist_percentile(total, 50) / 1000.0, hist_percentile(total, 90) / 1000.0,
+               hist_percentile(total, 99) / 1000.0, hist_percentile(total, 99.9) / 1000.0,
+               total->max / 1000.0);
+    } else {
+        printf("%ld requests in %.2f s over %d connections (pipeline %d, %s protocol)\n",
+               ops, secs, opts.conns, opts.pipeline, opts.binary ? "binary" : "text");
+        printf("  throughput: %.0f ops/s, errors: %ld\n", ops / secs, errors);
+        printf("  latency (us): mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               mean_us, hist_percentile(total, 50) / 1000.0, hist_percentile(total, 90) / 1000.0,
+               hist_percentile(total, 99) / 1000.0, hist_percentile(total, 99.9) / 1000.0,
+               total->max / 1000.0);
+    }
+
+    for (i = 0; i < opts.conns; i++)
+        free(conns[i]);
+    free(conns);
+    free(threads);
+    free(total);
+    return errors ? 2 : 0;
+}
@@ -0,0 +1,977 @@
+#define _GNU_SOURCE
+#include "kvclient.h"
+#include "../user/proto_bin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define KV_CONN_RBUF 16384
+#define KV_CONN_LINE 256
+#define KV_FRAME_MAX (KV_BIN_HDR_LEN + 2 * KV_CLIENT_VALUE_LEN)
+#define KV_RECONNECT_MAX_MS 2000
+
+/* One authenticated connection speaking the binary protocol */
+typedef struct kv_conn {
+    int fd;
+    uint32_t next_id;
+    time_t last_used;
+    struct kv_conn *next;       /* idle list */
+    size_t rpos;
+    size_t rlen;
+    char rbuf[KV_CONN_RBUF];
+} kv_conn;
+
+struct kv_pending {
+    uint32_t id;
+    int active;
+    kv_callback cb;
+    void *arg;
+};
+
+struct kv_client {
+    char *host;
+    char *unix_path;
+    char *user;
+    char *pass;
+    int port;
+    int pool_size;
+    int timeout_ms;
+
+    /* Connection pool for synchronous calls */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char token[64];             /* session token from the first password login */
+    kv_conn *idle;
+    int total;
+
+    /*
+     * Async connection. Submitters send under alock; only the reader
+     * thread receives. The inflight cap keeps the responses owed to us
+     * far below the server's per-client output limit, so a submitter
+     * blocked in send() while holding alock cannot stall the reader for
+     * long.
+     */
+    pthread_mutex_t alock;
+    pthread_cond_t acond;
+    kv_conn *aconn;             /* NULL while (re)connecting */
+    pthread_t reader;
+    int reader_started;
+    int closing;
+    uint32_t next_id;
+    unsigned int inflight;
+    time_t alast;
+    struct kv_pending pending[KV_CLIENT_MAX_INFLIGHT];
+};
+
+static time_t monotonic_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int io_error(void)
+{
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return -ETIMEDOUT;
+    return -errno;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return io_error();
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Make sure at least want unread bytes are buffered */
+static int conn_fill(kv_conn *conn, size_t want)
+{
+    while (conn->rlen - conn->rpos < want) {
+        ssize_t n;
+
+        if (conn->rpos > 0) {
+            memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+            conn->rlen -= conn->rpos;
+            conn->rpos = 0;
+        }
+        n = recv(conn->fd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen, 0);
+        if (n == 0)
+            return -ECONNRESET;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return io_error();
+        }
+        conn->rlen += (size_t)n;
+    }
+    return 0;
+}
+
+static int conn_read_line(kv_conn *conn, char *line, size_t linelen)
+{
+    for (;;) {
+        char *start = conn->rbuf + conn->rpos;
+        char *nl = memchr(start, '\n', conn->rlen - conn->rpos);
+        int ret;
+
+        if (nl) {
+            size_t len = (size_t)(nl - start);
+            size_t copy = len < linelen - 1 ? len : linelen - 1;
+            memcpy(line, start, copy);
+            line[copy] = '\0';
+            conn->rpos += len + 1;
+            return 0;
+        }
+        if (conn->rlen - conn->rpos >= linelen)
+            return -EPROTO;
+        ret = conn_fill(conn, conn->rlen - conn->rpos + 1);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+/* Is a complete response frame buffered? */
+static int conn_has_frame(kv_conn *conn)
+{
+    kv_bin_hdr h;
+
+    if (conn->rlen - conn->rpos < KV_BIN_HDR_LEN)
+        return 0;
+    memcpy(&h, conn->rbuf + conn->rpos, sizeof(h));
+    return conn->rlen - conn->rpos >= KV_BIN_HDR_LEN + ntohs(h.key_len) + ntohl(h.value_len);
+}
+
+/*
+ * Read one response frame. *payload points into the connection buffer
+ * and stays valid until the next read on this connection.
+ */
+static int conn_read_frame(kv_conn *conn, kv_bin_hdr *h, const char **payload)
+{
+    size_t len;
+    int ret;
+
+    ret = conn_fill(conn, KV_BIN_HDR_LEN);
+    if (ret < 0)
+        return ret;
+    memcpy(h, conn->rbuf + conn->rpos, sizeof(*h));
+    h->status = ntohs(h->status);
+    h->request_id = ntohl(h->request_id);
+    h->key_len = ntohs(h->key_len);
+    h->value_len = ntohl(h->value_len);
+
+    len = (size_t)h->key_len + h->value_len;
+    if (h->magic != KV_BIN_MAGIC_RES || len > KV_BIN_MAX_PAYLOAD)
+        return -EPROTO;
+    ret = conn_fill(conn, KV_BIN_HDR_LEN + len);
+    if (ret < 0)
+        return ret;
+    *payload = conn->rbuf + conn->rpos + KV_BIN_HDR_LEN + h->key_len;
+    conn->rpos += KV_BIN_HDR_LEN + len;
+    return 0;
+}
+
+static int status_to_errno(int status)
+{
+    switch (status) {
+    case KV_BIN_OK:        return 0;
+    case KV_BIN_NOT_FOUND: return -ENOENT;
+    case KV_BIN_EINVAL:    return -EINVAL;
+    case KV_BIN_EIO:       return -EIO;
+    case KV_BIN_EUNKNOWN:  return -ENOSYS;
+    case KV_BIN_EBUSY:     return -EBUSY;
+    default:               return -EPROTO;
+    }
+}
+
+/*
+ * Encode one request frame into out (at least KV_FRAME_MAX bytes).
+ * @return frame length, or -EINVAL if the key or value is too long.
+ */
+static int frame_encode(char *out, uint8_t opcode, uint32_t id,
+                        const char *key, const char *value)
+{
+    size_t klen = key ? strlen(key) : 0;
+    size_t vlen = value ? strlen(value) : 0;
+    kv_bin_hdr h;
+
+    if (klen >= KV_CLIENT_VALUE_LEN || vlen >= KV_CLIENT_VALUE_LEN)
+        return -EINVAL;
+
+    h.magic = KV_BIN_MAGIC_REQ;
+    h.opcode = opcode;
+    h.status = 0;
+    h.request_id = htonl(id);
+    h.key_len = htons((uint16_t)klen);
+    h.reserved = 0;
+    h.value_len = htonl((uint32_t)vlen);
+    memcpy(out, &h, sizeof(h));
+    memcpy(out + sizeof(h), key, klen);
+    memcpy(out + sizeof(h) + klen, value, vlen);
+    return (int)(sizeof(h) + klen + vlen);
+}
+
+static int conn_connect(kv_client *kc)
+{
+    int fd;
+
+    if (kc->unix_path) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(kc->unix_path) >= sizeof(sun.sun_path))
+            return -ENAMETOOLONG;
+        strcpy(sun.sun_path, kc->unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -errno;
+        if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            int err = -errno;
+            close(fd);
+            return err;
+        }
+    } else {
+        struct addrinfo hints, *res, *ai;
+        char port[16];
+        int one = 1;
+        int err = -ECONNREFUSED;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%d", kc->port);
+        if (getaddrinfo(kc->host, port, &hints, &res) != 0)
+            return -EHOSTUNREACH;
+
+        fd = -1;
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                err = -errno;
+                continue;
+            }
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            err = -errno;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0)
+            return err;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    }
+
+    if (kc->timeout_ms > 0) {
+        struct timeval tv;
+
+        tv.tv_sec = kc->timeout_ms / 1000;
+        tv.tv_usec = (kc->timeout_ms % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+/*
+ * Send AUTH-TOKEN (if we hold a token and use_token is set) or AUTH.
+ * A password login stores the returned session token for later
+ * connections. @return 0, -EKEYREJECTED if the token was refused, or
+ * another negative error.
+ */
+static int conn_auth(kv_client *kc, kv_conn *conn, int use_token)
+{
+    char line[KV_CONN_LINE];
+    char token[64] = "";
+    int ret;
+
+    if (use_token) {
+        pthread_mutex_lock(&kc->lock);
+        strcpy(token, kc->token);
+        pthread_mutex_unlock(&kc->lock);
+        use_token = token[0] != '\0';
+    }
+    if (use_token)
+        snprintf(line, sizeof(line), "AUTH-TOKEN %s\n", token);
+    else
+        snprintf(line, sizeof(line), "AUTH %s %s\n", kc->user, kc->pass);
+    ret = send_all(conn->fd, line, strlen(line));
+    memset(line, 0, sizeof(line));
+    if (ret == 0)
+        ret = conn_read_line(conn, line, sizeof(line));
+    if (ret < 0)
+        return ret;
+
+    if (!strncmp(line, "AUTH OK", 7)) {
+        if (!use_token && sscanf(line, "AUTH OK %63s", token) == 1) {
+            pthread_mutex_lock(&kc->lock);
+            strcpy(kc->token, token);
+            pthread_mutex_unlock(&kc->lock);
+        }
+        return 0;
+    }
+    /* "BUSY ..." instead of an AUTH reply: refused at accept, see admit.h */
+    if (!strcmp(line, "AUTH BUSY") || !strncmp(line, "BUSY", 4))
+        return -EBUSY;
+    if (use_token)
+        return -EKEYREJECTED;
+    if (!strcmp(line, "AUTH BACKOFF"))
+        return -EAGAIN;
+    if (!strcmp(line, "AUTH FAIL"))
+        return -EACCES;
+    return -EPROTO;
+}
+
+static void conn_free(kv_conn *conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    free(conn);
+}
+
+/* Connect, authenticate and switch to the binary protocol */
+static int conn_open(kv_client *kc, kv_conn **out)
+{
+    kv_conn *conn;
+    char line[KV_CONN_LINE];
+    int ret;
+
+    conn = calloc(1, sizeof(*conn));
+    if (!conn)
+        return -ENOMEM;
+
+    conn->fd = conn_connect(kc);
+    ret = conn->fd < 0 ? conn->fd : conn_auth(kc, conn, 1);
+    if (ret == -EKEYREJECTED) {
+        /* Token expired: the server has closed this connection, log in again */
+        pthread_mutex_lock(&kc->lock);
+        kc->token[0] = '\0';
+        pthread_mutex_unlock(&kc->lock);
+        close(conn->fd);
+        conn->rpos = conn->rlen = 0;
+        conn->fd = conn_connect(kc);
+        ret = conn->fd < 0 ? conn->fd : conn_auth(kc, conn, 0);
+    }
+    if (ret == 0)
+        ret = send_all(conn->fd, "BINARY\n", 7);
+    if (ret == 0)
+        ret = conn_read_line(conn, line, sizeof(line));
+    if (ret == 0 && strcmp(line, "BINARY OK") != 0)
+        ret = -EPROTO;
+    if (ret < 0) {
+        conn_free(conn);
+        return ret;
+    }
+
+    conn->last_used = monotonic_sec();
+    *out = conn;
+    return 0;
+}
+
+/* NOOP round trip on an idle pooled connection */
+static int conn_ping(kv_conn *conn)
+{
+    char frame[KV_FRAME_MAX];
+    const char *payload;
+    kv_bin_hdr h;
+    int len = frame_encode(frame, KV_BIN_OP_NOOP, conn->next_id++, NULL, NULL);
+    int ret = send_all(conn->fd, frame, (size_t)len);
+
+    if (ret == 0)
+        ret = conn_read_frame(conn, &h, &payload);
+    return ret;
+}
+
+/*
+ * Borrow a connection, opening one if the pool is below its size.
+ * Connections idle for KV_CLIENT_PING_IDLE seconds are checked first,
+ * since the server drops idle clients.
+ */
+static int pool_get(kv_client *kc, kv_conn **out)
+{
+    kv_conn *conn = NULL;
+    int ret;
+
+    pthread_mutex_lock(&kc->lock);
+    while (!kc->idle && kc->total >= kc->pool_size)
+        pthread_cond_wait(&kc->cond, &kc->lock);
+    if (kc->idle) {
+        conn = kc->idle;
+        kc->idle = conn->next;
+    } else {
+        kc->total++;
+    }
+    pthread_mutex_unlock(&kc->lock);
+
+    if (conn && monotonic_sec() - conn->last_used >= KV_CLIENT_PING_IDLE &&
+        conn_ping(conn) != 0) {
+        conn_free(conn);
+        conn = NULL;
+    }
+    if (!conn) {
+        ret = conn_open(kc, &conn);
+        if (ret < 0) {
+            pthread_mutex_lock(&kc->lock);
+            kc->total--;
+            pthread_cond_signal(&kc->cond);
+            pthread_mutex_unlock(&kc->lock);
+            return ret;
+        }
+    }
+    *out = conn;
+    return 0;
+}
+
+/* Return a connection; broken ones are closed instead of pooled */
+static void pool_put(kv_client *kc, kv_conn *conn, int broken)
+{
+    pthread_mutex_lock(&kc->lock);
+    if (broken) {
+        conn_free(conn);
+        kc->total--;
+    } else {
+        conn->last_used = monotonic_sec();
+        conn->next = kc->idle;
+        kc->idle = conn;
+    }
+    pthread_cond_signal(&kc->cond);
+    pthread_mutex_unlock(&kc->lock);
+}
+
+/* Synchronous single request; a response value is copied to out */
+static int kv_call(kv_client *kc, uint8_t opcode, const char *key, const char *value,
+                   char *out, size_t outlen)
+{
+    char frame[KV_FRAME_MAX];
+    const char *payload;
+    kv_conn *conn;
+    kv_bin_hdr h;
+    uint32_t id;
+    int len, ret;
+
+    ret = pool_get(kc, &conn);
+    if (ret < 0)
+        return ret;
+
+    id = conn->next_id++;
+    len = frame_encode(frame, opcode, id, key, value);
+    if (len < 0) {
+        pool_put(kc, conn, 0);
+        return len;
+    }
+    ret = send_all(conn->fd, frame, (size_t)len);
+    if (ret == 0)
+        ret = conn_read_frame(conn, &h, &payload);
+    if (ret == 0 && h.request_id != id)
+        ret = -EPROTO;
+    if (ret < 0) {
+        pool_put(kc, conn, 1);
+        return ret;
+    }
+
+    ret = status_to_errno(h.status);
+    if (out && outlen > 0) {
+        size_t copy = ret == 0 ? h.value_len : 0;
+        if (copy >= outlen)
+            copy = outlen - 1;
+        memcpy(out, payload, copy);
+        out[copy] = '\0';
+    }
+    pool_put(kc, conn, 0);
+    return ret;
+}
+
+int kv_get(kv_client *kc, const char *key, char *value, size_t len)
+{
+    return kv_call(kc, KV_BIN_OP_GET, key, NULL, value, len);
+}
+
+int kv_set(kv_client *kc, const char *key, const char *value)
+{
+    return kv_call(kc, KV_BIN_OP_SET, key, value, NULL, 0);
+}
+
+int kv_del(kv_client *kc, const char *key)
+{
+    return kv_call(kc, KV_BIN_OP_DEL, key, NULL, NULL, 0);
+}
+
+int kv_ping(kv_client *kc)
+{
+    return kv_call(kc, KV_BIN_OP_NOOP, NULL, NULL, NULL, 0);
+}
+
+int kv_stats(kv_client *kc, char *out, size_t len)
+{
+    return kv_call(kc, KV_BIN_OP_STATS, NULL, NULL, out, len);
+}
+
+int kv_scan_page(kv_client *kc, unsigned long long cursor, int count, const char *match,
+                 unsigned long long *next, kv_scan_fn fn, void *arg)
+{
+    char args[48], out[KV_BIN_MAX_PAYLOAD + 1];
+    char key[KV_CLIENT_VALUE_LEN], value[KV_CLIENT_VALUE_LEN];
+    char *line, *end;
+    int ret, n = 0;
+
+    if (count <= 0 || count > KV_CLIENT_SCAN_MAX)
+        return -EINVAL;
+    snprintf(args, sizeof(args), "%llu %d", cursor, count);
+    ret = kv_call(kc, KV_BIN_OP_SCAN, match, args, out, sizeof(out));
+    if (ret < 0)
+        return ret;
+
+    /* "<next>\n" then "key value\n" lines; the copy is ours, the connection is back in the pool */
+    *next = strtoull(out, &end, 10);
+    if (end == out || *end != '\n')
+        return -EPROTO;
+    for (line = end + 1; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (!end)
+            return -EPROTO;
+        *end = '\0';
+        if (sscanf(line, "%63s %63s", key, value) != 2)
+            return -EPROTO;
+        fn(key, value, arg);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Pipelined batch on one connection: send up to KV_CLIENT_BATCH frames
+ * in a single write, then collect their responses by request id.
+ */
+static int kv_batch(kv_client *kc, uint8_t opcode, const char *const *keys,
+                    const char *const *values, size_t n,
+                    char (*out)[KV_CLIENT_VALUE_LEN], int *status)
+{
+    char *frames;
+    kv_conn *conn;
+    size_t done;
+    int ret;
+
+    if (n == 0)
+        return 0;
+    frames = malloc((size_t)KV_CLIENT_BATCH * KV_FRAME_MAX);
+    if (!frames)
+        return -ENOMEM;
+    ret = pool_get(kc, &conn);
+    if (ret < 0) {
+        free(frames);
+        return ret;
+    }
+
+    for (done = 0; done < n && ret == 0; done += KV_CLIENT_BATCH) {
+        size_t batch = n - done < KV_CLIENT_BATCH ? n - done : KV_CLIENT_BATCH;
+        uint32_t first = conn->next_id;
+        size_t off = 0, sent = 0;
+
+        conn->next_id += (uint32_t)batch;
+        for (size_t i = 0; i < batch; i++) {
+            int len = frame_encode(frames + off, opcode, first + (uint32_t)i,
+                                   keys[done + i], values ? values[done + i] : NULL);
+            if (out)
+                out[done + i][0] = '\0';
+            if (len < 0) {
+                status[done + i] = len;
+                continue;
+            }
+            off += (size_t)len;
+            sent++;
+        }
+
+        ret = send_all(conn->fd, frames, off);
+        while (ret == 0 && sent > 0) {
+            const char *payload;
+            kv_bin_hdr h;
+            size_t idx;
+
+            ret = conn_read_frame(conn, &h, &payload);
+            if (ret < 0)
+                break;
+            idx = h.request_id - first;
+            if (idx >= batch) {
+                ret = -EPROTO;
+                break;
+            }
+            status[done + idx] = status_to_errno(h.status);
+            if (out && h.status == KV_BIN_OK) {
+                size_t copy = h.value_len < KV_CLIENT_VALUE_LEN ? h.value_len
+                                                                : KV_CLIENT_VALUE_LEN - 1;
+                memcpy(out[done + idx], payload, copy);
+                out[done + idx][copy] = '\0';
+            }
+            sent--;
+        }
+    }
+
+    pool_put(kc, conn, ret < 0);
+    free(frames);
+    return ret;
+}
+
+int kv_mget(kv_client *kc, const char *const *keys, size_t n,
+            char (*values)[KV_CLIENT_VALUE_LEN], int *status)
+{
+    return kv_batch(kc, KV_BIN_OP_GET, keys, NULL, n, values, status);
+}
+
+int kv_mset(kv_client *kc, const char *const *keys, const char *const *values,
+            size_t n, int *status)
+{
+    return kv_batch(kc, KV_BIN_OP_SET, keys, values, n, NULL, status);
+}
+
+/* Fail every outstanding async request; called by the reader with alock held */
+static size_t async_fail_all(kv_client *kc, struct kv_pending *failed)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < KV_CLIENT_MAX_INFLIGHT; i++) {
+        if (kc->pending[i].active) {
+            failed[n++] = kc->pending[i];
+            kc->pending[i].active = 0;
+        }
+    }
+    kc->inflight = 0;
+    pthread_cond_broadcast(&kc->acond);
+    return n;
+}
+
+/* Register and send one async frame; caller holds alock and has checked the slot is free */
+static int async_send_locked(kv_client *kc, uint8_t opcode, const char *key,
+                             const char *value, kv_callback cb, void *arg)
+{
+    char frame[KV_FRAME_MAX];
+    uint32_t id = kc->next_id;
+    struct kv_pending *p = &kc->pending[id % KV_CLIENT_MAX_INFLIGHT];
+    int len, ret;
+
+    len = frame_encode(frame, opcode, id, key, value);
+    if (len < 0)
+        return len;
+    ret = send_all(kc->aconn->fd, frame, (size_t)len);
+    if (ret < 0) {
+        /* The reader sees the same failure and reconnects */
+        shutdown(kc->aconn->fd, SHUT_RDWR);
+        return ret;
+    }
+    kc->next_id++;
+    p->id = id;
+    p->cb = cb;
+    p->arg = arg;
+    p->active = 1;
+    kc->inflight++;
+    kc->alast = monotonic_sec();
+    return 0;
+}
+
+static void async_dispatch(kv_client *kc, const kv_bin_hdr *h, const char *payload)
+{
+    char value[KV_BIN_MAX_PAYLOAD + 1];
+    struct kv_pending *p = &kc->pending[h->request_id % KV_CLIENT_MAX_INFLIGHT];
+    kv_callback cb = NULL;
+    void *arg = NULL;
+    int status = status_to_errno(h->status);
+    size_t len = 0;
+
+    pthread_mutex_lock(&kc->alock);
+    if (p->active && p->id == h->request_id) {
+        cb = p->cb;
+        arg = p->arg;
+        p->active = 0;
+        kc->inflight--;
+        pthread_cond_broadcast(&kc->acond);
+    }
+    pthread_mutex_unlock(&kc->alock);
+
+    if (!cb)
+        return;
+    if (status == 0 && h->opcode == KV_BIN_OP_GET) {
+        len = h->value_len;
+        memcpy(value, payload, len);
+    }
+    value[len] = '\0';
+    cb(status, len ? value : NULL, len, arg);
+}
+
+/*
+ * Async reader: dispatch responses to callbacks, keep the idle
+ * connection alive with NOOPs, and reconnect after failures (failing
+ * the requests that were in flight).
+ */
+static void *async_reader(void *arg)
+{
+    kv_client *kc = arg;
+    struct kv_pending *failed = malloc(sizeof(kc->pending));
+    int backoff_ms = 50;
+
+    if (!failed)
+        return NULL;
+
+    for (;;) {
+        kv_conn *conn;
+        struct pollfd pfd;
+        int ret = 0;
+
+        pthread_mutex_lock(&kc->alock);
+        conn = kc->aconn;
+        if (kc->closing && (!conn || kc->inflight == 0)) {
+            pthread_mutex_unlock(&kc->alock);
+            break;
+        }
+        if (conn && !kc->inflight && monotonic_sec() - kc->alast >= KV_CLIENT_PING_IDLE &&
+            !kc->pending[kc->next_id % KV_CLIENT_MAX_INFLIGHT].active)
+            async_send_locked(kc, KV_BIN_OP_NOOP, NULL, NULL, NULL, NULL);
+        pthread_mutex_unlock(&kc->alock);
+
+        if (!conn) {
+            ret = conn_open(kc, &conn);
+            pthread_mutex_lock(&kc->alock);
+            if (ret == 0) {
+                kc->aconn = conn;
+                kc->alast = monotonic_sec();
+                backoff_ms = 50;
+            }
+            pthread_cond_broadcast(&kc->acond);
+            pthread_mutex_unlock(&kc->alock);
+            if (ret < 0) {
+                usleep((useconds_t)backoff_ms * 1000);
+                if (backoff_ms < KV_RECONNECT_MAX_MS)
+                    backoff_ms *= 2;
+            }
+            continue;
+        }
+
+        while (ret == 0 && conn_has_frame(conn)) {
+            const char *payload;
+            kv_bin_hdr h;
+
+            ret = conn_read_frame(conn, &h, &payload);
+            if (ret == 0)
+                async_dispatch(kc, &h, payload);
+        }
+
+        if (ret == 0) {
+            pfd.fd = conn->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 1000) > 0) {
+                /* Readable: pull in at least one byte (frames are parsed above) */
+                ret = conn_fill(conn, conn->rlen - conn->rpos + 1);
+                if (ret == -ETIMEDOUT)
+                    ret = 0;
+            }
+        }
+
+        if (ret < 0) {
+            size_t n;
+
+            pthread_mutex_lock(&kc->alock);
+            kc->aconn = NULL;
+            n = async_fail_all(kc, failed);
+            pthread_mutex_unlock(&kc->alock);
+            conn_free(conn);
+            for (size_t i = 0; i < n; i++)
+                if (failed[i].cb)
+                    failed[i].cb(-ECONNRESET, NULL, 0, failed[i].arg);
+        }
+    }
+    free(failed);
+    return NULL;
+}
+
+static int async_submit(kv_client *kc, uint8_t opcode, const char *key,
+                        const char *value, kv_callback cb, void *arg)
+{
+    int in_reader;
+    int ret;
+
+    if ((key && strlen(key) >= KV_CLIENT_VALUE_LEN) ||
+        (value && strlen(value) >= KV_CLIENT_VALUE_LEN))
+        return -EINVAL;
+
+    pthread_mutex_lock(&kc->alock);
+    if (!kc->reader_started) {
+        ret = conn_open(kc, &kc->aconn);
+        if (ret == 0)
+            ret = -pthread_create(&kc->reader, NULL, async_reader, kc);
+        if (ret < 0) {
+            if (kc->aconn) {
+                conn_free(kc->aconn);
+                kc->aconn = NULL;
+            }
+            pthread_mutex_unlock(&kc->alock);
+            return ret;
+        }
+        kc->reader_started = 1;
+        kc->alast = monotonic_sec();
+    }
+
+    /* Wait for a free slot; fail fast while the reader is reconnecting */
+    in_reader = pthread_equal(pthread_self(), kc->reader);
+    while (kc->aconn && !kc->closing &&
+           kc->pending[kc->next_id % KV_CLIENT_MAX_INFLIGHT].active) {
+        if (in_reader) {
+            pthread_mutex_unlock(&kc->alock);
+            return -EAGAIN;
+        }
+        pthread_cond_wait(&kc->acond, &kc->alock);
+    }
+    if (kc->closing)
+        ret = -ESHUTDOWN;
+    else if (!kc->aconn)
+        ret = -ENOTCONN;
+    else
+        ret = async_send_locked(kc, opcode, key, value, cb, arg);
+    pthread_mutex_unlock(&kc->alock);
+    return ret;
+}
+
+int kv_get_async(kv_client *kc, const char *key, kv_callback cb, void *arg)
+{
+    return async_submit(kc, KV_BIN_OP_GET, key, NULL, cb, arg);
+}
+
+int kv_set_async(kv_client *kc, const char *key, const char *value,
+                 kv_callback cb, void *arg)
+{
+    return async_submit(kc, KV_BIN_OP_SET, key, value, cb, arg);
+}
+
+int kv_del_async(kv_client *kc, const char *key, kv_callback cb, void *arg)
+{
+    return async_submit(kc, KV_BIN_OP_DEL, key, NULL, cb, arg);
+}
+
+void kv_flush_async(kv_client *kc)
+{
+    pthread_mutex_lock(&kc->alock);
+    while (kc->inflight > 0)
+        pthread_cond_wait(&kc->acond, &kc->alock);
+    pthread_mutex_unlock(&kc->alock);
+}
+
+kv_client *kv_client_open(const kv_client_opts *opts)
+{
+    kv_client *kc;
+    kv_conn *conn;
+    int ret;
+
+    if (!opts || !opts->user || !opts->pass) {
+        errno = EINVAL;
+        return NULL;
+    }
+    kc = calloc(1, sizeof(*kc));
+    if (!kc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    kc->host = strdup(opts->host ? opts->host : KV_CLIENT_DEFAULT_HOST);
+    kc->unix_path = opts->unix_path ? strdup(opts->unix_path) : NULL;
+    kc->user = strdup(opts->user);
+    kc->pass = strdup(opts->pass);
+    kc->port = opts->port > 0 ? opts->port : KV_CLIENT_DEFAULT_PORT;
+    kc->pool_size = opts->pool_size > 0 ? opts->pool_size : KV_CLIENT_DEFAULT_POOL;
+    kc->timeout_ms = opts->timeout_ms;
+    pthread_mutex_init(&kc->lock, NULL);
+    pthread_cond_init(&kc->cond, NULL);
+    pthread_mutex_init(&kc->alock, NULL);
+    pthread_cond_init(&kc->acond, NULL);
+
+    if (!kc->host || !kc->user || !kc->pass || (opts->unix_path && !kc->unix_path)) {
+        ret = -ENOMEM;
+    } else {
+        /* Log in once now so bad credentials fail here, not on first use */
+        kc->total = 1;
+        ret = conn_open(kc, &conn);
+        if (ret == 0)
+            pool_put(kc, conn, 0);
+        else
+            kc->total = 0;
+    }
+    if (ret < 0) {
+        kv_client_close(kc);
+        errno = -ret;
+        return NULL;
+    }
+    return kc;
+}
+
+void kv_client_close(kv_client *kc)
+{
+    if (!kc)
+        return;
+
+    if (kc->reader_started) {
+        kv_flush_async(kc);
+        pthread_mutex_lock(&kc->alock);
+        kc->closing = 1;
+        if (kc->aconn)
+            shutdown(kc->aconn->fd, SHUT_RDWR);
+        pthread_cond_broadcast(&kc->acond);
+        pthread_mutex_unlock(&kc->alock);
+        pthread_join(kc->reader, NULL);
+        if (kc->aconn)
+            conn_free(kc->aconn);
+    }
+
+    while (kc->idle) {
+        kv_conn *conn = kc->idle;
+        kc->idle = conn->next;
+        conn_free(conn);
+    }
+    if (kc->pass)
+        memset(kc->pass, 0, strlen(kc->pass));
+    memset(kc->token, 0, sizeof(kc->token));
+    pthread_mutex_destroy(&kc->lock);
+    pthread_cond_destroy(&kc->cond);
+    pthread_mutex_destroy(&kc->alock);
+    pthread_cond_destroy(&kc->acond);
+    free(kc->host);
+    free(kc->unix_path);
+    free(kc->user);
+    free(kc->pass);
+    free(kc);
+}
+
+const char *kv_strerror(int status)
+{
+    switch (status) {
+    case 0:             return "OK";
+    case -ENOENT:       return "key not found";
+    case -EINVAL:       return "invalid key or value";
+    case -EIO:          return "kernel store error";
+    case -ENOSYS:       return "unknown command";
+    case -EPROTO:       return "protocol error";
+    case -EACCES:       return "authentication failed";
+    case -EBUSY:        return "server busy, try again";
+    case -EAGAIN:       return "too many failed logins, backing off";
+    default:            return strerror(-status);
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef KVCLIENT_H
+#define KVCLIENT_H
+
+#include <stddef.h>
+
+/*
+ * C client library for the kvstore daemon. Connects over TCP (or the
+ * daemon's Unix socket), authenticates once with PAM credentials, and
+ * reuses the session token for every further connection. It then
+ * switches each connection to the binary protocol (src/user/proto_bin.h).
+ *
+ * Status codes follow src/user/kvproc.h: 0 on success, -ENOENT for a
+ * missing key, -EINVAL for keys/values the store cannot hold, -EIO when
+ * the kernel store failed, -EACCES for bad credentials, -EBUSY when the
+ * server's auth queue is full or it sheds load (admission limits), and
+ * other negative errno values for connection errors.
+ *
+ * All calls are thread-safe. Synchronous calls borrow a connection from
+ * the pool for the duration of the call; asynchronous calls share one
+ * pipelined connection served by a background reader thread.
+ */
+
+#define KV_CLIENT_DEFAULT_HOST "127.0.0.1"
+#define KV_CLIENT_DEFAULT_PORT 5555
+#define KV_CLIENT_DEFAULT_POOL 4
+#define KV_CLIENT_VALUE_LEN 64          /* values are at most 63 bytes + NUL */
+#define KV_CLIENT_BATCH 256             /* frames per write in kv_mget()/kv_mset() */
+#define KV_CLIENT_MAX_INFLIGHT 1024     /* outstanding async requests */
+#define KV_CLIENT_PING_IDLE 30          /* seconds; below the server's idle timeout */
+#define KV_CLIENT_SCAN_MAX 16           /* entries asked for per kv_scan_page() */
+
+typedef struct kv_client kv_client;
+
+typedef struct {
+    const char *host;           /* NULL = KV_CLIENT_DEFAULT_HOST */
+    int port;                   /* 0 = KV_CLIENT_DEFAULT_PORT */
+    const char *unix_path;      /* connect to this socket instead of TCP */
+    const char *user;
+    const char *pass;
+    int pool_size;              /* max pooled connections, 0 = KV_CLIENT_DEFAULT_POOL */
+    int timeout_ms;             /* per send/receive, 0 = no timeout */
+} kv_client_opts;
+
+/**
+ * Completion callback for asynchronous requests. Runs on the client's
+ * reader thread; it should return quickly. value is only set for a
+ * successful kv_get_async() and is valid only during the call.
+ */
+typedef void (*kv_callback)(int status, const char *value, size_t len, void *arg);
+
+/**
+ * Called by kv_scan_page() for each entry, on the calling thread. It may
+ * make further calls on the same client.
+ */
+typedef void (*kv_scan_fn)(const char *key, const char *value, void *arg);
+
+/**
+ * Create a client and open its first connection to check the credentials.
+ * @return the client, or NULL with errno set.
+ */
+kv_client *kv_client_open(const kv_client_opts *opts);
+
+/**
+ * Wait for outstanding async requests, then close all connections.
+ */
+void kv_client_close(kv_client *kc);
+
+/**
+ * Look up a key.
+ * @param value  Receives the NUL-terminated value.
+ * @return 0, -ENOENT if the key does not exist, or a negative error.
+ */
+int kv_get(kv_client *kc, const char *key, char *value, size_t len);
+
+int kv_set(kv_client *kc, const char *key, const char *value);
+
+/**
+ * Delete a key.
+ * @return 0, -ENOENT if the key did not exist, or a negative error.
+ */
+int kv_del(kv_client *kc, const char *key);
+
+/**
+ * Round trip without touching the store; useful as a health check.
+ */
+int kv_ping(kv_client *kc);
+
+/**
+ * Fetch the server's one-line STATS report.
+ */
+int kv_stats(kv_client *kc, char *out, size_t len);
+
+/**
+ * Look up n keys with one pipelined batch per KV_CLIENT_BATCH keys.
+ * @param values  Receives each value ("" if missing).
+ * @param status  Receives each key's status (0, -ENOENT, ...).
+ * @return 0 if every key got an answer, or a negative connection error.
+ */
+int kv_mget(kv_client *kc, const char *const *keys, size_t n,
+            char (*values)[KV_CLIENT_VALUE_LEN], int *status);
+
+/**
+ * Store n key/value pairs, pipelined like kv_mget().
+ * @return 0 if every pair got an answer, or a negative connection error.
+ */
+int kv_mset(kv_client *kc, const char *const *keys, const char *const *values,
+            size_t n, int *status);
+
+/**
+ * Read one batch of an incremental scan of the server's store. Start
+ * with cursor 0 and pass *next back until it is 0; keys present for the
+ * whole scan are returned at least once, even if the store grows.
+ * @param count  Entries wanted, 1..KV_CLIENT_SCAN_MAX (a batch may hold a few more).
+ * @param match  Exact key or "prefix*", NULL for all keys.
+ * @return entries passed to fn, or a negative error (-ENOSYS from a router).
+ */
+int kv_scan_page(kv_client *kc, unsigned long long cursor, int count, const char *match,
+                 unsigned long long *next, kv_scan_fn fn, void *arg);
+
+/**
+ * Queue a request on the async connection. cb is called exactly once
+ * unless the call fails. If KV_CLIENT_MAX_INFLIGHT requests are
+ * outstanding, the call waits for a slot. When called from a callback,
+ * it returns -EAGAIN instead of waiting.
+ * @return 0 if queued, or a negative error.
+ */
+int kv_get_async(kv_client *kc, const char *key, kv_callback cb, void *arg);
+
+int kv_set_async(kv_client *kc, const char *key, const char *value,
+                 kv_callback cb, void *arg);
+
+int kv_del_async(kv_client *kc, const char *key, kv_callback cb, void *arg);
+
+/**
+ * Wait until every queued async request has completed.
+ */
+void kv_flush_async(kv_client *kc);
+
+/**
+ * Describe a status code.
+ */
+const char *kv_strerror(int status);
+
+#endif /* KVCLIENT_H */
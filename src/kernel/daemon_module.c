@@ -1,7 +1,9 @@
 #include "daemon_module.h"
 #include "kvstore.h"
+#include "kvstats.h"
+#include "kvtrace.h"
 
-extern struct rw_semaphore ht_sem; // refers to ht_sem in main_module.c, used for synchronizing access to cmd_history and table
+extern struct rw_semaphore ht_sem; // refers to ht_sem in main_module.c, used for synchronizing access to table
 extern ht *table; // refers to table in main_module.c
 
 pid_t daemon_pid = -1;
@@ -10,20 +12,27 @@ void signal_daemon(void)
 {
     struct pid *pid_struct;
     struct task_struct *task;
+    int ret;
 
     if (daemon_pid <= 0)
         return;
 
     pid_struct = find_get_pid(daemon_pid);
-    if (!pid_struct)
+    if (!pid_struct) {
+        trace_kv_signal_daemon(daemon_pid, -ESRCH);
         return;
+    }
 
     task = pid_task(pid_struct, PIDTYPE_PID);
-    if (!task)
+    if (!task) {
+        trace_kv_signal_daemon(daemon_pid, -ESRCH);
         return;
+    }
 
-    send_sig_info(SIGUSR1, SEND_SIG_PRIV, task);
-    printk(KERN_INFO "Sent SIGUSR1 to daemon PID %d\n", daemon_pid);
+    ret = send_sig_info(SIGUSR1, SEND_SIG_PRIV, task);
+    trace_kv_signal_daemon(daemon_pid, ret);
+    KV_STAT_INC(KV_STAT_SIGNALS);
+    pr_debug("Sent SIGUSR1 to daemon PID %d\n", daemon_pid);
 }
 
 /* /proc/hashtable
@@ -38,11 +47,17 @@ ssize_t daemon_ht_read(struct file *file,
     size_t len = 0;
     int i; 
     ht_entry *e;
+    ssize_t ret;
 
-    if (*offs > 0)
+    trace_kv_proc_enter("hashtable", count, *offs);
+
+    if (*offs > 0) {
+        trace_kv_proc_exit("hashtable", 0);
         return 0;
+    }
 
-    down_read(&ht_sem);
+    kv_down_read(&ht_sem);
+    KV_STAT_INC(KV_STAT_DUMPS);
 
     for (i = 0; i < table->capacity; i++) {
         e = table->entries[i];
@@ -55,9 +70,11 @@ ssize_t daemon_ht_read(struct file *file,
         }
     }
 
-    up_read(&ht_sem);
+    kv_up_read(&ht_sem);
 
-    return simple_read_from_buffer(user_buffer, count, offs, buf, len);
+    ret = simple_read_from_buffer(user_buffer, count, offs, buf, len);
+    trace_kv_proc_exit("hashtable", ret);
+    return ret;
 }
 
 ssize_t daemonpid_read(struct file *file,
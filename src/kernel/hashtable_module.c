@@ -1,6 +1,11 @@
+#include <linux/mm.h>
 #include "hashtable_module.h"
+#include "kvtrace.h"
 
-#define SIZE 20
+#define SIZE 32                 /* initial buckets; always a power of two */
+#define MAX_LOAD 2              /* grow when entries exceed buckets * MAX_LOAD */
+#define MAX_SIZE (1 << 24)
+#define VALUE_BUCKETS 1024
 #define FNV_OFFSET 14695981039346656037UL
 #define FNV_PRIME 1099511628211UL
 
@@ -12,8 +17,15 @@ ht* create_ht(void)
         return NULL;
     }
     table->capacity = SIZE;
+    table->count = 0;
+    table->version = 0;
+    table->values = NULL;
+    table->snap = NULL;
+    table->snap_ids = 0;
+    memset(table->chains, 0, sizeof(table->chains));
+    table->chains[0] = SIZE;
 
-    table->entries = kcalloc(SIZE, sizeof(ht_entry*), GFP_KERNEL);
+    table->entries = kvcalloc(SIZE, sizeof(ht_entry*), GFP_KERNEL);
     if(table->entries == NULL)
     {
         kfree(table);
@@ -22,6 +34,311 @@ ht* create_ht(void)
     return table;
 }
 
+static inline int ht_index(ht* table, uint64_t hash)
+{
+    return (int)(hash & (uint64_t)(table->capacity - 1));
+}
+
+/* A bucket's chain went from len to len + delta entries */
+static void ht_chain_moved(ht* table, int len, int delta)
+{
+    table->chains[min(len, HT_CHAIN_LENGTHS - 1)]--;
+    table->chains[min(len + delta, HT_CHAIN_LENGTHS - 1)]++;
+}
+
+/*
+ * Double the bucket array and rehash every entry. Called with the table
+ * locked for writing. Growing is an optimization, so if memory is short
+ * the table keeps its size and stays correct. Past a few pages the array
+ * comes from vmalloc, since MAX_SIZE buckets is 128 MiB and contiguous
+ * pages that large are rarely there.
+ */
+static void ht_grow(ht* table)
+{
+    int capacity = table->capacity * 2;
+    struct ht_entry** entries;
+
+    if (capacity > MAX_SIZE)
+        return;
+    entries = kvcalloc(capacity, sizeof(ht_entry*), GFP_KERNEL);
+    if (!entries)
+        return;
+    for (int i = 0; i < table->capacity; i++) {
+        struct ht_entry* entry = table->entries[i];
+
+        while (entry) {
+            struct ht_entry* next = entry->next;
+            int index = (int)(hash_key(entry->key) & (uint64_t)(capacity - 1));
+
+            entry->next = entries[index];
+            entries[index] = entry;
+            entry = next;
+        }
+    }
+    kvfree(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+
+    memset(table->chains, 0, sizeof(table->chains));
+    for (int i = 0; i < capacity; i++) {
+        int len = 0;
+
+        for (struct ht_entry* entry = entries[i]; entry; entry = entry->next)
+            len++;
+        table->chains[min(len, HT_CHAIN_LENGTHS - 1)]++;
+    }
+}
+
+static void ht_added(ht* table)
+{
+    if (++table->count > (unsigned long)table->capacity * MAX_LOAD)
+        ht_grow(table);
+}
+
+static uint64_t reverse_bits(uint64_t v)
+{
+    uint64_t r = 0;
+
+    for (int i = 0; i < 64; i++) {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+ht_entry* ht_scan_bucket(ht* table, uint64_t cursor)
+{
+    return table->entries[ht_index(table, cursor)];
+}
+
+uint64_t ht_scan_next(ht* table, uint64_t cursor)
+{
+    /*
+     * Increment the bucket index from its high bit down. Buckets split
+     * by a resize have the same low bits, so when the table doubles, the
+     * buckets still ahead of the cursor are exactly the images of the
+     * ones it has not visited yet.
+     */
+    cursor |= ~(uint64_t)(table->capacity - 1);
+    cursor = reverse_bits(cursor);
+    cursor++;
+    return reverse_bits(cursor);
+}
+
+int ht_intern_values(ht* table)
+{
+    ht_values* values;
+
+    if (table->count)
+        return -EBUSY;
+
+    values = kzalloc(sizeof(ht_values), GFP_KERNEL);
+    if (!values)
+        return -ENOMEM;
+    values->capacity = VALUE_BUCKETS;
+    values->buckets = kcalloc(VALUE_BUCKETS, sizeof(ht_value*), GFP_KERNEL);
+    if (!values->buckets) {
+        kfree(values);
+        return -ENOMEM;
+    }
+    table->values = values;
+    return 0;
+}
+
+static ht_value* value_of(char* str)
+{
+    return (ht_value*)(str - offsetof(ht_value, str));
+}
+
+/* An unlinked value with no references yet */
+static ht_value* value_alloc(const char* str, uint64_t hash)
+{
+    size_t size = strlen(str) + 1;
+    ht_value* v = kmalloc(sizeof(ht_value) + size, GFP_KERNEL);
+
+    if (!v)
+        return NULL;
+    v->next = NULL;
+    v->hash = hash;
+    v->refs = 0;
+    v->size = (unsigned int)size;
+    memcpy(v->str, str, size);
+    return v;
+}
+
+static ht_value* value_find(ht_values* values, const char* str, uint64_t hash)
+{
+    ht_value* v;
+
+    for (v = values->buckets[hash % values->capacity]; v; v = v->next)
+        if (v->hash == hash && !strcmp(v->str, str))
+            return v;
+    return NULL;
+}
+
+static char* value_ref(ht_values* values, ht_value* v)
+{
+    v->refs++;
+    values->refs++;
+    values->ref_bytes += v->size;
+    return v->str;
+}
+
+/* Link a freshly allocated value, or drop it for an equal stored one */
+static char* value_adopt(ht_values* values, ht_value* v)
+{
+    ht_value* found = value_find(values, v->str, v->hash);
+
+    if (found) {
+        kfree(v);
+        return value_ref(values, found);
+    }
+    v->next = values->buckets[v->hash % values->capacity];
+    values->buckets[v->hash % values->capacity] = v;
+    values->count++;
+    values->bytes += sizeof(ht_value) + v->size;
+    return value_ref(values, v);
+}
+
+static void value_put(ht_values* values, char* str)
+{
+    ht_value* v = value_of(str);
+    ht_value** pp;
+
+    values->refs--;
+    values->ref_bytes -= v->size;
+    if (--v->refs)
+        return;
+    for (pp = &values->buckets[v->hash % values->capacity]; *pp != v; pp = &(*pp)->next)
+        ;
+    *pp = v->next;
+    values->count--;
+    values->bytes -= sizeof(ht_value) + v->size;
+    kfree(v);
+}
+
+/* A stored copy of value: private, or a new reference when interning */
+static char* value_dup(ht* table, const char* value)
+{
+    uint64_t hash;
+    ht_value* v;
+
+    if (!table->values)
+        return kstrdup(value, GFP_KERNEL);
+    hash = hash_key(value);
+    v = value_find(table->values, value, hash);
+    if (v)
+        return value_ref(table->values, v);
+    v = value_alloc(value, hash);
+    return v ? value_adopt(table->values, v) : NULL;
+}
+
+static void value_free(ht* table, char* value)
+{
+    if (table->values)
+        value_put(table->values, value);
+    else
+        kfree(value);
+}
+
+int ht_snapshot_begin(ht* table)
+{
+    ht_snapshot* snap;
+
+    if (table->snap)
+        return -EBUSY;
+    snap = kzalloc(sizeof(ht_snapshot), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+    snap->version = table->version;
+    /* Ids are never 0, so entries that no snapshot returned never match */
+    if (++table->snap_ids == 0)
+        table->snap_ids = 1;
+    snap->id = table->snap_ids;
+    table->snap = snap;
+    return 0;
+}
+
+static void snapshot_free_preserved(ht* table, ht_snapshot* snap)
+{
+    while (snap->preserved) {
+        ht_entry* entry = snap->preserved;
+
+        snap->preserved = entry->next;
+        kfree(entry->key);
+        value_free(table, entry->value);
+        kfree(entry);
+    }
+}
+
+void ht_snapshot_end(ht* table)
+{
+    if (!table->snap)
+        return;
+    snapshot_free_preserved(table, table->snap);
+    kfree(table->snap);
+    table->snap = NULL;
+}
+
+int ht_snapshot_visible(ht* table, ht_entry* entry)
+{
+    return entry->version <= table->snap->version && entry->snap_seen != table->snap->id;
+}
+
+void ht_snapshot_mark(ht* table, ht_entry* entry)
+{
+    entry->snap_seen = table->snap->id;
+}
+
+void ht_snapshot_live_done(ht* table)
+{
+    table->snap->live_done = 1;
+}
+
+/* Whether the open snapshot still needs this entry's current key and value */
+static int snapshot_needs(ht* table, ht_entry* entry)
+{
+    ht_snapshot* snap = table->snap;
+
+    return snap && !snap->live_done && entry->version <= snap->version &&
+           entry->snap_seen != snap->id;
+}
+
+static void snapshot_keep(ht_snapshot* snap, ht_entry* entry)
+{
+    entry->next = snap->preserved;
+    snap->preserved = entry;
+    snap->preserved_count++;
+    snap->preserved_bytes += sizeof(ht_entry) + strlen(entry->key) + strlen(entry->value) + 2;
+}
+
+/*
+ * An entry is about to get a new value: move the old one to the
+ * snapshot if it needs it.
+ * @return 1 if the old value now belongs to the snapshot, 0 if the
+ *         caller must free it.
+ */
+static int snapshot_keep_value(ht* table, ht_entry* entry)
+{
+    ht_entry* old;
+
+    if (!snapshot_needs(table, entry))
+        return 0;
+    old = kmalloc(sizeof(ht_entry), GFP_KERNEL);
+    if (old)
+        old->key = kstrdup(entry->key, GFP_KERNEL);
+    if (!old || !old->key) {
+        /* The write goes ahead; the reader reports the snapshot as incomplete */
+        kfree(old);
+        table->snap->failed = 1;
+        return 0;
+    }
+    old->value = entry->value;
+    old->version = entry->version;
+    snapshot_keep(table->snap, old);
+    return 1;
+}
+
 void destroy_ht(ht* table)
 {
     for(int i = 0; i < table->capacity; i++)
@@ -32,11 +349,31 @@ void destroy_ht(ht* table)
             struct ht_entry* temp = entry;
             entry = entry->next;
             kfree(temp->key);
-            kfree(temp->value);
+            if (!table->values)
+                kfree(temp->value);
             kfree(temp);
         }
     }
-    kfree(table->entries);
+    if (table->snap) {
+        snapshot_free_preserved(table, table->snap);
+        kfree(table->snap);
+    }
+    if (table->values) {
+        /* Every entry is gone, so free the shared values without counting refs */
+        for (int i = 0; i < table->values->capacity; i++) {
+            ht_value* v = table->values->buckets[i];
+
+            while (v) {
+                ht_value* next = v->next;
+
+                kfree(v);
+                v = next;
+            }
+        }
+        kfree(table->values->buckets);
+        kfree(table->values);
+    }
+    kvfree(table->entries);
     kfree(table);
 }
 
@@ -56,23 +393,27 @@ uint64_t hash_key(const char* key)
 int ht_insert(ht* table, const char* key, char* value)
 {
     int ret = 0;
+    int chain = 0;
     uint64_t hash = hash_key(key);
-    int index = (int)(hash % table->capacity);
+    int index = ht_index(table, hash);
     struct ht_entry* entry = table->entries[index];
     while(entry != NULL)
     {
+        chain++;
         if (!strcmp(entry->key, key))
         {
             char *new_value;
 
-            new_value = kstrdup(value, GFP_KERNEL);
+            new_value = value_dup(table, value);
             if (!new_value) {
                 ret = -ENOMEM;
                 goto out;
             }
 
-            kfree(entry->value);
+            if (!snapshot_keep_value(table, entry))
+                value_free(table, entry->value);
             entry->value = new_value;
+            entry->version = ++table->version;
             ret = 0;
             goto out;
         }
@@ -91,7 +432,7 @@ int ht_insert(ht* table, const char* key, char* value)
         ret = -ENOMEM;
         goto out;
     } 
-    entry->value = kstrdup(value, GFP_KERNEL);
+    entry->value = value_dup(table, value);
     if (!entry->value) 
     {
         kfree(entry->key);
@@ -99,22 +440,102 @@ int ht_insert(ht* table, const char* key, char* value)
         ret = -ENOMEM;
         goto out;
     }
+    entry->version = ++table->version;
+    entry->snap_seen = 0;
     entry->next = table->entries[index];
     table->entries[index] = entry;
+    ht_chain_moved(table, chain, 1);
+    ht_added(table);
     ret = 0;
 out:
+    trace_kv_insert(key, hash, index, chain, ret);
     return ret;
 }
 
+ht_entry* ht_entry_alloc(ht* table, const char* key, const char* value)
+{
+    ht_entry* entry = kmalloc(sizeof(ht_entry), GFP_KERNEL);
+    ht_value* v = NULL;
+
+    if (!entry)
+        return NULL;
+    entry->key = kstrdup(key, GFP_KERNEL);
+    /* Interned values are shared at insert time; until then this one is unlinked */
+    if (table->values) {
+        v = value_alloc(value, hash_key(value));
+        entry->value = v ? v->str : NULL;
+    } else {
+        entry->value = kstrdup(value, GFP_KERNEL);
+    }
+    if (!entry->key || !entry->value) {
+        ht_entry_free(table, entry);
+        return NULL;
+    }
+    entry->version = 0;
+    entry->snap_seen = 0;
+    entry->next = NULL;
+    return entry;
+}
+
+void ht_entry_free(ht* table, ht_entry* entry)
+{
+    if (!entry)
+        return;
+    kfree(entry->key);
+    if (entry->value && table->values)
+        kfree(value_of(entry->value));      /* never linked: not counted yet */
+    else
+        kfree(entry->value);
+    kfree(entry);
+}
+
+const char* ht_insert_entry(ht* table, ht_entry* new_entry)
+{
+    int chain = 0;
+    uint64_t hash = hash_key(new_entry->key);
+    int index = ht_index(table, hash);
+    struct ht_entry* entry;
+    char* value;
+
+    /* Adopting may free the preallocated value for an equal interned one */
+    if (table->values)
+        new_entry->value = value_adopt(table->values, value_of(new_entry->value));
+    value = new_entry->value;
+
+    for (entry = table->entries[index]; entry; entry = entry->next) {
+        chain++;
+        if (!strcmp(entry->key, new_entry->key)) {
+            /* Keep the linked entry, take the preallocated value */
+            if (!snapshot_keep_value(table, entry))
+                value_free(table, entry->value);
+            entry->value = new_entry->value;
+            entry->version = ++table->version;
+            new_entry->value = NULL;
+            trace_kv_insert(entry->key, hash, index, chain, 0);
+            ht_entry_free(table, new_entry);
+            return value;
+        }
+    }
+    new_entry->version = ++table->version;
+    new_entry->next = table->entries[index];
+    table->entries[index] = new_entry;
+    trace_kv_insert(new_entry->key, hash, index, chain, 0);
+    ht_chain_moved(table, chain, 1);
+    ht_added(table);
+    return value;
+}
+
 int ht_delete(ht* table, const char* key)
 {
     int ret = -ENOENT;
+    int chain = 0;
     uint64_t hash = hash_key(key);
-    int index = (int)(hash % table->capacity);
+    int index = ht_index(table, hash);
     struct ht_entry* prevEntry = NULL;
     struct ht_entry* entry = table->entries[index];
     while(entry != NULL)
     {
+        chain++;
         if(!strcmp(entry->key, key))
         {
             if(prevEntry != NULL)
@@ -125,29 +546,58 @@ int ht_delete(ht* table, const char* key)
             {
                 table->entries[index] = entry->next;
             }
-            kfree(entry->key);
-            kfree(entry->value);
-            kfree(entry);
+            if (snapshot_needs(table, entry)) {
+                /* The unlinked entry itself becomes the preserved copy */
+                snapshot_keep(table->snap, entry);
+            } else {
+                kfree(entry->key);
+                value_free(table, entry->value);
+                kfree(entry);
+            }
+            /* The rest of the chain, for the histogram */
+            for (entry = prevEntry ? prevEntry->next : table->entries[index]; entry;
+                 entry = entry->next)
+                chain++;
+            ht_chain_moved(table, chain, -1);
+            table->count--;
             ret = 0;
             break;
         }
         prevEntry = entry;
         entry = entry->next;
     }
+    trace_kv_delete(key, hash, index, chain, ret);
     return ret;
 }
 
 char* ht_search(ht* table, const char* key)
 {
     uint64_t hash = hash_key(key);
-    int index = hash % table->capacity;
+    int index = ht_index(table, hash);
     struct ht_entry* entry = table->entries[index];
+    int chain = 0;
 
     while (entry) {
-        if (!strcmp(entry->key, key))
+        chain++;
+        if (!strcmp(entry->key, key)) {
+            trace_kv_search(key, hash, index, chain, 1);
             return entry->value;
+        }
         entry = entry->next;
     }
 
+    trace_kv_search(key, hash, index, chain, 0);
     return NULL;
-}
\ No newline at end of file
+}
+
+uint64_t ht_version(ht* table, const char* key)
+{
+    uint64_t hash = hash_key(key);
+    struct ht_entry* entry;
+
+    for (entry = table->entries[ht_index(table, hash)]; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key))
+            return entry->version;
+    }
+    return 0;
+}
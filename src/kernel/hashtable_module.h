@@ -10,13 +10,65 @@ typedef struct ht_entry
 {
     const char* key;
     char* value;
+    uint64_t version;           /* table->version when last written */
+    unsigned int snap_seen;     /* id of the last snapshot that returned this entry */
     struct ht_entry* next;
 } ht_entry;
 
-typedef struct ht 
+/*
+ * Shared value string, used when the table interns values: entries
+ * whose values are equal point at the same str. Only the table frees it.
+ */
+typedef struct ht_value
+{
+    struct ht_value* next;
+    uint64_t hash;
+    unsigned int refs;          /* entries pointing at str */
+    unsigned int size;          /* strlen(str) + 1 */
+    char str[];
+} ht_value;
+
+typedef struct ht_values
 {
     int capacity;
+    unsigned long count;        /* distinct values stored */
+    unsigned long refs;         /* sum of refs */
+    unsigned long bytes;        /* memory of the stored values, headers included */
+    unsigned long ref_bytes;    /* what private copies of every value would take */
+    struct ht_value** buckets;
+} ht_values;
+
+/*
+ * Point-in-time view of the table, see ht_snapshot_begin(). Entries
+ * written after it was taken have a version above its version; their
+ * old key and value are kept on the preserved list until the reader
+ * has returned them.
+ */
+typedef struct ht_snapshot
+{
+    uint64_t version;           /* table version when the snapshot was taken */
+    unsigned int id;
+    int live_done;              /* reader has walked the whole live table */
+    int failed;                 /* a writer could not preserve an entry */
+    struct ht_entry* preserved;
+    unsigned long preserved_count;
+    unsigned long preserved_bytes;
+    unsigned long started;      /* jiffies, set by the owner */
+} ht_snapshot;
+
+#define HT_CHAIN_LENGTHS 32     /* histogram classes 0..30, last one is 31+ */
+
+typedef struct ht 
+{
+    int capacity;               /* buckets, a power of two; doubles as entries grow */
+    unsigned long count;        /* entries */
+    uint64_t version;           /* bumped by every insert; never reused */
     struct ht_entry** entries;
+    struct ht_values* values;   /* NULL unless values are interned */
+    struct ht_snapshot* snap;   /* NULL unless a snapshot is open */
+    unsigned int snap_ids;
+    /* Buckets by chain length, kept up to date by every link and unlink */
+    unsigned long chains[HT_CHAIN_LENGTHS];
 } ht;
 
 ht* create_ht(void);
@@ -25,6 +77,64 @@ uint64_t hash_key(const char* key);
 int ht_insert(ht* table, const char* key, char* value);
 int ht_delete(ht* table, const char* key);
 char* ht_search(ht* table, const char* key);
+
+/*
+ * Incremental iteration. Start with cursor 0; each call visits one
+ * bucket, and ht_scan_next() returns 0 when the scan is complete. The
+ * table may grow between calls: every key present for the whole scan is
+ * still visited at least once, though some may be seen twice. Hold the
+ * lock for each bucket, not across the scan.
+ */
+ht_entry* ht_scan_bucket(ht* table, uint64_t cursor);
+uint64_t ht_scan_next(ht* table, uint64_t cursor);
+
+/*
+ * Copy-on-write snapshots. ht_snapshot_begin() pins the current version
+ * without copying anything. While it is open, the first write or delete
+ * of an entry the reader has not returned yet moves the old key and
+ * value to the preserved list. The reader walks the live table with the
+ * scan cursor, returns the entries ht_snapshot_visible() accepts and
+ * marks them with ht_snapshot_mark(); once the walk is complete it calls
+ * ht_snapshot_live_done() and returns the preserved list. Begin and end
+ * need the table locked for writing, the rest only for reading. Only
+ * one snapshot can be open at a time.
+ * @return 0, -EBUSY if a snapshot is open, or -ENOMEM.
+ */
+int ht_snapshot_begin(ht* table);
+void ht_snapshot_end(ht* table);
+int ht_snapshot_visible(ht* table, ht_entry* entry);
+void ht_snapshot_mark(ht* table, ht_entry* entry);
+void ht_snapshot_live_done(ht* table);
+
+/*
+ * Store values content-addressed and reference-counted: entries with
+ * equal values share one allocation. Call on an empty table, right
+ * after create_ht(). Values returned by ht_search() must not be
+ * modified either way.
+ * @return 0, -EBUSY if the table has entries, or -ENOMEM.
+ */
+int ht_intern_values(ht* table);
+
+/*
+ * Version of a key for optimistic checks: the table version of its last
+ * insert, or 0 if the key does not exist. A key that is deleted and
+ * inserted again gets a new version, so a matching version means the
+ * key has not been written since it was read.
+ */
+uint64_t ht_version(ht* table, const char* key);
+
+/*
+ * Two-phase insert for transactions: ht_entry_alloc() does every
+ * allocation up front (no lock needed), ht_insert_entry() links the
+ * entry, or moves its value into an existing entry for the same key,
+ * and cannot fail. Release unused entries with ht_entry_free(). The
+ * table is only read for its value format, so allocation needs no lock.
+ * ht_insert_entry() returns the value as stored: with interning this can
+ * be an existing copy, and the entry's own value has then been freed.
+ */
+ht_entry* ht_entry_alloc(ht* table, const char* key, const char* value);
+const char* ht_insert_entry(ht* table, ht_entry* entry);
+void ht_entry_free(ht* table, ht_entry* entry);
 void test_hashtable(void);
 int init_module(void);
 void cleanup_module(void);
@@ -0,0 +1,162 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+
+#include "kvevents.h"
+
+#define KV_EVENT_MASK (KV_EVENT_RING - 1)
+
+struct kv_event {
+    u64 seq;
+    enum kv_event_op op;
+    char key[64];
+    char value[64];
+};
+
+/* One per open file: where this reader is in the feed */
+struct kv_event_reader {
+    struct mutex lock;          /* serializes read() calls on one file */
+    u64 next;
+    char line[KV_EVENT_LINE_MAX];
+};
+
+static struct kv_event kv_events[KV_EVENT_RING];
+static u64 kv_event_head = 1;   /* seq of the next event; 0 is never used */
+static DEFINE_SPINLOCK(kv_event_lock);
+static DECLARE_WAIT_QUEUE_HEAD(kv_event_wq);
+
+void kv_event_emit(enum kv_event_op op, const char *key, const char *value)
+{
+    struct kv_event *ev;
+
+    spin_lock(&kv_event_lock);
+    ev = &kv_events[kv_event_head & KV_EVENT_MASK];
+    ev->seq = kv_event_head;
+    ev->op = op;
+    strscpy(ev->key, key, sizeof(ev->key));
+    strscpy(ev->value, value ? value : "", sizeof(ev->value));
+    smp_store_release(&kv_event_head, kv_event_head + 1);
+    spin_unlock(&kv_event_lock);
+
+    wake_up_interruptible(&kv_event_wq);
+}
+
+u64 kv_event_next_seq(void)
+{
+    return smp_load_acquire(&kv_event_head);
+}
+
+static bool kv_event_pending(struct kv_event_reader *r)
+{
+    return smp_load_acquire(&kv_event_head) != READ_ONCE(r->next);
+}
+
+/*
+ * Format the reader's next event into r->line and advance its cursor.
+ * @return line length, or 0 if the reader is caught up.
+ */
+static int kv_event_next_line(struct kv_event_reader *r)
+{
+    struct kv_event ev;
+    u64 head, lost;
+
+    spin_lock(&kv_event_lock);
+    head = kv_event_head;
+    if (r->next == head) {
+        spin_unlock(&kv_event_lock);
+        return 0;
+    }
+    if (head - r->next > KV_EVENT_RING) {
+        /* Overwritten while this reader was away: skip to the oldest kept */
+        lost = head - KV_EVENT_RING - r->next;
+        r->next = head - KV_EVENT_RING;
+        spin_unlock(&kv_event_lock);
+        return scnprintf(r->line, sizeof(r->line), "%llu lost %llu\n", r->next, lost);
+    }
+    ev = kv_events[r->next & KV_EVENT_MASK];
+    r->next++;
+    spin_unlock(&kv_event_lock);
+
+    if (ev.op == KV_EVENT_INSERT)
+        return scnprintf(r->line, sizeof(r->line), "%llu insert %s %s\n",
+                         ev.seq, ev.key, ev.value);
+    return scnprintf(r->line, sizeof(r->line), "%llu delete %s\n", ev.seq, ev.key);
+}
+
+static int kvevents_open(struct inode *inode, struct file *file)
+{
+    struct kv_event_reader *r;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    mutex_init(&r->lock);
+    /* Readers only see mutations made after they opened the file */
+    r->next = kv_event_next_seq();
+    file->private_data = r;
+    return 0;
+}
+
+static int kvevents_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+static ssize_t kvevents_read(struct file *file, char __user *user_buffer,
+                             size_t count, loff_t *offs)
+{
+    struct kv_event_reader *r = file->private_data;
+    size_t done = 0;
+    int len, ret;
+
+    if (count < KV_EVENT_LINE_MAX)
+        return -EINVAL;
+
+    /* Another thread reading the same file may take the events first */
+    while (done == 0) {
+        if (!kv_event_pending(r)) {
+            if (file->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            ret = wait_event_interruptible(kv_event_wq, kv_event_pending(r));
+            if (ret)
+                return ret;
+        }
+
+        if (mutex_lock_interruptible(&r->lock))
+            return -ERESTARTSYS;
+        while (done + KV_EVENT_LINE_MAX <= count) {
+            len = kv_event_next_line(r);
+            if (len == 0)
+                break;
+            if (copy_to_user(user_buffer + done, r->line, len)) {
+                mutex_unlock(&r->lock);
+                return done ? done : -EFAULT;
+            }
+            done += len;
+        }
+        mutex_unlock(&r->lock);
+    }
+    return done;
+}
+
+static __poll_t kvevents_poll(struct file *file, poll_table *wait)
+{
+    struct kv_event_reader *r = file->private_data;
+
+    poll_wait(file, &kv_event_wq, wait);
+    return kv_event_pending(r) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+const struct proc_ops kvevents_proc_ops = {
+    .proc_open    = kvevents_open,
+    .proc_read    = kvevents_read,
+    .proc_poll    = kvevents_poll,
+    .proc_lseek   = noop_llseek,
+    .proc_release = kvevents_release,
+};
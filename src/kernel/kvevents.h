@@ -0,0 +1,40 @@
+#ifndef KVEVENTS_H
+#define KVEVENTS_H
+
+#include <linux/types.h>
+#include <linux/proc_fs.h>
+
+/*
+ * Mutation feed behind /proc/htevents. Every successful insert or delete
+ * is appended to a ring with a sequence number; each open file has its
+ * own cursor and reads one line per event:
+ *
+ *   <seq> insert <key> <value>
+ *   <seq> delete <key>
+ *   <seq> lost <n>        reader fell behind, n events were overwritten
+ *
+ * Reads block until an event is available (unless O_NONBLOCK), return
+ * whole lines only and support poll().
+ */
+#define KV_EVENT_RING 1024          /* events kept; must be a power of two */
+#define KV_EVENT_LINE_MAX 192       /* smallest read() size accepted */
+
+enum kv_event_op {
+    KV_EVENT_INSERT,
+    KV_EVENT_DELETE,
+};
+
+/**
+ * Append a mutation to the feed and wake readers. Call with ht_sem held
+ * for writing, so feed order matches the order applied to the table.
+ */
+void kv_event_emit(enum kv_event_op op, const char *key, const char *value);
+
+/**
+ * Sequence number the next event will get.
+ */
+u64 kv_event_next_seq(void);
+
+extern const struct proc_ops kvevents_proc_ops;
+
+#endif // KVEVENTS_H
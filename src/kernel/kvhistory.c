@@ -0,0 +1,235 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+#include "kvhistory.h"
+
+struct kv_history_rec {
+    seqcount_t seq;
+    u64 time;                   /* 0 = never written */
+    u32 latency_ns;
+    s16 result;
+    u8 op;
+    char key[64];
+};
+
+struct kv_history_cpu {
+    struct kv_history_rec *recs;
+    unsigned int head;          /* next slot, masked */
+};
+
+/* A record as copied out for a reader */
+struct kv_history_entry {
+    u64 time;
+    u32 latency_ns;
+    s16 result;
+    u8 op;
+    unsigned int cpu;
+    char key[64];
+};
+
+/* All CPUs' records as of open, oldest first */
+struct kv_history_view {
+    size_t n;
+    struct kv_history_entry e[];
+};
+
+static DEFINE_PER_CPU(struct kv_history_cpu, kv_history_cpu);
+static unsigned int kv_history_depth;   /* 0 = off */
+
+static const char *const kv_history_ops[KV_HIST_NR] = {
+    [KV_HIST_INSERT]  = "insert",
+    [KV_HIST_DELETE]  = "delete",
+    [KV_HIST_LOOKUP]  = "lookup",
+    [KV_HIST_VERSION] = "version",
+    [KV_HIST_SCAN]    = "scan",
+    [KV_HIST_TXN]     = "multi",
+    [KV_HIST_INVALID] = "invalid",
+};
+
+int kv_history_init(unsigned int depth)
+{
+    unsigned int i;
+    int cpu;
+
+    if (!depth)
+        return 0;
+    depth = roundup_pow_of_two(min_t(unsigned int, depth, KV_HISTORY_MAX_DEPTH));
+
+    for_each_possible_cpu(cpu) {
+        struct kv_history_cpu *hc = per_cpu_ptr(&kv_history_cpu, cpu);
+
+        /* On the CPU's own node: only that CPU writes it */
+        hc->recs = kvzalloc_node(array_size(depth, sizeof(*hc->recs)), GFP_KERNEL,
+                                 cpu_to_node(cpu));
+        if (!hc->recs) {
+            kv_history_exit();
+            return -ENOMEM;
+        }
+        for (i = 0; i < depth; i++)
+            seqcount_init(&hc->recs[i].seq);
+    }
+    WRITE_ONCE(kv_history_depth, depth);
+    return 0;
+}
+
+void kv_history_exit(void)
+{
+    int cpu;
+
+    WRITE_ONCE(kv_history_depth, 0);
+    for_each_possible_cpu(cpu) {
+        struct kv_history_cpu *hc = per_cpu_ptr(&kv_history_cpu, cpu);
+
+        kvfree(hc->recs);
+        hc->recs = NULL;
+        hc->head = 0;
+    }
+}
+
+u64 kv_history_start(void)
+{
+    return READ_ONCE(kv_history_depth) ? ktime_get_ns() : 0;
+}
+
+void kv_history_record(enum kv_history_op op, const char *key, int result, u64 start)
+{
+    struct kv_history_cpu *hc;
+    struct kv_history_rec *r;
+    u64 latency;
+
+    if (!start)
+        return;
+    latency = ktime_get_ns() - start;
+
+    /* Preemption stays off until the record is complete: one writer per ring */
+    hc = get_cpu_ptr(&kv_history_cpu);
+    r = &hc->recs[hc->head];
+    hc->head = (hc->head + 1) & (kv_history_depth - 1);
+
+    write_seqcount_begin(&r->seq);
+    r->time = start;
+    r->latency_ns = latency > U32_MAX ? U32_MAX : (u32)latency;
+    r->result = (s16)result;
+    r->op = op;
+    strscpy(r->key, key ? key : "-", sizeof(r->key));
+    write_seqcount_end(&r->seq);
+    put_cpu_ptr(&kv_history_cpu);
+}
+
+static void kv_history_copy(const struct kv_history_rec *r, struct kv_history_entry *e)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&r->seq);
+        e->time = r->time;
+        e->latency_ns = r->latency_ns;
+        e->result = r->result;
+        e->op = r->op;
+        memcpy(e->key, r->key, sizeof(e->key));
+    } while (read_seqcount_retry(&r->seq, seq));
+    e->key[sizeof(e->key) - 1] = '\0';
+}
+
+static int kv_history_cmp(const void *a, const void *b)
+{
+    const struct kv_history_entry *x = a, *y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return 0;
+}
+
+static void *kvhistory_start(struct seq_file *m, loff_t *pos)
+{
+    struct kv_history_view *v = m->private;
+
+    return *pos < v->n ? &v->e[*pos] : NULL;
+}
+
+static void *kvhistory_next(struct seq_file *m, void *p, loff_t *pos)
+{
+    ++*pos;
+    return kvhistory_start(m, pos);
+}
+
+static void kvhistory_stop(struct seq_file *m, void *p)
+{
+}
+
+static int kvhistory_show(struct seq_file *m, void *p)
+{
+    const struct kv_history_entry *e = p;
+
+    seq_printf(m, "%llu %u %s %s %d %u\n", e->time, e->cpu, kv_history_ops[e->op],
+               e->key, e->result, e->latency_ns);
+    return 0;
+}
+
+static const struct seq_operations kvhistory_seq_ops = {
+    .start = kvhistory_start,
+    .next  = kvhistory_next,
+    .stop  = kvhistory_stop,
+    .show  = kvhistory_show,
+};
+
+/* Copy every ring now, so the view cannot change while it is read */
+static int kvhistory_open(struct inode *inode, struct file *file)
+{
+    unsigned int depth = READ_ONCE(kv_history_depth);
+    struct kv_history_view *v;
+    unsigned int i;
+    int cpu, ret;
+
+    v = kvmalloc(struct_size(v, e, (size_t)depth * num_possible_cpus()), GFP_KERNEL);
+    if (!v)
+        return -ENOMEM;
+    v->n = 0;
+    for_each_possible_cpu(cpu) {
+        const struct kv_history_rec *recs = per_cpu_ptr(&kv_history_cpu, cpu)->recs;
+
+        for (i = 0; i < depth; i++) {
+            struct kv_history_entry *e = &v->e[v->n];
+
+            kv_history_copy(&recs[i], e);
+            if (!e->time)
+                continue;
+            e->cpu = cpu;
+            v->n++;
+        }
+        cond_resched();
+    }
+    sort(v->e, v->n, sizeof(v->e[0]), kv_history_cmp, NULL);
+
+    ret = seq_open(file, &kvhistory_seq_ops);
+    if (ret) {
+        kvfree(v);
+        return ret;
+    }
+    ((struct seq_file *)file->private_data)->private = v;
+    return 0;
+}
+
+static int kvhistory_release(struct inode *inode, struct file *file)
+{
+    struct seq_file *m = file->private_data;
+
+    kvfree(m->private);
+    return seq_release(inode, file);
+}
+
+const struct proc_ops kvhistory_proc_ops = {
+    .proc_open    = kvhistory_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = kvhistory_release,
+};
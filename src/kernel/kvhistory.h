@@ -0,0 +1,57 @@
+#ifndef KVHISTORY_H
+#define KVHISTORY_H
+
+#include <linux/types.h>
+#include <linux/proc_fs.h>
+
+/*
+ * Recent /proc/ht commands, kept per CPU. Each CPU has a ring of
+ * history_depth records (module parameter, rounded up to a power of
+ * two, 0 = off) that only that CPU writes, with preemption disabled,
+ * so recording takes no lock and shares no cache line with other CPUs.
+ * Every record has its own seqcount; a reader that races the writer
+ * retries that one record.
+ *
+ * /proc/hthistory merges the rings as of open(), oldest first, one
+ * "<time_ns> <cpu> <op> <key> <result> <latency_ns>" line per command:
+ * time is CLOCK_MONOTONIC at the start of the command, result is 0 or
+ * a negative errno (-ENOENT for a missing key), latency includes any
+ * wait for ht_sem. Commands without a key show "-".
+ */
+#define KV_HISTORY_DEFAULT_DEPTH 256    /* records per CPU */
+#define KV_HISTORY_MAX_DEPTH 16384
+
+enum kv_history_op {
+    KV_HIST_INSERT,
+    KV_HIST_DELETE,
+    KV_HIST_LOOKUP,
+    KV_HIST_VERSION,
+    KV_HIST_SCAN,
+    KV_HIST_TXN,                /* one record per multi/exec batch */
+    KV_HIST_INVALID,
+    KV_HIST_NR,
+};
+
+/**
+ * Allocate every CPU's ring. depth 0 turns recording off.
+ * @return 0 on success, -ENOMEM.
+ */
+int kv_history_init(unsigned int depth);
+
+void kv_history_exit(void);
+
+/**
+ * Start timing a command.
+ * @return the time to pass to kv_history_record(), 0 if recording is off.
+ */
+u64 kv_history_start(void);
+
+/**
+ * Record a finished command on this CPU. Lock-free; no-op if start is 0.
+ * @param key  NULL for commands without one.
+ */
+void kv_history_record(enum kv_history_op op, const char *key, int result, u64 start);
+
+extern const struct proc_ops kvhistory_proc_ops;
+
+#endif // KVHISTORY_H
@@ -0,0 +1,281 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+
+#include "kvhot.h"
+#include "kvstats.h"
+#include "hashtable_module.h"
+
+/*
+ * One hot key, shared by all CPUs and written under kv_hot_seq. Lookups
+ * only read gen, so each slot gets its own cache line and a write to
+ * one hot key does not invalidate the others.
+ */
+struct kv_hot_slot {
+    u64 gen;                    /* 0 = empty; new value on every write or reuse */
+    u64 owner;                  /* gen at promotion, identifies this tenant */
+    u64 hash;
+    unsigned long promoted;     /* jiffies of the last promotion */
+    char key[64];
+} ____cacheline_aligned_in_smp;
+
+/* A CPU's copy of a hot slot, valid while gen matches the slot's */
+struct kv_hot_copy {
+    u64 gen;
+    u64 owner;
+    u64 hash;
+    u64 hits;                   /* lookups answered for this owner */
+    char key[64];
+    char value[64];
+};
+
+struct kv_hot_cand {
+    u64 hash;
+    unsigned int count;
+    char key[64];
+};
+
+struct kv_hot_cpu {
+    struct kv_hot_copy copy[KV_HOT_SLOTS];
+    struct kv_hot_cand cand[KV_HOT_CANDIDATES];
+    u32 rnd;                    /* xorshift state for picking samples */
+    unsigned int samples;
+};
+
+static struct kv_hot_slot kv_hot_slots[KV_HOT_SLOTS];
+static DEFINE_SEQLOCK(kv_hot_seq);
+static u64 kv_hot_next_gen = 1;     /* under kv_hot_seq */
+static int kv_hot_used;             /* occupied slots; 0 skips every lookup */
+static DEFINE_PER_CPU(struct kv_hot_cpu, kv_hot_cpu);
+
+/*
+ * Find the slot holding key and read its generation and owner.
+ * @return the slot index, or -1 if the key is not hot.
+ */
+static int kv_hot_find(const char *key, u64 hash, u64 *gen, u64 *owner)
+{
+    unsigned int seq;
+    int i, found;
+
+    do {
+        seq = read_seqbegin(&kv_hot_seq);
+        found = -1;
+        for (i = 0; i < KV_HOT_SLOTS; i++) {
+            struct kv_hot_slot *s = &kv_hot_slots[i];
+
+            if (s->gen && s->hash == hash && !strcmp(s->key, key)) {
+                found = i;
+                *gen = s->gen;
+                *owner = s->owner;
+                break;
+            }
+        }
+    } while (read_seqretry(&kv_hot_seq, seq));
+    return found;
+}
+
+/* Make key hot, or refresh it if it already is. Called with preemption off. */
+static void kv_hot_promote(const struct kv_hot_cand *c)
+{
+    unsigned long now = jiffies;
+    int i, victim = -1;
+
+    write_seqlock(&kv_hot_seq);
+    for (i = 0; i < KV_HOT_SLOTS; i++) {
+        struct kv_hot_slot *s = &kv_hot_slots[i];
+
+        if (s->gen && s->hash == c->hash && !strcmp(s->key, c->key)) {
+            s->promoted = now;
+            goto out;
+        }
+        if (victim < 0 && (!s->gen || time_after(now, s->promoted + KV_HOT_TTL)))
+            victim = i;
+    }
+    if (victim >= 0) {
+        struct kv_hot_slot *s = &kv_hot_slots[victim];
+
+        if (!s->gen)
+            WRITE_ONCE(kv_hot_used, kv_hot_used + 1);
+        s->hash = c->hash;
+        strscpy(s->key, c->key, sizeof(s->key));
+        s->promoted = now;
+        s->owner = kv_hot_next_gen;
+        WRITE_ONCE(s->gen, kv_hot_next_gen++);
+        KV_STAT_INC(KV_STAT_HOT_PROMOTIONS);
+    }
+out:
+    write_sequnlock(&kv_hot_seq);
+}
+
+/* End of a sampling period on this CPU: promote the heavy hitters */
+static void kv_hot_period(struct kv_hot_cpu *hc)
+{
+    int i;
+
+    for (i = 0; i < KV_HOT_CANDIDATES; i++) {
+        if (hc->cand[i].count >= KV_HOT_PERIOD / KV_HOT_MIN_SHARE)
+            kv_hot_promote(&hc->cand[i]);
+        hc->cand[i].count = 0;
+    }
+}
+
+void kv_hot_sample(const char *key, u64 hash)
+{
+    struct kv_hot_cpu *hc = get_cpu_ptr(&kv_hot_cpu);
+    struct kv_hot_cand *min;
+    u32 x = hc->rnd ? hc->rnd : 2463534242U;
+    int i;
+
+    /* Random rather than every Nth lookup, so periodic traffic cannot alias */
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    hc->rnd = x;
+    if (x % KV_HOT_SAMPLE)
+        goto out;
+
+    /* Space-saving: a new key replaces the smallest counter and inherits it */
+    min = &hc->cand[0];
+    for (i = 0; i < KV_HOT_CANDIDATES; i++) {
+        struct kv_hot_cand *c = &hc->cand[i];
+
+        if (c->count && c->hash == hash && !strcmp(c->key, key)) {
+            c->count++;
+            goto counted;
+        }
+        if (c->count < min->count)
+            min = c;
+    }
+    min->hash = hash;
+    strscpy(min->key, key, sizeof(min->key));
+    min->count++;
+counted:
+    if (++hc->samples == KV_HOT_PERIOD) {
+        hc->samples = 0;
+        kv_hot_period(hc);
+    }
+out:
+    put_cpu_ptr(&kv_hot_cpu);
+}
+
+bool kv_hot_lookup(const char *key, u64 hash, char *value, size_t len)
+{
+    struct kv_hot_cpu *hc;
+    bool hit = false;
+    int i;
+
+    if (!READ_ONCE(kv_hot_used))
+        return false;
+
+    hc = get_cpu_ptr(&kv_hot_cpu);
+    for (i = 0; i < KV_HOT_SLOTS; i++) {
+        struct kv_hot_copy *c = &hc->copy[i];
+
+        if (c->gen && c->hash == hash && !strcmp(c->key, key)) {
+            if (READ_ONCE(kv_hot_slots[i].gen) == c->gen) {
+                strscpy(value, c->value, len);
+                c->hits++;
+                hit = true;
+            }
+            break;
+        }
+    }
+    put_cpu_ptr(&kv_hot_cpu);
+    if (hit)
+        KV_STAT_INC(KV_STAT_HOT_HITS);
+    return hit;
+}
+
+void kv_hot_fill(const char *key, u64 hash, const char *value)
+{
+    struct kv_hot_cpu *hc;
+    struct kv_hot_copy *c;
+    u64 gen, owner;
+    int i;
+
+    if (!READ_ONCE(kv_hot_used))
+        return;
+    i = kv_hot_find(key, hash, &gen, &owner);
+    if (i < 0)
+        return;
+
+    hc = get_cpu_ptr(&kv_hot_cpu);
+    c = &hc->copy[i];
+    if (c->owner != owner)
+        c->hits = 0;
+    c->owner = owner;
+    c->hash = hash;
+    strscpy(c->key, key, sizeof(c->key));
+    strscpy(c->value, value, sizeof(c->value));
+    c->gen = gen;
+    put_cpu_ptr(&kv_hot_cpu);
+    KV_STAT_INC(KV_STAT_HOT_FILLS);
+}
+
+void kv_hot_invalidate(const char *key)
+{
+    u64 hash;
+    int i;
+
+    if (!READ_ONCE(kv_hot_used))
+        return;
+
+    hash = hash_key(key);
+    for (i = 0; i < KV_HOT_SLOTS; i++) {
+        struct kv_hot_slot *s = &kv_hot_slots[i];
+
+        /* Unlocked peek; most writes are to cold keys and stop here */
+        if (READ_ONCE(s->hash) != hash)
+            continue;
+        write_seqlock(&kv_hot_seq);
+        if (s->gen && s->hash == hash && !strcmp(s->key, key)) {
+            WRITE_ONCE(s->gen, kv_hot_next_gen++);
+            KV_STAT_INC(KV_STAT_HOT_INVALIDATIONS);
+        }
+        write_sequnlock(&kv_hot_seq);
+    }
+}
+
+static int kvhot_show(struct seq_file *m, void *v)
+{
+    struct kv_hot_slot snap;
+    unsigned int seq;
+    int i, cpu;
+
+    for (i = 0; i < KV_HOT_SLOTS; i++) {
+        u64 hits = 0;
+
+        do {
+            seq = read_seqbegin(&kv_hot_seq);
+            snap = kv_hot_slots[i];
+        } while (read_seqretry(&kv_hot_seq, seq));
+        if (!snap.gen)
+            continue;
+
+        /* Racy reads of other CPUs' counters; good enough for a report */
+        for_each_possible_cpu(cpu) {
+            struct kv_hot_copy *c = &per_cpu_ptr(&kv_hot_cpu, cpu)->copy[i];
+
+            if (READ_ONCE(c->owner) == snap.owner)
+                hits += READ_ONCE(c->hits);
+        }
+        seq_printf(m, "%s %llu %u\n", snap.key, hits,
+                   jiffies_to_msecs(jiffies - snap.promoted));
+    }
+    return 0;
+}
+
+static int kvhot_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, kvhot_show, NULL);
+}
+
+const struct proc_ops kvhot_proc_ops = {
+    .proc_open    = kvhot_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release,
+};
@@ -0,0 +1,60 @@
+#ifndef KVHOT_H
+#define KVHOT_H
+
+#include <linux/types.h>
+#include <linux/proc_fs.h>
+
+/*
+ * Per-CPU replicas of hot keys. Under skewed traffic a few keys take
+ * most lookups, and every lookup of them takes ht_sem for reading and
+ * walks the same bucket, so those cache lines bounce between cores.
+ *
+ * Each CPU samples one lookup in KV_HOT_SAMPLE into a small
+ * space-saving counter table. Every KV_HOT_PERIOD samples, keys that
+ * took at least 1/KV_HOT_MIN_SHARE of them join the hot set (at most
+ * KV_HOT_SLOTS keys, shared by all CPUs). A hot key found in the table
+ * is copied into the looking-up CPU's private slot, and later lookups
+ * on that CPU are answered from the copy without taking ht_sem.
+ *
+ * Every hot slot has a generation. A write to a hot key, or reuse of
+ * the slot, gives it a new generation, and a copy is only used while
+ * its generation matches, so a write invalidates all copies with one
+ * store. A slot that has not been promoted again for KV_HOT_TTL can be
+ * taken over by a new hot key.
+ *
+ * /proc/hthot lists the hot set, one "<key> <hits> <age_ms>" line per
+ * slot: hits served from copies, and time since the last promotion.
+ */
+#define KV_HOT_SLOTS 16             /* hot keys replicated on every CPU */
+#define KV_HOT_SAMPLE 16            /* lookups per sample, per CPU */
+#define KV_HOT_CANDIDATES 32        /* space-saving counters per CPU */
+#define KV_HOT_PERIOD 256           /* samples between promotion passes */
+#define KV_HOT_MIN_SHARE 16         /* promote keys with 1/16 of a period's samples */
+#define KV_HOT_TTL (5 * HZ)         /* drop keys not promoted again for this long */
+
+/**
+ * Count a lookup towards the hot key statistics. Lock-free.
+ */
+void kv_hot_sample(const char *key, u64 hash);
+
+/**
+ * Answer a lookup from this CPU's copy of a hot key. Lock-free.
+ * @return true and the value in value[len] if the copy is current.
+ */
+bool kv_hot_lookup(const char *key, u64 hash, char *value, size_t len);
+
+/**
+ * Copy a value just found in the table to this CPU if the key is hot.
+ * Call with ht_sem held (either way), so no write can race the copy.
+ */
+void kv_hot_fill(const char *key, u64 hash, const char *value);
+
+/**
+ * Invalidate every CPU's copy of a key. Call with ht_sem held for
+ * writing after the table was changed, before the lock is released.
+ */
+void kv_hot_invalidate(const char *key);
+
+extern const struct proc_ops kvhot_proc_ops;
+
+#endif // KVHOT_H
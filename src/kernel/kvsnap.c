@@ -0,0 +1,153 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/uaccess.h>
+
+#include "kvsnap.h"
+#include "kvstats.h"
+#include "hashtable_module.h"
+
+extern struct rw_semaphore ht_sem; // refers to ht_sem in main_module.c
+extern ht *table; // refers to table in main_module.c
+
+unsigned int kv_snap_last_ms;
+
+/* State of one open /proc/htsnap */
+struct kv_snap_reader {
+    struct mutex lock;          /* reads on a shared fd take turns */
+    u64 cursor;                 /* next bucket of the live walk */
+    int live_done;
+    ht_entry *pos;              /* next preserved entry, once live_done */
+    size_t len;                 /* formatted bytes in buf */
+    size_t off;                 /* bytes of buf already returned */
+    char buf[KV_SNAP_BUF_SIZE];
+};
+
+/*
+ * Format whole buckets of the live table until buf is full. Entries are
+ * only marked as returned once their bucket fits, so a bucket that is
+ * cut off is formatted again on the next refill.
+ * Called with ht_sem held for reading.
+ */
+static int kv_snap_fill_live(struct kv_snap_reader *r)
+{
+    do {
+        size_t bucket_start = r->len;
+        ht_entry *e;
+
+        for (e = ht_scan_bucket(table, r->cursor); e; e = e->next) {
+            if (!ht_snapshot_visible(table, e))
+                continue;
+            r->len += scnprintf(r->buf + r->len, sizeof(r->buf) - r->len,
+                                "%s %s\n", e->key, e->value);
+            if (r->len >= sizeof(r->buf) - 1)
+                break;
+        }
+        if (e) {
+            r->len = bucket_start;
+            return bucket_start ? 0 : -EFBIG;
+        }
+        for (e = ht_scan_bucket(table, r->cursor); e; e = e->next) {
+            if (ht_snapshot_visible(table, e))
+                ht_snapshot_mark(table, e);
+        }
+        r->cursor = ht_scan_next(table, r->cursor);
+    } while (r->cursor);
+
+    /* Nothing returned from now on can change, so writers stop copying */
+    ht_snapshot_live_done(table);
+    r->live_done = 1;
+    r->pos = table->snap->preserved;
+    return 0;
+}
+
+/*
+ * Format preserved entries. After live_done the list no longer grows
+ * and is only freed on release, so pos stays valid between reads.
+ */
+static void kv_snap_fill_preserved(struct kv_snap_reader *r)
+{
+    while (r->pos) {
+        size_t n = snprintf(r->buf + r->len, sizeof(r->buf) - r->len,
+                            "%s %s\n", r->pos->key, r->pos->value);
+
+        if (n >= sizeof(r->buf) - r->len)
+            break;
+        r->len += n;
+        r->pos = r->pos->next;
+    }
+}
+
+static ssize_t kvsnap_read(struct file *file, char __user *user_buffer, size_t count, loff_t *offs)
+{
+    struct kv_snap_reader *r = file->private_data;
+    ssize_t ret = 0;
+
+    mutex_lock(&r->lock);
+    if (r->off == r->len) {
+        r->off = r->len = 0;
+        kv_down_read(&ht_sem);
+        if (table->snap->failed)
+            ret = -EIO;
+        else if (!r->live_done)
+            ret = kv_snap_fill_live(r);
+        if (!ret && r->live_done)
+            kv_snap_fill_preserved(r);
+        kv_up_read(&ht_sem);
+        if (ret)
+            goto out;
+    }
+    count = min(count, r->len - r->off);
+    if (copy_to_user(user_buffer, r->buf + r->off, count)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    r->off += count;
+    *offs += count;
+    ret = count;
+out:
+    mutex_unlock(&r->lock);
+    return ret;
+}
+
+static int kvsnap_open(struct inode *inode, struct file *file)
+{
+    struct kv_snap_reader *r;
+    int ret;
+
+    r = kvzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    mutex_init(&r->lock);
+
+    kv_down_write(&ht_sem);
+    ret = ht_snapshot_begin(table);
+    if (!ret)
+        table->snap->started = jiffies;
+    kv_up_write(&ht_sem);
+    if (ret) {
+        kvfree(r);
+        return ret;
+    }
+    KV_STAT_INC(KV_STAT_SNAPSHOTS);
+    file->private_data = r;
+    return 0;
+}
+
+static int kvsnap_release(struct inode *inode, struct file *file)
+{
+    kv_down_write(&ht_sem);
+    kv_snap_last_ms = jiffies_to_msecs(jiffies - table->snap->started);
+    ht_snapshot_end(table);
+    kv_up_write(&ht_sem);
+    kvfree(file->private_data);
+    return 0;
+}
+
+const struct proc_ops kvsnap_proc_ops = {
+    .proc_open    = kvsnap_open,
+    .proc_read    = kvsnap_read,
+    .proc_release = kvsnap_release,
+};
@@ -0,0 +1,29 @@
+#ifndef KVSNAP_H
+#define KVSNAP_H
+
+#include <linux/proc_fs.h>
+
+/*
+ * /proc/htsnap: a consistent point-in-time copy of the table, one
+ * "<key> <value>" line per entry, without stopping writers.
+ *
+ * Opening the file takes a copy-on-write snapshot (see
+ * ht_snapshot_begin()) under one short write lock. Reads walk the table
+ * a few buckets at a time under the read lock, so writers keep going
+ * between reads; a writer that changes or deletes an entry the reader
+ * has not returned yet keeps the old key and value for it. Closing the
+ * file frees what was kept.
+ *
+ * Only one snapshot can be open: a second open fails with EBUSY. An
+ * open snapshot makes overwrites and deletes copy, so read it through
+ * and close it. If a writer could not allocate its copy, the read fails
+ * with EIO instead of returning an incomplete snapshot.
+ */
+#define KV_SNAP_BUF_SIZE 8192   /* lines formatted per refill */
+
+/* Duration of the last completed snapshot, for /proc/htstats */
+extern unsigned int kv_snap_last_ms;
+
+extern const struct proc_ops kvsnap_proc_ops;
+
+#endif // KVSNAP_H
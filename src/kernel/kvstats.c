@@ -0,0 +1,176 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/atomic.h>
+#include <linux/seq_file.h>
+
+#include "kvstats.h"
+#include "hashtable_module.h"
+#include "kvtrace.h"
+#include "kvevents.h"
+#include "kvsnap.h"
+
+extern struct rw_semaphore ht_sem; // refers to ht_sem in main_module.c
+extern ht *table; // refers to table in main_module.c
+
+DEFINE_PER_CPU(struct kv_stats, kv_stats);
+
+static atomic64_t kv_lock_wait_max_ns = ATOMIC64_INIT(0);
+
+static const char *const kv_stat_names[KV_STAT_NR] = {
+    [KV_STAT_INSERTS]       = "inserts",
+    [KV_STAT_INSERT_FAILS]  = "insert_fails",
+    [KV_STAT_DELETES]       = "deletes",
+    [KV_STAT_DELETE_MISSES] = "delete_misses",
+    [KV_STAT_LOOKUPS]       = "lookups",
+    [KV_STAT_LOOKUP_HITS]   = "lookup_hits",
+    [KV_STAT_LOOKUP_MISSES] = "lookup_misses",
+    [KV_STAT_INVALID]       = "invalid_commands",
+    [KV_STAT_DUMPS]         = "dumps",
+    [KV_STAT_SIGNALS]       = "daemon_signals",
+    [KV_STAT_READ_WAITS]    = "lock_read_waits",
+    [KV_STAT_READ_WAIT_NS]  = "lock_read_wait_ns",
+    [KV_STAT_WRITE_WAITS]   = "lock_write_waits",
+    [KV_STAT_WRITE_WAIT_NS] = "lock_write_wait_ns",
+    [KV_STAT_TXNS]          = "txns",
+    [KV_STAT_TXN_OPS]       = "txn_ops",
+    [KV_STAT_TXN_ABORTS]    = "txn_aborts",
+    [KV_STAT_HOT_HITS]      = "hot_hits",
+    [KV_STAT_HOT_FILLS]     = "hot_fills",
+    [KV_STAT_HOT_PROMOTIONS] = "hot_promotions",
+    [KV_STAT_HOT_INVALIDATIONS] = "hot_invalidations",
+    [KV_STAT_SCANS]         = "scans",
+    [KV_STAT_SNAPSHOTS]     = "snapshots",
+};
+
+static u64 kv_account_wait(enum kv_stat_item waits, enum kv_stat_item wait_ns, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    s64 max = atomic64_read(&kv_lock_wait_max_ns);
+
+    KV_STAT_INC(waits);
+    KV_STAT_ADD(wait_ns, ns);
+    while ((s64)ns > max) {
+        s64 old = atomic64_cmpxchg(&kv_lock_wait_max_ns, max, ns);
+        if (old == max)
+            break;
+        max = old;
+    }
+    return ns;
+}
+
+void kv_down_read(struct rw_semaphore *sem)
+{
+    u64 start;
+
+    if (down_read_trylock(sem)) {
+        trace_kv_lock_acquire(0, 0);
+        return;
+    }
+    start = ktime_get_ns();
+    down_read(sem);
+    trace_kv_lock_acquire(0, kv_account_wait(KV_STAT_READ_WAITS, KV_STAT_READ_WAIT_NS, start));
+}
+
+void kv_down_write(struct rw_semaphore *sem)
+{
+    u64 start;
+
+    if (down_write_trylock(sem)) {
+        trace_kv_lock_acquire(1, 0);
+        return;
+    }
+    start = ktime_get_ns();
+    down_write(sem);
+    trace_kv_lock_acquire(1, kv_account_wait(KV_STAT_WRITE_WAITS, KV_STAT_WRITE_WAIT_NS, start));
+}
+
+void kv_up_read(struct rw_semaphore *sem)
+{
+    trace_kv_lock_release(0);
+    up_read(sem);
+}
+
+void kv_up_write(struct rw_semaphore *sem)
+{
+    trace_kv_lock_release(1);
+    up_write(sem);
+}
+
+static int kvstats_show(struct seq_file *m, void *v)
+{
+    u64 sum[KV_STAT_NR] = {0};
+    unsigned long chains[KV_CHAIN_HIST + 1] = {0};
+    unsigned long lengths[HT_CHAIN_LENGTHS];
+    unsigned long entries = 0, max_chain = 0;
+    ht_values values = { 0 };
+    ht_snapshot snap = { 0 };
+    unsigned int snap_age_ms = 0;
+    int capacity;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        struct kv_stats *s = per_cpu_ptr(&kv_stats, cpu);
+        for (i = 0; i < KV_STAT_NR; i++)
+            sum[i] += s->v[i];
+    }
+
+    /* Kept current by the table itself: no walk over the buckets here */
+    kv_down_read(&ht_sem);
+    capacity = table->capacity;
+    entries = table->count;
+    memcpy(lengths, table->chains, sizeof(lengths));
+    if (table->values)
+        values = *table->values;
+    if (table->snap) {
+        snap = *table->snap;
+        snap_age_ms = jiffies_to_msecs(jiffies - snap.started);
+    }
+    kv_up_read(&ht_sem);
+
+    /* Bucket occupancy: how many buckets hold chains of each length */
+    for (i = 0; i < HT_CHAIN_LENGTHS; i++) {
+        if (lengths[i])
+            max_chain = i;
+        chains[min(i, KV_CHAIN_HIST)] += lengths[i];
+    }
+
+    for (i = 0; i < KV_STAT_NR; i++)
+        seq_printf(m, "%s %llu\n", kv_stat_names[i], sum[i]);
+    seq_printf(m, "lock_wait_max_ns %lld\n", atomic64_read(&kv_lock_wait_max_ns));
+    seq_printf(m, "event_seq %llu\n", kv_event_next_seq());
+    seq_printf(m, "entries %lu\n", entries);
+    seq_printf(m, "buckets %d\n", capacity);
+    seq_printf(m, "max_chain %lu\n", max_chain);
+    for (i = 0; i < KV_CHAIN_HIST; i++)
+        seq_printf(m, "chain_%d %lu\n", i, chains[i]);
+    seq_printf(m, "chain_%d+ %lu\n", KV_CHAIN_HIST, chains[KV_CHAIN_HIST]);
+    /* Value interning (intern_values=1); all zero when disabled */
+    seq_printf(m, "values_distinct %lu\n", values.count);
+    seq_printf(m, "values_refs %lu\n", values.refs);
+    seq_printf(m, "values_bytes %lu\n", values.bytes);
+    seq_printf(m, "values_bytes_saved %lu\n",
+               values.ref_bytes > values.bytes ? values.ref_bytes - values.bytes : 0);
+    seq_printf(m, "values_dedup_ratio_pct %lu\n",
+               values.count ? values.refs * 100 / values.count : 0);
+    /* Open /proc/htsnap, and what writers have kept for it so far */
+    seq_printf(m, "snap_active %d\n", snap.id != 0);
+    seq_printf(m, "snap_age_ms %u\n", snap_age_ms);
+    seq_printf(m, "snap_preserved %lu\n", snap.preserved_count);
+    seq_printf(m, "snap_preserved_bytes %lu\n", snap.preserved_bytes);
+    seq_printf(m, "snap_last_ms %u\n", kv_snap_last_ms);
+    return 0;
+}
+
+static int kvstats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, kvstats_show, NULL);
+}
+
+const struct proc_ops kvstats_proc_ops = {
+    .proc_open    = kvstats_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release,
+};
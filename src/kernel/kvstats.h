@@ -0,0 +1,61 @@
+#ifndef KVSTATS_H
+#define KVSTATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/proc_fs.h>
+
+/* Per-CPU event counters, summed when /proc/htstats is read */
+enum kv_stat_item {
+    KV_STAT_INSERTS,
+    KV_STAT_INSERT_FAILS,
+    KV_STAT_DELETES,
+    KV_STAT_DELETE_MISSES,
+    KV_STAT_LOOKUPS,
+    KV_STAT_LOOKUP_HITS,
+    KV_STAT_LOOKUP_MISSES,
+    KV_STAT_INVALID,
+    KV_STAT_DUMPS,              /* reads of /proc/hashtable */
+    KV_STAT_SIGNALS,            /* SIGUSR1 sent to the daemon */
+    KV_STAT_READ_WAITS,         /* contended down_read() on ht_sem */
+    KV_STAT_READ_WAIT_NS,
+    KV_STAT_WRITE_WAITS,        /* contended down_write() on ht_sem */
+    KV_STAT_WRITE_WAIT_NS,
+    KV_STAT_TXNS,               /* multi/exec batches applied */
+    KV_STAT_TXN_OPS,            /* inserts and deletes inside them */
+    KV_STAT_TXN_ABORTS,         /* batches rejected by a version check */
+    KV_STAT_HOT_HITS,           /* lookups answered from a per-CPU hot copy */
+    KV_STAT_HOT_FILLS,          /* hot copies refreshed from the table */
+    KV_STAT_HOT_PROMOTIONS,     /* keys that joined the hot set */
+    KV_STAT_HOT_INVALIDATIONS,  /* writes to hot keys */
+    KV_STAT_SCANS,              /* scan batches */
+    KV_STAT_SNAPSHOTS,          /* opens of /proc/htsnap */
+    KV_STAT_NR,
+};
+
+#define KV_CHAIN_HIST 8         /* chain lengths 0..7, last bucket is 8+ */
+
+struct kv_stats {
+    u64 v[KV_STAT_NR];
+};
+
+DECLARE_PER_CPU(struct kv_stats, kv_stats);
+
+#define KV_STAT_INC(item)    this_cpu_inc(kv_stats.v[item])
+#define KV_STAT_ADD(item, n) this_cpu_add(kv_stats.v[item], (n))
+
+/*
+ * Take ht_sem, accounting the time spent waiting. The uncontended case
+ * is a trylock and costs no clock reads. Acquire and release both fire
+ * the kvstore:kv_lock_* tracepoints, so use the pairs together.
+ */
+void kv_down_read(struct rw_semaphore *sem);
+void kv_down_write(struct rw_semaphore *sem);
+void kv_up_read(struct rw_semaphore *sem);
+void kv_up_write(struct rw_semaphore *sem);
+
+/* /proc/htstats: "name value" lines */
+extern const struct proc_ops kvstats_proc_ops;
+
+#endif // KVSTATS_H
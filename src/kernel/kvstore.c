@@ -1,66 +1,394 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
 #include "kvstore.h"
+#include "kvstats.h"
+#include "kvtrace.h"
+#include "kvevents.h"
+#include "kvhot.h"
+#include "kvhistory.h"
 
 extern struct rw_semaphore ht_sem; // refers to ht_sem in main_module.c, used for synchronizing access to table
 extern ht *table; // refers to table in main_module.c
 
+/* Reply to the last command written on an open /proc/ht file */
+struct kv_reply {
+    size_t len;
+    char buf[KV_REPLY_SIZE];
+};
+
+struct kv_txn_op {
+    char cmd;                   /* 'c'heck, 'i'nsert or 'd'elete */
+    char key[64];
+    u64 version;                /* check: expected version, 0 = absent */
+    ht_entry *entry;            /* insert: preallocated entry */
+};
+
 static int process_kv_command(const char *input, char *output, size_t outlen, struct rw_semaphore *sem, ht *table) {
     char cmd[16], key[64], value[64];
     int ret = 0;
     const char *res = NULL;
+    u64 start = kv_history_start();
     memset(cmd, 0, sizeof(cmd));
     memset(key, 0, sizeof(key));
     memset(value, 0, sizeof(value));
     if (sscanf(input, "%15s %63s %63s", cmd, key, value) < 1) {
+        KV_STAT_INC(KV_STAT_INVALID);
         snprintf(output, outlen, "Invalid command");
+        kv_history_record(KV_HIST_INVALID, NULL, -EINVAL, start);
         return -EINVAL;
     }
     if (!strcmp(cmd, "insert")) {
-        down_write(sem);
+        kv_down_write(sem);
         ret = ht_insert(table, key, value);
-        up_write(sem);
+        if (!ret) {
+            kv_hot_invalidate(key);
+            kv_event_emit(KV_EVENT_INSERT, key, value);
+        }
+        kv_up_write(sem);
+        KV_STAT_INC(KV_STAT_INSERTS);
+        if (ret)
+            KV_STAT_INC(KV_STAT_INSERT_FAILS);
         signal_daemon();
         snprintf(output, outlen, ret ? "Insert failed" : "Inserted key: %s, value: %s", key, value);
+        kv_history_record(KV_HIST_INSERT, key, ret, start);
     } else if (!strcmp(cmd, "delete")) {
-        down_write(sem);
+        kv_down_write(sem);
         ret = ht_delete(table, key);
-        up_write(sem);
+        if (!ret) {
+            kv_hot_invalidate(key);
+            kv_event_emit(KV_EVENT_DELETE, key, NULL);
+        }
+        kv_up_write(sem);
+        KV_STAT_INC(KV_STAT_DELETES);
+        if (ret)
+            KV_STAT_INC(KV_STAT_DELETE_MISSES);
         signal_daemon();
         snprintf(output, outlen, ret ? "Delete failed" : "Deleted key: %s", key);
+        kv_history_record(KV_HIST_DELETE, key, ret, start);
+    } else if (!strcmp(cmd, "version")) {
+        u64 version;
+
+        kv_down_read(sem);
+        version = ht_version(table, key);
+        kv_up_read(sem);
+        snprintf(output, outlen, "Version of key: %s is: %llu", key, version);
+        kv_history_record(KV_HIST_VERSION, key, 0, start);
     } else if (!strcmp(cmd, "lookup")) {
-        down_read(sem);
+        u64 hash = hash_key(key);
+
+        /* Hot keys are answered from this CPU's copy, without ht_sem */
+        kv_hot_sample(key, hash);
+        if (kv_hot_lookup(key, hash, value, sizeof(value))) {
+            snprintf(output, outlen, "Lookup on key: %s, gave value: %s", key, value);
+            KV_STAT_INC(KV_STAT_LOOKUPS);
+            KV_STAT_INC(KV_STAT_LOOKUP_HITS);
+            kv_history_record(KV_HIST_LOOKUP, key, 0, start);
+            return 0;
+        }
+        kv_down_read(sem);
         res = ht_search(table, key);
-        if (res)
+        if (res) {
             snprintf(output, outlen, "Lookup on key: %s, gave value: %s", key, res);
-        else
+            kv_hot_fill(key, hash, res);
+        } else {
             snprintf(output, outlen, "Not found");
-        up_read(sem);
+        }
+        kv_up_read(sem);
+        KV_STAT_INC(KV_STAT_LOOKUPS);
+        KV_STAT_INC(res ? KV_STAT_LOOKUP_HITS : KV_STAT_LOOKUP_MISSES);
+        kv_history_record(KV_HIST_LOOKUP, key, res ? 0 : -ENOENT, start);
     } else {
+        KV_STAT_INC(KV_STAT_INVALID);
         snprintf(output, outlen, "Unknown command");
+        kv_history_record(KV_HIST_INVALID, NULL, -EINVAL, start);
     }
     return 0;
 }
 
+/* Same pattern language as the daemon's watch: exact key, or "prefix*" */
+static bool kv_scan_match(const char *match, const char *key)
+{
+    size_t len;
+
+    if (!match[0])
+        return true;
+    len = strlen(match);
+    if (match[len - 1] == '*')
+        return !strncmp(key, match, len - 1);
+    return !strcmp(key, match);
+}
+
+/*
+ * "scan <cursor> [count] [match]": visit buckets from cursor until at
+ * least count matching entries were found, count * 10 buckets were
+ * visited, or the scan is complete. ht_sem is held for one batch only.
+ * Output is a "Scan cursor: <next> entries: <n>" line followed by
+ * "<key> <value>" lines; cursor 0 means the scan is complete. A bucket
+ * is never split between two batches, so a reply can end short of count.
+ */
+static void process_kv_scan(const char *input, char *output, size_t outlen,
+                            struct rw_semaphore *sem, ht *table)
+{
+    char match[64] = "", header[64];
+    unsigned long long cursor;
+    unsigned int count = KV_SCAN_DEFAULT_COUNT, buckets = 0;
+    size_t len, hlen;
+    unsigned int n = 0;
+    u64 start = kv_history_start();
+
+    if (sscanf(input, "scan %llu %u %63s", &cursor, &count, match) < 1 ||
+        count == 0 || count > KV_SCAN_MAX_COUNT) {
+        KV_STAT_INC(KV_STAT_INVALID);
+        snprintf(output, outlen, "Invalid scan");
+        kv_history_record(KV_HIST_SCAN, NULL, -EINVAL, start);
+        return;
+    }
+
+    /* Entries go after room for the header, which is written last */
+    len = sizeof(header);
+    kv_down_read(sem);
+    do {
+        size_t bucket_start = len;
+        unsigned int bucket_n = 0;
+        ht_entry *e;
+
+        for (e = ht_scan_bucket(table, cursor); e; e = e->next) {
+            if (!kv_scan_match(match, e->key))
+                continue;
+            len += scnprintf(output + len, outlen - len, "\n%s %s", e->key, e->value);
+            if (len >= outlen - 1)
+                break;
+            bucket_n++;
+        }
+        if (e) {
+            /* Out of room: leave this bucket for the next batch */
+            len = bucket_start;
+            if (!buckets) {
+                kv_up_read(sem);
+                snprintf(output, outlen, "Scan failed: bucket too large");
+                kv_history_record(KV_HIST_SCAN, match[0] ? match : NULL, -EFBIG, start);
+                return;
+            }
+            break;
+        }
+        n += bucket_n;
+        cursor = ht_scan_next(table, cursor);
+    } while (cursor && n < count && ++buckets < count * 10);
+    kv_up_read(sem);
+    KV_STAT_INC(KV_STAT_SCANS);
+
+    hlen = scnprintf(header, sizeof(header), "Scan cursor: %llu entries: %u", cursor, n);
+    memmove(output + hlen, output + sizeof(header), len - sizeof(header));
+    memcpy(output, header, hlen);
+    output[hlen + len - sizeof(header)] = '\0';
+    kv_history_record(KV_HIST_SCAN, match[0] ? match : NULL, 0, start);
+}
+
+/*
+ * Parse the lines of a "multi ... exec" batch. Allocation happens here,
+ * before the lock is taken, so applying the batch cannot fail halfway.
+ * @return number of ops, or a negative errno.
+ */
+static int kv_txn_parse(ht *table, char *body, struct kv_txn_op *ops)
+{
+    char *line;
+    int n = 0, done = 0;
+
+    while ((line = strsep(&body, "\n")) != NULL) {
+        char cmd[16], key[64], arg[64];
+        struct kv_txn_op *op;
+        int fields;
+
+        if (!*line)
+            continue;
+        if (done)
+            return -EINVAL;             /* nothing may follow exec */
+        fields = sscanf(line, "%15s %63s %63s", cmd, key, arg);
+        if (fields == 1 && !strcmp(cmd, "exec")) {
+            done = 1;
+            continue;
+        }
+        if (n == KV_TXN_MAX_OPS)
+            return -E2BIG;
+        op = &ops[n];
+        op->entry = NULL;
+        if (fields == 3 && !strcmp(cmd, "check")) {
+            op->cmd = 'c';
+            if (kstrtoull(arg, 10, &op->version))
+                return -EINVAL;
+        } else if (fields == 3 && !strcmp(cmd, "insert")) {
+            op->cmd = 'i';
+            op->entry = ht_entry_alloc(table, key, arg);
+            if (!op->entry)
+                return -ENOMEM;
+        } else if (fields == 2 && !strcmp(cmd, "delete")) {
+            op->cmd = 'd';
+        } else {
+            return -EINVAL;
+        }
+        strscpy(op->key, key, sizeof(op->key));
+        n++;
+    }
+    return done ? n : -EINVAL;
+}
+
+/*
+ * Apply a batch atomically: every check is evaluated and every write
+ * applied under one hold of ht_sem, so readers see all of it or none of
+ * it, and the daemon is signalled once.
+ */
+static int process_kv_txn(char *body, char *output, size_t outlen,
+                          struct rw_semaphore *sem, ht *table)
+{
+    struct kv_txn_op *ops;
+    int n, i, writes = 0, ret = 0;
+    u64 start = kv_history_start();
+
+    ops = kcalloc(KV_TXN_MAX_OPS, sizeof(*ops), GFP_KERNEL);
+    if (!ops) {
+        kv_history_record(KV_HIST_TXN, NULL, -ENOMEM, start);
+        return -ENOMEM;
+    }
+    n = kv_txn_parse(table, body, ops);
+    if (n < 0) {
+        ret = n;
+        KV_STAT_INC(KV_STAT_INVALID);
+        snprintf(output, outlen, ret == -ENOMEM ? "Transaction failed" : "Invalid transaction");
+        goto out;
+    }
+
+    kv_down_write(sem);
+    for (i = 0; i < n; i++) {
+        if (ops[i].cmd == 'c' && ht_version(table, ops[i].key) != ops[i].version) {
+            kv_up_write(sem);
+            KV_STAT_INC(KV_STAT_TXN_ABORTS);
+            snprintf(output, outlen, "Transaction aborted: key %s changed", ops[i].key);
+            ret = -ECANCELED;
+            goto out;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (ops[i].cmd == 'i') {
+            /* The stored value, which may be an interned copy of the entry's */
+            const char *value = ht_insert_entry(table, ops[i].entry);
+
+            ops[i].entry = NULL;
+            kv_hot_invalidate(ops[i].key);
+            kv_event_emit(KV_EVENT_INSERT, ops[i].key, value);
+            writes++;
+        } else if (ops[i].cmd == 'd') {
+            if (!ht_delete(table, ops[i].key)) {
+                kv_hot_invalidate(ops[i].key);
+                kv_event_emit(KV_EVENT_DELETE, ops[i].key, NULL);
+            }
+            writes++;
+        }
+    }
+    kv_up_write(sem);
+
+    KV_STAT_INC(KV_STAT_TXNS);
+    KV_STAT_ADD(KV_STAT_TXN_OPS, writes);
+    if (writes)
+        signal_daemon();
+    snprintf(output, outlen, "Transaction applied: %d ops", n);
+out:
+    for (i = 0; i < KV_TXN_MAX_OPS; i++)
+        ht_entry_free(table, ops[i].entry);
+    kfree(ops);
+    kv_history_record(KV_HIST_TXN, NULL, ret, start);
+    return ret;
+}
+
 ssize_t ht_write(struct file *file,
                         const char __user *user_buffer,
                         size_t count,
                         loff_t *offs)
 {
-    char buf[256];
-    char output[PROC_BUF_SIZE];
+    char small[256];
+    char *buf = small;
+    char discard[PROC_BUF_SIZE];
+    struct kv_reply *reply = file->private_data;
+    /* Replies are built in place; write-only opens get a scratch buffer */
+    char *output = reply ? reply->buf : discard;
+    size_t outlen = reply ? sizeof(reply->buf) - 1 : sizeof(discard);
+    ssize_t ret = count;
 
-    memset(buf, 0, sizeof(buf));
-    memset(output, 0, sizeof(output));
+    trace_kv_proc_enter("ht", count, *offs);
 
-    if (count >= sizeof(buf))
-        return -EINVAL;
+    output[0] = '\0';
 
-    if (copy_from_user(buf, user_buffer, count))
-        return -EFAULT;
+    /* Single commands fit on the stack; only a multi batch needs more */
+    if (count >= KV_TXN_BUF_SIZE) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (count >= sizeof(small)) {
+        buf = kmalloc(count + 1, GFP_KERNEL);
+        if (!buf) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    if (copy_from_user(buf, user_buffer, count)) {
+        ret = -EFAULT;
+        goto out;
+    }
 
     buf[count] = '\0';
-    buf[strcspn(buf, "\n")] = 0;
+    if (!strncmp(buf, "multi\n", 6)) {
+        int err = process_kv_txn(buf + 6, output, outlen, &ht_sem, table);
 
-    process_kv_command(buf, output, sizeof(output), &ht_sem, table);
+        if (err)
+            ret = err;
+    } else if (count >= sizeof(small)) {
+        ret = -EINVAL;
+    } else {
+        buf[strcspn(buf, "\n")] = 0;
+        if (!strncmp(buf, "scan ", 5))
+            process_kv_scan(buf, output, outlen, &ht_sem, table);
+        else
+            process_kv_command(buf, output, outlen, &ht_sem, table);
+    }
 
-    return count;
-}
\ No newline at end of file
+    if (reply) {
+        reply->len = strnlen(reply->buf, outlen);
+        reply->buf[reply->len++] = '\n';
+        /* Each write starts a new reply, read from its beginning */
+        *offs = 0;
+    }
+out:
+    if (buf != small)
+        kfree(buf);
+    trace_kv_proc_exit("ht", ret);
+    return ret;
+}
+
+/* Reading /proc/ht returns the reply to the last command written on this fd */
+ssize_t ht_read(struct file *file, char __user *user_buffer, size_t count, loff_t *offs)
+{
+    struct kv_reply *reply = file->private_data;
+
+    if (!reply)
+        return 0;
+    return simple_read_from_buffer(user_buffer, count, offs, reply->buf, reply->len);
+}
+
+int ht_open(struct inode *inode, struct file *file)
+{
+    /* Write-only opens cannot read a reply, so they skip the buffer */
+    if (file->f_mode & FMODE_READ) {
+        file->private_data = kzalloc(sizeof(struct kv_reply), GFP_KERNEL);
+        if (!file->private_data)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+int ht_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
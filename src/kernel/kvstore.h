@@ -5,9 +5,28 @@
 #include "hashtable_module.h"
 
 #define PROC_BUF_SIZE 512
+#define KV_TXN_MAX_OPS 32       /* check/insert/delete lines per multi batch */
+#define KV_TXN_BUF_SIZE 4096    /* largest write accepted by /proc/ht */
+#define KV_REPLY_SIZE 4096      /* reply readable back from /proc/ht */
+#define KV_SCAN_DEFAULT_COUNT 10
+#define KV_SCAN_MAX_COUNT 64
 
 #include "daemon_module.h"
 
+/*
+ * /proc/ht. A write is one command ("insert k v", "delete k", "lookup k",
+ * "version k", "scan <cursor> [count] [match]") or a transaction:
+ *
+ *   multi\n[check <key> <version>\n | insert <key> <value>\n | delete <key>\n]...exec\n
+ *
+ * A transaction is applied under a single write lock with one daemon
+ * signal. The write fails with ECANCELED if a check does not match the
+ * key's current version (0 = key absent), and nothing is applied.
+ * Reading a file opened O_RDWR returns the reply to its last command.
+ */
 ssize_t ht_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *offs);
+ssize_t ht_read(struct file *file, char __user *user_buffer, size_t count, loff_t *offs);
+int ht_open(struct inode *inode, struct file *file);
+int ht_release(struct inode *inode, struct file *file);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+/*
+ * Static tracepoints for the kvstore module (trace system "kvstore").
+ * Disabled tracepoints are a patched-out branch, so they stay in
+ * production builds. Attach with e.g.
+ *
+ *   perf record -e 'kvstore:*' -a
+ *   echo 1 > /sys/kernel/tracing/events/kvstore/enable
+ *
+ * main_module.c defines CREATE_TRACE_POINTS before including this file.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kvstore
+
+#if !defined(_KVTRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KVTRACE_H
+
+#include <linux/tracepoint.h>
+
+#define KV_TRACE_KEY_LEN 64
+
+/* Hashtable operations: key hash, bucket, entries walked and result */
+DECLARE_EVENT_CLASS(kv_op,
+    TP_PROTO(const char *key, u64 hash, int bucket, int chain, int result),
+    TP_ARGS(key, hash, bucket, chain, result),
+    TP_STRUCT__entry(
+        __field(u64, hash)
+        __field(int, bucket)
+        __field(int, chain)
+        __field(int, result)
+        __array(char, key, KV_TRACE_KEY_LEN)
+    ),
+    TP_fast_assign(
+        __entry->hash = hash;
+        __entry->bucket = bucket;
+        __entry->chain = chain;
+        __entry->result = result;
+        strscpy(__entry->key, key, KV_TRACE_KEY_LEN);
+    ),
+    TP_printk("key=%s hash=%016llx bucket=%d chain=%d result=%d",
+              __entry->key, __entry->hash, __entry->bucket, __entry->chain,
+              __entry->result)
+);
+
+DEFINE_EVENT(kv_op, kv_insert,
+    TP_PROTO(const char *key, u64 hash, int bucket, int chain, int result),
+    TP_ARGS(key, hash, bucket, chain, result));
+
+DEFINE_EVENT(kv_op, kv_delete,
+    TP_PROTO(const char *key, u64 hash, int bucket, int chain, int result),
+    TP_ARGS(key, hash, bucket, chain, result));
+
+/* result is 1 for a hit, 0 for a miss */
+DEFINE_EVENT(kv_op, kv_search,
+    TP_PROTO(const char *key, u64 hash, int bucket, int chain, int result),
+    TP_ARGS(key, hash, bucket, chain, result));
+
+/* ht_sem; wait_ns is 0 when the lock was taken without blocking */
+TRACE_EVENT(kv_lock_acquire,
+    TP_PROTO(int write, u64 wait_ns),
+    TP_ARGS(write, wait_ns),
+    TP_STRUCT__entry(
+        __field(int, write)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->write = write;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("mode=%s wait_ns=%llu", __entry->write ? "write" : "read", __entry->wait_ns)
+);
+
+TRACE_EVENT(kv_lock_release,
+    TP_PROTO(int write),
+    TP_ARGS(write),
+    TP_STRUCT__entry(
+        __field(int, write)
+    ),
+    TP_fast_assign(
+        __entry->write = write;
+    ),
+    TP_printk("mode=%s", __entry->write ? "write" : "read")
+);
+
+TRACE_EVENT(kv_signal_daemon,
+    TP_PROTO(int pid, int result),
+    TP_ARGS(pid, result),
+    TP_STRUCT__entry(
+        __field(int, pid)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->result = result;
+    ),
+    TP_printk("pid=%d result=%d", __entry->pid, __entry->result)
+);
+
+/* /proc file handlers: file is "ht" or "hashtable" */
+TRACE_EVENT(kv_proc_enter,
+    TP_PROTO(const char *file, size_t count, loff_t pos),
+    TP_ARGS(file, count, pos),
+    TP_STRUCT__entry(
+        __array(char, file, 16)
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->file, file, sizeof(__entry->file));
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("file=%s count=%zu pos=%lld", __entry->file, __entry->count, __entry->pos)
+);
+
+TRACE_EVENT(kv_proc_exit,
+    TP_PROTO(const char *file, ssize_t result),
+    TP_ARGS(file, result),
+    TP_STRUCT__entry(
+        __array(char, file, 16)
+        __field(ssize_t, result)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->file, file, sizeof(__entry->file));
+        __entry->result = result;
+    ),
+    TP_printk("file=%s result=%zd", __entry->file, __entry->result)
+);
+
+#endif /* _KVTRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kvtrace
+#include <trace/define_trace.h>
@@ -9,11 +9,24 @@
 
 #include "hashtable_module.h"
 #include "kvstore.h"
+#include "kvstats.h"
+#include "kvevents.h"
+#include "kvhot.h"
+#include "kvsnap.h"
+#include "kvhistory.h"
+
+#define CREATE_TRACE_POINTS
+#include "kvtrace.h"
 
 
 static struct proc_dir_entry *proc_ht;
 static struct proc_dir_entry *proc_hashtable;
 static struct proc_dir_entry *proc_daemonpid;
+static struct proc_dir_entry *proc_htstats;
+static struct proc_dir_entry *proc_htevents;
+static struct proc_dir_entry *proc_hthot;
+static struct proc_dir_entry *proc_htsnap;
+static struct proc_dir_entry *proc_hthistory;
 
 //static pid_t daemon_pid = -1;
 
@@ -21,8 +34,19 @@ DECLARE_RWSEM(ht_sem);
 
 ht *table;
 
+static bool intern_values;
+module_param(intern_values, bool, 0444);
+MODULE_PARM_DESC(intern_values, "Share one allocation between equal values (default: off)");
+
+static unsigned int history_depth = KV_HISTORY_DEFAULT_DEPTH;
+module_param(history_depth, uint, 0444);
+MODULE_PARM_DESC(history_depth, "Commands kept per CPU in /proc/hthistory, 0 = off (default: 256)");
+
 static const struct proc_ops ht_proc_ops = {
-    .proc_write = ht_write,
+    .proc_open    = ht_open,
+    .proc_read    = ht_read,
+    .proc_write   = ht_write,
+    .proc_release = ht_release,
 };
 
 static const struct proc_ops hashtable_proc_ops = {
@@ -39,12 +63,28 @@ int init_module(void)
     table = create_ht();
     if (!table)
         return -ENOMEM;
+    if (intern_values && ht_intern_values(table)) {
+        destroy_ht(table);
+        return -ENOMEM;
+    }
+    if (kv_history_init(history_depth)) {
+        destroy_ht(table);
+        return -ENOMEM;
+    }
 
-    proc_ht = proc_create("ht", 0222, NULL, &ht_proc_ops);
+    proc_ht = proc_create("ht", 0666, NULL, &ht_proc_ops);
     proc_hashtable = proc_create("hashtable", 0444, NULL, &hashtable_proc_ops);
     proc_daemonpid = proc_create("daemonpid", 0666, NULL, &daemonpid_proc_ops);
-
-    if (!proc_ht || !proc_hashtable || !proc_daemonpid) {
+    proc_htstats = proc_create("htstats", 0444, NULL, &kvstats_proc_ops);
+    proc_htevents = proc_create("htevents", 0444, NULL, &kvevents_proc_ops);
+    proc_hthot = proc_create("hthot", 0444, NULL, &kvhot_proc_ops);
+    /* Root only: it returns every value, and an open snapshot blocks others */
+    proc_htsnap = proc_create("htsnap", 0400, NULL, &kvsnap_proc_ops);
+    proc_hthistory = proc_create("hthistory", 0444, NULL, &kvhistory_proc_ops);
+
+    if (!proc_ht || !proc_hashtable || !proc_daemonpid || !proc_htstats || !proc_htevents ||
+        !proc_hthot || !proc_htsnap || !proc_hthistory) {
+        kv_history_exit();
         destroy_ht(table);
         return -ENOMEM;
     }
@@ -58,10 +98,16 @@ void cleanup_module(void)
     proc_remove(proc_ht);
     proc_remove(proc_hashtable);
     proc_remove(proc_daemonpid);
+    proc_remove(proc_htstats);
+    proc_remove(proc_htevents);
+    proc_remove(proc_hthot);
+    proc_remove(proc_htsnap);
+    proc_remove(proc_hthistory);
 
     down_write(&ht_sem);
     destroy_ht(table);
     up_write(&ht_sem);
+    kv_history_exit();
     printk(KERN_INFO "Hashtable proc module unloaded\n");
 }
 
@@ -0,0 +1,247 @@
+#include "admit.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+struct admit_slot {
+    pthread_mutex_t lock;       /* tokens and refilled */
+    char key[64];               /* "" = never used; under the table's lock */
+    int conns;                  /* under the table's lock */
+    double tokens;
+    unsigned long long refilled;    /* metrics_now_us() of the last refill */
+};
+
+/*
+ * Open-addressed like the auth pool's IP table. A slot is only reused
+ * once no connection holds it and its bucket has refilled, so closing
+ * and reopening connections does not reset a client's rate. A key whose
+ * probed slots are all held shares the overflow slot with every other
+ * such key: a full table tightens the limits rather than lifting them.
+ */
+struct admit_table {
+    pthread_mutex_t lock;
+    int max_conns;
+    double rate;
+    double burst;
+    struct admit_slot slots[ADMIT_SLOTS];
+    struct admit_slot overflow;
+};
+
+static struct admit_table ip_table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct admit_table user_table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static int max_inflight;
+static long inflight;
+static struct admit_stats stats;
+
+#define STAT_INC(field) __atomic_add_fetch(&stats.field, 1, __ATOMIC_RELAXED)
+
+/* FNV-1a, as in the kernel module */
+static uint64_t admit_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037UL;
+
+    for (const char *p = key; *p; p++) {
+        hash ^= (uint64_t)(unsigned char)*p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static void table_init(struct admit_table *t, int max_conns, double rate, int burst)
+{
+    t->max_conns = max_conns > 0 ? max_conns : 0;
+    t->rate = rate > 0 ? rate : 0;
+    t->burst = burst > 0 ? burst : t->rate;
+    if (t->burst < 1)
+        t->burst = 1;
+    for (int i = 0; i < ADMIT_SLOTS; i++)
+        pthread_mutex_init(&t->slots[i].lock, NULL);
+    pthread_mutex_init(&t->overflow.lock, NULL);
+    t->overflow.conns = 0;
+    t->overflow.tokens = t->burst;
+    t->overflow.refilled = metrics_now_us();
+}
+
+void admit_init(const admit_opts *opts)
+{
+    table_init(&ip_table, opts->ip_conns, opts->ip_rate, opts->burst);
+    table_init(&user_table, opts->user_conns, opts->user_rate, opts->burst);
+    max_inflight = opts->max_inflight > 0 ? opts->max_inflight : 0;
+    stats.inflight_max = (unsigned long)max_inflight;
+}
+
+/* Add the tokens earned since the last refill. Caller holds s->lock. */
+static void slot_refill(const struct admit_table *t, struct admit_slot *s,
+                        unsigned long long now)
+{
+    if (now > s->refilled) {
+        s->tokens += (double)(now - s->refilled) * t->rate / 1e6;
+        if (s->tokens > t->burst)
+            s->tokens = t->burst;
+    }
+    s->refilled = now;
+}
+
+static int slot_idle(const struct admit_table *t, struct admit_slot *s,
+                     unsigned long long now)
+{
+    int full;
+
+    if (s->conns > 0)
+        return 0;
+    if (t->rate == 0)
+        return 1;
+    pthread_mutex_lock(&s->lock);
+    slot_refill(t, s, now);
+    full = s->tokens >= t->burst;
+    pthread_mutex_unlock(&s->lock);
+    return full;
+}
+
+static int table_open(struct admit_table *t, const char *key, admit_slot **slot)
+{
+    size_t idx = admit_hash(key) % ADMIT_SLOTS;
+    unsigned long long now = metrics_now_us();
+    struct admit_slot *s = NULL, *idle = NULL;
+    size_t i;
+
+    *slot = NULL;
+    if (!t->max_conns && t->rate == 0)
+        return 0;
+
+    pthread_mutex_lock(&t->lock);
+    for (i = 0; i < ADMIT_PROBE; i++) {
+        struct admit_slot *p = &t->slots[(idx + i) % ADMIT_SLOTS];
+
+        if (!strcmp(p->key, key)) {
+            s = p;
+            break;
+        }
+        if (!idle && (p->key[0] == '\0' || slot_idle(t, p, now)))
+            idle = p;
+    }
+    if (!s && idle) {
+        /* New client, or one whose slot was taken over: start with a full bucket */
+        s = idle;
+        snprintf(s->key, sizeof(s->key), "%s", key);
+        s->conns = 0;
+        pthread_mutex_lock(&s->lock);
+        s->tokens = t->burst;
+        s->refilled = now;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!s) {
+        /* Every probed slot busy: charge the shared overflow slot */
+        s = &t->overflow;
+        STAT_INC(overflowed);
+    }
+    if (t->max_conns && s->conns >= t->max_conns) {
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+    s->conns++;
+    *slot = s;
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+int admit_ip_open(const char *ip, admit_slot **slot)
+{
+    if (table_open(&ip_table, ip, slot) != 0) {
+        STAT_INC(refused_ip);
+        return -1;
+    }
+    return 0;
+}
+
+int admit_user_open(const char *user, admit_slot **slot)
+{
+    if (table_open(&user_table, user, slot) != 0) {
+        STAT_INC(refused_user);
+        return -1;
+    }
+    return 0;
+}
+
+void admit_close(admit_slot *slot)
+{
+    struct admit_table *t;
+
+    if (!slot)
+        return;
+    t = (slot >= ip_table.slots && slot < ip_table.slots + ADMIT_SLOTS) ||
+        slot == &ip_table.overflow ? &ip_table : &user_table;
+    pthread_mutex_lock(&t->lock);
+    slot->conns--;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static unsigned int slot_charge(const struct admit_table *t, struct admit_slot *s,
+                                unsigned long long now)
+{
+    unsigned int wait_ms = 0;
+
+    if (!s || t->rate == 0)
+        return 0;
+    pthread_mutex_lock(&s->lock);
+    slot_refill(t, s, now);
+    s->tokens -= 1;
+    if (s->tokens < 0)
+        wait_ms = (unsigned int)(-s->tokens * 1000 / t->rate) + 1;
+    pthread_mutex_unlock(&s->lock);
+    return wait_ms;
+}
+
+unsigned int admit_charge(admit_slot *ip, admit_slot *user)
+{
+    unsigned long long now;
+    unsigned int a, b;
+
+    if (!ip && !user)
+        return 0;
+    now = metrics_now_us();
+    a = slot_charge(&ip_table, ip, now);
+    b = slot_charge(&user_table, user, now);
+    return a > b ? a : b;
+}
+
+int admit_inflight_limited(void)
+{
+    return max_inflight > 0;
+}
+
+int admit_inflight_begin(void)
+{
+    return __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED) > max_inflight ? -1 : 0;
+}
+
+void admit_inflight_end(void)
+{
+    __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+}
+
+void admit_count_shed(void)
+{
+    STAT_INC(shed);
+}
+
+void admit_count_throttled(void)
+{
+    STAT_INC(throttled);
+}
+
+void admit_get_stats(struct admit_stats *st)
+{
+    long n = __atomic_load_n(&inflight, __ATOMIC_RELAXED);
+
+    st->inflight = n > 0 ? (unsigned long)n : 0;
+    st->inflight_max = stats.inflight_max;
+    st->shed = __atomic_load_n(&stats.shed, __ATOMIC_RELAXED);
+    st->refused_ip = __atomic_load_n(&stats.refused_ip, __ATOMIC_RELAXED);
+    st->refused_user = __atomic_load_n(&stats.refused_user, __ATOMIC_RELAXED);
+    st->throttled = __atomic_load_n(&stats.throttled, __ATOMIC_RELAXED);
+    st->overflowed = __atomic_load_n(&stats.overflowed, __ATOMIC_RELAXED);
+}
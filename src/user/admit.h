@@ -0,0 +1,101 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#define ADMIT_SLOTS 4096            /* tracked client IPs, and as many users */
+#define ADMIT_PROBE 8
+
+/*
+ * Admission control for the network server, so one client cannot take
+ * the capacity everyone else shares.
+ *
+ * Connections: a shard serves one request per connection at a time, so
+ * a client's concurrent requests are bounded by its connections. These
+ * are capped per client IP at accept and per user at login.
+ *
+ * Rates: every request takes a token from its IP's and its user's
+ * bucket. A connection whose bucket runs dry is paused until the bucket
+ * refills; its input waits in its own buffer and in TCP.
+ *
+ * Load: a request is in flight from the moment its shard sees it ready
+ * until it has been answered. Past the in-flight cap new requests are
+ * answered BUSY at once instead of waiting behind the others.
+ *
+ * Every limit is off (0) unless configured. Each table tracks
+ * ADMIT_SLOTS keys; when a key finds no free slot it shares one
+ * overflow slot, and its limits, with every other key that did not.
+ */
+
+typedef struct {
+    int max_inflight;           /* requests in flight, all shards */
+    int ip_conns;               /* connections per client IP */
+    int user_conns;             /* connections per user */
+    double ip_rate;             /* requests per second per client IP */
+    double user_rate;           /* requests per second per user */
+    int burst;                  /* requests a full bucket allows; 0 = one second's worth */
+} admit_opts;
+
+struct admit_stats {
+    unsigned long inflight;
+    unsigned long inflight_max;     /* the configured cap */
+    unsigned long shed;             /* requests answered BUSY */
+    unsigned long refused_ip;       /* connections over the per-IP limit */
+    unsigned long refused_user;     /* logins over the per-user limit */
+    unsigned long throttled;        /* requests held back by a rate limit */
+    unsigned long overflowed;       /* connections charged to an overflow slot */
+};
+
+/* One client IP or user; held by each of its connections */
+typedef struct admit_slot admit_slot;
+
+/**
+ * Set the limits. Call before the server starts.
+ */
+void admit_init(const admit_opts *opts);
+
+/**
+ * Count a new connection from ip against the per-IP limits.
+ * @param slot  Receives the IP's slot, or NULL if no per-IP limit is set.
+ * @return 0 if admitted, -1 if the IP has too many connections.
+ */
+int admit_ip_open(const char *ip, admit_slot **slot);
+
+/**
+ * Count an authenticated connection against the per-user limits.
+ * @return 0 if admitted, -1 if the user has too many connections.
+ */
+int admit_user_open(const char *user, admit_slot **slot);
+
+/**
+ * Release a slot from admit_ip_open() or admit_user_open(). NULL is ignored.
+ */
+void admit_close(admit_slot *slot);
+
+/**
+ * Take one request's token from the IP and user buckets (either may be
+ * NULL). Buckets may go into debt; the connection then waits it off.
+ * @return milliseconds until the connection may send again, 0 if none.
+ */
+unsigned int admit_charge(admit_slot *ip, admit_slot *user);
+
+/**
+ * Whether the in-flight cap is set; without it nothing is counted.
+ */
+int admit_inflight_limited(void);
+
+/**
+ * A request became ready. It is counted until admit_inflight_end().
+ * @return 0 if under the cap, -1 if it should be answered BUSY.
+ */
+int admit_inflight_begin(void);
+
+void admit_inflight_end(void);
+
+/**
+ * Count requests answered BUSY, and requests held back by a rate limit.
+ */
+void admit_count_shed(void);
+void admit_count_throttled(void);
+
+void admit_get_stats(struct admit_stats *st);
+
+#endif /* ADMIT_H */
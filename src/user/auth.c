@@ -0,0 +1,605 @@
+#include "auth.h"
+#include "metrics.h"
+
+#include <security/pam_appl.h>
+#include <security/pam_misc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#define AUTH_TOKEN_PROBE 8
+#define AUTH_IP_PROBE 8
+
+typedef struct {
+    char token[AUTH_TOKEN_LEN + 1];
+    char user[64];
+    time_t expires;
+} auth_token;
+
+/* Cached successful verification, keyed on a keyed (salted) hash of user+password */
+typedef struct {
+    uint64_t hash[2];
+    time_t expires;
+} auth_cache_entry;
+
+/* Queued credential check */
+typedef struct {
+    char user[64];
+    char pass[64];
+    char ip[64];
+    uint64_t hash[2];
+    int tracked;            /* the IP has a backoff slot */
+    struct timespec submitted;
+    auth_done_fn done;
+    void *arg;
+} auth_request;
+
+/* Per-client-IP concurrency and failure tracking */
+typedef struct {
+    char ip[64];
+    int active;             /* queued + running requests */
+    int failures;
+    time_t last_failure;
+    time_t backoff_until;
+} auth_ip_state;
+
+static auth_token tokens[AUTH_MAX_TOKENS];
+static auth_cache_entry cache[AUTH_CACHE_SLOTS];
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Worker pool; everything below is protected by pool_lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static auth_request *queue;
+static int queue_head;
+static int queue_len;
+static int queue_cap;
+static int per_ip_limit;
+static auth_ip_state ip_table[AUTH_IP_SLOTS];
+static struct auth_stats stats;
+
+static int token_ttl_sec = 0;
+static int cache_ttl_sec = 0;
+
+/* Secret per-process keys: [0..1] token slots, [2..3] and [4..5] credential hash */
+static uint64_t sip_keys[6];
+
+static int pam_check(const char *user, const char *pass, int no_delay);
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* ---- SipHash-2-4 ---- */
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                   \
+    do {                                                           \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);  \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                     \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                     \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);  \
+    } while (0)
+
+static uint64_t siphash(const void *data, size_t len, const uint64_t key[2])
+{
+    const uint8_t *in = data;
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    uint64_t b = ((uint64_t)len) << 56;
+    size_t i;
+
+    for (; len >= 8; len -= 8, in += 8) {
+        uint64_t m = 0;
+        for (i = 0; i < 8; i++)
+            m |= (uint64_t)in[i] << (8 * i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    for (i = 0; i < len; i++)
+        b |= (uint64_t)in[i] << (8 * i);
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void credential_hash(const char *user, const char *pass, uint64_t out[2])
+{
+    char buf[130];
+    size_t ulen = strnlen(user, 64);
+    size_t plen = strnlen(pass, 64);
+
+    memcpy(buf, user, ulen);
+    buf[ulen] = '\0';
+    memcpy(buf + ulen + 1, pass, plen);
+
+    out[0] = siphash(buf, ulen + 1 + plen, &sip_keys[2]);
+    out[1] = siphash(buf, ulen + 1 + plen, &sip_keys[4]);
+    memset(buf, 0, sizeof(buf));
+}
+
+/* Compare without leaking the position of the first mismatch */
+static int token_equal(const char *a, const char *b)
+{
+    unsigned char diff = 0;
+    size_t i;
+
+    for (i = 0; i < AUTH_TOKEN_LEN; i++)
+        diff |= (unsigned char)(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+int auth_init(int token_ttl, int cache_ttl)
+{
+    token_ttl_sec = token_ttl > 0 ? token_ttl : 0;
+    cache_ttl_sec = cache_ttl > 0 ? cache_ttl : 0;
+
+    if (getrandom(sip_keys, sizeof(sip_keys), 0) != (ssize_t)sizeof(sip_keys)) {
+        perror("auth_init: getrandom");
+        token_ttl_sec = 0;
+        cache_ttl_sec = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 if this credential hash has a live cache entry */
+static int cache_lookup(const uint64_t h[2])
+{
+    auth_cache_entry *slot = &cache[h[0] % AUTH_CACHE_SLOTS];
+    int hit;
+
+    pthread_mutex_lock(&cache_lock);
+    hit = slot->expires > now_sec() && slot->hash[0] == h[0] && slot->hash[1] == h[1];
+    pthread_mutex_unlock(&cache_lock);
+    return hit;
+}
+
+static void cache_store(const uint64_t h[2])
+{
+    auth_cache_entry *slot = &cache[h[0] % AUTH_CACHE_SLOTS];
+
+    pthread_mutex_lock(&cache_lock);
+    slot->hash[0] = h[0];
+    slot->hash[1] = h[1];
+    slot->expires = now_sec() + cache_ttl_sec;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Put a token in its slot: the first free or expired one, else the one closest to expiry */
+static void token_store(const char *token, const char *user, time_t expires)
+{
+    size_t i, idx = siphash(token, AUTH_TOKEN_LEN, &sip_keys[0]) % AUTH_MAX_TOKENS;
+    auth_token *victim = NULL;
+    time_t now;
+
+    pthread_mutex_lock(&token_lock);
+    now = now_sec();
+    for (i = 0; i < AUTH_TOKEN_PROBE; i++) {
+        auth_token *t = &tokens[(idx + i) % AUTH_MAX_TOKENS];
+        if (t->expires <= now) {
+            victim = t;
+            break;
+        }
+        if (!victim || t->expires < victim->expires)
+            victim = t;
+    }
+    memcpy(victim->token, token, AUTH_TOKEN_LEN + 1);
+    snprintf(victim->user, sizeof(victim->user), "%s", user);
+    victim->expires = expires;
+    pthread_mutex_unlock(&token_lock);
+}
+
+int auth_token_issue(const char *user, char *out, size_t outlen)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[AUTH_TOKEN_LEN / 2];
+    char token[AUTH_TOKEN_LEN + 1];
+    size_t i;
+
+    if (token_ttl_sec == 0 || outlen < sizeof(token))
+        return -1;
+
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw))
+        return -1;
+    for (i = 0; i < sizeof(raw); i++) {
+        token[2 * i] = hex[raw[i] >> 4];
+        token[2 * i + 1] = hex[raw[i] & 0xf];
+    }
+    token[AUTH_TOKEN_LEN] = '\0';
+
+    token_store(token, user, now_sec() + token_ttl_sec);
+
+    memcpy(out, token, sizeof(token));
+    return 0;
+}
+
+void auth_token_foreach(void (*fn)(const char *token, const char *user, int ttl, void *arg),
+                        void *arg)
+{
+    time_t now;
+    size_t i;
+
+    pthread_mutex_lock(&token_lock);
+    now = now_sec();
+    for (i = 0; i < AUTH_MAX_TOKENS; i++) {
+        if (tokens[i].expires > now)
+            fn(tokens[i].token, tokens[i].user, (int)(tokens[i].expires - now), arg);
+    }
+    pthread_mutex_unlock(&token_lock);
+}
+
+int auth_token_import(const char *token, const char *user, int ttl)
+{
+    /* Never valid for longer than this daemon would issue it */
+    if (token_ttl_sec == 0 || ttl <= 0 || strlen(token) != AUTH_TOKEN_LEN)
+        return -1;
+    token_store(token, user, now_sec() + (ttl < token_ttl_sec ? ttl : token_ttl_sec));
+    return 0;
+}
+
+int auth_token_check(const char *token, char *user, size_t userlen)
+{
+    size_t i, idx;
+    time_t now;
+    int ret = -1;
+
+    if (token_ttl_sec == 0 || strlen(token) != AUTH_TOKEN_LEN)
+        return -1;
+
+    idx = siphash(token, AUTH_TOKEN_LEN, &sip_keys[0]) % AUTH_MAX_TOKENS;
+
+    pthread_mutex_lock(&token_lock);
+    now = now_sec();
+    for (i = 0; i < AUTH_TOKEN_PROBE; i++) {
+        auth_token *t = &tokens[(idx + i) % AUTH_MAX_TOKENS];
+        if (t->expires > now && token_equal(t->token, token)) {
+            snprintf(user, userlen, "%s", t->user);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&token_lock);
+
+    return ret;
+}
+
+/**
+ * Find the tracking slot for ip, claiming an idle one if create is set.
+ * Returns NULL when every probed slot is busy; the request is then
+ * admitted untracked rather than refused. Caller holds pool_lock.
+ */
+static auth_ip_state *ip_state(const char *ip, int create, time_t now)
+{
+    size_t idx = siphash(ip, strlen(ip), &sip_keys[0]) % AUTH_IP_SLOTS;
+    auth_ip_state *idle = NULL;
+    size_t i;
+
+    for (i = 0; i < AUTH_IP_PROBE; i++) {
+        auth_ip_state *st = &ip_table[(idx + i) % AUTH_IP_SLOTS];
+        if (!strcmp(st->ip, ip))
+            return st;
+        if (!idle && (st->ip[0] == '\0' ||
+                      (st->active == 0 && st->backoff_until <= now &&
+                       now - st->last_failure > AUTH_BACKOFF_RESET)))
+            idle = st;
+    }
+    if (!create || !idle)
+        return NULL;
+
+    memset(idle, 0, sizeof(*idle));
+    snprintf(idle->ip, sizeof(idle->ip), "%s", ip);
+    return idle;
+}
+
+static unsigned long long elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - since->tv_sec) * 1000000ULL +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void *auth_worker(void *arg)
+{
+    auth_request req;
+    auth_ip_state *st;
+    unsigned long long lat;
+    time_t now;
+    int ret;
+
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (queue_len == 0)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        req = queue[queue_head];
+        memset(&queue[queue_head], 0, sizeof(queue[queue_head]));
+        queue_head = (queue_head + 1) % queue_cap;
+        queue_len--;
+        stats.in_progress++;
+        pthread_mutex_unlock(&pool_lock);
+
+        /* Per-IP backoff replaces PAM's failure delay, for IPs it tracks */
+        ret = pam_check(req.user, req.pass, req.tracked);
+        if (ret == 0 && cache_ttl_sec > 0)
+            cache_store(req.hash);
+        lat = elapsed_us(&req.submitted);
+        metrics_observe(METRIC_AUTH, lat);
+
+        pthread_mutex_lock(&pool_lock);
+        now = now_sec();
+        stats.in_progress--;
+        stats.latency_total_us += lat;
+        if (lat > stats.latency_max_us)
+            stats.latency_max_us = lat;
+        st = ip_state(req.ip, 0, now);
+        if (st && st->active > 0)
+            st->active--;
+        if (ret == 0) {
+            stats.ok++;
+            if (st) {
+                st->failures = 0;
+                st->backoff_until = 0;
+            }
+        } else {
+            stats.failed++;
+            if (st) {
+                if (now - st->last_failure > AUTH_BACKOFF_RESET)
+                    st->failures = 0;
+                st->failures++;
+                st->last_failure = now;
+                /* 1, 2, 4, ... seconds once the free attempts are used up */
+                if (st->failures > AUTH_BACKOFF_FREE) {
+                    int shift = st->failures - AUTH_BACKOFF_FREE - 1;
+                    int delay = shift < 6 ? 1 << shift : AUTH_BACKOFF_MAX;
+                    st->backoff_until = now + (delay < AUTH_BACKOFF_MAX ? delay : AUTH_BACKOFF_MAX);
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        memset(req.pass, 0, sizeof(req.pass));
+        req.done(ret, req.arg);
+    }
+    return NULL;
+}
+
+int auth_pool_start(int workers, int queue_max, int per_ip_max)
+{
+    int i;
+
+    if (workers <= 0 || queue_max <= 0)
+        return -1;
+
+    queue = calloc((size_t)queue_max, sizeof(*queue));
+    if (!queue)
+        return -1;
+    queue_cap = queue_max;
+    per_ip_limit = per_ip_max > 0 ? per_ip_max : queue_max;
+    stats.queue_max = (unsigned long)queue_max;
+
+    for (i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, auth_worker, NULL) != 0) {
+            perror("auth_pool_start: pthread_create");
+            if (i == 0)
+                return -1;
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int auth_submit(const char *user, const char *pass, const char *ip,
+                auth_done_fn done, void *arg)
+{
+    uint64_t h[2] = { 0, 0 };
+    auth_ip_state *st;
+    auth_request *req;
+    time_t now;
+
+    if (cache_ttl_sec > 0) {
+        credential_hash(user, pass, h);
+        if (cache_lookup(h)) {
+            pthread_mutex_lock(&pool_lock);
+            stats.cache_hits++;
+            pthread_mutex_unlock(&pool_lock);
+            done(0, arg);
+            return 0;
+        }
+    }
+
+    /* No pool configured: authenticate on the caller's thread */
+    if (queue_cap == 0) {
+        int ret = authenticate_user(user, pass);
+        if (ret == 0 && cache_ttl_sec > 0)
+            cache_store(h);
+        done(ret, arg);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    now = now_sec();
+    st = ip_state(ip, 1, now);
+    if (st && st->backoff_until > now) {
+        stats.rejected_backoff++;
+        pthread_mutex_unlock(&pool_lock);
+        return AUTH_BACKOFF;
+    }
+    if (queue_len == queue_cap || (st && st->active >= per_ip_limit)) {
+        stats.rejected_busy++;
+        pthread_mutex_unlock(&pool_lock);
+        return AUTH_BUSY;
+    }
+
+    req = &queue[(queue_head + queue_len) % queue_cap];
+    snprintf(req->user, sizeof(req->user), "%s", user);
+    snprintf(req->pass, sizeof(req->pass), "%s", pass);
+    snprintf(req->ip, sizeof(req->ip), "%s", ip);
+    req->hash[0] = h[0];
+    req->hash[1] = h[1];
+    req->tracked = st != NULL;
+    clock_gettime(CLOCK_MONOTONIC, &req->submitted);
+    req->done = done;
+    req->arg = arg;
+    queue_len++;
+    if (st)
+        st->active++;
+    stats.submitted++;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+struct auth_waiter {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int result;
+};
+
+static void auth_wake(int result, void *arg)
+{
+    struct auth_waiter *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    w->result = result;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int auth_verify(const char *user, const char *pass, const char *ip)
+{
+    struct auth_waiter w = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int ret;
+
+    ret = auth_submit(user, pass, ip, auth_wake, &w);
+    if (ret != 0)
+        return ret;
+
+    pthread_mutex_lock(&w.lock);
+    while (!w.done)
+        pthread_cond_wait(&w.cond, &w.lock);
+    pthread_mutex_unlock(&w.lock);
+
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+    return w.result;
+}
+
+void auth_get_stats(struct auth_stats *st)
+{
+    pthread_mutex_lock(&pool_lock);
+    *st = stats;
+    st->queue_depth = (unsigned long)queue_len;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* PAM's own failure delay would park a worker for seconds */
+static void auth_no_delay(int retval, unsigned usec_delay, void *appdata_ptr)
+{
+    (void)retval;
+    (void)usec_delay;
+    (void)appdata_ptr;
+}
+
+static int pam_password_conv(int num_msg, const struct pam_message **msg,
+                             struct pam_response **resp, void *appdata_ptr)
+{
+    struct pam_response *replies;
+    const char *password = appdata_ptr;
+    int i;
+
+    if (!msg || !resp || !password || num_msg <= 0)
+        return PAM_CONV_ERR;
+
+    replies = calloc((size_t)num_msg, sizeof(*replies));
+    if (!replies)
+        return PAM_CONV_ERR;
+
+    for (i = 0; i < num_msg; i++) {
+        switch (msg[i]->msg_style) {
+        case PAM_PROMPT_ECHO_OFF:
+        case PAM_PROMPT_ECHO_ON:
+            replies[i].resp = strdup(password);
+            if (!replies[i].resp)
+                goto fail;
+            break;
+        case PAM_TEXT_INFO:
+        case PAM_ERROR_MSG:
+            replies[i].resp = NULL;
+            break;
+        default:
+            goto fail;
+        }
+    }
+
+    *resp = replies;
+    return PAM_SUCCESS;
+
+fail:
+    for (i = 0; i < num_msg; i++)
+        free(replies[i].resp);
+    free(replies);
+    return PAM_CONV_ERR;
+}
+
+/*
+ * Without the failure delay a password can be guessed as fast as PAM
+ * answers, so it may only be dropped where the per-IP backoff throttles
+ * the guesser instead.
+ */
+static int pam_check(const char *user, const char *pass, int no_delay)
+{
+    pam_handle_t *pamh = NULL;
+    struct pam_conv conv = { pam_password_conv, (void *)pass };
+
+    int ret = pam_start("login", user, &conv, &pamh);
+    if (ret != PAM_SUCCESS)
+        return -1;
+
+    if (no_delay)
+        pam_set_item(pamh, PAM_FAIL_DELAY, (const void *)auth_no_delay);
+
+    ret = pam_authenticate(pamh, 0);
+    if (ret == PAM_SUCCESS)
+        ret = pam_acct_mgmt(pamh, 0);
+
+    pam_end(pamh, ret);
+
+    return (ret == PAM_SUCCESS) ? 0 : -1;
+}
+
+int authenticate_user(const char *user, const char *pass)
+{
+    return pam_check(user, pass, 0);
+}
@@ -0,0 +1,112 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stddef.h>
+
+#define AUTH_TOKEN_LEN 32           /* hex characters, 128 bits of entropy */
+#define AUTH_MAX_TOKENS 4096
+#define AUTH_CACHE_SLOTS 1024
+#define AUTH_DEFAULT_TOKEN_TTL 300  /* seconds */
+
+#define AUTH_DEFAULT_WORKERS 4
+#define AUTH_DEFAULT_QUEUE 64
+#define AUTH_DEFAULT_PER_IP 4
+#define AUTH_IP_SLOTS 1024
+#define AUTH_BACKOFF_FREE 3         /* failures allowed before backoff starts */
+#define AUTH_BACKOFF_MAX 60         /* seconds */
+#define AUTH_BACKOFF_RESET 300      /* forget failures after this many quiet seconds */
+
+/* Results of auth_submit()/auth_verify() besides 0 (ok) and -1 (bad credentials) */
+#define AUTH_BUSY -2                /* queue full or per-IP limit reached */
+#define AUTH_BACKOFF -3             /* too many recent failures from this IP */
+
+/* Completion callback, invoked from an auth worker thread */
+typedef void (*auth_done_fn)(int result, void *arg);
+
+struct auth_stats {
+    unsigned long queue_depth;
+    unsigned long queue_max;
+    unsigned long in_progress;
+    unsigned long submitted;
+    unsigned long cache_hits;
+    unsigned long ok;
+    unsigned long failed;
+    unsigned long rejected_busy;
+    unsigned long rejected_backoff;
+    unsigned long long latency_total_us; /* submit to completion, PAM runs only */
+    unsigned long long latency_max_us;
+};
+
+/**
+ * Initialize the token store and credential cache.
+ * @param token_ttl  Lifetime of issued session tokens in seconds (0 = tokens disabled).
+ * @param cache_ttl  How long a successful PAM verification is cached (0 = no cache).
+ * @return 0 on success, -1 if no randomness source is available.
+ */
+int auth_init(int token_ttl, int cache_ttl);
+
+/**
+ * Issue a new session token for an authenticated user.
+ * @param out  Receives a NUL-terminated token (at least AUTH_TOKEN_LEN + 1 bytes).
+ * @return 0 on success, -1 if tokens are disabled.
+ */
+int auth_token_issue(const char *user, char *out, size_t outlen);
+
+/**
+ * Validate a session token presented with AUTH-TOKEN.
+ * @param user  Receives the user the token was issued to.
+ * @return 0 if the token is known and not expired, -1 otherwise.
+ */
+int auth_token_check(const char *token, char *user, size_t userlen);
+
+/**
+ * Call fn for every live session token with its remaining lifetime in
+ * seconds, so a daemon taking over can keep them valid. fn runs with
+ * the token store locked and must not call back into it.
+ */
+void auth_token_foreach(void (*fn)(const char *token, const char *user, int ttl, void *arg),
+                        void *arg);
+
+/**
+ * Add a token issued by another daemon, e.g. the one being replaced.
+ * @return 0 on success, -1 if tokens are disabled or the token is malformed.
+ */
+int auth_token_import(const char *token, const char *user, int ttl);
+
+/**
+ * Start the pool of PAM worker threads. PAM runs only on these threads,
+ * so a burst of logins cannot occupy the threads serving KV traffic.
+ * @param workers  Number of worker threads.
+ * @param queue_max  Maximum number of queued requests.
+ * @param per_ip_max  Maximum concurrent requests (queued + running) per client IP.
+ * @return 0 on success, -1 on error.
+ */
+int auth_pool_start(int workers, int queue_max, int per_ip_max);
+
+/**
+ * Queue a credential check. Cache hits complete immediately on the
+ * calling thread; otherwise done() is called from a worker.
+ * @return 0 if done() has been or will be called, AUTH_BUSY or
+ *         AUTH_BACKOFF if the request was rejected (done() is not called).
+ */
+int auth_submit(const char *user, const char *pass, const char *ip,
+                auth_done_fn done, void *arg);
+
+/**
+ * Blocking wrapper around auth_submit().
+ * @return 0, -1, AUTH_BUSY or AUTH_BACKOFF.
+ */
+int auth_verify(const char *user, const char *pass, const char *ip);
+
+/**
+ * Snapshot the auth pool counters.
+ */
+void auth_get_stats(struct auth_stats *st);
+
+/**
+ * Run a full PAM authentication against the "login" service.
+ * @return 0 on success, -1 on failure.
+ */
+int authenticate_user(const char *user, const char *pass);
+
+#endif /* AUTH_H */
@@ -2,12 +2,70 @@
 #include "daemon.h"
 #include "net_server.h"
 #include "debug_net.h"
+#include "auth.h"
+#include "metrics.h"
+#include "kvfeed.h"
+#include "watch.h"
+#include "kvcache.h"
+#include "repl.h"
+#include "replica.h"
+#include "router.h"
+#include "upgrade.h"
+#include "admit.h"
+#include <errno.h>
+#include <limits.h>
 
 static pthread_t net_thread;
+static net_server_opts net_opts;
+static const char *backup_path = DAEMON_BACKUP_PATH;
+static pthread_t main_thread;
+static volatile sig_atomic_t stop_flag = 0;
+static volatile sig_atomic_t handed_off = 0;
+
+enum {
+    OPT_AUTH_WORKERS = 256,
+    OPT_AUTH_QUEUE,
+    OPT_AUTH_PER_IP,
+    OPT_SHARDS,
+    OPT_RESP_PORT,
+    OPT_UNIX_SOCKET,
+    OPT_UNIX_ALLOW_UID,
+    OPT_UNIX_ALLOW_GID,
+    OPT_DEBUG_SAMPLE,
+    OPT_DEBUG_RATE,
+    OPT_METRICS_PORT,
+    OPT_CACHE_SIZE,
+    OPT_CACHE_MAX_STALE,
+    OPT_PORT,
+    OPT_BACKUP,
+    OPT_REPLICA_OF,
+    OPT_REPLICA_AUTH,
+    OPT_ROUTER,
+    OPT_ROUTER_AUTH,
+    OPT_ROUTER_VNODES,
+    OPT_UPGRADE_SOCKET,
+    OPT_TAKEOVER,
+    OPT_DRAIN_TIMEOUT,
+    OPT_MAX_INFLIGHT,
+    OPT_CONNS_PER_IP,
+    OPT_CONNS_PER_USER,
+    OPT_RATE_PER_IP,
+    OPT_RATE_PER_USER,
+    OPT_RATE_BURST,
+};
 
 void handle_signal(int sig) {
     if (sig == SIGUSR1)
         save_flag = 1;
+    else if (sig == SIGTERM)
+        stop_flag = 1;
+}
+
+/* Upgrade thread: a successor is serving on our listeners */
+static void upgrade_handed_off(void)
+{
+    handed_off = 1;
+    pthread_kill(main_thread, SIGTERM);
 }
 
 void write_pid_to_proc(void) {
@@ -24,18 +82,32 @@ void write_pid_to_proc(void) {
     close(fd);
 }
 
+/*
+ * Back the table up from /proc/htsnap, a consistent snapshot that does
+ * not hold writers off while it is read. Older modules only have
+ * /proc/hashtable. The copy goes to a temporary file and replaces the
+ * backup only once complete, so a failed save keeps the previous one.
+ */
 void save_hashtable(void)
 {
-    FILE *fp = fopen("/proc/hashtable", "r");
+    unsigned long long start = metrics_now_us();
+    char tmp_path[PATH_MAX];
+    FILE *fp = fopen("/proc/htsnap", "r");
+    if(!fp && errno == ENOENT)
+        fp = fopen("/proc/hashtable", "r");
     if(!fp)
     {
-        perror("Failed to open /proc/hashtable in daemon");
+        /* EBUSY: another snapshot is open; the next signal saves again */
+        perror("Failed to open /proc/htsnap in daemon");
+        metrics_inc(METRIC_SAVE_ERRORS);
         return;
     }
-    FILE *backup = fopen("/var/tmp/hashtable_backup.txt", "w");
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", backup_path);
+    FILE *backup = fopen(tmp_path, "w");
     if(!backup)
     {
         perror("Failed to open backup file in daemon");
+        metrics_inc(METRIC_SAVE_ERRORS);
         fclose(fp);
         return;
     }
@@ -44,10 +116,24 @@ void save_hashtable(void)
     {
         fputs(buf, backup);
     }
+    int failed = ferror(fp);
+    if (failed)
+        perror("Failed to read snapshot in daemon");
     fclose(fp);
-    fclose(backup);
+    if (fclose(backup) != 0)
+        failed = 1;
+    if (!failed && rename(tmp_path, backup_path) != 0) {
+        perror("Failed to replace backup file in daemon");
+        failed = 1;
+    }
+    if (failed) {
+        unlink(tmp_path);
+        metrics_inc(METRIC_SAVE_ERRORS);
+        return;
+    }
+    metrics_observe(METRIC_SAVE, metrics_now_us() - start);
 
-    debug_send("[DAEMON] hashtable saved to /var/tmp/hashtable_backup.txt");
+    debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] hashtable saved to %s", backup_path);
 }
 
 void daemonize(void)
@@ -66,15 +152,6 @@ void daemonize(void)
         exit(1);
     }
 
-    struct sigaction sa;
-    sa.sa_handler = handle_signal;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if (sigaction(SIGUSR1, &sa, NULL) < 0) {
-        perror("sigaction failed");
-        exit(1);
-    }
-
     pid = fork();
     if (pid < 0) {
         perror("Second fork failed");
@@ -102,7 +179,7 @@ void daemonize(void)
 
 void restore_hashtable(void)
 {
-    FILE *backup = fopen("/var/tmp/hashtable_backup.txt", "r");
+    FILE *backup = fopen(backup_path, "r");
     if (!backup) {
         // No backup file, nothing to restore
         return;
@@ -123,12 +200,101 @@ void restore_hashtable(void)
     debug_send("[DAEMON] hashtable restored from backup");
 }
 
+/* Parse a comma-separated list of numeric ids, e.g. "0,1000,1001" */
+static int parse_id_list(const char *list, unsigned int *ids, int max)
+{
+    char buf[256];
+    char *tok, *save = NULL;
+    int n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (tok = strtok_r(buf, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save))
+        ids[n++] = (unsigned int)strtoul(tok, NULL, 10);
+    return n;
+}
+
+/* Split "A:B" (HOST:PORT, USER:PASS) at the last colon */
+static int split_pair(const char *arg, char *a, size_t alen, const char **b)
+{
+    const char *colon = strrchr(arg, ':');
+
+    if (!colon || colon == arg || (size_t)(colon - arg) >= alen)
+        return -1;
+    memcpy(a, arg, (size_t)(colon - arg));
+    a[colon - arg] = '\0';
+    *b = colon + 1;
+    return 0;
+}
+
+/* Parse "CATEGORY:N" for --debug-sample / --debug-rate */
+static int parse_debug_setting(const char *arg, int *cat, unsigned int *n)
+{
+    char name[32];
+    const char *colon = strchr(arg, ':');
+
+    if (!colon || (size_t)(colon - arg) >= sizeof(name))
+        return -1;
+    memcpy(name, arg, (size_t)(colon - arg));
+    name[colon - arg] = '\0';
+    *cat = debug_category(name);
+    *n = (unsigned int)strtoul(colon + 1, NULL, 10);
+    return *cat < 0 ? -1 : 0;
+}
+
 static void print_usage(const char *prog)
 {
     fprintf(stderr,
         "Usage: %s [OPTIONS]\n"
         "  -d, --debug-ip IP     Enable debug messages to remote IP\n"
         "  -p, --debug-port PORT Debug UDP port (default: 6666)\n"
+        "      --debug-sample CAT:N\n"
+        "                        Send 1 in N debug messages of CAT (daemon, remote)\n"
+        "      --debug-rate CAT:N\n"
+        "                        Send at most N debug messages of CAT per second\n"
+        "  -t, --token-ttl SECS  Session token lifetime (default: 300, 0 = disabled)\n"
+        "  -c, --auth-cache-ttl SECS\n"
+        "                        Cache successful PAM logins (default: 0 = disabled)\n"
+        "      --port PORT       TCP port for clients and replicas (default: 5555)\n"
+        "      --backup PATH     Backup file for SIGUSR1 saves and startup restore\n"
+        "                        (default: " DAEMON_BACKUP_PATH ")\n"
+        "      --replica-of HOST:PORT\n"
+        "                        Follow a primary daemon; client writes are refused\n"
+        "      --replica-auth USER:PASS\n"
+        "                        Credentials used to log in to the primary\n"
+        "      --router HOST:PORT[,HOST:PORT...]\n"
+        "                        Shard keys over these daemons instead of the local store\n"
+        "      --router-auth USER:PASS\n"
+        "                        Credentials used to log in to the backends\n"
+        "      --router-vnodes N Hash ring points per backend (default: 160)\n"
+        "      --shards N        TCP listener threads, one per CPU (default: online CPUs)\n"
+        "      --resp-port PORT  Also serve the Redis protocol (RESP2 subset) on PORT\n"
+        "      --unix-socket PATH\n"
+        "                        Also listen on a Unix socket (SO_PEERCRED auth, no PAM)\n"
+        "      --unix-allow-uid LIST\n"
+        "                        Comma-separated uids allowed on the Unix socket\n"
+        "      --unix-allow-gid LIST\n"
+        "                        Comma-separated gids allowed on the Unix socket, matched\n"
+        "                        against the caller's primary and supplementary groups\n"
+        "      --metrics-port PORT\n"
+        "                        Serve Prometheus metrics on http://HOST:PORT/metrics\n"
+        "      --cache-size N    Lookup cache entries (default: 4096, 0 = disabled)\n"
+        "      --cache-max-stale MS\n"
+        "                        Longest a cached read may lag a kernel write (default: 100)\n"
+        "      --auth-workers N  PAM worker threads (default: 4)\n"
+        "      --auth-queue N    Max queued logins before AUTH BUSY (default: 64)\n"
+        "      --auth-per-ip N   Max concurrent logins per client IP (default: 4)\n"
+        "      --max-inflight N  Answer BUSY past N requests in flight (default: 0 = no cap)\n"
+        "      --conns-per-ip N  Max connections per client IP (default: 0 = unlimited)\n"
+        "      --conns-per-user N\n"
+        "                        Max authenticated connections per user (default: 0 = unlimited)\n"
+        "      --rate-per-ip R   Requests per second per client IP (default: 0 = unlimited)\n"
+        "      --rate-per-user R Requests per second per user (default: 0 = unlimited)\n"
+        "      --rate-burst N    Requests allowed back to back (default: one second's worth)\n"
+        "      --upgrade-socket PATH\n"
+        "                        Hand listeners over to a new daemon through PATH\n"
+        "      --takeover        Take over listeners from the daemon on --upgrade-socket\n"
+        "      --drain-timeout SECS\n"
+        "                        Longest wait for clients when stopping (default: 30)\n"
         "  -n, --no-daemon       Run in foreground (don't daemonize)\n"
         "  -h, --help            Show this help\n",
         prog);
@@ -139,17 +305,76 @@ int main(int argc, char *argv[])
     const char *debug_ip = NULL;
     int debug_port = DEBUG_DEFAULT_PORT;
     int foreground = 0;
+    int token_ttl = AUTH_DEFAULT_TOKEN_TTL;
+    int auth_cache_ttl = 0;
+    int auth_workers = AUTH_DEFAULT_WORKERS;
+    int auth_queue = AUTH_DEFAULT_QUEUE;
+    int auth_per_ip = AUTH_DEFAULT_PER_IP;
+    int metrics_port = 0;
+    long cache_size = KVCACHE_DEFAULT_SIZE;
+    int cache_max_stale = KVCACHE_DEFAULT_STALE_MS;
+    char replica_host[256] = "";
+    const char *replica_port = NULL;
+    char replica_user[64] = "";
+    const char *replica_pass = "";
+    const char *router_nodes = NULL;
+    char router_user[64] = "";
+    const char *router_pass = "";
+    int router_vnodes = 0;
+    const char *upgrade_path = NULL;
+    int takeover = 0;
+    int drain_timeout = UPGRADE_DEFAULT_DRAIN;
+    admit_opts admit = { 0 };
+    upgrade_handoff handoff = { .conn = -1 };
+    struct upgrade_stats upgrade;
+    unsigned long long drain_start;
+    int net_started = 0;
+    sigset_t block, wait_mask;
+    struct sigaction sa;
+    int debug_cat;
+    unsigned int debug_n;
 
     static struct option long_opts[] = {
         {"debug-ip",   required_argument, NULL, 'd'},
         {"debug-port", required_argument, NULL, 'p'},
+        {"debug-sample", required_argument, NULL, OPT_DEBUG_SAMPLE},
+        {"debug-rate", required_argument, NULL, OPT_DEBUG_RATE},
+        {"token-ttl",  required_argument, NULL, 't'},
+        {"auth-cache-ttl", required_argument, NULL, 'c'},
+        {"port",       required_argument, NULL, OPT_PORT},
+        {"backup",     required_argument, NULL, OPT_BACKUP},
+        {"replica-of", required_argument, NULL, OPT_REPLICA_OF},
+        {"replica-auth", required_argument, NULL, OPT_REPLICA_AUTH},
+        {"router",     required_argument, NULL, OPT_ROUTER},
+        {"router-auth", required_argument, NULL, OPT_ROUTER_AUTH},
+        {"router-vnodes", required_argument, NULL, OPT_ROUTER_VNODES},
+        {"shards",     required_argument, NULL, OPT_SHARDS},
+        {"resp-port",  required_argument, NULL, OPT_RESP_PORT},
+        {"unix-socket", required_argument, NULL, OPT_UNIX_SOCKET},
+        {"unix-allow-uid", required_argument, NULL, OPT_UNIX_ALLOW_UID},
+        {"unix-allow-gid", required_argument, NULL, OPT_UNIX_ALLOW_GID},
+        {"metrics-port", required_argument, NULL, OPT_METRICS_PORT},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-max-stale", required_argument, NULL, OPT_CACHE_MAX_STALE},
+        {"auth-workers", required_argument, NULL, OPT_AUTH_WORKERS},
+        {"auth-queue", required_argument, NULL, OPT_AUTH_QUEUE},
+        {"auth-per-ip", required_argument, NULL, OPT_AUTH_PER_IP},
+        {"upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET},
+        {"takeover",   no_argument,       NULL, OPT_TAKEOVER},
+        {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+        {"max-inflight", required_argument, NULL, OPT_MAX_INFLIGHT},
+        {"conns-per-ip", required_argument, NULL, OPT_CONNS_PER_IP},
+        {"conns-per-user", required_argument, NULL, OPT_CONNS_PER_USER},
+        {"rate-per-ip", required_argument, NULL, OPT_RATE_PER_IP},
+        {"rate-per-user", required_argument, NULL, OPT_RATE_PER_USER},
+        {"rate-burst", required_argument, NULL, OPT_RATE_BURST},
         {"no-daemon",  no_argument,       NULL, 'n'},
         {"help",       no_argument,       NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "d:p:nh", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:p:t:c:nh", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'd':
                 debug_ip = optarg;
@@ -157,6 +382,114 @@ int main(int argc, char *argv[])
             case 'p':
                 debug_port = atoi(optarg);
                 break;
+            case OPT_DEBUG_SAMPLE:
+            case OPT_DEBUG_RATE:
+                if (parse_debug_setting(optarg, &debug_cat, &debug_n) < 0) {
+                    fprintf(stderr, "invalid --debug-%s value: %s\n",
+                            opt == OPT_DEBUG_SAMPLE ? "sample" : "rate", optarg);
+                    exit(1);
+                }
+                if (opt == OPT_DEBUG_SAMPLE)
+                    debug_set_sampling(debug_cat, debug_n);
+                else
+                    debug_set_rate_limit(debug_cat, debug_n);
+                break;
+            case 't':
+                token_ttl = atoi(optarg);
+                break;
+            case 'c':
+                auth_cache_ttl = atoi(optarg);
+                break;
+            case OPT_PORT:
+                net_opts.port = atoi(optarg);
+                break;
+            case OPT_BACKUP:
+                backup_path = optarg;
+                break;
+            case OPT_REPLICA_OF:
+                if (split_pair(optarg, replica_host, sizeof(replica_host), &replica_port) < 0) {
+                    fprintf(stderr, "invalid --replica-of value: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_REPLICA_AUTH:
+                if (split_pair(optarg, replica_user, sizeof(replica_user), &replica_pass) < 0) {
+                    fprintf(stderr, "invalid --replica-auth value: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_ROUTER:
+                router_nodes = optarg;
+                break;
+            case OPT_ROUTER_AUTH:
+                if (split_pair(optarg, router_user, sizeof(router_user), &router_pass) < 0) {
+                    fprintf(stderr, "invalid --router-auth value: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_ROUTER_VNODES:
+                router_vnodes = atoi(optarg);
+                break;
+            case OPT_SHARDS:
+                net_opts.shards = atoi(optarg);
+                break;
+            case OPT_RESP_PORT:
+                net_opts.resp_port = atoi(optarg);
+                break;
+            case OPT_UNIX_SOCKET:
+                net_opts.unix_path = optarg;
+                break;
+            case OPT_UNIX_ALLOW_UID:
+                net_opts.n_allow_uids = parse_id_list(optarg, net_opts.allow_uids, NET_MAX_ALLOW);
+                break;
+            case OPT_UNIX_ALLOW_GID:
+                net_opts.n_allow_gids = parse_id_list(optarg, net_opts.allow_gids, NET_MAX_ALLOW);
+                break;
+            case OPT_METRICS_PORT:
+                metrics_port = atoi(optarg);
+                break;
+            case OPT_CACHE_SIZE:
+                cache_size = atol(optarg);
+                break;
+            case OPT_CACHE_MAX_STALE:
+                cache_max_stale = atoi(optarg);
+                break;
+            case OPT_AUTH_WORKERS:
+                auth_workers = atoi(optarg);
+                break;
+            case OPT_AUTH_QUEUE:
+                auth_queue = atoi(optarg);
+                break;
+            case OPT_AUTH_PER_IP:
+                auth_per_ip = atoi(optarg);
+                break;
+            case OPT_UPGRADE_SOCKET:
+                upgrade_path = optarg;
+                break;
+            case OPT_TAKEOVER:
+                takeover = 1;
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                drain_timeout = atoi(optarg);
+                break;
+            case OPT_MAX_INFLIGHT:
+                admit.max_inflight = atoi(optarg);
+                break;
+            case OPT_CONNS_PER_IP:
+                admit.ip_conns = atoi(optarg);
+                break;
+            case OPT_CONNS_PER_USER:
+                admit.user_conns = atoi(optarg);
+                break;
+            case OPT_RATE_PER_IP:
+                admit.ip_rate = atof(optarg);
+                break;
+            case OPT_RATE_PER_USER:
+                admit.user_rate = atof(optarg);
+                break;
+            case OPT_RATE_BURST:
+                admit.burst = atoi(optarg);
+                break;
             case 'n':
                 foreground = 1;
                 break;
@@ -167,8 +500,45 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (takeover && !upgrade_path) {
+        fprintf(stderr, "--takeover needs --upgrade-socket\n");
+        exit(1);
+    }
+    if (router_nodes && replica_port) {
+        fprintf(stderr, "--router and --replica-of cannot be combined\n");
+        exit(1);
+    }
+    if (router_nodes) {
+        int ret = router_start(router_nodes, router_user, router_pass, router_vnodes);
+
+        if (ret < 0) {
+            fprintf(stderr, "invalid --router node list %s: %s\n", router_nodes, strerror(-ret));
+            exit(1);
+        }
+        /* Lookups go to the backends; the local feed says nothing about them */
+        cache_size = 0;
+    }
+
+    /*
+     * Block the signals the main loop waits for before any thread starts;
+     * threads inherit the mask, so only sigsuspend() below receives them.
+     */
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &wait_mask);
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    /* Foreground (-n) daemons get the kernel's save signal too */
+    if (sigaction(SIGUSR1, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0) {
+        perror("sigaction failed");
+        exit(1);
+    }
+
     if (!foreground)
         daemonize();
+    main_thread = pthread_self();
 
     /* Initialize debug message sender if configured */
     if (debug_ip) {
@@ -177,29 +547,104 @@ int main(int argc, char *argv[])
         }
     }
 
-    write_pid_to_proc();
-    restore_hashtable();
+    auth_init(token_ttl, auth_cache_ttl);
+    if (takeover) {
+        /* Before anything else binds: the ports are still the old daemon's */
+        if (upgrade_takeover(upgrade_path, &handoff) < 0) {
+            fprintf(stderr, "takeover through %s failed\n", upgrade_path);
+            exit(1);
+        }
+        net_server_inherit(handoff.fds, handoff.kinds, handoff.n);
+    }
+    admit_init(&admit);
+    if (auth_pool_start(auth_workers, auth_queue, auth_per_ip) != 0)
+        fprintf(stderr, "auth pool not started, authenticating inline\n");
+    if (router_nodes && router_pool_start(ROUTER_WORKERS, ROUTER_QUEUE_MAX) != 0)
+        fprintf(stderr, "router pool not started, calling backends inline\n");
+
+    if (upgrade_fd(&handoff, UPGRADE_FD_METRICS) >= 0) {
+        if (metrics_start_fd(upgrade_fd(&handoff, UPGRADE_FD_METRICS)) == 0)
+            debug_send("[DAEMON] metrics endpoint taken over");
+    } else if (metrics_port > 0 && metrics_start(metrics_port) == 0) {
+        debug_send("[DAEMON] metrics endpoint started");
+    }
+
+    /*
+     * A router has no local data, and a replica's is the primary's: the
+     * kernel's save signal belongs to the daemon that owns the store
+     */
+    if (!router_nodes && !replica_port)
+        write_pid_to_proc();
+    /*
+     * A replica takes its contents from the primary's snapshot, a router
+     * has none, and after a takeover the table is still in the kernel
+     */
+    if (!replica_port && !router_nodes && !takeover)
+        restore_hashtable();
+
+    /* Mutation feed from /proc/htevents drives watch subscriptions, replicas and the lookup cache */
+    kvfeed_add_listener(watch_on_event, NULL);
+    kvfeed_add_listener(repl_on_event, NULL);
+    if (cache_size > 0 && kvcache_init((size_t)cache_size, (unsigned int)cache_max_stale) != 0)
+        fprintf(stderr, "lookup cache disabled\n");
+    if (kvfeed_start() == 0)
+        debug_send("[DAEMON] mutation feed reader started");
+
+    if (replica_port) {
+        if (replica_start(replica_host, atoi(replica_port), replica_user, replica_pass) == 0)
+            debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] replicating from %s:%s", replica_host, replica_port);
+        else
+            fprintf(stderr, "replication from %s:%s not started\n", replica_host, replica_port);
+    }
 
     /* Start the tpc network server in a separate thread */
-    if (pthread_create(&net_thread, NULL, net_server_run, NULL) != 0) {
+    if (pthread_create(&net_thread, NULL, net_server_run, &net_opts) != 0) {
         perror("Failed to start network server thread");
     } else {
-        debug_send("[DAEMON] network server started on UDP port 5555");
+        net_started = net_server_wait_started() > 0;
+        debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] network server started on TCP port %d",
+                    net_opts.port ? net_opts.port : KVSTORE_PORT);
+    }
+
+    if (takeover) {
+        /* Without READY the old daemon keeps serving */
+        if (!net_started) {
+            fprintf(stderr, "takeover: network server did not start\n");
+            exit(1);
+        }
+        upgrade_ready(&handoff);
+        upgrade_get_stats(&upgrade);
+        debug_sendf(DEBUG_CAT_DAEMON,
+                    "[DAEMON] took over %d listeners and %d tokens from pid %d, serving after %llu ms",
+                    handoff.n, handoff.tokens, (int)handoff.pid, upgrade.takeover_ms);
     }
+    if (upgrade_path && net_started && upgrade_listen(upgrade_path, upgrade_handed_off) == 0)
+        debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] accepting upgrades on %s", upgrade_path);
 
     /* Main daemon loop: wait for signals */
-    while (1) {
-        pause(); /* wait for signal */
+    while (!stop_flag) {
+        sigsuspend(&wait_mask);
 
         if (save_flag) {
-            save_hashtable();
+            if (!router_nodes && !replica_port)
+                save_hashtable();
             save_flag = 0;
         }
     }
 
-    /* Cleanup (unreachable, but good practice) */
-    net_server_stop();
-    pthread_join(net_thread, NULL);
+    /* SIGTERM, or a new daemon took over: stop accepting and let clients finish */
+    upgrade_stop();
+    debug_send(handed_off ? "[DAEMON] handed over, draining connections"
+                          : "[DAEMON] stopping, draining connections");
+    drain_start = metrics_now_us();
+    net_server_drain(drain_timeout, handed_off);
+    if (net_started)
+        pthread_join(net_thread, NULL);
+    debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] drained in %llu ms",
+                (metrics_now_us() - drain_start) / 1000);
+    replica_stop();
+    router_stop();
+    kvfeed_stop();
     debug_cleanup();
 
     return 0;
@@ -12,6 +12,8 @@
 #include <pthread.h>
 #include <getopt.h>
 
+#define DAEMON_BACKUP_PATH "/var/tmp/hashtable_backup.txt"
+
 static volatile sig_atomic_t save_flag = 0;
 
 void handle_signal(int sig);
@@ -1,79 +1,328 @@
+#define _GNU_SOURCE
 #include "debug_net.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#define DEBUG_RING_MASK (DEBUG_RING_SLOTS - 1)
+
+/*
+ * Bounded MPSC ring (Vyukov-style sequence numbers). A slot whose seq
+ * equals the producer's ticket is free; seq == ticket + 1 marks it
+ * filled for the consumer, which hands it back with ticket + SLOTS.
+ * Producers only ever do one CAS on the tail and never wait.
+ */
+struct debug_slot {
+    unsigned long seq;
+    unsigned int len;
+    char msg[DEBUG_MSG_MAX];
+};
+
+struct debug_cat_state {
+    unsigned int sample_every;      /* keep 1 in n, 0/1 = all */
+    unsigned int rate_limit;        /* per second, 0 = unlimited */
+    unsigned long sample_count;
+    long window;                    /* second the window_count applies to */
+    unsigned int window_count;
+} __attribute__((aligned(64)));
+
+static struct debug_slot *ring;
+static unsigned long ring_tail __attribute__((aligned(64)));   /* producers */
+static unsigned long ring_head __attribute__((aligned(64)));   /* sender thread only */
+
+static struct debug_cat_state cats[DEBUG_CAT_COUNT];
+static const char *cat_names[DEBUG_CAT_COUNT] = { "daemon", "remote" };
+
+static struct debug_stats counters;
+
 static int debug_fd = -1;
-static struct sockaddr_in debug_target;
 static int debug_enabled = 0;
+static int debug_running = 0;
+static pthread_t debug_thread;
+
+/* The target is only read by the sender thread, once per datagram */
+static pthread_mutex_t target_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sockaddr_in debug_target;
+
+#define STAT_INC(field) __atomic_add_fetch(&counters.field, 1, __ATOMIC_RELAXED)
+
+static int parse_target(const char *remote_ip, int remote_port, struct sockaddr_in *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_port = htons(remote_port > 0 ? remote_port : DEBUG_DEFAULT_PORT);
+    return inet_pton(AF_INET, remote_ip, &out->sin_addr) > 0 ? 0 : -1;
+}
+
+static void debug_flush(const char *buf, size_t len, unsigned long msgs)
+{
+    struct sockaddr_in target;
+
+    pthread_mutex_lock(&target_lock);
+    target = debug_target;
+    pthread_mutex_unlock(&target_lock);
+
+    if (sendto(debug_fd, buf, len, 0, (struct sockaddr *)&target, sizeof(target)) < 0)
+        STAT_INC(send_errors);
+    __atomic_add_fetch(&counters.sent, msgs, __ATOMIC_RELAXED);
+    STAT_INC(datagrams);
+}
+
+/*
+ * Sender thread: drain the ring every DEBUG_FLUSH_MS, packing
+ * newline-separated messages into datagrams of up to DEBUG_DGRAM_MAX
+ * bytes. Exits once stopped and the ring is empty.
+ */
+static void *debug_sender(void *arg)
+{
+    char buf[DEBUG_DGRAM_MAX];
+    struct timespec delay = { 0, DEBUG_FLUSH_MS * 1000000L };
+
+    (void)arg;
+    for (;;) {
+        int running = __atomic_load_n(&debug_running, __ATOMIC_ACQUIRE);
+        unsigned long drained = 0, msgs = 0;
+        size_t off = 0;
+
+        for (;;) {
+            struct debug_slot *slot = &ring[ring_head & DEBUG_RING_MASK];
+            unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+            if (seq != ring_head + 1)
+                break;
+            if (off && off + 1 + slot->len > sizeof(buf)) {
+                debug_flush(buf, off, msgs);
+                off = 0;
+                msgs = 0;
+            }
+            if (off)
+                buf[off++] = '\n';
+            memcpy(buf + off, slot->msg, slot->len);
+            off += slot->len;
+            msgs++;
+            drained++;
+            __atomic_store_n(&slot->seq, ring_head + DEBUG_RING_SLOTS, __ATOMIC_RELEASE);
+            ring_head++;
+        }
+        if (off)
+            debug_flush(buf, off, msgs);
+
+        if (!running && drained == 0)
+            break;
+        /* Under heavy load keep draining; otherwise let messages accumulate */
+        if (drained < DEBUG_RING_SLOTS / 2)
+            nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
 
 int debug_init(const char *remote_ip, int remote_port)
 {
+    struct sockaddr_in target;
+
     if (!remote_ip || strlen(remote_ip) == 0)
         return -1;
+    if (debug_fd >= 0)
+        return debug_set_target(remote_ip, remote_port);
+
+    if (parse_target(remote_ip, remote_port, &target) < 0) {
+        fprintf(stderr, "debug_init: invalid remote_ip %s\n", remote_ip);
+        return -1;
+    }
+
+    ring = calloc(DEBUG_RING_SLOTS, sizeof(*ring));
+    if (!ring) {
+        perror("debug_init: calloc");
+        return -1;
+    }
+    for (unsigned long i = 0; i < DEBUG_RING_SLOTS; i++)
+        ring[i].seq = i;
+    ring_head = ring_tail = 0;
 
     debug_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (debug_fd < 0) {
         perror("debug_init: socket");
+        free(ring);
+        ring = NULL;
         return -1;
     }
 
-    memset(&debug_target, 0, sizeof(debug_target));
-    debug_target.sin_family = AF_INET;
-    debug_target.sin_port = htons(remote_port > 0 ? remote_port : DEBUG_DEFAULT_PORT);
+    pthread_mutex_lock(&target_lock);
+    debug_target = target;
+    pthread_mutex_unlock(&target_lock);
 
-    if (inet_pton(AF_INET, remote_ip, &debug_target.sin_addr) <= 0) {
-        perror("debug_init: invalid remote_ip");
+    debug_running = 1;
+    if (pthread_create(&debug_thread, NULL, debug_sender, NULL) != 0) {
+        perror("debug_init: pthread_create");
+        debug_running = 0;
         close(debug_fd);
         debug_fd = -1;
+        free(ring);
+        ring = NULL;
         return -1;
     }
 
-    debug_enabled = 1;
+    __atomic_store_n(&debug_enabled, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
-void debug_send(const char *msg)
+/* Sampling and rate limiting, checked before the message is formatted */
+static int debug_admit(int cat)
+{
+    struct debug_cat_state *st = &cats[cat];
+    unsigned int n = __atomic_load_n(&st->sample_every, __ATOMIC_RELAXED);
+    unsigned int limit = __atomic_load_n(&st->rate_limit, __ATOMIC_RELAXED);
+
+    if (n > 1 && __atomic_fetch_add(&st->sample_count, 1, __ATOMIC_RELAXED) % n != 0) {
+        STAT_INC(sampled_out);
+        return 0;
+    }
+    if (limit) {
+        struct timespec ts;
+        long window;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        window = __atomic_load_n(&st->window, __ATOMIC_RELAXED);
+        if (window != ts.tv_sec &&
+            __atomic_compare_exchange_n(&st->window, &window, ts.tv_sec, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            __atomic_store_n(&st->window_count, 0, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&st->window_count, 1, __ATOMIC_RELAXED) > limit) {
+            STAT_INC(rate_limited);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void debug_vsend(int cat, const char *fmt, va_list ap)
 {
-    if (!debug_enabled || debug_fd < 0 || !msg)
+    struct debug_slot *slot;
+    unsigned long pos;
+    int n;
+
+    if (!__atomic_load_n(&debug_enabled, __ATOMIC_ACQUIRE) || cat < 0 ||
+        cat >= DEBUG_CAT_COUNT || !debug_admit(cat))
         return;
 
-    sendto(debug_fd, msg, strlen(msg), 0,
-           (struct sockaddr *)&debug_target, sizeof(debug_target));
+    /* Claim a slot; a full ring drops the message instead of waiting */
+    pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        long diff;
+
+        slot = &ring[pos & DEBUG_RING_MASK];
+        diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            STAT_INC(dropped);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    n = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    if (n < 0)
+        n = 0;
+    slot->len = (unsigned int)n < sizeof(slot->msg) ? (unsigned int)n : sizeof(slot->msg) - 1;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    STAT_INC(queued);
+}
+
+void debug_sendf(int cat, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    debug_vsend(cat, fmt, ap);
+    va_end(ap);
+}
+
+void debug_send(const char *msg)
+{
+    if (msg)
+        debug_sendf(DEBUG_CAT_DAEMON, "%s", msg);
+}
+
+void debug_set_sampling(int cat, unsigned int n)
+{
+    if (cat >= 0 && cat < DEBUG_CAT_COUNT)
+        __atomic_store_n(&cats[cat].sample_every, n ? n : 1, __ATOMIC_RELAXED);
+}
+
+void debug_set_rate_limit(int cat, unsigned int per_sec)
+{
+    if (cat >= 0 && cat < DEBUG_CAT_COUNT)
+        __atomic_store_n(&cats[cat].rate_limit, per_sec, __ATOMIC_RELAXED);
+}
+
+int debug_category(const char *name)
+{
+    for (int i = 0; i < DEBUG_CAT_COUNT; i++) {
+        if (!strcmp(name, cat_names[i]))
+            return i;
+    }
+    return -1;
 }
 
 void debug_enable(int enable)
 {
-    debug_enabled = enable;
+    /* Only meaningful once the ring and sender exist */
+    __atomic_store_n(&debug_enabled, enable && debug_fd >= 0, __ATOMIC_RELEASE);
 }
 
 int debug_set_target(const char *remote_ip, int remote_port)
 {
+    struct sockaddr_in target;
+
     if (!remote_ip || strlen(remote_ip) == 0)
         return -1;
 
-    memset(&debug_target, 0, sizeof(debug_target));
-    debug_target.sin_family = AF_INET;
-    debug_target.sin_port = htons(remote_port > 0 ? remote_port : DEBUG_DEFAULT_PORT);
-
-    if (inet_pton(AF_INET, remote_ip, &debug_target.sin_addr) <= 0) {
-        perror("debug_set_target: invalid remote_ip");
+    if (parse_target(remote_ip, remote_port, &target) < 0) {
+        fprintf(stderr, "debug_set_target: invalid remote_ip %s\n", remote_ip);
         return -1;
     }
 
+    pthread_mutex_lock(&target_lock);
+    debug_target = target;
+    pthread_mutex_unlock(&target_lock);
     return 0;
 }
 
+void debug_get_stats(struct debug_stats *st)
+{
+    st->queued = __atomic_load_n(&counters.queued, __ATOMIC_RELAXED);
+    st->sent = __atomic_load_n(&counters.sent, __ATOMIC_RELAXED);
+    st->datagrams = __atomic_load_n(&counters.datagrams, __ATOMIC_RELAXED);
+    st->dropped = __atomic_load_n(&counters.dropped, __ATOMIC_RELAXED);
+    st->sampled_out = __atomic_load_n(&counters.sampled_out, __ATOMIC_RELAXED);
+    st->rate_limited = __atomic_load_n(&counters.rate_limited, __ATOMIC_RELAXED);
+    st->send_errors = __atomic_load_n(&counters.send_errors, __ATOMIC_RELAXED);
+}
+
 void debug_cleanup(void)
 {
-    debug_enabled = 0;
-    if (debug_fd >= 0) {
-        close(debug_fd);
-        debug_fd = -1;
-    }
+    __atomic_store_n(&debug_enabled, 0, __ATOMIC_RELEASE);
+    if (debug_fd < 0)
+        return;
+
+    /* The sender drains what is already queued before exiting */
+    __atomic_store_n(&debug_running, 0, __ATOMIC_RELEASE);
+    pthread_join(debug_thread, NULL);
+
+    close(debug_fd);
+    debug_fd = -1;
+    free(ring);
+    ring = NULL;
 }
@@ -2,9 +2,30 @@
 #define DEBUG_NET_H
 
 #define DEBUG_DEFAULT_PORT 6666
+#define DEBUG_MSG_MAX 256           /* longer messages are truncated */
+#define DEBUG_RING_SLOTS 4096       /* power of two */
+#define DEBUG_DGRAM_MAX 1400        /* pack messages up to one MTU-sized datagram */
+#define DEBUG_FLUSH_MS 20           /* sender wakes up at least this often */
+
+/* Message categories; sampling and rate limits are set per category */
+enum {
+    DEBUG_CAT_DAEMON,               /* lifecycle, backup/restore */
+    DEBUG_CAT_REMOTE,               /* per-request messages from the network server */
+    DEBUG_CAT_COUNT,
+};
+
+struct debug_stats {
+    unsigned long queued;           /* accepted into the ring */
+    unsigned long sent;             /* messages handed to sendto() */
+    unsigned long datagrams;
+    unsigned long dropped;          /* ring full */
+    unsigned long sampled_out;
+    unsigned long rate_limited;
+    unsigned long send_errors;
+};
 
 /**
- * Initialize the debug message sender.
+ * Initialize the debug message sender and start its background thread.
  * @param remote_ip  IP address of the remote machine to send debug messages to.
  * @param remote_port  UDP port on the remote machine (0 = use default 6666).
  * @return 0 on success, -1 on error.
@@ -12,11 +33,36 @@
 int debug_init(const char *remote_ip, int remote_port);
 
 /**
- * Send a debug message to the configured remote target.
+ * Queue a DEBUG_CAT_DAEMON message for the remote target.
  * Does nothing if debug is not enabled/initialized.
  */
 void debug_send(const char *msg);
 
+/**
+ * Format and queue a message. Never blocks: the message goes into a
+ * lock-free ring and is sent by the background thread, batched with
+ * others into one datagram. Sampled-out and rate-limited messages are
+ * dropped before formatting, and a full ring drops the message; all of
+ * these are counted.
+ */
+void debug_sendf(int cat, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Keep one in every n messages of a category (1 = all, the default).
+ */
+void debug_set_sampling(int cat, unsigned int n);
+
+/**
+ * Allow at most per_sec messages per second in a category (0 = unlimited).
+ */
+void debug_set_rate_limit(int cat, unsigned int per_sec);
+
+/**
+ * Parse a category name ("daemon", "remote").
+ * @return the category, or -1 if unknown.
+ */
+int debug_category(const char *name);
+
 /**
  * Enable or disable debug message sending at runtime.
  */
@@ -24,13 +70,20 @@ void debug_enable(int enable);
 
 /**
  * Reconfigure the debug target at runtime (no recompile needed).
+ * Safe to call while other threads are sending.
  * @param remote_ip  New remote IP address.
  * @param remote_port  New remote UDP port.
  */
 int debug_set_target(const char *remote_ip, int remote_port);
 
 /**
- * Clean up and close the debug socket.
+ * Snapshot the sender's counters.
+ */
+void debug_get_stats(struct debug_stats *st);
+
+/**
+ * Flush queued messages, stop the sender thread and close the socket.
+ * Call once the threads that send messages have stopped.
  */
 void debug_cleanup(void);
 
@@ -0,0 +1,89 @@
+#include "hashring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+uint64_t hashring_hash(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    /* murmur3 fmix64 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    const struct hashring_point *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    /* Tie-break on the node so every router builds the same ring */
+    return x->node - y->node;
+}
+
+int hashring_build(struct hashring *ring, const char *const *nodes, int n, int vnodes)
+{
+    char name[320];
+    int i, v, k = 0;
+
+    ring->points = NULL;
+    ring->n_points = ring->n_nodes = 0;
+    if (n < 0 || vnodes <= 0 || vnodes > HASHRING_MAX_VNODES)
+        return -EINVAL;
+    if (n == 0)
+        return 0;
+
+    ring->points = malloc((size_t)n * (size_t)vnodes * sizeof(*ring->points));
+    if (!ring->points)
+        return -ENOMEM;
+    for (i = 0; i < n; i++) {
+        for (v = 0; v < vnodes; v++) {
+            snprintf(name, sizeof(name), "%s#%d", nodes[i], v);
+            ring->points[k].hash = hashring_hash(name);
+            ring->points[k].node = i;
+            k++;
+        }
+    }
+    qsort(ring->points, (size_t)k, sizeof(*ring->points), point_cmp);
+    ring->n_points = k;
+    ring->n_nodes = n;
+    return 0;
+}
+
+void hashring_free(struct hashring *ring)
+{
+    free(ring->points);
+    ring->points = NULL;
+    ring->n_points = ring->n_nodes = 0;
+}
+
+int hashring_lookup(const struct hashring *ring, const char *key)
+{
+    uint64_t h;
+    int lo = 0, hi;
+
+    if (ring->n_points == 0)
+        return -1;
+    h = hashring_hash(key);
+    hi = ring->n_points;
+    /* First point with hash >= h; past the end wraps to point 0 */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ring->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring->points[lo == ring->n_points ? 0 : lo].node;
+}
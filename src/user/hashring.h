@@ -0,0 +1,52 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stdint.h>
+
+/*
+ * Consistent-hash ring. Each node is placed at `vnodes` points on a
+ * 64-bit circle (hashes of "<name>#<i>"), and a key belongs to the node
+ * owning the first point at or after the key's hash. Adding a node only
+ * takes over the arcs just before its own points, so about 1/(N+1) of
+ * the keys move, all of them to the new node.
+ */
+
+#define HASHRING_DEFAULT_VNODES 160
+#define HASHRING_MAX_VNODES 1024
+
+struct hashring_point {
+    uint64_t hash;
+    int node;
+};
+
+struct hashring {
+    struct hashring_point *points;  /* sorted by hash */
+    int n_points;
+    int n_nodes;
+};
+
+/**
+ * Build a ring for nodes[0..n-1]; node i is returned as index i. Node
+ * names must be unique and stable (e.g. "host:port"): the same names
+ * always give the same ring.
+ * @return 0 on success, -EINVAL or -ENOMEM.
+ */
+int hashring_build(struct hashring *ring, const char *const *nodes, int n, int vnodes);
+
+/**
+ * Free the points of a ring built by hashring_build().
+ */
+void hashring_free(struct hashring *ring);
+
+/**
+ * @return the node index owning key, or -1 for an empty ring.
+ */
+int hashring_lookup(const struct hashring *ring, const char *key);
+
+/**
+ * 64-bit FNV-1a with a final avalanche step, so keys that differ only
+ * in their last byte still land far apart on the ring.
+ */
+uint64_t hashring_hash(const char *s);
+
+#endif /* HASHRING_H */
@@ -0,0 +1,334 @@
+#include "kvcache.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define KVCACHE_NONE (-1)
+
+struct kvcache_entry {
+    uint64_t hash;
+    int next;                       /* bucket chain, or free list */
+    int in_use;
+    unsigned char ref;              /* CLOCK bit, set on every hit */
+    unsigned char present;          /* 0 = cached "not found" */
+    char key[KV_MAX_KEY + 1];
+    char value[KV_MAX_VALUE + 1];
+};
+
+/*
+ * One shard: a chained hash table over a fixed entry array, evicting with
+ * CLOCK. Lookups take the read lock only; gen counts mutations so that a
+ * fill racing one is dropped.
+ */
+struct kvcache_shard {
+    pthread_rwlock_t lock;
+    unsigned long gen;
+    struct kvcache_entry *entries;
+    int *buckets;
+    unsigned int mask;              /* buckets - 1 */
+    int capacity;
+    int used;                       /* entries ever handed out */
+    int live;
+    int free_list;
+    int hand;
+    struct kvcache_stats stats;     /* entries/capacity unused here */
+} __attribute__((aligned(64)));
+
+static struct kvcache_shard shards[KVCACHE_SHARDS];
+static int cache_enabled;
+static unsigned long long max_stale_us;
+
+#define STAT_INC(sh, field) __atomic_add_fetch(&(sh)->stats.field, 1, __ATOMIC_RELAXED)
+
+/* FNV-1a, as in the kernel module */
+static uint64_t kvcache_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037UL;
+
+    for (const char *p = key; *p; p++) {
+        hash ^= (uint64_t)(unsigned char)*p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * The low bits pick the shard and the bits above them the bucket. FNV-1a
+ * mixes the last byte of a key into the high bits only weakly.
+ */
+#define KVCACHE_SHARD_BITS 4        /* log2(KVCACHE_SHARDS) */
+
+static struct kvcache_shard *shard_of(uint64_t hash)
+{
+    return &shards[hash & (KVCACHE_SHARDS - 1)];
+}
+
+static unsigned int bucket_of(const struct kvcache_shard *sh, uint64_t hash)
+{
+    return (unsigned int)(hash >> KVCACHE_SHARD_BITS) & sh->mask;
+}
+
+static int kvcache_fresh(void)
+{
+    unsigned long long synced = kvfeed_synced_us();
+
+    return synced && metrics_now_us() - synced <= max_stale_us;
+}
+
+/* Caller holds the shard lock */
+static int shard_find(struct kvcache_shard *sh, uint64_t hash, const char *key)
+{
+    int i;
+
+    for (i = sh->buckets[bucket_of(sh, hash)]; i != KVCACHE_NONE; i = sh->entries[i].next) {
+        if (sh->entries[i].hash == hash && !strcmp(sh->entries[i].key, key))
+            return i;
+    }
+    return KVCACHE_NONE;
+}
+
+/* Caller holds the write lock */
+static void shard_remove(struct kvcache_shard *sh, int idx)
+{
+    struct kvcache_entry *e = &sh->entries[idx];
+    int *pp = &sh->buckets[bucket_of(sh, e->hash)];
+
+    while (*pp != idx)
+        pp = &sh->entries[*pp].next;
+    *pp = e->next;
+    e->in_use = 0;
+    e->next = sh->free_list;
+    sh->free_list = idx;
+    sh->live--;
+}
+
+/* Caller holds the write lock: a free slot, evicting with CLOCK if full */
+static int shard_alloc(struct kvcache_shard *sh)
+{
+    int idx;
+
+    if (sh->free_list != KVCACHE_NONE) {
+        idx = sh->free_list;
+        sh->free_list = sh->entries[idx].next;
+        return idx;
+    }
+    if (sh->used < sh->capacity)
+        return sh->used++;
+
+    for (;;) {
+        struct kvcache_entry *e = &sh->entries[sh->hand];
+
+        idx = sh->hand;
+        sh->hand = (sh->hand + 1) % sh->capacity;
+        if (!e->in_use)
+            continue;
+        if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        shard_remove(sh, idx);
+        STAT_INC(sh, evictions);
+        /* shard_remove() pushed it on the free list */
+        sh->free_list = sh->entries[idx].next;
+        return idx;
+    }
+}
+
+static void shard_store(struct kvcache_entry *e, const char *value)
+{
+    e->present = value != NULL;
+    snprintf(e->value, sizeof(e->value), "%s", value ? value : "");
+}
+
+int kvcache_get(const char *key, char *value, size_t vlen, unsigned long *gen)
+{
+    uint64_t hash = kvcache_hash(key);
+    struct kvcache_shard *sh = shard_of(hash);
+    int idx, ret;
+
+    if (!cache_enabled)
+        return KVCACHE_BYPASS;
+    if (!kvcache_fresh()) {
+        STAT_INC(sh, bypassed);
+        return KVCACHE_BYPASS;
+    }
+
+    pthread_rwlock_rdlock(&sh->lock);
+    idx = shard_find(sh, hash, key);
+    if (idx == KVCACHE_NONE) {
+        *gen = sh->gen;
+        pthread_rwlock_unlock(&sh->lock);
+        STAT_INC(sh, misses);
+        return KVCACHE_MISS;
+    }
+    __atomic_store_n(&sh->entries[idx].ref, 1, __ATOMIC_RELAXED);
+    if (sh->entries[idx].present) {
+        snprintf(value, vlen, "%s", sh->entries[idx].value);
+        ret = KVCACHE_HIT;
+    } else {
+        ret = KVCACHE_HIT_ABSENT;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    STAT_INC(sh, hits);
+    return ret;
+}
+
+void kvcache_fill(const char *key, const char *value, unsigned long gen)
+{
+    uint64_t hash = kvcache_hash(key);
+    struct kvcache_shard *sh = shard_of(hash);
+    struct kvcache_entry *e;
+    int idx;
+
+    if (!cache_enabled)
+        return;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    if (sh->gen != gen || !kvcache_fresh()) {
+        pthread_rwlock_unlock(&sh->lock);
+        STAT_INC(sh, fill_races);
+        return;
+    }
+    idx = shard_find(sh, hash, key);
+    if (idx == KVCACHE_NONE) {
+        idx = shard_alloc(sh);
+        e = &sh->entries[idx];
+        e->hash = hash;
+        snprintf(e->key, sizeof(e->key), "%s", key);
+        e->in_use = 1;
+        e->next = sh->buckets[bucket_of(sh, hash)];
+        sh->buckets[bucket_of(sh, hash)] = idx;
+        sh->live++;
+    }
+    e = &sh->entries[idx];
+    e->ref = 1;
+    shard_store(e, value);
+    pthread_rwlock_unlock(&sh->lock);
+    STAT_INC(sh, fills);
+}
+
+void kvcache_invalidate(const char *key)
+{
+    uint64_t hash = kvcache_hash(key);
+    struct kvcache_shard *sh = shard_of(hash);
+    int idx;
+
+    if (!cache_enabled)
+        return;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    sh->gen++;
+    idx = shard_find(sh, hash, key);
+    if (idx != KVCACHE_NONE) {
+        shard_remove(sh, idx);
+        STAT_INC(sh, invalidations);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+}
+
+static void kvcache_clear(void)
+{
+    int s;
+
+    for (s = 0; s < KVCACHE_SHARDS; s++) {
+        struct kvcache_shard *sh = &shards[s];
+
+        pthread_rwlock_wrlock(&sh->lock);
+        sh->gen++;
+        memset(sh->buckets, 0xff, (sh->mask + 1) * sizeof(int));
+        sh->used = sh->live = sh->hand = 0;
+        sh->free_list = KVCACHE_NONE;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+}
+
+/*
+ * Feed listener. Cached keys take the new value (or "not found") from the
+ * event itself; keys that are not cached are left alone.
+ */
+static void kvcache_on_event(const struct kv_event *ev, void *arg)
+{
+    uint64_t hash;
+    struct kvcache_shard *sh;
+    int idx;
+
+    (void)arg;
+    if (ev->op == KV_EVENT_LOST) {
+        kvcache_clear();
+        return;
+    }
+
+    hash = kvcache_hash(ev->key);
+    sh = shard_of(hash);
+    pthread_rwlock_wrlock(&sh->lock);
+    sh->gen++;
+    idx = shard_find(sh, hash, ev->key);
+    if (idx != KVCACHE_NONE) {
+        shard_store(&sh->entries[idx], ev->op == KV_EVENT_INSERT ? ev->value : NULL);
+        STAT_INC(sh, updates);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+}
+
+int kvcache_init(size_t entries, unsigned int max_stale_ms)
+{
+    size_t per_shard;
+    unsigned int nbuckets;
+    int s;
+
+    if (entries == 0)
+        return 0;
+
+    per_shard = (entries + KVCACHE_SHARDS - 1) / KVCACHE_SHARDS;
+    for (nbuckets = 1; nbuckets < per_shard * 2; nbuckets <<= 1)
+        ;
+
+    for (s = 0; s < KVCACHE_SHARDS; s++) {
+        struct kvcache_shard *sh = &shards[s];
+
+        pthread_rwlock_init(&sh->lock, NULL);
+        sh->entries = calloc(per_shard, sizeof(*sh->entries));
+        sh->buckets = malloc(nbuckets * sizeof(int));
+        if (!sh->entries || !sh->buckets) {
+            perror("kvcache_init: calloc");
+            return -1;
+        }
+        memset(sh->buckets, 0xff, nbuckets * sizeof(int));
+        sh->mask = nbuckets - 1;
+        sh->capacity = (int)per_shard;
+        sh->free_list = KVCACHE_NONE;
+    }
+
+    max_stale_us = (unsigned long long)max_stale_ms * 1000;
+    /* Wake the idle feed often enough that the bound does not expire on its own */
+    kvfeed_set_sync_interval(max_stale_ms / 2);
+    if (kvfeed_add_listener(kvcache_on_event, NULL) < 0)
+        return -1;
+    cache_enabled = 1;
+    return 0;
+}
+
+void kvcache_get_stats(struct kvcache_stats *st)
+{
+    int s;
+
+    memset(st, 0, sizeof(*st));
+    for (s = 0; s < KVCACHE_SHARDS; s++) {
+        struct kvcache_shard *sh = &shards[s];
+
+        st->hits += __atomic_load_n(&sh->stats.hits, __ATOMIC_RELAXED);
+        st->misses += __atomic_load_n(&sh->stats.misses, __ATOMIC_RELAXED);
+        st->bypassed += __atomic_load_n(&sh->stats.bypassed, __ATOMIC_RELAXED);
+        st->fills += __atomic_load_n(&sh->stats.fills, __ATOMIC_RELAXED);
+        st->fill_races += __atomic_load_n(&sh->stats.fill_races, __ATOMIC_RELAXED);
+        st->updates += __atomic_load_n(&sh->stats.updates, __ATOMIC_RELAXED);
+        st->invalidations += __atomic_load_n(&sh->stats.invalidations, __ATOMIC_RELAXED);
+        st->evictions += __atomic_load_n(&sh->stats.evictions, __ATOMIC_RELAXED);
+        st->entries += (unsigned long)__atomic_load_n(&sh->live, __ATOMIC_RELAXED);
+        st->capacity += (unsigned long)sh->capacity;
+    }
+}
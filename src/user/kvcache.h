@@ -0,0 +1,63 @@
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <stddef.h>
+#include "kvfeed.h"
+
+#define KVCACHE_SHARDS 16           /* power of two */
+#define KVCACHE_DEFAULT_SIZE 4096   /* entries over all shards; 0 disables the cache */
+#define KVCACHE_DEFAULT_STALE_MS 100
+
+/* kvcache_get() results */
+enum {
+    KVCACHE_MISS,                   /* not cached: read the kernel, then kvcache_fill() */
+    KVCACHE_HIT,                    /* value copied out */
+    KVCACHE_HIT_ABSENT,             /* cached as not present */
+    KVCACHE_BYPASS,                 /* disabled, or the feed is behind: don't fill */
+};
+
+struct kvcache_stats {
+    unsigned long hits;             /* including cached "not found" */
+    unsigned long misses;
+    unsigned long bypassed;         /* feed not known to be in sync */
+    unsigned long fills;
+    unsigned long fill_races;       /* fill dropped: a mutation raced the kernel read */
+    unsigned long updates;          /* entries refreshed from the feed */
+    unsigned long invalidations;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long capacity;
+};
+
+/**
+ * Size the cache and set the staleness bound. Cached entries are only
+ * served while the mutation feed has been seen drained within the last
+ * max_stale_ms, so a read never misses a kernel write older than that.
+ * Registers the cache as a kvfeed listener; call before kvfeed_start().
+ * @param entries  0 disables the cache.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int kvcache_init(size_t entries, unsigned int max_stale_ms);
+
+/**
+ * Look a key up without touching the kernel.
+ * @param gen  On KVCACHE_MISS, receives the token for kvcache_fill().
+ * @return one of KVCACHE_*.
+ */
+int kvcache_get(const char *key, char *value, size_t vlen, unsigned long *gen);
+
+/**
+ * Cache the result of a kernel read that followed a KVCACHE_MISS.
+ * Dropped if the key's shard saw a mutation since kvcache_get().
+ * @param value  NULL when the key was not found.
+ */
+void kvcache_fill(const char *key, const char *value, unsigned long gen);
+
+/**
+ * Forget a key, e.g. after this daemon wrote it.
+ */
+void kvcache_invalidate(const char *key);
+
+void kvcache_get_stats(struct kvcache_stats *st);
+
+#endif /* KVCACHE_H */
@@ -0,0 +1,177 @@
+#include "kvfeed.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static struct {
+    kvfeed_fn fn;
+    void *arg;
+} listeners[KVFEED_MAX_LISTENERS];
+static int n_listeners;
+
+static struct kvfeed_stats counters;
+static unsigned long long synced_us;
+static unsigned int sync_ms = KVFEED_SYNC_MS;
+static int feed_running;
+static pthread_t feed_thread;
+
+int kvfeed_add_listener(kvfeed_fn fn, void *arg)
+{
+    if (n_listeners >= KVFEED_MAX_LISTENERS)
+        return -1;
+    listeners[n_listeners].fn = fn;
+    listeners[n_listeners].arg = arg;
+    n_listeners++;
+    return 0;
+}
+
+static void kvfeed_deliver(const struct kv_event *ev)
+{
+    int i;
+
+    if (ev->op == KV_EVENT_LOST)
+        __atomic_add_fetch(&counters.lost, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&counters.events, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters.last_seq, ev->seq, __ATOMIC_RELAXED);
+
+    for (i = 0; i < n_listeners; i++)
+        listeners[i].fn(ev, listeners[i].arg);
+}
+
+/* Parse "<seq> insert k v", "<seq> delete k" or "<seq> lost n" */
+static int kvfeed_parse(const char *line, struct kv_event *ev)
+{
+    char op[16];
+    int n;
+
+    ev->key[0] = '\0';
+    ev->value[0] = '\0';
+    n = sscanf(line, "%llu %15s %63s %63s", &ev->seq, op, ev->key, ev->value);
+    if (n >= 4 && !strcmp(op, "insert"))
+        ev->op = KV_EVENT_INSERT;
+    else if (n >= 3 && !strcmp(op, "delete"))
+        ev->op = KV_EVENT_DELETE;
+    else if (n >= 2 && !strcmp(op, "lost"))
+        ev->op = KV_EVENT_LOST;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Feed thread. The kernel only returns whole lines, so every read is
+ * parsed on its own. The fd is non-blocking: a read that finds nothing
+ * proves every mutation before it was delivered, which is what
+ * kvfeed_synced_us() reports. The poll() timeout keeps that fresh while
+ * idle and lets kvfeed_stop() finish.
+ */
+static void *kvfeed_run(void *arg)
+{
+    char buf[KVFEED_BUF_SIZE + 1];
+    int opened_before = 0;
+    int fd = -1;
+
+    (void)arg;
+    while (__atomic_load_n(&feed_running, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd;
+        struct kv_event ev;
+        unsigned long long now;
+        char *line, *nl;
+        ssize_t n;
+
+        if (fd < 0) {
+            fd = open(KVFEED_PATH, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) {
+                usleep(KVFEED_RETRY_MS * 1000);
+                continue;
+            }
+            __atomic_store_n(&counters.connected, 1, __ATOMIC_RELAXED);
+            if (opened_before) {
+                memset(&ev, 0, sizeof(ev));
+                ev.op = KV_EVENT_LOST;
+                kvfeed_deliver(&ev);
+            }
+            opened_before = 1;
+        }
+
+        now = metrics_now_us();
+        n = read(fd, buf, KVFEED_BUF_SIZE);
+        if (n < 0 && errno == EAGAIN) {
+            __atomic_store_n(&synced_us, now, __ATOMIC_RELEASE);
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, (int)sync_ms);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* Module unloaded under us: reopen once it is back */
+            close(fd);
+            fd = -1;
+            __atomic_store_n(&synced_us, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&counters.connected, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        buf[n] = '\0';
+
+        for (line = buf; *line; line = nl + 1) {
+            nl = strchr(line, '\n');
+            if (!nl)
+                break;
+            *nl = '\0';
+            if (kvfeed_parse(line, &ev) == 0)
+                kvfeed_deliver(&ev);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    __atomic_store_n(&synced_us, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&counters.connected, 0, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int kvfeed_start(void)
+{
+    __atomic_store_n(&feed_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&feed_thread, NULL, kvfeed_run, NULL) != 0) {
+        perror("kvfeed: pthread_create");
+        feed_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void kvfeed_stop(void)
+{
+    if (!__atomic_load_n(&feed_running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&feed_running, 0, __ATOMIC_RELEASE);
+    pthread_join(feed_thread, NULL);
+}
+
+void kvfeed_set_sync_interval(unsigned int ms)
+{
+    sync_ms = ms ? ms : 1;
+}
+
+unsigned long long kvfeed_synced_us(void)
+{
+    return __atomic_load_n(&synced_us, __ATOMIC_ACQUIRE);
+}
+
+void kvfeed_get_stats(struct kvfeed_stats *st)
+{
+    st->events = __atomic_load_n(&counters.events, __ATOMIC_RELAXED);
+    st->lost = __atomic_load_n(&counters.lost, __ATOMIC_RELAXED);
+    st->last_seq = __atomic_load_n(&counters.last_seq, __ATOMIC_RELAXED);
+    st->connected = __atomic_load_n(&counters.connected, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+#ifndef KVFEED_H
+#define KVFEED_H
+
+#include "kvproc.h"
+
+#define KVFEED_PATH "/proc/htevents"
+#define KVFEED_MAX_LISTENERS 4
+#define KVFEED_BUF_SIZE 8192        /* one read() of whole event lines */
+#define KVFEED_RETRY_MS 1000        /* reopen delay while the module is missing */
+#define KVFEED_SYNC_MS 1000         /* default: confirm the feed is drained this often */
+
+/* Mutations reported by the kernel module, see src/kernel/kvevents.h */
+enum {
+    KV_EVENT_INSERT,
+    KV_EVENT_DELETE,
+    KV_EVENT_LOST,                  /* events were missed; cached state may be stale */
+};
+
+struct kv_event {
+    unsigned long long seq;
+    int op;
+    char key[KV_MAX_KEY + 1];
+    char value[KV_MAX_VALUE + 1];   /* "" unless op is KV_EVENT_INSERT */
+};
+
+struct kvfeed_stats {
+    unsigned long events;           /* inserts and deletes delivered */
+    unsigned long lost;             /* KV_EVENT_LOST deliveries */
+    unsigned long long last_seq;
+    int connected;                  /* 1 while /proc/htevents is open */
+};
+
+/**
+ * Called on the feed thread for every event, in sequence order. Must not
+ * block: hand work to other threads instead.
+ */
+typedef void (*kvfeed_fn)(const struct kv_event *ev, void *arg);
+
+/**
+ * Register a listener. Call before kvfeed_start().
+ * @return 0 on success, -1 if KVFEED_MAX_LISTENERS are registered.
+ */
+int kvfeed_add_listener(kvfeed_fn fn, void *arg);
+
+/**
+ * Start the feed thread. It keeps /proc/htevents open, reopening it if
+ * the module is reloaded; listeners get KV_EVENT_LOST after a reopen
+ * because mutations in between were not seen.
+ * @return 0 on success, -1 on error.
+ */
+int kvfeed_start(void);
+
+/**
+ * Stop the feed thread and close /proc/htevents.
+ */
+void kvfeed_stop(void);
+
+/**
+ * How often an idle feed thread re-checks /proc/htevents, which bounds
+ * how old kvfeed_synced_us() gets while nothing changes. Call before
+ * kvfeed_start().
+ */
+void kvfeed_set_sync_interval(unsigned int ms);
+
+/**
+ * Time (metrics_now_us() clock) at which the feed was last seen fully
+ * drained, with every earlier mutation delivered to the listeners.
+ * 0 while /proc/htevents is not open.
+ */
+unsigned long long kvfeed_synced_us(void);
+
+void kvfeed_get_stats(struct kvfeed_stats *st);
+
+#endif /* KVFEED_H */
@@ -0,0 +1,468 @@
+#include "kvproc.h"
+#include "metrics.h"
+#include "kvcache.h"
+#include "router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int read_only;
+
+/*
+ * Read the whole /proc/hashtable dump into buf, timing the read.
+ * @return bytes read (0 if empty), or a negative errno.
+ */
+static ssize_t read_dump(char *buf, size_t len)
+{
+    unsigned long long start = metrics_now_us();
+    ssize_t n;
+    int fd;
+
+    fd = open("/proc/hashtable", O_RDONLY);
+    if (fd < 0) {
+        metrics_inc(METRIC_PROC_ERRORS);
+        return errno == ENOENT ? -ENODEV : -errno; /* module not loaded != key missing */
+    }
+    n = read(fd, buf, len - 1);
+    close(fd);
+    metrics_observe(METRIC_PROC_READ, metrics_now_us() - start);
+    if (n < 0)
+        n = 0;
+    buf[n] = '\0';
+    return n;
+}
+
+int kv_lookup(const char *key, char *value, size_t vlen)
+{
+    char buf[4096];
+    char *line;
+    unsigned long gen = 0;
+    ssize_t n;
+    int cached;
+
+    if (router_active())
+        return router_lookup(key, value, vlen);
+    cached = kvcache_get(key, value, vlen, &gen);
+    if (cached == KVCACHE_HIT)
+        return 0;
+    if (cached == KVCACHE_HIT_ABSENT)
+        return -ENOENT;
+
+    /* Search /proc/hashtable directly instead of going through /proc/ht */
+    n = read_dump(buf, sizeof(buf));
+    if (n < 0)
+        return (int)n;
+
+    /* Parse lines "key value\n" to find our key */
+    line = n > 0 ? buf : NULL;
+    while (line && *line) {
+        char k[64], v[64];
+        char *nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        if (sscanf(line, "%63s %63s", k, v) == 2 && strcmp(k, key) == 0) {
+            if (cached == KVCACHE_MISS)
+                kvcache_fill(key, v, gen);
+            snprintf(value, vlen, "%s", v);
+            return 0;
+        }
+        line = nl ? nl + 1 : NULL;
+    }
+    if (cached == KVCACHE_MISS)
+        kvcache_fill(key, NULL, gen);
+    return -ENOENT;
+}
+
+int kv_mlookup(const char **keys, int n, char (*values)[KV_MAX_VALUE + 1], int *found)
+{
+    char buf[4096];
+    char *line;
+    unsigned long gen[n];
+    int cached[n];
+    int need = 0;
+    ssize_t len;
+    int i;
+
+    if (router_active())
+        return router_mlookup(keys, n, values, found);
+
+    for (i = 0; i < n; i++) {
+        found[i] = 0;
+        values[i][0] = '\0';
+        cached[i] = kvcache_get(keys[i], values[i], KV_MAX_VALUE + 1, &gen[i]);
+        if (cached[i] == KVCACHE_HIT)
+            found[i] = 1;
+        else if (cached[i] != KVCACHE_HIT_ABSENT)
+            need++;
+    }
+    /* Every key answered from the cache: no kernel read at all */
+    if (need == 0)
+        return 0;
+
+    len = read_dump(buf, sizeof(buf));
+    if (len < 0)
+        return (int)len;
+
+    line = buf;
+    while (line && *line) {
+        char k[64], v[64];
+        char *nl = strchr(line, '\n');
+        if (nl) *nl = '\0';
+        if (sscanf(line, "%63s %63s", k, v) == 2) {
+            for (i = 0; i < n; i++) {
+                if (!found[i] && cached[i] != KVCACHE_HIT_ABSENT && strcmp(k, keys[i]) == 0) {
+                    snprintf(values[i], KV_MAX_VALUE + 1, "%s", v);
+                    found[i] = 1;
+                }
+            }
+        }
+        line = nl ? nl + 1 : NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (cached[i] == KVCACHE_MISS)
+            kvcache_fill(keys[i], found[i] ? values[i] : NULL, gen[i]);
+    }
+    return 0;
+}
+
+/* Make room for at least need more bytes, plus a NUL */
+static int buf_reserve(char **buf, size_t *cap, size_t used, size_t need)
+{
+    size_t ncap = *cap ? *cap : 8192;
+    char *nbuf;
+
+    while (ncap < used + need + 1)
+        ncap *= 2;
+    if (ncap == *cap)
+        return 0;
+    nbuf = realloc(*buf, ncap);
+    if (!nbuf)
+        return -ENOMEM;
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+
+/* Read /proc/htsnap through, appending to buf */
+static ssize_t read_snapshot(char **buf, size_t *cap)
+{
+    size_t used = 0;
+    ssize_t n;
+    int fd, err;
+
+    fd = open("/proc/htsnap", O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    for (;;) {
+        err = buf_reserve(buf, cap, used, 8192);
+        if (err) {
+            close(fd);
+            return err;
+        }
+        n = read(fd, *buf + used, *cap - used - 1);
+        if (n <= 0)
+            break;
+        used += (size_t)n;
+    }
+    err = errno;
+    close(fd);
+    if (n < 0)
+        return -err;        /* EIO: a writer could not keep the snapshot */
+    (*buf)[used] = '\0';
+    return (ssize_t)used;
+}
+
+ssize_t kv_read_all(char **out)
+{
+    unsigned long long start = metrics_now_us();
+    char chunk[KV_SCAN_REPLY_MAX];
+    unsigned long long cursor = 0, next;
+    size_t cap = 0, used = 0, len;
+    char *buf = NULL;
+    ssize_t n;
+
+    *out = NULL;
+    if (router_active())
+        return -EOPNOTSUPP;     /* the keys are spread over the backends */
+    if (buf_reserve(&buf, &cap, 0, 0))
+        return -ENOMEM;
+
+    n = read_snapshot(&buf, &cap);
+    if (n < 0) {
+        /*
+         * No snapshot: the module predates /proc/htsnap, another reader
+         * (a backup) has it open, or it failed. Scan instead; a key the
+         * scan returns twice was written meanwhile.
+         */
+        do {
+            n = kv_scan(cursor, KV_SCAN_MAX_COUNT, NULL, &next, chunk, sizeof(chunk));
+            if (n >= 0) {
+                len = strlen(chunk);
+                n = buf_reserve(&buf, &cap, used, len);
+            }
+            if (n < 0) {
+                free(buf);
+                metrics_inc(METRIC_PROC_ERRORS);
+                return n;
+            }
+            memcpy(buf + used, chunk, len + 1);
+            used += len;
+            cursor = next;
+        } while (cursor);
+        n = (ssize_t)used;
+    }
+    metrics_observe(METRIC_PROC_READ, metrics_now_us() - start);
+    *out = buf;
+    return n;
+}
+
+void kv_set_read_only(int ro)
+{
+    read_only = ro;
+}
+
+int kv_exec(const char *cmd)
+{
+    if (read_only)
+        return -EROFS;
+    return kv_apply(cmd);
+}
+
+int kv_apply(const char *cmd)
+{
+    unsigned long long start = metrics_now_us();
+    char verb[16], key[KV_MAX_KEY + 1];
+    ssize_t n;
+    int fd, err;
+
+    if (router_active()) {
+        char value[KV_MAX_VALUE + 1];
+
+        if (sscanf(cmd, "insert %63s %63s", key, value) == 2)
+            return router_insert(key, value);
+        if (sscanf(cmd, "delete %63s", key) == 1)
+            return router_delete(key);
+        return -EINVAL;
+    }
+
+    fd = open("/proc/ht", O_WRONLY);
+    if (fd < 0) {
+        metrics_inc(METRIC_PROC_ERRORS);
+        return errno == ENOENT ? -ENODEV : -errno;
+    }
+    n = write(fd, cmd, strlen(cmd));
+    err = errno;
+    /*
+     * Our own writes are visible to our next read without waiting for the
+     * feed. Done after the write so a lookup racing it cannot refill the
+     * old value.
+     */
+    if (sscanf(cmd, "%15s %63s", verb, key) == 2)
+        kvcache_invalidate(key);
+    if (n < 0) {
+        close(fd);
+        metrics_inc(METRIC_PROC_ERRORS);
+        return -err;
+    }
+    close(fd);
+    metrics_observe(METRIC_PROC_WRITE, metrics_now_us() - start);
+    return 0;
+}
+
+int kv_exec_txn(const char *body)
+{
+    unsigned long long start = metrics_now_us();
+    char cmd[KV_TXN_MAX_BYTES + 1];
+    const char *line;
+    int len, fd, err;
+    ssize_t n;
+
+    if (read_only)
+        return -EROFS;
+    if (router_active())
+        return -EOPNOTSUPP;
+    len = snprintf(cmd, sizeof(cmd), "multi\n%sexec\n", body);
+    if (len < 0 || (size_t)len >= sizeof(cmd))
+        return -E2BIG;
+
+    fd = open("/proc/ht", O_WRONLY);
+    if (fd < 0) {
+        metrics_inc(METRIC_PROC_ERRORS);
+        return errno == ENOENT ? -ENODEV : -errno;
+    }
+    n = write(fd, cmd, (size_t)len);
+    err = errno;
+    close(fd);
+    /* As in kv_apply(): drop every written key after the write */
+    for (line = body; *line; ) {
+        char verb[16], key[KV_MAX_KEY + 1];
+        const char *nl = strchr(line, '\n');
+
+        if (sscanf(line, "%15s %63s", verb, key) == 2 && strcmp(verb, "check"))
+            kvcache_invalidate(key);
+        if (!nl)
+            break;
+        line = nl + 1;
+    }
+    if (n < 0) {
+        /* ECANCELED is the expected outcome of a failed check, not a /proc fault */
+        if (err != ECANCELED)
+            metrics_inc(METRIC_PROC_ERRORS);
+        return -err;
+    }
+    metrics_observe(METRIC_PROC_WRITE, metrics_now_us() - start);
+    return 0;
+}
+
+/*
+ * Write one command to /proc/ht and read its reply back. The file is
+ * opened O_RDWR, since the kernel keeps the reply per open file.
+ * @return reply length (NUL-terminated in reply), or a negative errno.
+ */
+static ssize_t proc_request(const char *cmd, char *reply, size_t len)
+{
+    ssize_t n, total = 0;
+    int fd, err;
+
+    fd = open("/proc/ht", O_RDWR);
+    if (fd < 0) {
+        metrics_inc(METRIC_PROC_ERRORS);
+        return errno == ENOENT ? -ENODEV : -errno;
+    }
+    if (write(fd, cmd, strlen(cmd)) < 0)
+        goto fail;
+    while ((size_t)total < len - 1) {
+        n = read(fd, reply + total, len - 1 - (size_t)total);
+        if (n < 0)
+            goto fail;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    close(fd);
+    reply[total] = '\0';
+    return total;
+fail:
+    err = errno;
+    close(fd);
+    metrics_inc(METRIC_PROC_ERRORS);
+    return -err;
+}
+
+int kv_version(const char *key, unsigned long long *version)
+{
+    char cmd[16 + KV_MAX_KEY], reply[128];
+    ssize_t n;
+
+    if (router_active())
+        return -EOPNOTSUPP;
+    snprintf(cmd, sizeof(cmd), "version %s", key);
+    n = proc_request(cmd, reply, sizeof(reply));
+    if (n < 0)
+        return (int)n;
+    if (sscanf(reply, "Version of key: %*s is: %llu", version) != 1)
+        return -EPROTO;
+    return 0;
+}
+
+int kv_scan(unsigned long long cursor, int count, const char *match,
+            unsigned long long *next, char *buf, size_t len)
+{
+    char cmd[48 + KV_MAX_KEY], reply[KV_SCAN_REPLY_MAX];
+    const char *lines;
+    unsigned int n;
+    ssize_t rlen;
+    size_t body;
+
+    if (router_active())
+        return -EOPNOTSUPP;
+    if (count <= 0 || count > KV_SCAN_MAX_COUNT)
+        return -EINVAL;
+    snprintf(cmd, sizeof(cmd), "scan %llu %d %s", cursor, count, match ? match : "");
+    rlen = proc_request(cmd, reply, sizeof(reply));
+    if (rlen < 0)
+        return (int)rlen;
+    if (sscanf(reply, "Scan cursor: %llu entries: %u", next, &n) != 2)
+        return strncmp(reply, "Scan failed", 11) ? -EPROTO : -EFBIG;
+
+    /* The "key value" lines follow the header line */
+    lines = strchr(reply, '\n');
+    lines = lines ? lines + 1 : reply + rlen;
+    body = (size_t)(reply + rlen - lines);
+    if (body >= len)
+        return -ENOSPC;
+    memcpy(buf, lines, body);
+    buf[body] = '\0';
+    return (int)n;
+}
+
+int kv_insert(const char *key, const char *value)
+{
+    char cmd[16 + KV_MAX_KEY + KV_MAX_VALUE];
+
+    snprintf(cmd, sizeof(cmd), "insert %s %s", key, value);
+    return kv_exec(cmd);
+}
+
+int kv_minsert(const char **keys, const char **values, int n)
+{
+    int i, ret;
+
+    if (read_only)
+        return -EROFS;
+    if (router_active())
+        return router_minsert(keys, values, n);
+    for (i = 0; i < n; i++) {
+        ret = kv_insert(keys[i], values[i]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+int kv_delete(const char *key)
+{
+    char cmd[16 + KV_MAX_KEY];
+
+    snprintf(cmd, sizeof(cmd), "delete %s", key);
+    return kv_exec(cmd);
+}
+
+int kv_remove(const char *key)
+{
+    unsigned long long start = metrics_now_us();
+    char cmd[16 + KV_MAX_KEY], reply[32 + KV_MAX_KEY];
+    ssize_t n;
+
+    if (read_only)
+        return -EROFS;
+    if (router_active())
+        return router_remove(key);
+    snprintf(cmd, sizeof(cmd), "delete %s", key);
+    n = proc_request(cmd, reply, sizeof(reply));
+    /* As in kv_apply(): drop the key after the write */
+    kvcache_invalidate(key);
+    if (n < 0)
+        return (int)n;
+    metrics_observe(METRIC_PROC_WRITE, metrics_now_us() - start);
+    if (!strncmp(reply, "Deleted key", 11))
+        return 0;
+    return strncmp(reply, "Delete failed", 13) ? -EPROTO : -ENOENT;
+}
+
+int kv_valid_token(const char *s, size_t len, size_t max)
+{
+    size_t i;
+
+    if (len == 0 || len > max)
+        return 0;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\0' || isspace((unsigned char)s[i]))
+            return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,122 @@
+#ifndef KVPROC_H
+#define KVPROC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Limits imposed by the kernel command parser (sscanf "%63s") */
+#define KV_MAX_KEY 63
+#define KV_MAX_VALUE 63
+
+/* Transaction limits, mirroring KV_TXN_MAX_OPS/KV_TXN_BUF_SIZE in kvstore.h */
+#define KV_TXN_MAX_OPS 32
+#define KV_TXN_MAX_BYTES 4095
+
+/* Scan limits, mirroring KV_SCAN_MAX_COUNT/KV_REPLY_SIZE in kvstore.h */
+#define KV_SCAN_MAX_COUNT 64
+#define KV_SCAN_REPLY_MAX 4096
+
+/**
+ * Look up a key in the kernel store (via /proc/hashtable).
+ * @param value  Receives the NUL-terminated value.
+ * @return 0 if found, -ENOENT if not, another negative errno on error.
+ */
+int kv_lookup(const char *key, char *value, size_t vlen);
+
+/**
+ * Look up several keys with a single read of /proc/hashtable.
+ * @param values  Array of n buffers of vlen bytes each; set to "" when missing.
+ * @param found  Receives 1/0 per key.
+ * @return 0 on success, negative errno on error.
+ */
+int kv_mlookup(const char **keys, int n, char (*values)[KV_MAX_VALUE + 1], int *found);
+
+/**
+ * Insert or overwrite a key in the kernel store.
+ * @return 0 on success, negative errno on error.
+ */
+int kv_insert(const char *key, const char *value);
+
+/**
+ * Insert several pairs. In router mode each backend gets one pipelined
+ * batch; otherwise this is a loop over kv_insert().
+ * @return 0 on success, or the first error (earlier pairs stay written).
+ */
+int kv_minsert(const char **keys, const char **values, int n);
+
+/**
+ * Delete a key from the kernel store.
+ * @return 0 on success, negative errno on error.
+ */
+int kv_delete(const char *key);
+
+/**
+ * Delete a key and report whether it was there, from the kernel's reply
+ * on /proc/ht (or the backend's, in router mode).
+ * @return 0 if deleted, -ENOENT if the key did not exist, -EROFS in
+ *         read-only mode, another negative errno on error.
+ */
+int kv_remove(const char *key);
+
+/**
+ * Write a raw command line (e.g. "insert k v") to /proc/ht.
+ * @return 0 on success, -EROFS in read-only mode, negative errno on error.
+ */
+int kv_exec(const char *cmd);
+
+/**
+ * Apply a batch atomically. body holds "check <key> <version>",
+ * "insert <key> <value>" and "delete <key>" lines; it is sent to /proc/ht
+ * as one "multi ... exec" write.
+ * @return 0 if applied, -ECANCELED if a check failed (nothing applied),
+ *         -EROFS in read-only mode, -EOPNOTSUPP in router mode, -EINVAL
+ *         or -E2BIG for a bad batch, another negative errno on error.
+ */
+int kv_exec_txn(const char *body);
+
+/**
+ * Read a key's version (bumped on every write, 0 if absent).
+ * @return 0 on success, negative errno on error.
+ */
+int kv_version(const char *key, unsigned long long *version);
+
+/**
+ * Read one batch of an incremental scan of the kernel store. Start with
+ * cursor 0 and pass *next back until it is 0. Keys present for the whole
+ * scan are returned at least once, even if the table grows meanwhile.
+ * @param count  Entries wanted, 1..KV_SCAN_MAX_COUNT (a batch may hold fewer).
+ * @param match  Exact key or "prefix*", NULL or "" for all keys.
+ * @param buf    Receives "key value\n" lines; KV_SCAN_REPLY_MAX is enough.
+ * @return entries in buf, or a negative errno.
+ */
+int kv_scan(unsigned long long cursor, int count, const char *match,
+            unsigned long long *next, char *buf, size_t len);
+
+/**
+ * kv_exec() that ignores read-only mode, for the replication applier.
+ */
+int kv_apply(const char *cmd);
+
+/**
+ * Reject writes from clients (kv_exec and friends return -EROFS). Used
+ * by replicas, whose store follows the primary.
+ */
+void kv_set_read_only(int read_only);
+
+/**
+ * Read the whole store as "key value\n" lines, from /proc/htsnap or, if
+ * that cannot be had, with kv_scan() (which may return a key twice).
+ * @param out  Receives a malloc'd, NUL-terminated buffer (NULL on error);
+ *             the caller frees it.
+ * @return bytes in *out, or a negative errno (-EOPNOTSUPP in router mode).
+ */
+ssize_t kv_read_all(char **out);
+
+/**
+ * Check that s (len bytes) can be passed to the kernel as a key or value:
+ * non-empty, at most max bytes, and free of whitespace and NUL bytes.
+ * @return 1 if valid, 0 otherwise.
+ */
+int kv_valid_token(const char *s, size_t len, size_t max);
+
+#endif /* KVPROC_H */
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "net_server.h"
+#include "upgrade.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* Upper bounds in microseconds; the last bucket is +Inf */
+static const unsigned long long bucket_le_us[METRICS_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 10000000,
+};
+
+struct metrics_hist {
+    unsigned long buckets[METRICS_BUCKETS + 1];
+    unsigned long count;
+    unsigned long long sum_us;
+};
+
+/*
+ * Threads are spread over cache-line aligned stripes so hot paths on
+ * different shards do not bounce the same lines; the exporter sums the
+ * stripes when scraped.
+ */
+struct metrics_stripe {
+    unsigned long counters[METRIC_COUNTER_COUNT];
+    struct metrics_hist hist[METRIC_HIST_COUNT];
+} __attribute__((aligned(64)));
+
+static struct metrics_stripe stripes[METRICS_STRIPES];
+static int next_stripe;
+static __thread int my_stripe = -1;
+static int metrics_fd = -1;               /* listening socket, handed over on upgrade */
+
+static const struct {
+    const char *name;
+    const char *help;
+} hist_info[METRIC_HIST_COUNT] = {
+    [METRIC_AUTH]       = { "kvstore_auth_duration_seconds",
+                            "PAM authentication time, including auth queue wait." },
+    [METRIC_PROC_READ]  = { "kvstore_proc_read_duration_seconds",
+                            "Time to read /proc/hashtable for lookups." },
+    [METRIC_PROC_WRITE] = { "kvstore_proc_write_duration_seconds",
+                            "Time to forward insert/delete to /proc/ht." },
+    [METRIC_SAVE]       = { "kvstore_save_duration_seconds",
+                            "Time to write the backup file after SIGUSR1." },
+};
+
+static struct metrics_stripe *stripe(void)
+{
+    if (my_stripe < 0)
+        my_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % METRICS_STRIPES;
+    return &stripes[my_stripe];
+}
+
+unsigned long long metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+void metrics_observe(int hist, unsigned long long usec)
+{
+    struct metrics_hist *h;
+    int b = 0;
+
+    if (hist < 0 || hist >= METRIC_HIST_COUNT)
+        return;
+    while (b < METRICS_BUCKETS && usec > bucket_le_us[b])
+        b++;
+    h = &stripe()->hist[hist];
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, usec, __ATOMIC_RELAXED);
+}
+
+void metrics_inc(int counter)
+{
+    if (counter >= 0 && counter < METRIC_COUNTER_COUNT)
+        __atomic_add_fetch(&stripe()->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long sum_counter(int counter)
+{
+    unsigned long total = 0;
+
+    for (int s = 0; s < METRICS_STRIPES; s++)
+        total += __atomic_load_n(&stripes[s].counters[counter], __ATOMIC_RELAXED);
+    return total;
+}
+
+static void write_hist(FILE *out, int hist)
+{
+    struct metrics_hist sum;
+    unsigned long cumulative = 0;
+
+    memset(&sum, 0, sizeof(sum));
+    for (int s = 0; s < METRICS_STRIPES; s++) {
+        const struct metrics_hist *h = &stripes[s].hist[hist];
+        for (int b = 0; b <= METRICS_BUCKETS; b++)
+            sum.buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        sum.count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        sum.sum_us += __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    }
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+            hist_info[hist].name, hist_info[hist].help, hist_info[hist].name);
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        cumulative += sum.buckets[b];
+        fprintf(out, "%s_bucket{le=\"%g\"} %lu\n",
+                hist_info[hist].name, bucket_le_us[b] / 1e6, cumulative);
+    }
+    cumulative += sum.buckets[METRICS_BUCKETS];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", hist_info[hist].name, cumulative);
+    fprintf(out, "%s_sum %.6f\n%s_count %lu\n",
+            hist_info[hist].name, sum.sum_us / 1e6, hist_info[hist].name, sum.count);
+}
+
+static void write_metric(FILE *out, const char *name, const char *type,
+                         const char *help, unsigned long long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+/*
+ * Re-export /proc/htstats ("name value" lines) as kvstore_kernel_*.
+ * The chain length histogram becomes one labelled series.
+ */
+static void write_kernel_stats(FILE *out)
+{
+    char line[128], name[64];
+    unsigned long long value;
+    int chain_header = 0;
+    FILE *fp = fopen("/proc/htstats", "r");
+
+    fprintf(out, "# HELP kvstore_kernel_up Whether /proc/htstats could be read.\n"
+                 "# TYPE kvstore_kernel_up gauge\nkvstore_kernel_up %d\n", fp != NULL);
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%63s %llu", name, &value) != 2)
+            continue;
+        if (!strncmp(name, "chain_", 6)) {
+            if (!chain_header) {
+                fprintf(out, "# HELP kvstore_kernel_buckets Buckets by chain length.\n"
+                             "# TYPE kvstore_kernel_buckets gauge\n");
+                chain_header = 1;
+            }
+            fprintf(out, "kvstore_kernel_buckets{chain_length=\"%s\"} %llu\n", name + 6, value);
+        } else {
+            fprintf(out, "kvstore_kernel_%s %llu\n", name, value);
+        }
+    }
+    fclose(fp);
+}
+
+static void write_metrics(FILE *out)
+{
+    struct auth_stats as;
+    struct debug_stats ds;
+    struct kvcache_stats cs;
+    struct repl_stats rs;
+    struct replica_stats rps;
+    struct router_stats rts;
+    struct upgrade_stats us;
+    struct admit_stats ads;
+    int shards;
+    long conns;
+
+    net_get_counts(&shards, &conns);
+    auth_get_stats(&as);
+    debug_get_stats(&ds);
+    kvcache_get_stats(&cs);
+    repl_get_stats(&rs);
+    replica_get_stats(&rps);
+    router_get_stats(&rts);
+    upgrade_get_stats(&us);
+    admit_get_stats(&ads);
+
+    fprintf(out, "# HELP kvstore_requests_total Requests handled, by protocol.\n"
+                 "# TYPE kvstore_requests_total counter\n"
+                 "kvstore_requests_total{proto=\"text\"} %lu\n"
+                 "kvstore_requests_total{proto=\"binary\"} %lu\n"
+                 "kvstore_requests_total{proto=\"resp\"} %lu\n",
+            sum_counter(METRIC_REQ_TEXT), sum_counter(METRIC_REQ_BINARY),
+            sum_counter(METRIC_REQ_RESP));
+    write_metric(out, "kvstore_proc_errors_total", "counter",
+                 "Failed /proc accesses.", sum_counter(METRIC_PROC_ERRORS));
+    write_metric(out, "kvstore_save_errors_total", "counter",
+                 "Backups that could not be written.", sum_counter(METRIC_SAVE_ERRORS));
+    write_metric(out, "kvstore_connections", "gauge",
+                 "Open client connections.", (unsigned long long)conns);
+    write_metric(out, "kvstore_shards", "gauge",
+                 "Network server shards.", (unsigned long long)shards);
+    write_metric(out, "kvstore_upgrade_inherited_listeners", "gauge",
+                 "Listening sockets taken over from the previous daemon.", us.inherited);
+    write_metric(out, "kvstore_upgrade_takeover_ms", "gauge",
+                 "Takeover start to serving, in milliseconds (0 = started fresh).", us.takeover_ms);
+
+    write_metric(out, "kvstore_requests_in_flight", "gauge",
+                 "Requests ready or being served (counted with --max-inflight only).",
+                 ads.inflight);
+    fprintf(out, "# HELP kvstore_admission_rejected_total Requests and connections refused.\n"
+                 "# TYPE kvstore_admission_rejected_total counter\n"
+                 "kvstore_admission_rejected_total{reason=\"busy\"} %lu\n"
+                 "kvstore_admission_rejected_total{reason=\"conns_per_ip\"} %lu\n"
+                 "kvstore_admission_rejected_total{reason=\"conns_per_user\"} %lu\n",
+            ads.shed, ads.refused_ip, ads.refused_user);
+    write_metric(out, "kvstore_admission_throttled_total", "counter",
+                 "Requests held back by a rate limit.", ads.throttled);
+    write_metric(out, "kvstore_admission_overflowed_total", "counter",
+                 "Connections from clients the admission tables had no room to track.",
+                 ads.overflowed);
+
+    write_metric(out, "kvstore_auth_queue_depth", "gauge",
+                 "Logins waiting for a PAM worker.", as.queue_depth);
+    write_metric(out, "kvstore_auth_in_progress", "gauge",
+                 "Logins being checked by PAM.", as.in_progress);
+    fprintf(out, "# HELP kvstore_auth_total Login attempts, by outcome.\n"
+                 "# TYPE kvstore_auth_total counter\n"
+                 "kvstore_auth_total{result=\"ok\"} %lu\n"
+                 "kvstore_auth_total{result=\"failed\"} %lu\n"
+                 "kvstore_auth_total{result=\"cache_hit\"} %lu\n"
+                 "kvstore_auth_total{result=\"busy\"} %lu\n"
+                 "kvstore_auth_total{result=\"backoff\"} %lu\n",
+            as.ok, as.failed, as.cache_hits, as.rejected_busy, as.rejected_backoff);
+
+    fprintf(out, "# HELP kvstore_debug_messages_total Debug messages, by outcome.\n"
+                 "# TYPE kvstore_debug_messages_total counter\n"
+                 "kvstore_debug_messages_total{result=\"sent\"} %lu\n"
+                 "kvstore_debug_messages_total{result=\"dropped\"} %lu\n"
+                 "kvstore_debug_messages_total{result=\"sampled_out\"} %lu\n"
+                 "kvstore_debug_messages_total{result=\"rate_limited\"} %lu\n",
+            ds.sent, ds.dropped, ds.sampled_out, ds.rate_limited);
+
+    fprintf(out, "# HELP kvstore_cache_lookups_total Lookups by cache outcome.\n"
+                 "# TYPE kvstore_cache_lookups_total counter\n"
+                 "kvstore_cache_lookups_total{result=\"hit\"} %lu\n"
+                 "kvstore_cache_lookups_total{result=\"miss\"} %lu\n"
+                 "kvstore_cache_lookups_total{result=\"bypass\"} %lu\n",
+            cs.hits, cs.misses, cs.bypassed);
+    write_metric(out, "kvstore_cache_entries", "gauge",
+                 "Keys held by the read cache.", cs.entries);
+    write_metric(out, "kvstore_cache_evictions_total", "counter",
+                 "Cache entries evicted to make room.", cs.evictions);
+    write_metric(out, "kvstore_cache_invalidations_total", "counter",
+                 "Cache entries dropped after a write by this daemon.", cs.invalidations);
+
+    write_metric(out, "kvstore_replicas", "gauge",
+                 "Replicas streaming from this daemon.", rs.replicas);
+    write_metric(out, "kvstore_replication_events_sent_total", "counter",
+                 "Mutations sent to replicas.", rs.events_sent);
+    write_metric(out, "kvstore_replication_snapshots_sent_total", "counter",
+                 "Full snapshots sent to replicas.", rs.snapshots);
+    if (replica_enabled()) {
+        write_metric(out, "kvstore_replica_connected", "gauge",
+                     "1 while streaming from the primary.", (unsigned long long)rps.connected);
+        write_metric(out, "kvstore_replication_lag_events", "gauge",
+                     "Primary mutations not yet applied here.", rps.lag_events);
+        write_metric(out, "kvstore_replica_last_contact_ms", "gauge",
+                     "Milliseconds since the primary was last heard from.", rps.last_contact_ms);
+        write_metric(out, "kvstore_replica_applied_total", "counter",
+                     "Local writes made by the replication stream.", rps.applied);
+    }
+    if (router_active()) {
+        write_metric(out, "kvstore_router_nodes", "gauge",
+                     "Backends on the hash ring.", (unsigned long long)rts.nodes);
+        write_metric(out, "kvstore_router_requests_total", "counter",
+                     "Calls made to backends.", rts.requests);
+        write_metric(out, "kvstore_router_errors_total", "counter",
+                     "Backend calls that failed.", rts.errors);
+        write_metric(out, "kvstore_router_moved_total", "counter",
+                     "Keys moved to a newly added backend.", rts.moved);
+    }
+
+    for (int h = 0; h < METRIC_HIST_COUNT; h++)
+        write_hist(out, h);
+
+    write_kernel_stats(out);
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* One request per connection: read the header, answer, close */
+static void metrics_handle(int fd)
+{
+    char req[METRICS_REQ_MAX];
+    char header[256];
+    size_t len = 0;
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out;
+    int status = 200;
+
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            return;
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+
+    out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6))
+        write_metrics(out);
+    else {
+        status = 404;
+        fputs("not found, try /metrics\n", out);
+    }
+    fclose(out);
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 %d %s\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n",
+             status, status == 200 ? "OK" : "Not Found", body_len);
+    if (send_all(fd, header, strlen(header)) == 0)
+        send_all(fd, body, body_len);
+    free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+
+    for (;;) {
+        struct timeval tv = { 2, 0 };
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("metrics: accept");
+            sleep(1);
+            continue;
+        }
+        /* A stalled scraper must not wedge the endpoint */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        metrics_handle(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start(int port)
+{
+    struct sockaddr_in addr;
+    int fd, opt = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("metrics: socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics: bind/listen");
+        close(fd);
+        return -1;
+    }
+    return metrics_start_fd(fd);
+}
+
+int metrics_start_fd(int fd)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, metrics_thread, (void *)(long)fd) != 0) {
+        perror("metrics: pthread_create");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    metrics_fd = fd;
+    return 0;
+}
+
+int metrics_listener(void)
+{
+    return metrics_fd;
+}
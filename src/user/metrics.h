@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_STRIPES 64          /* threads share counters in this many cache lines */
+#define METRICS_BUCKETS 16          /* histogram buckets, plus +Inf */
+#define METRICS_REQ_MAX 4096        /* largest HTTP request header read */
+
+/* Latency histograms */
+enum {
+    METRIC_AUTH,                    /* PAM run, queue wait included */
+    METRIC_PROC_READ,               /* /proc/hashtable reads */
+    METRIC_PROC_WRITE,              /* /proc/ht writes */
+    METRIC_SAVE,                    /* backup after SIGUSR1 */
+    METRIC_HIST_COUNT,
+};
+
+/* Counters */
+enum {
+    METRIC_REQ_TEXT,
+    METRIC_REQ_BINARY,
+    METRIC_REQ_RESP,
+    METRIC_PROC_ERRORS,
+    METRIC_SAVE_ERRORS,
+    METRIC_COUNTER_COUNT,
+};
+
+/**
+ * Monotonic clock in microseconds, for timing observations.
+ */
+unsigned long long metrics_now_us(void);
+
+/**
+ * Record one duration. Lock-free; each thread updates its own stripe.
+ */
+void metrics_observe(int hist, unsigned long long usec);
+
+/**
+ * Increment a counter. Lock-free like metrics_observe().
+ */
+void metrics_inc(int counter);
+
+/**
+ * Start the Prometheus endpoint: GET /metrics on the given TCP port,
+ * served by one background thread. It includes the kernel's
+ * /proc/htstats when the module is loaded.
+ * @return 0 on success, -1 on error.
+ */
+int metrics_start(int port);
+
+/**
+ * Serve metrics on a listening socket taken over from another daemon.
+ * @return 0 on success, -1 on error.
+ */
+int metrics_start_fd(int fd);
+
+/**
+ * The metrics listening socket, or -1 if the endpoint is not running.
+ */
+int metrics_listener(void);
+
+#endif /* METRICS_H */
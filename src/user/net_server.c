@@ -1,62 +1,72 @@
+#define _GNU_SOURCE
 #include "net_server.h"
+#include "proto_bin.h"
+#include "proto_resp.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 static volatile int server_running = 1;
-static int server_fd = -1;
+static volatile int server_draining;
+static time_t drain_deadline;
+static int listeners_handed_off;
+static int num_shards;
+static long num_connections;
+
+/* Listening sockets from a daemon we are taking over from */
+static int inherit_fds[NET_MAX_LISTENERS];
+static char inherit_kinds[NET_MAX_LISTENERS];
+static int n_inherit;
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int start_done;
 
 /**
  * Forward a command string to the kernel via /proc/ht.
  * For insert/delete: write to /proc/ht.
- * For lookup: write to /proc/ht, then read the response.
+ * For lookup: read the entry back from /proc/hashtable.
  */
 int forward_to_proc(const char *cmd, char *response, size_t resp_len)
 {
-    int fd;
-    ssize_t n;
     char clean[NET_BUF_SIZE];
+    int ret;
 
     /* Strip trailing newline/whitespace */
     strncpy(clean, cmd, sizeof(clean) - 1);
     clean[sizeof(clean) - 1] = '\0';
     clean[strcspn(clean, "\r\n")] = '\0';
 
-    /* For lookup: search /proc/hashtable directly instead of going through /proc/ht */
     if (strncmp(clean, "lookup", 6) == 0) {
         char key[64];
+        char value[KV_MAX_VALUE + 1];
+
         if (sscanf(clean, "lookup %63s", key) != 1) {
             snprintf(response, resp_len, "ERROR: missing key\n");
             return -1;
         }
-        fd = open("/proc/hashtable", O_RDONLY);
-        if (fd < 0) {
-            snprintf(response, resp_len, "ERROR: cannot open /proc/hashtable: %s\n", strerror(errno));
-            return -1;
-        }
-        char buf[4096];
-        n = read(fd, buf, sizeof(buf) - 1);
-        close(fd);
-        if (n <= 0) {
-            snprintf(response, resp_len, "Not found\n");
+        ret = kv_lookup(key, value, sizeof(value));
+        if (ret == 0) {
+            snprintf(response, resp_len, "Lookup on key: %s, gave value: %s\n", key, value);
             return 0;
         }
-        buf[n] = '\0';
-        /* Parse lines "key value\n" to find our key */
-        char *line = buf;
-        while (line && *line) {
-            char k[64], v[64];
-            char *nl = strchr(line, '\n');
-            if (nl) *nl = '\0';
-            if (sscanf(line, "%63s %63s", k, v) == 2 && strcmp(k, key) == 0) {
-                snprintf(response, resp_len, "Lookup on key: %s, gave value: %s\n", k, v);
-                return 0;
-            }
-            line = nl ? nl + 1 : NULL;
+        if (ret != -ENOENT) {
+            snprintf(response, resp_len, "ERROR: cannot open /proc/hashtable: %s\n", strerror(-ret));
+            return -1;
         }
         snprintf(response, resp_len, "Not found\n");
         return 0;
     }
 
     /* Validate command before forwarding */
-    char verb[16];
+    char verb[16] = "";
     if (sscanf(clean, "%15s", verb) != 1 ||
         (strcmp(verb, "insert") != 0 && strcmp(verb, "delete") != 0)) {
         snprintf(response, resp_len, "ERROR: unknown command '%s'. Use: insert, delete, lookup\n", verb);
@@ -64,15 +74,13 @@ int forward_to_proc(const char *cmd, char *response, size_t resp_len)
     }
 
     /* For insert/delete: write to /proc/ht */
-    fd = open("/proc/ht", O_WRONLY);
-    if (fd < 0) {
-        snprintf(response, resp_len, "ERROR: cannot open /proc/ht: %s\n", strerror(errno));
+    ret = kv_exec(clean);
+    if (ret == -EROFS) {
+        snprintf(response, resp_len, "ERROR: read-only replica\n");
         return -1;
     }
-    n = write(fd, clean, strlen(clean));
-    close(fd);
-    if (n < 0) {
-        snprintf(response, resp_len, "ERROR: write to /proc/ht failed: %s\n", strerror(errno));
+    if (ret < 0) {
+        snprintf(response, resp_len, "ERROR: write to /proc/ht failed: %s\n", strerror(-ret));
         return -1;
     }
 
@@ -80,226 +88,1663 @@ int forward_to_proc(const char *cmd, char *response, size_t resp_len)
     return 0;
 }
 
+void net_get_counts(int *shards, long *connections)
+{
+    *shards = num_shards;
+    *connections = __atomic_load_n(&num_connections, __ATOMIC_RELAXED);
+}
+
 /**
- * Thread handler for a single client connection.
+ * Format server counters as a single "STATS key=value ..." line. Size
+ * out with NET_STATS_SIZE.
+ * @return the line's length, or -ENOSPC if it does not fit (out is then
+ *         empty rather than a cut-off line).
  */
-void *handle_client(void *arg)
+int net_format_stats(char *out, size_t outlen)
 {
-    client_info *ci = (client_info *)arg;
-    char buf[NET_BUF_SIZE];
-    char response[NET_BUF_SIZE];
-    char debug_msg[NET_BUF_SIZE];
-    ssize_t n;
+    struct auth_stats as;
+    struct debug_stats ds;
+    struct watch_stats ws;
+    struct kvfeed_stats fs;
+    struct kvcache_stats cs;
+    struct repl_stats rs;
+    struct replica_stats rps;
+    struct router_stats rts;
+    struct admit_stats ads;
+    unsigned long runs, lookups;
+    int n;
 
-    char username[64];
-    char password[64];
+    auth_get_stats(&as);
+    debug_get_stats(&ds);
+    watch_get_stats(&ws);
+    kvfeed_get_stats(&fs);
+    kvcache_get_stats(&cs);
+    repl_get_stats(&rs);
+    replica_get_stats(&rps);
+    router_get_stats(&rts);
+    admit_get_stats(&ads);
+    runs = as.ok + as.failed;
+    lookups = cs.hits + cs.misses + cs.bypassed;
 
-    /* Set timeout */
-    struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
-    setsockopt(ci->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(ci->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    n = snprintf(out, outlen,
+             "STATS net_shards=%d net_connections=%ld "
+             "auth_queue_depth=%lu auth_queue_max=%lu auth_in_progress=%lu "
+             "auth_submitted=%lu auth_cache_hits=%lu auth_ok=%lu auth_failed=%lu "
+             "auth_rejected_busy=%lu auth_rejected_backoff=%lu "
+             "auth_latency_avg_us=%llu auth_latency_max_us=%llu "
+             "debug_queued=%lu debug_sent=%lu debug_datagrams=%lu debug_dropped=%lu "
+             "debug_sampled_out=%lu debug_rate_limited=%lu "
+             "feed_connected=%d feed_events=%lu feed_lost=%lu feed_seq=%llu "
+             "watch_subscribers=%lu watch_queued=%lu watch_coalesced=%lu "
+             "watch_overflows=%lu watch_pushed=%lu "
+             "cache_hits=%lu cache_misses=%lu cache_bypassed=%lu cache_hit_ratio=%.3f "
+             "cache_entries=%lu cache_capacity=%lu cache_fill_races=%lu cache_updates=%lu "
+             "cache_invalidations=%lu cache_evictions=%lu "
+             "repl_replicas=%lu repl_events_sent=%lu repl_snapshots=%lu repl_resyncs=%lu "
+             "replica_enabled=%d replica_connected=%d replica_applied_seq=%llu "
+             "replica_primary_seq=%llu replica_lag_events=%llu replica_last_contact_ms=%llu "
+             "replica_applied=%lu replica_skipped=%lu replica_snapshots=%lu "
+             "replica_reconnects=%lu "
+             "router_enabled=%d router_nodes=%d router_migrating=%d router_sweeping=%d "
+             "router_requests=%lu "
+             "router_errors=%lu router_split=%lu router_moved=%lu router_queue_depth=%lu "
+             "admit_inflight=%lu admit_inflight_max=%lu admit_shed=%lu "
+             "admit_refused_ip=%lu admit_refused_user=%lu admit_throttled=%lu "
+             "admit_overflowed=%lu\n",
+             num_shards, __atomic_load_n(&num_connections, __ATOMIC_RELAXED),
+             as.queue_depth, as.queue_max, as.in_progress,
+             as.submitted, as.cache_hits, as.ok, as.failed,
+             as.rejected_busy, as.rejected_backoff,
+             runs ? as.latency_total_us / runs : 0ULL, as.latency_max_us,
+             ds.queued, ds.sent, ds.datagrams, ds.dropped,
+             ds.sampled_out, ds.rate_limited,
+             fs.connected, fs.events, fs.lost, fs.last_seq,
+             ws.subscribers, ws.queued, ws.coalesced, ws.overflows, ws.pushed,
+             cs.hits, cs.misses, cs.bypassed, lookups ? (double)cs.hits / lookups : 0.0,
+             cs.entries, cs.capacity, cs.fill_races, cs.updates,
+             cs.invalidations, cs.evictions,
+             rs.replicas, rs.events_sent, rs.snapshots, rs.resyncs,
+             replica_enabled(), rps.connected, rps.applied_seq,
+             rps.primary_seq, rps.lag_events, rps.last_contact_ms,
+             rps.applied, rps.skipped, rps.snapshots, rps.reconnects,
+             router_active(), rts.nodes, rts.migrating, rts.sweeping, rts.requests,
+             rts.errors, rts.split, rts.moved, rts.queue_depth,
+             ads.inflight, ads.inflight_max, ads.shed,
+             ads.refused_ip, ads.refused_user, ads.throttled, ads.overflowed);
+    if (n < 0 || (size_t)n >= outlen) {
+        if (outlen)
+            out[0] = '\0';
+        return -ENOSPC;
+    }
+    return n;
+}
 
-    /* ---- STEP 1: READ AUTH LINE ---- */
-    memset(buf, 0, sizeof(buf));
-    n = read(ci->fd, buf, sizeof(buf) - 1);
-    if (n <= 0)
-        goto cleanup;
+/* ---- Client buffers ---- */
 
-    buf[n] = '\0';
+/**
+ * Queue a response. Output is written when the socket is writable
+ * (see client_flush), so a burst of pipelined requests is answered
+ * with few writes.
+ */
+int net_client_write(net_client *c, const char *data, size_t len)
+{
+    if (c->wlen + len > c->wcap) {
+        size_t cap = c->wcap ? c->wcap : NET_WBUF_SIZE;
+        char *nbuf;
 
-    if (sscanf(buf, "AUTH %63s %63s", username, password) != 2) {
-        if(write(ci->fd, "ERROR: expected AUTH <user> <pass>\n", 35) < 0)
-        {
-            perror("Auth error write");
+        /* Reclaim already-sent space before growing */
+        if (c->woff > 0) {
+            memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+            c->wlen -= c->woff;
+            c->woff = 0;
+        }
+        while (cap < c->wlen + len)
+            cap *= 2;
+        if (cap != c->wcap) {
+            nbuf = realloc(c->wbuf, cap);
+            if (!nbuf)
+                return -1;
+            c->wbuf = nbuf;
+            c->wcap = cap;
         }
-        goto cleanup;
     }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+    return 0;
+}
+
+static int client_puts(net_client *c, const char *s)
+{
+    return net_client_write(c, s, strlen(s));
+}
 
-    if (authenticate_user(username, password) != 0) {
-        if (write(ci->fd, "AUTH FAIL\n", 10) < 0) {
-            perror("Auth fail write");
+static size_t client_pending(const net_client *c)
+{
+    return c->wlen - c->woff;
+}
+
+/**
+ * Write as much buffered output as the socket accepts.
+ * Returns 0 on success (possibly with output left over), -1 on error.
+ */
+static int client_flush(net_client *c)
+{
+    while (c->woff < c->wlen) {
+        ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
         }
-        goto cleanup;
+        c->woff += (size_t)n;
     }
+    c->woff = 0;
+    c->wlen = 0;
+    return 0;
+}
+
+/* ---- Shards ---- */
+
+enum {
+    NET_EV_LISTENER,
+    NET_EV_WAKE,
+    NET_EV_CLIENT,
+};
+
+typedef struct {
+    int ev_type;                /* must be first: epoll dispatch tag */
+    int fd;
+    int family;                 /* AF_INET or AF_UNIX */
+    int proto;                  /* NET_PROTO_* spoken by accepted clients */
+} net_listener;
+
+struct net_shard {
+    int ev_type;                /* must be first: NET_EV_WAKE for wake_fd */
+    int id;
+    int cpu;
+    int epfd;
+    int wake_fd;                /* eventfd: auth completions or watch events are ready */
+    net_listener tcp;
+    net_listener resp;          /* optional RESP-speaking port */
+    int listening;              /* listeners still registered with epfd */
+    pthread_t thread;
+    net_client *clients;
+    pthread_mutex_t done_lock;
+    net_client *done_list;
+    net_client *notify_list;    /* clients with watch/replication events to flush */
+    net_client *throttled;      /* clients paused by a rate limit */
+    net_client *dead;           /* closed this loop iteration, freed after the batch */
+    char scratch[NET_BUF_SIZE];
+};
 
-    if (write(ci->fd, "AUTH OK\n", 8) < 0) {
-        perror("Auth ok write");
-        goto cleanup;
+static net_shard *shards;
+static net_server_opts server_opts;
+static net_listener unix_listener = { NET_EV_LISTENER, -1, AF_UNIX, NET_PROTO_TEXT };
+
+/* Paused on a worker pool, which still holds a pointer to c */
+static int client_waiting(const net_client *c)
+{
+    return c->state == NET_CLIENT_AUTH_PENDING || c->state == NET_CLIENT_ROUTING;
+}
+
+/* Defer the free: later events in the same epoll batch may still point at c */
+static void client_free(net_client *c)
+{
+    net_shard *sh = c->shard;
+
+    c->done_next = sh->dead;
+    sh->dead = c;
+    __atomic_fetch_sub(&num_connections, 1, __ATOMIC_RELAXED);
+}
+
+static void shard_reap(net_shard *sh)
+{
+    while (sh->dead) {
+        net_client *c = sh->dead;
+        sh->dead = c->done_next;
+        free(c->wbuf);
+        free(c->txn);
+        free(c);
     }
+}
 
-    /* ---- STEP 2: READ COMMAND ---- */
-    memset(buf, 0, sizeof(buf));
-    n = read(ci->fd, buf, sizeof(buf) - 1);
-    if (n <= 0)
-        goto cleanup;
+/**
+ * Tear down a connection. A client with credentials still on the auth
+ * pool, or a request on the router workers, is only detached here; it
+ * is freed when the completion arrives.
+ */
+static void client_close(net_client *c)
+{
+    net_shard *sh = c->shard;
 
-    buf[n] = '\0';
+    if (c->fd >= 0) {
+        epoll_ctl(sh->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    if (c->watch || c->repl) {
+        /* The feed thread cannot notify c after this, so unqueue it for good */
+        watch_client_close(c);
+        repl_client_close(c);
+        pthread_mutex_lock(&sh->done_lock);
+        if (c->notify_queued) {
+            net_client **pp = &sh->notify_list;
+
+            while (*pp != c)
+                pp = &(*pp)->notify_next;
+            *pp = c->notify_next;
+            c->notify_queued = 0;
+        }
+        pthread_mutex_unlock(&sh->done_lock);
+    }
+
+    if (c->throttle_until) {
+        net_client **pp = &sh->throttled;
+
+        while (*pp != c)
+            pp = &(*pp)->throttle_next;
+        *pp = c->throttle_next;
+        c->throttle_until = 0;
+    }
+    if (c->inflight) {
+        admit_inflight_end();
+        c->inflight = 0;
+    }
+    admit_close(c->admit_ip);
+    admit_close(c->admit_user);
+    c->admit_ip = c->admit_user = NULL;
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else if (sh->clients == c)
+        sh->clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+
+    if (!client_waiting(c))
+        client_free(c);
+}
+
+/**
+ * Recompute epoll interest: stop reading while authentication or a
+ * routed request is pending, the input buffer is full, or too much
+ * output is queued.
+ */
+static void client_update_events(net_client *c)
+{
+    unsigned int ev = 0;
+    struct epoll_event e;
+
+    if (!client_waiting(c) && !c->close_after_flush && !c->eof &&
+        c->rend < sizeof(c->rbuf) && client_pending(c) < NET_WBUF_HIGH)
+        ev |= EPOLLIN;
+    if (client_pending(c) > 0)
+        ev |= EPOLLOUT;
+
+    if (ev == c->events)
+        return;
+    c->events = ev;
+    e.events = ev;
+    e.data.ptr = c;
+    epoll_ctl(c->shard->epfd, EPOLL_CTL_MOD, c->fd, &e);
+}
+
+/* Called on a worker thread: hand the client back to its shard */
+static void client_hand_back(net_client *c)
+{
+    net_shard *sh = c->shard;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&sh->done_lock);
+    c->done_next = sh->done_list;
+    sh->done_list = c;
+    pthread_mutex_unlock(&sh->done_lock);
+
+    if (write(sh->wake_fd, &one, sizeof(one)) < 0)
+        perror("net_server: eventfd write");
+}
+
+static void client_auth_done(int result, void *arg)
+{
+    net_client *c = arg;
+
+    c->auth_result = result;
+    client_hand_back(c);
+}
+
+/* Runs on a router worker: only c->route is touched until the hand-back */
+static void client_route_run(void *arg)
+{
+    net_client *c = arg;
+
+    c->route->run(c->route);
+    client_hand_back(c);
+}
+
+void net_client_route(net_client *c, net_route *r)
+{
+    c->route = r;
+    c->state = NET_CLIENT_ROUTING;
+    if (router_submit(client_route_run, c) == 0)
+        return;
+    /* No pool, or its queue is full: make the backend calls here */
+    c->route = NULL;
+    c->state = NET_CLIENT_READY;
+    r->run(r);
+    r->done(c, r);
+    free(r);
+}
+
+void net_client_notify(net_client *c)
+{
+    net_shard *sh = c->shard;
+    uint64_t one = 1;
+    int wake = 0;
 
-    /* Debug message */
-    snprintf(debug_msg, sizeof(debug_msg),
-             "[REMOTE] from %s:%d user:%s cmd: %.256s",
-             ci->addr, ci->port, username, buf);
+    pthread_mutex_lock(&sh->done_lock);
+    if (!c->notify_queued) {
+        c->notify_queued = 1;
+        c->notify_next = sh->notify_list;
+        sh->notify_list = c;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&sh->done_lock);
+
+    if (wake && write(sh->wake_fd, &one, sizeof(one)) < 0)
+        perror("net_server: eventfd write");
+}
+
+int net_client_auth(net_client *c, const char *user, const char *pass)
+{
+    int ret;
+
+    /* PAM runs on the auth pool; the shard keeps serving other clients */
+    c->state = NET_CLIENT_AUTH_PENDING;
+    ret = auth_submit(user, pass, c->addr, client_auth_done, c);
+    if (ret != 0)
+        c->state = NET_CLIENT_AUTH;
+    return ret;
+}
 
-    debug_send(debug_msg);
+int net_client_login(net_client *c)
+{
+    admit_slot *prev = c->admit_user;
+    int ret;
+
+    /* RESP clients may AUTH again on a live connection */
+    ret = admit_user_open(c->username, &c->admit_user);
+    admit_close(prev);
+    return ret;
+}
+
+static void client_handle_auth(net_client *c, char *line)
+{
+    char password[64];
+    char token[64];
+    int ret;
+
+    if (sscanf(line, "AUTH-TOKEN %63s", token) == 1) {
+        /* Session token from an earlier AUTH: no PAM round trip */
+        if (auth_token_check(token, c->username, sizeof(c->username)) != 0) {
+            client_puts(c, "AUTH FAIL\n");
+            c->close_after_flush = 1;
+            return;
+        }
+        if (net_client_login(c) != 0) {
+            client_puts(c, "AUTH BUSY\n");
+            c->close_after_flush = 1;
+            return;
+        }
+        c->state = NET_CLIENT_READY;
+        client_puts(c, "AUTH OK\n");
+    } else if (sscanf(line, "AUTH %63s %63s", c->username, password) == 2) {
+        ret = net_client_auth(c, c->username, password);
+        memset(password, 0, sizeof(password));
+        memset(line, 0, strlen(line));
+        if (ret != 0) {
+            client_puts(c, ret == AUTH_BUSY ? "AUTH BUSY\n" : "AUTH BACKOFF\n");
+            c->close_after_flush = 1;
+        }
+    } else {
+        client_puts(c, "ERROR: expected AUTH <user> <pass> or AUTH-TOKEN <token>\n");
+        c->close_after_flush = 1;
+    }
+}
+
+/* ROUTER NODES | ROUTER ADD <host:port> | ROUTER DONE, see router.h */
+static void client_cmd_router(net_client *c, const char *line)
+{
+    net_shard *sh = c->shard;
+    char node[272];
+    int ret;
+
+    if (!router_active()) {
+        client_puts(c, "ERROR: not running as a router\n");
+        return;
+    }
+    if (!strcmp(line, "ROUTER NODES")) {
+        router_format_nodes(sh->scratch, sizeof(sh->scratch));
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (sscanf(line, "ROUTER ADD %271s", node) == 1) {
+        ret = router_add_node(node);
+        if (ret == 0)
+            snprintf(sh->scratch, sizeof(sh->scratch), "ROUTER ADDED %s\n", node);
+        else if (ret == -EBUSY)
+            snprintf(sh->scratch, sizeof(sh->scratch),
+                     "ERROR: migration in progress, send ROUTER DONE first\n");
+        else
+            snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: router add: %s\n", strerror(-ret));
+        debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s router add %s: %d",
+                    c->addr, c->port, c->username, node, ret);
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (!strcmp(line, "ROUTER DONE")) {
+        ret = router_finish_migration();
+        if (ret == 0)
+            client_puts(c, "ROUTER SWEEPING\n");
+        else if (ret == -EALREADY)
+            client_puts(c, "ERROR: no migration in progress\n");
+        else if (ret == -EINPROGRESS)
+            client_puts(c, "ERROR: sweep in progress\n");
+        else
+            client_puts(c, "ERROR: cannot start the sweep\n");
+        return;
+    }
+    client_puts(c, "ERROR: use ROUTER NODES, ROUTER ADD <host:port> or ROUTER DONE\n");
+}
+
+/*
+ * multi | exec | discard | version <key>, and the insert/delete/check
+ * lines queued in between. The queued lines go to the kernel as one
+ * /proc/ht write at exec time (kv_exec_txn).
+ */
+static void client_cmd_txn(net_client *c, const char *line)
+{
+    net_shard *sh = c->shard;
+    char verb[16] = "", key[KV_MAX_KEY + 1], arg[KV_MAX_VALUE + 1];
+    unsigned long long version;
+    int n, ret;
+
+    n = sscanf(line, "%15s %63s %63s", verb, key, arg);
+    if (!strcmp(verb, "version")) {
+        if (n < 2) {
+            client_puts(c, "ERROR: missing key\n");
+            return;
+        }
+        ret = kv_version(key, &version);
+        if (ret == 0)
+            snprintf(sh->scratch, sizeof(sh->scratch), "VERSION %s %llu\n", key, version);
+        else
+            snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: version: %s\n", strerror(-ret));
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (!strcmp(verb, "multi")) {
+        if (c->txn) {
+            client_puts(c, "ERROR: multi calls can not be nested\n");
+            return;
+        }
+        c->txn = malloc(KV_TXN_MAX_BYTES + 1);
+        if (!c->txn) {
+            client_puts(c, "ERROR: out of memory\n");
+            return;
+        }
+        c->txn[0] = '\0';
+        c->txn_len = 0;
+        c->txn_ops = 0;
+        client_puts(c, "OK: multi\n");
+        return;
+    }
+    if (!c->txn) {
+        snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: %s without multi\n", verb);
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (!strcmp(verb, "exec") || !strcmp(verb, "discard")) {
+        if (verb[0] == 'd') {
+            client_puts(c, "OK: discard\n");
+        } else {
+            ret = c->txn_ops ? kv_exec_txn(c->txn) : 0;
+            if (ret == 0)
+                snprintf(sh->scratch, sizeof(sh->scratch), "OK: exec %d\n", c->txn_ops);
+            else if (ret == -ECANCELED)
+                snprintf(sh->scratch, sizeof(sh->scratch), "ABORTED: version check failed\n");
+            else if (ret == -EROFS)
+                snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: read-only replica\n");
+            else
+                snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: exec: %s\n", strerror(-ret));
+            debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s exec %d ops: %d",
+                        c->addr, c->port, c->username, c->txn_ops, ret);
+            client_puts(c, sh->scratch);
+        }
+        free(c->txn);
+        c->txn = NULL;
+        return;
+    }
+
+    if (!((!strcmp(verb, "insert") && n == 3) || (!strcmp(verb, "delete") && n == 2) ||
+          (!strcmp(verb, "check") && n == 3 && sscanf(arg, "%llu", &version) == 1))) {
+        snprintf(sh->scratch, sizeof(sh->scratch),
+                 "ERROR: inside multi use insert, delete, check <key> <version>, exec or discard\n");
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (c->txn_ops == KV_TXN_MAX_OPS) {
+        snprintf(sh->scratch, sizeof(sh->scratch),
+                 "ERROR: at most %d commands per transaction\n", KV_TXN_MAX_OPS);
+        client_puts(c, sh->scratch);
+        return;
+    }
+    n = snprintf(c->txn + c->txn_len, KV_TXN_MAX_BYTES + 1 - c->txn_len, "%s %s%s%s\n",
+                 verb, key, n == 3 ? " " : "", n == 3 ? arg : "");
+    /* Leave room for the "multi\n" and "exec\n" framing */
+    if (c->txn_len + (size_t)n + 11 > KV_TXN_MAX_BYTES) {
+        c->txn[c->txn_len] = '\0';
+        client_puts(c, "ERROR: transaction too large\n");
+        return;
+    }
+    c->txn_len += (size_t)n;
+    c->txn_ops++;
+    client_puts(c, "QUEUED\n");
+}
+
+/* scan <cursor> [count [match]] -> "SCAN <next> <n>" and n "key value" lines */
+static void client_cmd_scan(net_client *c, const char *line)
+{
+    net_shard *sh = c->shard;
+    char buf[KV_SCAN_REPLY_MAX], match[KV_MAX_KEY + 1] = "";
+    unsigned long long cursor, next;
+    int count = 10, n;
+
+    if (sscanf(line, "scan %llu %d %63s", &cursor, &count, match) < 1) {
+        client_puts(c, "ERROR: use scan <cursor> [count [match]]\n");
+        return;
+    }
+    n = kv_scan(cursor, count, match, &next, buf, sizeof(buf));
+    if (n < 0) {
+        snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: scan: %s\n", strerror(-n));
+        client_puts(c, sh->scratch);
+        return;
+    }
+    snprintf(sh->scratch, sizeof(sh->scratch), "SCAN %llu %d\n", next, n);
+    client_puts(c, sh->scratch);
+    client_puts(c, buf);
+}
+
+/* A text command for the router's backends, see net_client_route() */
+struct text_route {
+    net_route r;
+    char line[NET_BUF_SIZE];
+    char reply[NET_BUF_SIZE];
+};
+
+static void text_route_run(net_route *r)
+{
+    struct text_route *t = (struct text_route *)r;
+
+    forward_to_proc(t->line, t->reply, sizeof(t->reply));
+}
+
+static void text_route_done(net_client *c, net_route *r)
+{
+    client_puts(c, ((struct text_route *)r)->reply);
+}
+
+static int is_txn_command(const char *line)
+{
+    return !strcmp(line, "multi") || !strcmp(line, "exec") || !strcmp(line, "discard") ||
+           !strncmp(line, "version ", 8) || !strncmp(line, "check ", 6);
+}
+
+static void client_handle_line(net_client *c, char *line)
+{
+    net_shard *sh = c->shard;
+
+    if (c->state == NET_CLIENT_AUTH) {
+        client_handle_auth(c, line);
+        return;
+    }
+
+    if (line[0] == '\0')
+        return;
+    if (c->is_local && !strncmp(line, "AUTH", 4)) {
+        /* Local peers are authenticated by credentials; accept the usual handshake */
+        memset(line, 0, strlen(line));
+        client_puts(c, "AUTH OK\n");
+        return;
+    }
+    if (!strcmp(line, "QUIT") || !strcmp(line, "quit")) {
+        client_puts(c, "BYE\n");
+        c->close_after_flush = 1;
+        return;
+    }
+    if (c->shed) {
+        /* Over the in-flight cap: answer now rather than queue, see admit.h */
+        admit_count_shed();
+        client_puts(c, "BUSY\n");
+        return;
+    }
+    if (c->txn || is_txn_command(line)) {
+        client_cmd_txn(c, line);
+        return;
+    }
+    if (!strcmp(line, "BINARY")) {
+        /* Everything after this line is framed, see proto_bin.h */
+        client_puts(c, "BINARY OK\n");
+        c->proto = NET_PROTO_BINARY;
+        return;
+    }
+    if (!strcmp(line, "stats")) {
+        char stats[NET_STATS_SIZE];
+
+        if (net_format_stats(stats, sizeof(stats)) < 0)
+            client_puts(c, "ERROR: stats do not fit the reply buffer\n");
+        else
+            client_puts(c, stats);
+        return;
+    }
+    if (!strncmp(line, "watch ", 6)) {
+        char pattern[KV_MAX_KEY + 1];
+        int ret = -EINVAL;
+
+        if (sscanf(line + 6, "%63s", pattern) == 1)
+            ret = watch_add(c, pattern);
+        if (ret == 0)
+            snprintf(sh->scratch, sizeof(sh->scratch), "WATCHING %s\n", pattern);
+        else if (ret == -E2BIG)
+            snprintf(sh->scratch, sizeof(sh->scratch),
+                     "ERROR: at most %d watch patterns per connection\n", WATCH_MAX_PATTERNS);
+        else
+            snprintf(sh->scratch, sizeof(sh->scratch), "ERROR: watch: %s\n", strerror(-ret));
+        client_puts(c, sh->scratch);
+        return;
+    }
+    if (!strcmp(line, "REPLICATE")) {
+        /* From here on the connection carries the replication stream, see repl.h */
+        if (repl_attach(c) == 0) {
+            client_puts(c, "REPLICATING\n");
+        } else {
+            client_puts(c, "ERROR: cannot start replication\n");
+            c->close_after_flush = 1;
+        }
+        return;
+    }
+    if (!strncmp(line, "ROUTER", 6)) {
+        client_cmd_router(c, line);
+        return;
+    }
+    if (!strncmp(line, "scan ", 5)) {
+        client_cmd_scan(c, line);
+        return;
+    }
+    if (!strcmp(line, "unwatch") || !strncmp(line, "unwatch ", 8)) {
+        char pattern[KV_MAX_KEY + 1];
+        int n;
+
+        if (sscanf(line + 7, "%63s", pattern) == 1)
+            n = watch_remove(c, pattern);
+        else
+            n = watch_remove(c, NULL);
+        snprintf(sh->scratch, sizeof(sh->scratch), "UNWATCHED %d\n", n);
+        client_puts(c, sh->scratch);
+        return;
+    }
+
+    debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s cmd: %.160s",
+                c->addr, c->port, c->username, line);
+
+    if (router_active()) {
+        struct text_route *t = malloc(sizeof(*t));
+
+        if (t) {
+            t->r.run = text_route_run;
+            t->r.done = text_route_done;
+            snprintf(t->line, sizeof(t->line), "%s", line);
+            t->reply[0] = '\0';
+            net_client_route(c, &t->r);
+            return;
+        }
+    }
 
     /* Forward command */
-    memset(response, 0, sizeof(response));
-    forward_to_proc(buf, response, sizeof(response));
+    sh->scratch[0] = '\0';
+    forward_to_proc(line, sh->scratch, sizeof(sh->scratch));
+    client_puts(c, sh->scratch);
+}
+
+/**
+ * Execute one newline-terminated command from the input buffer.
+ * Returns 1 if a line was consumed, 0 if more input is needed.
+ */
+static int text_handle_request(net_client *c)
+{
+    char *start = c->rbuf + c->rstart;
+    char *nl = memchr(start, '\n', c->rend - c->rstart);
+
+    if (!nl)
+        return 0;
+    *nl = '\0';
+    if (nl > start && nl[-1] == '\r')
+        nl[-1] = '\0';
+    c->rstart = (size_t)(nl - c->rbuf) + 1;
+    client_handle_line(c, start);
+    return 1;
+}
+
+/* Rate limited: leave the rest of the input until the bucket has refilled */
+static void client_throttle(net_client *c, unsigned int wait_ms)
+{
+    net_shard *sh = c->shard;
+
+    c->throttle_until = metrics_now_us() + (unsigned long long)wait_ms * 1000;
+    c->throttle_counted = 0;
+    c->throttle_next = sh->throttled;
+    sh->throttled = c;
+}
+
+/**
+ * Parse and execute every complete request in the input buffer, then try
+ * to write out the responses. Closes the client when it is finished.
+ */
+static void client_process(net_client *c)
+{
+    while ((c->state == NET_CLIENT_AUTH || c->state == NET_CLIENT_READY) &&
+           !c->close_after_flush && client_pending(c) < NET_WBUF_HIGH) {
+        int consumed, counter, ready = c->state == NET_CLIENT_READY;
+        unsigned int wait_ms;
+
+        if (c->throttle_until) {
+            if (c->rstart < c->rend && !c->throttle_counted) {
+                admit_count_throttled();
+                c->throttle_counted = 1;
+            }
+            break;
+        }
+        if (c->proto == NET_PROTO_BINARY) {
+            counter = METRIC_REQ_BINARY;
+            consumed = bin_handle_request(c);
+        } else if (c->proto == NET_PROTO_RESP) {
+            counter = METRIC_REQ_RESP;
+            consumed = resp_handle_request(c);
+        } else {
+            counter = METRIC_REQ_TEXT;
+            consumed = text_handle_request(c);
+        }
+        if (!consumed)
+            break;
+        metrics_inc(counter);
+        if (ready && (wait_ms = admit_charge(c->admit_ip, c->admit_user)) > 0)
+            client_throttle(c, wait_ms);
+    }
+    /* A routed request stays in flight until its reply is written */
+    if (c->inflight && c->state != NET_CLIENT_ROUTING) {
+        admit_inflight_end();
+        c->inflight = 0;
+    }
+    c->shed = 0;
+    if (c->eof && !client_waiting(c) && !c->throttle_until)
+        c->close_after_flush = 1;
 
-    if(write(ci->fd, response, strlen(response)) < 0) {
-        perror("response write");
-        goto cleanup;
+    if (c->rstart == c->rend) {
+        c->rstart = c->rend = 0;
+    } else if (c->rstart > 0) {
+        memmove(c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+        c->rend -= c->rstart;
+        c->rstart = 0;
+    } else if (c->rend == sizeof(c->rbuf) && !c->throttle_until) {
+        client_puts(c, c->proto == NET_PROTO_RESP ? "-ERR Protocol error: request too large\r\n"
+                                                  : "ERROR: line too long\n");
+        c->close_after_flush = 1;
     }
 
-cleanup:
-    close(ci->fd);
-    free(ci);
-    return NULL;
+    /* Refill from the watch queue for as long as the socket takes it all */
+    for (;;) {
+        int more = 0;
+
+        if (c->watch && !c->close_after_flush)
+            more = watch_flush(c);
+        if (c->repl && !c->close_after_flush)
+            more |= repl_flush(c);
+        if (client_flush(c) < 0) {
+            client_close(c);
+            return;
+        }
+        if (!more || client_pending(c) > 0)
+            break;
+    }
+    if (c->close_after_flush && client_pending(c) == 0 && !client_waiting(c)) {
+        client_close(c);
+        return;
+    }
+    client_update_events(c);
 }
 
-void *net_server_run(void *arg)
+static void client_on_readable(net_client *c)
 {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    int client_fd;
+    while (c->rend < sizeof(c->rbuf)) {
+        ssize_t n = read(c->fd, c->rbuf + c->rend, sizeof(c->rbuf) - c->rend);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client_close(c);
+            return;
+        }
+        if (n == 0) {
+            /* Peer is done sending: answer what arrived, then close */
+            c->eof = 1;
+            break;
+        }
+        c->rend += (size_t)n;
+    }
+    c->last_active = time(NULL);
+    client_process(c);
+}
 
-    (void)arg;
+/*
+ * Local clients are authenticated by their socket credentials instead of
+ * a password. With no allowlist configured only the daemon's own uid
+ * (and root) may connect.
+ */
+#ifndef SO_PEERGROUPS
+#define SO_PEERGROUPS 59
+#endif
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("net_server: socket");
-        return NULL;
+/*
+ * Supplementary groups of a Unix socket peer, in a malloc'd array the
+ * caller frees. SO_PEERGROUPS reports the groups the peer held at
+ * connect(); before Linux 4.13 fall back to the groups the user
+ * database lists for its uid.
+ * @return the number of groups, or -1
+ */
+static int peer_groups(int fd, uid_t uid, gid_t **out)
+{
+    struct passwd pw, *res = NULL;
+    char pwbuf[1024];
+    socklen_t len = 0;
+    gid_t *groups;
+    int n, want;
+
+    *out = NULL;
+    /* A zero-length probe fails with ERANGE and the size needed */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS, NULL, &len) == 0)
+        return 0;
+    if (errno == ERANGE) {
+        groups = malloc(len);
+        if (!groups)
+            return -1;
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS, groups, &len) < 0) {
+            free(groups);
+            return -1;
+        }
+        *out = groups;
+        return (int)(len / sizeof(gid_t));
+    }
+    if (errno != ENOPROTOOPT)
+        return -1;
+
+    if (getpwuid_r(uid, &pw, pwbuf, sizeof(pwbuf), &res) != 0 || !res)
+        return -1;
+    for (n = 32;;) {
+        want = n;
+        groups = malloc((size_t)n * sizeof(gid_t));
+        if (!groups)
+            return -1;
+        if (getgrouplist(pw.pw_name, pw.pw_gid, groups, &n) >= 0)
+            break;
+        free(groups);
+        if (n <= want)
+            return -1;
+    }
+    *out = groups;
+    return n;
+}
+
+static int gid_allowed(gid_t gid)
+{
+    for (int i = 0; i < server_opts.n_allow_gids; i++) {
+        if (server_opts.allow_gids[i] == gid)
+            return 1;
+    }
+    return 0;
+}
+
+/* --unix-allow-gid matches the peer's primary or any supplementary group */
+static int local_peer_allowed(int fd, const struct ucred *cred)
+{
+    gid_t *groups;
+    int i, n, ok = 0;
+
+    if (!server_opts.n_allow_uids && !server_opts.n_allow_gids)
+        return cred->uid == 0 || cred->uid == geteuid();
+
+    for (i = 0; i < server_opts.n_allow_uids; i++) {
+        if (server_opts.allow_uids[i] == cred->uid)
+            return 1;
     }
+    if (!server_opts.n_allow_gids)
+        return 0;
+    if (gid_allowed(cred->gid))
+        return 1;
+
+    n = peer_groups(fd, cred->uid, &groups);
+    for (i = 0; i < n && !ok; i++)
+        ok = gid_allowed(groups[i]);
+    free(groups);
+    return ok;
+}
+
+static void shard_accept(net_shard *sh, net_listener *l)
+{
+    for (;;) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        struct epoll_event e;
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        net_client *c;
+        int optval = 1;
+        int fd;
+
+        fd = accept4(l->fd, (struct sockaddr *)&client_addr, &client_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("net_server: accept");
+            return;
+        }
+
+        if (l->family == AF_UNIX &&
+            (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+             !local_peer_allowed(fd, &cred))) {
+            if (write(fd, "AUTH FAIL\n", 10) < 0) {
+                /* nothing more to tell this peer */
+            }
+            close(fd);
+            continue;
+        }
+
+        c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        c->ev_type = NET_EV_CLIENT;
+        c->fd = fd;
+        c->shard = sh;
+        c->proto = l->proto;
+        c->last_active = time(NULL);
+
+        if (l->family == AF_UNIX) {
+            struct passwd pw, *res = NULL;
+            char pwbuf[1024];
+
+            /* Already authenticated by SO_PEERCRED: no AUTH line needed */
+            c->state = NET_CLIENT_READY;
+            c->is_local = 1;
+            snprintf(c->addr, sizeof(c->addr), "unix");
+            c->port = (int)cred.pid;
+            if (getpwuid_r(cred.uid, &pw, pwbuf, sizeof(pwbuf), &res) == 0 && res)
+                snprintf(c->username, sizeof(c->username), "%s", pw.pw_name);
+            else
+                snprintf(c->username, sizeof(c->username), "uid:%u", (unsigned)cred.uid);
+            if (net_client_login(c) != 0) {
+                if (write(fd, "AUTH BUSY\n", 10) < 0) {
+                    /* nothing more to tell this peer */
+                }
+                close(fd);
+                free(c);
+                continue;
+            }
+        } else {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&client_addr;
+
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+            c->state = NET_CLIENT_AUTH;
+            inet_ntop(AF_INET, &sin->sin_addr, c->addr, sizeof(c->addr));
+            c->port = ntohs(sin->sin_port);
+            if (admit_ip_open(c->addr, &c->admit_ip) != 0) {
+                const char *msg = c->proto == NET_PROTO_RESP
+                                  ? "-ERR too many connections from this address\r\n"
+                                  : "BUSY too many connections from this address\n";
+
+                if (write(fd, msg, strlen(msg)) < 0) {
+                    /* nothing more to tell this peer */
+                }
+                close(fd);
+                free(c);
+                continue;
+            }
+        }
+
+        c->events = EPOLLIN;
+        e.events = c->events;
+        e.data.ptr = c;
+        if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+            perror("net_server: epoll_ctl");
+            close(fd);
+            admit_close(c->admit_ip);
+            admit_close(c->admit_user);
+            free(c);
+            continue;
+        }
+
+        c->next = sh->clients;
+        if (sh->clients)
+            sh->clients->prev = c;
+        sh->clients = c;
+        __atomic_fetch_add(&num_connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Flush clients the feed thread queued watch or replication events for */
+static void shard_drain_notify(net_shard *sh)
+{
+    net_client *c;
+
+    /* One at a time: the feed thread may requeue a client meanwhile */
+    for (;;) {
+        pthread_mutex_lock(&sh->done_lock);
+        c = sh->notify_list;
+        if (c) {
+            sh->notify_list = c->notify_next;
+            c->notify_next = NULL;
+            c->notify_queued = 0;
+        }
+        pthread_mutex_unlock(&sh->done_lock);
+        if (!c)
+            break;
+        client_process(c);
+    }
+}
+
+/* Apply auth results and routed requests handed back by the worker pools */
+static void shard_drain_done(net_shard *sh)
+{
+    net_client *list, *c;
+    uint64_t count;
+    char token[AUTH_TOKEN_LEN + 1];
+    char reply[64 + AUTH_TOKEN_LEN];
+
+    if (read(sh->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("net_server: eventfd read");
+
+    pthread_mutex_lock(&sh->done_lock);
+    list = sh->done_list;
+    sh->done_list = NULL;
+    pthread_mutex_unlock(&sh->done_lock);
+
+    while (list) {
+        c = list;
+        list = c->done_next;
+        c->done_next = NULL;
 
-    /* Allow address reuse */
+        if (c->fd < 0) {
+            /* Client went away while PAM or the backend calls were running */
+            free(c->route);
+            c->route = NULL;
+            client_free(c);
+            continue;
+        }
+
+        if (c->state == NET_CLIENT_ROUTING) {
+            net_route *r = c->route;
+
+            c->route = NULL;
+            c->state = NET_CLIENT_READY;
+            r->done(c, r);
+            free(r);
+            /* Requests pipelined behind it are still buffered */
+            client_process(c);
+            continue;
+        }
+
+        if (c->proto == NET_PROTO_RESP) {
+            resp_auth_done(c);
+        } else if (c->auth_result == 0 && net_client_login(c) != 0) {
+            c->state = NET_CLIENT_AUTH;
+            client_puts(c, "AUTH BUSY\n");
+            c->close_after_flush = 1;
+        } else if (c->auth_result == 0) {
+            c->state = NET_CLIENT_READY;
+            /* Hand out a session token when enabled: "AUTH OK <token>" */
+            if (auth_token_issue(c->username, token, sizeof(token)) == 0)
+                snprintf(reply, sizeof(reply), "AUTH OK %s\n", token);
+            else
+                snprintf(reply, sizeof(reply), "AUTH OK\n");
+            client_puts(c, reply);
+        } else {
+            c->state = NET_CLIENT_AUTH;
+            client_puts(c, "AUTH FAIL\n");
+            c->close_after_flush = 1;
+        }
+        /* Commands pipelined behind the AUTH line are already buffered */
+        client_process(c);
+    }
+}
+
+/* Runs once a second: close idle clients, send replication heartbeats */
+static void shard_sweep_idle(net_shard *sh, time_t now)
+{
+    net_client *c = sh->clients;
+
+    while (c) {
+        net_client *next = c->next;
+        if (c->repl) {
+            repl_heartbeat(c);
+            client_process(c);
+        } else if (!client_waiting(c) && !watch_active(c) &&
+                   now - c->last_active > NET_IDLE_TIMEOUT) {
+            client_close(c);
+        }
+        c = next;
+    }
+}
+
+static int shard_listen(net_listener *l, int port, int proto)
+{
+    struct sockaddr_in server_addr;
     int optval = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("net_server: socket");
+        return -1;
+    }
+
+    /* Every shard binds the same port; the kernel balances accepts between them */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("net_server: SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(KVSTORE_PORT);
+    server_addr.sin_port = htons((uint16_t)port);
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("net_server: bind");
-        close(server_fd);
-        server_fd = -1;
-        return NULL;
+        close(fd);
+        return -1;
     }
 
-    if (listen(server_fd, 5) < 0) {
+    if (listen(fd, SOMAXCONN) < 0) {
         perror("net_server: listen");
-        close(server_fd);
-        server_fd = -1;
-        return NULL;
+        close(fd);
+        return -1;
     }
 
-    /* Set a timeout on accept so we can check server_running periodically */
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    l->ev_type = NET_EV_LISTENER;
+    l->fd = fd;
+    l->family = AF_INET;
+    l->proto = proto;
+    return 0;
+}
 
-    while (server_running) {
-        client_len = sizeof(client_addr);
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue; /* timeout, check server_running */
-            }
-            perror("net_server: accept");
-            continue;
+/* The n-th inherited fd of a kind, or -1 */
+static int inherited_fd(char kind, int nth)
+{
+    for (int i = 0; i < n_inherit; i++) {
+        if (inherit_kinds[i] == kind && nth-- == 0)
+            return inherit_fds[i];
+    }
+    return -1;
+}
+
+static void listener_adopt(net_listener *l, int fd, int family, int proto)
+{
+    l->ev_type = NET_EV_LISTENER;
+    l->fd = fd;
+    l->family = family;
+    l->proto = proto;
+}
+
+static int unix_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "net_server: unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("net_server: unix socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path); /* stale socket from a previous run */
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("net_server: unix bind");
+        close(fd);
+        return -1;
+    }
+    /* Access is decided by the SO_PEERCRED allowlist, not file permissions */
+    chmod(path, 0666);
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("net_server: unix listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    unix_listener.fd = fd;
+    return 0;
+}
+
+/* Close whatever shard_init() opened; the shard thread is not running */
+static void shard_fini(net_shard *sh)
+{
+    if (sh->tcp.fd >= 0)
+        close(sh->tcp.fd);
+    if (sh->resp.fd >= 0)
+        close(sh->resp.fd);
+    if (sh->wake_fd >= 0)
+        close(sh->wake_fd);
+    if (sh->epfd >= 0)
+        close(sh->epfd);
+    sh->tcp.fd = sh->resp.fd = sh->wake_fd = sh->epfd = -1;
+    pthread_mutex_destroy(&sh->done_lock);
+}
+
+static int shard_init(net_shard *sh, int id, int cpu)
+{
+    struct epoll_event e;
+
+    memset(sh, 0, sizeof(*sh));
+    sh->ev_type = NET_EV_WAKE;
+    sh->id = id;
+    sh->cpu = cpu;
+    sh->tcp.fd = -1;
+    sh->resp.fd = -1;
+    pthread_mutex_init(&sh->done_lock, NULL);
+
+    sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+    sh->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->epfd < 0 || sh->wake_fd < 0) {
+        perror("net_server: epoll/eventfd");
+        goto fail;
+    }
+    if (inherited_fd(NET_FD_TCP, id) >= 0)
+        listener_adopt(&sh->tcp, inherited_fd(NET_FD_TCP, id), AF_INET, NET_PROTO_TEXT);
+    else if (shard_listen(&sh->tcp, server_opts.port > 0 ? server_opts.port : KVSTORE_PORT,
+                          NET_PROTO_TEXT) < 0)
+        goto fail;
+    /* Inherited RESP sockets are served even without --resp-port: clients may be queued on them */
+    if (inherited_fd(NET_FD_RESP, 0) >= 0) {
+        if (inherited_fd(NET_FD_RESP, id) >= 0)
+            listener_adopt(&sh->resp, inherited_fd(NET_FD_RESP, id), AF_INET, NET_PROTO_RESP);
+    } else if (server_opts.resp_port > 0 &&
+               shard_listen(&sh->resp, server_opts.resp_port, NET_PROTO_RESP) < 0) {
+        goto fail;
+    }
+
+    e.events = EPOLLIN;
+    e.data.ptr = &sh->tcp;
+    epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->tcp.fd, &e);
+    if (sh->resp.fd >= 0) {
+        e.events = EPOLLIN;
+        e.data.ptr = &sh->resp;
+        epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->resp.fd, &e);
+    }
+    e.events = EPOLLIN;
+    e.data.ptr = sh;
+    epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->wake_fd, &e);
+
+    /* The Unix socket is shared; EPOLLEXCLUSIVE wakes one shard per connection */
+    if (unix_listener.fd >= 0) {
+        e.events = EPOLLIN | EPOLLEXCLUSIVE;
+        e.data.ptr = &unix_listener;
+        epoll_ctl(sh->epfd, EPOLL_CTL_ADD, unix_listener.fd, &e);
+    }
+    sh->listening = 1;
+    return 0;
+
+fail:
+    shard_fini(sh);
+    return -1;
+}
+
+/*
+ * Draining: stop accepting. After a handoff the sockets live on in the
+ * other daemon, which accepts everything queued on them from now on.
+ */
+static void shard_stop_listening(net_shard *sh)
+{
+    net_listener *ls[] = { &sh->tcp, &sh->resp };
+
+    for (int i = 0; i < 2; i++) {
+        if (ls[i]->fd >= 0) {
+            epoll_ctl(sh->epfd, EPOLL_CTL_DEL, ls[i]->fd, NULL);
+            close(ls[i]->fd);
+            ls[i]->fd = -1;
         }
+    }
+    if (unix_listener.fd >= 0)
+        epoll_ctl(sh->epfd, EPOLL_CTL_DEL, unix_listener.fd, NULL);
+    sh->listening = 0;
+}
+
+/* Process rate-limited clients whose wait is over */
+static void shard_resume_throttled(net_shard *sh)
+{
+    unsigned long long now = metrics_now_us();
+    net_client **pp = &sh->throttled, *due = NULL, *c;
+
+    while ((c = *pp)) {
+        if (c->throttle_until <= now) {
+            *pp = c->throttle_next;
+            c->throttle_until = 0;
+            c->throttle_next = due;
+            due = c;
+        } else {
+            pp = &c->throttle_next;
+        }
+    }
+    /* c may be throttled again meanwhile, onto sh->throttled */
+    while ((c = due)) {
+        due = c->throttle_next;
+        c->throttle_next = NULL;
+        client_process(c);
+    }
+}
+
+/* epoll timeout: a second, or until the next throttled client is due */
+static int shard_timeout(net_shard *sh)
+{
+    unsigned long long now = metrics_now_us();
+    int timeout = 1000;
+
+    for (net_client *c = sh->throttled; c; c = c->throttle_next) {
+        unsigned long long ms = c->throttle_until > now ? (c->throttle_until - now + 999) / 1000 : 0;
 
-        /* Allocate client info and spawn a handler thread */
-        client_info *ci = malloc(sizeof(client_info));
-        if (!ci) {
-            close(client_fd);
+        if (ms < (unsigned long long)timeout)
+            timeout = (int)ms;
+    }
+    return timeout;
+}
+
+/*
+ * Every client with input in this batch is in flight until processed,
+ * so the count includes requests still waiting behind others. Those
+ * over the cap are answered BUSY.
+ */
+static void shard_admit_batch(struct epoll_event *events, int n)
+{
+    for (int i = 0; i < n; i++) {
+        net_client *c = events[i].data.ptr;
+
+        if (c->ev_type != NET_EV_CLIENT || !(events[i].events & EPOLLIN) ||
+            c->fd < 0 || c->inflight)
             continue;
+        c->inflight = 1;
+        if (admit_inflight_begin() != 0)
+            c->shed = 1;
+    }
+}
+
+/* Draining: close connections with nothing in flight, and all of them past the deadline */
+static void shard_drain_clients(net_shard *sh, time_t now)
+{
+    net_client *c = sh->clients;
+
+    while (c) {
+        net_client *next = c->next;
+
+        if (now >= drain_deadline)
+            client_close(c);
+        else if (!client_waiting(c) && !c->txn && c->rstart == c->rend &&
+                 client_pending(c) == 0 && now - c->last_active >= NET_DRAIN_IDLE)
+            client_close(c);
+        c = next;
+    }
+}
+
+static void *shard_run(void *arg)
+{
+    net_shard *sh = arg;
+    struct epoll_event events[NET_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    cpu_set_t set;
+    int i, n;
+
+    if (sh->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "net_server: shard %d could not pin to cpu %d\n", sh->id, sh->cpu);
+    }
+
+    while (server_running) {
+        n = epoll_wait(sh->epfd, events, NET_MAX_EVENTS, sh->throttled ? shard_timeout(sh) : 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("net_server: epoll_wait");
+            break;
         }
-        ci->fd = client_fd;
-        inet_ntop(AF_INET, &client_addr.sin_addr, ci->addr, sizeof(ci->addr));
-        ci->port = ntohs(client_addr.sin_port);
+        if (n > 0 && admit_inflight_limited())
+            shard_admit_batch(events, n);
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, ci) != 0) {
-            perror("net_server: pthread_create");
-            close(client_fd);
-            free(ci);
-        } else {
-            pthread_detach(tid); /* auto-cleanup when thread finishes */
+        for (i = 0; i < n; i++) {
+            int type = *(int *)events[i].data.ptr;
+
+            if (type == NET_EV_LISTENER) {
+                shard_accept(sh, events[i].data.ptr);
+            } else if (type == NET_EV_WAKE) {
+                shard_drain_done(sh);
+                shard_drain_notify(sh);
+            } else {
+                net_client *c = events[i].data.ptr;
+
+                if (c->fd < 0)
+                    continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+                    !(events[i].events & EPOLLIN)) {
+                    client_close(c);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    client_on_readable(c);
+                } else if (events[i].events & EPOLLOUT) {
+                    /* Output drained: may unblock reading and queued input */
+                    if (client_flush(c) < 0)
+                        client_close(c);
+                    else
+                        client_process(c);
+                }
+            }
+        }
+
+        if (sh->throttled)
+            shard_resume_throttled(sh);
+
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            shard_sweep_idle(sh, now);
+            last_sweep = now;
         }
+        if (server_draining) {
+            if (sh->listening)
+                shard_stop_listening(sh);
+            shard_drain_clients(sh, now);
+        }
+        shard_reap(sh);
+        if (server_draining && !sh->clients)
+            break;
     }
 
-    close(server_fd);
-    server_fd = -1;
+    while (sh->clients)
+        client_close(sh->clients);
+    shard_reap(sh);
+    if (sh->tcp.fd >= 0)
+        close(sh->tcp.fd);
+    if (sh->resp.fd >= 0)
+        close(sh->resp.fd);
     return NULL;
 }
 
-void net_server_stop(void)
+/* Pick the n-th CPU this process may run on, or -1 */
+static int nth_allowed_cpu(int n)
 {
-    server_running = 0;
-    if (server_fd >= 0) {
-        close(server_fd);
-        server_fd = -1;
+    cpu_set_t set;
+    int cpu, seen = 0, count;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return -1;
+    count = CPU_COUNT(&set);
+    if (count == 0)
+        return -1;
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && seen++ == n)
+            return cpu;
     }
+    return -1;
 }
 
-static int pam_password_conv(int num_msg, const struct pam_message **msg,
-                             struct pam_response **resp, void *appdata_ptr)
+/* Let net_server_wait_started() return */
+static void net_server_started(int n)
 {
-    struct pam_response *replies;
-    const char *password = appdata_ptr;
-    int i;
+    pthread_mutex_lock(&start_lock);
+    num_shards = n;
+    start_done = 1;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_lock);
+}
+
+void *net_server_run(void *arg)
+{
+    net_server_opts *opts = arg;
+    int n;
+    int i, started = 0;
+
+    if (opts)
+        server_opts = *opts;
+    n = server_opts.shards;
+    if (inherited_fd(NET_FD_TCP, 0) >= 0) {
+        for (n = 0; inherited_fd(NET_FD_TCP, n) >= 0; n++)
+            ;
+        if (server_opts.shards > 0 && server_opts.shards != n)
+            fprintf(stderr, "net_server: using %d shards, one per inherited listener\n", n);
+    }
+
+    if (n <= 0)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+    if (n > NET_MAX_SHARDS)
+        n = NET_MAX_SHARDS;
 
-    if (!msg || !resp || !password || num_msg <= 0)
-        return PAM_CONV_ERR;
+    shards = calloc((size_t)n, sizeof(*shards));
+    if (!shards) {
+        net_server_started(0);
+        return NULL;
+    }
 
-    replies = calloc((size_t)num_msg, sizeof(*replies));
-    if (!replies)
-        return PAM_CONV_ERR;
+    if (inherited_fd(NET_FD_UNIX, 0) >= 0)
+        listener_adopt(&unix_listener, inherited_fd(NET_FD_UNIX, 0), AF_UNIX, NET_PROTO_TEXT);
+    else if (server_opts.unix_path)
+        unix_listen(server_opts.unix_path);
 
-    for (i = 0; i < num_msg; i++) {
-        switch (msg[i]->msg_style) {
-        case PAM_PROMPT_ECHO_OFF:
-        case PAM_PROMPT_ECHO_ON:
-            replies[i].resp = strdup(password);
-            if (!replies[i].resp)
-                goto fail;
+    for (i = 0; i < n; i++) {
+        if (shard_init(&shards[i], i, nth_allowed_cpu(i)) < 0)
             break;
-        case PAM_TEXT_INFO:
-        case PAM_ERROR_MSG:
-            replies[i].resp = NULL;
+        if (pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]) != 0) {
+            perror("net_server: pthread_create");
+            shard_fini(&shards[i]);
             break;
-        default:
-            goto fail;
         }
+        started++;
     }
+    net_server_started(started);
 
-    *resp = replies;
-    return PAM_SUCCESS;
+    for (i = 0; i < started; i++)
+        pthread_join(shards[i].thread, NULL);
 
-fail:
-    for (i = 0; i < num_msg; i++)
-        free(replies[i].resp);
-    free(replies);
-    return PAM_CONV_ERR;
+    if (unix_listener.fd >= 0) {
+        close(unix_listener.fd);
+        unix_listener.fd = -1;
+        if (server_opts.unix_path && !listeners_handed_off)
+            unlink(server_opts.unix_path);
+    }
+    return NULL;
 }
 
-int authenticate_user(const char *user, const char *pass)
+void net_server_stop(void)
 {
-    pam_handle_t *pamh = NULL;
-    struct pam_conv conv = { pam_password_conv, (void *)pass };
+    server_running = 0;
+}
 
-    int ret = pam_start("login", user, &conv, &pamh);
-    if (ret != PAM_SUCCESS)
-        return -1;
+void net_server_inherit(const int *fds, const char *kinds, int n)
+{
+    n_inherit = 0;
+    for (int i = 0; i < n && n_inherit < NET_MAX_LISTENERS; i++) {
+        if (kinds[i] == NET_FD_TCP || kinds[i] == NET_FD_RESP || kinds[i] == NET_FD_UNIX) {
+            inherit_fds[n_inherit] = fds[i];
+            inherit_kinds[n_inherit++] = kinds[i];
+        }
+    }
+}
+
+int net_server_listeners(int *fds, char *kinds, int max)
+{
+    int n = 0;
+
+    for (int i = 0; i < num_shards; i++) {
+        if (shards[i].tcp.fd >= 0 && n < max) {
+            fds[n] = shards[i].tcp.fd;
+            kinds[n++] = NET_FD_TCP;
+        }
+        if (shards[i].resp.fd >= 0 && n < max) {
+            fds[n] = shards[i].resp.fd;
+            kinds[n++] = NET_FD_RESP;
+        }
+    }
+    if (unix_listener.fd >= 0 && n < max) {
+        fds[n] = unix_listener.fd;
+        kinds[n++] = NET_FD_UNIX;
+    }
+    return n;
+}
 
-    ret = pam_authenticate(pamh, 0);
-    if (ret == PAM_SUCCESS)
-        ret = pam_acct_mgmt(pamh, 0);
+int net_server_wait_started(void)
+{
+    pthread_mutex_lock(&start_lock);
+    while (!start_done)
+        pthread_cond_wait(&start_cond, &start_lock);
+    pthread_mutex_unlock(&start_lock);
+    return num_shards;
+}
 
-    pam_end(pamh, ret);
+void net_server_drain(int timeout, int handed_off)
+{
+    uint64_t one = 1;
 
-    return (ret == PAM_SUCCESS) ? 0 : -1;
-}
\ No newline at end of file
+    listeners_handed_off = handed_off;
+    drain_deadline = time(NULL) + timeout;
+    server_draining = 1;
+    /* Wake every shard so it stops accepting now, not at its next timeout */
+    for (int i = 0; i < num_shards; i++) {
+        if (write(shards[i].wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("net_server: drain wakeup");
+    }
+}
@@ -2,47 +2,228 @@
 #define NET_SERVER_H
 
 #define KVSTORE_PORT 5555
-#define NET_BUF_SIZE 512
+#define NET_BUF_SIZE 2048
+#define NET_STATS_SIZE 4096         /* a net_format_stats() line, about 2.4 KB at most */
+#define NET_RBUF_SIZE 8192
+#define NET_WBUF_SIZE 8192
+#define NET_WBUF_HIGH (256 * 1024)  /* stop reading a client with this much unsent output */
+#define NET_IDLE_TIMEOUT 60
+#define NET_DRAIN_IDLE 1            /* seconds of quiet before a draining client is closed */
+#define NET_MAX_EVENTS 128
+#define NET_MAX_SHARDS 256
+#define NET_MAX_ALLOW 32
+#define NET_MAX_LISTENERS (2 * NET_MAX_SHARDS + 1)
+
+/* Listening socket kinds, see net_server_listeners() */
+#define NET_FD_TCP 't'
+#define NET_FD_RESP 'r'
+#define NET_FD_UNIX 'u'
 
-#include <security/pam_appl.h>
-#include <security/pam_misc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/types.h>
 #include "debug_net.h"
+#include "auth.h"
+#include "kvproc.h"
+#include "metrics.h"
+#include "watch.h"
+#include "kvcache.h"
+#include "repl.h"
+#include "replica.h"
+#include "router.h"
+#include "admit.h"
 
-/* Per-client connection info passed to the handler thread */
-typedef struct {
+/* Client connection states */
+enum {
+    NET_CLIENT_AUTH,            /* waiting for AUTH / AUTH-TOKEN line */
+    NET_CLIENT_AUTH_PENDING,    /* credentials queued on the auth pool */
+    NET_CLIENT_READY,           /* authenticated, serving commands */
+    NET_CLIENT_ROUTING,         /* request queued on the router workers */
+};
+
+/* Wire protocol spoken on a connection */
+enum {
+    NET_PROTO_TEXT,             /* newline-delimited commands */
+    NET_PROTO_BINARY,           /* length-prefixed frames, see proto_bin.h */
+    NET_PROTO_RESP,             /* Redis RESP2 subset, see proto_resp.h */
+};
+
+typedef struct net_shard net_shard;
+struct net_client;
+
+/*
+ * A request for the router's backends (see router.h). run() makes the
+ * backend calls on a router worker; done() writes the reply on the
+ * client's shard. Protocol handlers put this first in their own job.
+ */
+typedef struct net_route {
+    void (*run)(struct net_route *r);
+    void (*done)(struct net_client *c, struct net_route *r);
+} net_route;
+
+/*
+ * Per-client connection, owned by exactly one shard. Input is parsed
+ * from rbuf; responses accumulate in wbuf and are written out when the
+ * socket is writable, so pipelined requests are answered in order with
+ * few writes.
+ */
+typedef struct net_client {
+    int ev_type;                /* must be first: epoll dispatch tag */
     int fd;
     char addr[INET_ADDRSTRLEN];
     int port;
-} client_info;
+    int state;
+    int proto;
+    int close_after_flush;
+    int eof;                    /* peer shut down its sending side */
+    int is_local;               /* Unix socket peer, authenticated by SO_PEERCRED */
+    int auth_result;
+    unsigned int events;        /* current epoll interest */
+    time_t last_active;
+    char username[64];
+    net_shard *shard;
+    struct net_client *prev;
+    struct net_client *next;
+    struct net_client *done_next;   /* auth and routing completion list */
+    net_route *route;               /* request on the router workers, NULL if none */
+    struct watch_sub *watch;        /* watch subscriptions, NULL if none */
+    struct repl_peer *repl;         /* set once the peer sent REPLICATE */
+    struct net_client *notify_next; /* shard's list of clients with queued events */
+    int notify_queued;              /* on that list; guarded by the shard's done_lock */
+    admit_slot *admit_ip;           /* per-IP limits, NULL if none apply */
+    admit_slot *admit_user;         /* per-user limits, from login */
+    unsigned long long throttle_until; /* metrics_now_us() to resume at; 0 = not throttled */
+    struct net_client *throttle_next;  /* shard's list of throttled clients */
+    int throttle_counted;           /* held-back input counted for this pause */
+    int inflight;                   /* counted against the in-flight cap */
+    int shed;                       /* answer BUSY to what this read delivered */
+    char *txn;                      /* queued "multi" lines, NULL outside a transaction */
+    size_t txn_len;
+    int txn_ops;
+    char rbuf[NET_RBUF_SIZE];
+    size_t rstart;
+    size_t rend;
+    char *wbuf;
+    size_t woff;
+    size_t wlen;
+    size_t wcap;
+} net_client;
 
+/* Options for net_server_run() */
+typedef struct {
+    int port;                   /* TCP port; 0 = KVSTORE_PORT */
+    int shards;                 /* listener threads; 0 = number of online CPUs */
+    int resp_port;              /* extra port speaking RESP, 0 = disabled */
+    const char *unix_path;      /* AF_UNIX listener path, NULL = disabled */
+    uid_t allow_uids[NET_MAX_ALLOW];
+    int n_allow_uids;
+    gid_t allow_gids[NET_MAX_ALLOW];
+    int n_allow_gids;
+} net_server_opts;
 
 int forward_to_proc(const char *cmd, char *response, size_t resp_len);
 
-void *handle_client(void *arg);
+int net_format_stats(char *out, size_t outlen);
+
 /**
- * Start the UDP server that listens for remote key-value commands.
+ * Current number of shards and open client connections.
+ */
+void net_get_counts(int *shards, long *connections);
+
+/**
+ * Queue response bytes for a client; they are written out by its shard.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int net_client_write(net_client *c, const char *data, size_t len);
+
+/**
+ * Ask the client's shard to flush queued watch or replication events.
+ * Safe to call from any thread while the client is registered with the
+ * watch or replication module.
+ */
+void net_client_notify(net_client *c);
+
+/**
+ * Queue a credential check for a client. Input processing pauses until
+ * the result arrives; the shard then sets c->auth_result and calls the
+ * protocol's completion handler.
+ * @return 0 if queued, AUTH_BUSY or AUTH_BACKOFF if rejected.
+ */
+int net_client_auth(net_client *c, const char *user, const char *pass);
+
+/**
+ * Hand a request to the router workers. Input processing pauses until
+ * r->done() has run on the shard, so replies keep their order. If no
+ * worker can take it, r runs on the calling thread.
+ * @param r  from malloc(); freed after r->done(), or without calling
+ *           it if the client has gone away meanwhile.
+ */
+void net_client_route(net_client *c, net_route *r);
+
+/**
+ * Count a client that just authenticated against its user's connection
+ * limit (see admit.h). On failure the caller answers and closes.
+ * @return 0 if admitted, -1 if the user has too many connections.
+ */
+int net_client_login(net_client *c);
+
+/**
+ * Start the TCP server for remote key-value commands.
+ * Opens one SO_REUSEPORT listener per shard on the port (KVSTORE_PORT by default); each shard
+ * is a thread pinned to one CPU running its own epoll loop, so the
+ * kernel spreads connections without a shared accept queue. An optional
+ * AF_UNIX listener serves local clients authenticated by SO_PEERCRED.
  * Commands received are forwarded to /proc/ht.
- * Responses are sent back to the sender.
- * This function blocks; run it in a separate thread.
+ * This function blocks until net_server_stop(); run it in a separate thread.
+ * @param arg  net_server_opts pointer, or NULL for defaults.
  */
 void *net_server_run(void *arg);
 
 /**
- * Stop the UDP server gracefully.
+ * Stop the TCP server gracefully.
  */
 void net_server_stop(void);
 
-int authenticate_user(const char *user, const char *pass);
+/**
+ * Serve on listening sockets taken over from another daemon instead of
+ * opening new ones. Call before net_server_run(). There is one shard per
+ * inherited TCP socket, whatever opts->shards says, so no socket of the
+ * SO_REUSEPORT group is left without a thread accepting on it.
+ * @param kinds  NET_FD_* of each fd; others are ignored.
+ */
+void net_server_inherit(const int *fds, const char *kinds, int n);
+
+/**
+ * Listening sockets of the running server: TCP and RESP per shard, then
+ * the Unix socket. They stay owned by the server.
+ * @return number of fds stored, at most max.
+ */
+int net_server_listeners(int *fds, char *kinds, int max);
+
+/**
+ * Wait until net_server_run() is accepting on all shards.
+ * @return number of shards started, 0 if it failed.
+ */
+int net_server_wait_started(void);
+
+/**
+ * Stop accepting and let the server finish: each connection is closed
+ * once it has been quiet for NET_DRAIN_IDLE with no request or reply in
+ * flight, and the rest after timeout seconds. net_server_run() returns
+ * when the last one is gone.
+ * @param handed_off  the listeners now belong to another daemon; keep
+ *                    the Unix socket path in place.
+ */
+void net_server_drain(int timeout, int handed_off);
 
 #endif /* NET_SERVER_H */
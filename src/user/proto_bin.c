@@ -0,0 +1,209 @@
+#include "proto_bin.h"
+#include "net_server.h"
+
+static void bin_reply(net_client *c, const kv_bin_hdr *req, int status,
+                      const char *value, size_t value_len)
+{
+    kv_bin_hdr h;
+
+    h.magic = KV_BIN_MAGIC_RES;
+    h.opcode = req->opcode;
+    h.status = htons((uint16_t)status);
+    h.request_id = htonl(req->request_id);
+    h.key_len = 0;
+    h.reserved = 0;
+    h.value_len = htonl((uint32_t)value_len);
+
+    net_client_write(c, (const char *)&h, sizeof(h));
+    if (value_len)
+        net_client_write(c, value, value_len);
+}
+
+/* Malformed stream: answer once, drop the rest of the input and close */
+static void bin_protocol_error(net_client *c, const kv_bin_hdr *req)
+{
+    bin_reply(c, req, KV_BIN_EPROTO, NULL, 0);
+    c->rstart = c->rend;
+    c->close_after_flush = 1;
+}
+
+/* GET, SET or DEL, run on a router worker or inline, see bin_kv() */
+struct bin_route {
+    net_route r;
+    kv_bin_hdr h;
+    char key[KV_MAX_KEY + 1];
+    char value[KV_MAX_VALUE + 1];
+    int ret;
+};
+
+static void bin_route_run(net_route *r)
+{
+    struct bin_route *b = (struct bin_route *)r;
+
+    if (b->h.opcode == KV_BIN_OP_GET)
+        b->ret = kv_lookup(b->key, b->value, sizeof(b->value));
+    else if (b->h.opcode == KV_BIN_OP_SET)
+        b->ret = kv_insert(b->key, b->value);
+    else
+        b->ret = kv_remove(b->key);
+}
+
+static void bin_route_done(net_client *c, net_route *r)
+{
+    struct bin_route *b = (struct bin_route *)r;
+
+    if (b->h.opcode == KV_BIN_OP_GET && b->ret == 0)
+        bin_reply(c, &b->h, KV_BIN_OK, b->value, strlen(b->value));
+    else if (b->ret == -ENOENT)
+        bin_reply(c, &b->h, KV_BIN_NOT_FOUND, NULL, 0);
+    else
+        bin_reply(c, &b->h, b->ret == 0 ? KV_BIN_OK : KV_BIN_EIO, NULL, 0);
+}
+
+/* On a router the backend calls leave the shard, see net_client_route() */
+static void bin_kv(net_client *c, const kv_bin_hdr *h, const char *key, const char *value)
+{
+    struct bin_route local, *b = router_active() ? malloc(sizeof(*b)) : NULL;
+
+    if (!b)
+        b = &local;
+    b->r.run = bin_route_run;
+    b->r.done = bin_route_done;
+    b->h = *h;
+    snprintf(b->key, sizeof(b->key), "%s", key);
+    snprintf(b->value, sizeof(b->value), "%s", value);
+    if (b != &local) {
+        net_client_route(c, &b->r);
+        return;
+    }
+    bin_route_run(&b->r);
+    bin_route_done(c, &b->r);
+}
+
+static void bin_scan(net_client *c, const kv_bin_hdr *h, const char *p)
+{
+    char match[KV_MAX_KEY + 1] = "", args[48];
+    char body[KV_SCAN_REPLY_MAX], out[KV_BIN_MAX_PAYLOAD];
+    unsigned long long cursor, next;
+    int count, n, len;
+
+    if ((h->key_len && !kv_valid_token(p, h->key_len, KV_MAX_KEY)) ||
+        h->value_len >= sizeof(args)) {
+        bin_reply(c, h, KV_BIN_EINVAL, NULL, 0);
+        return;
+    }
+    memcpy(match, p, h->key_len);
+    match[h->key_len] = '\0';
+    memcpy(args, p + h->key_len, h->value_len);
+    args[h->value_len] = '\0';
+    if (sscanf(args, "%llu %d", &cursor, &count) != 2 ||
+        count <= 0 || count > KV_BIN_SCAN_MAX_COUNT) {
+        bin_reply(c, h, KV_BIN_EINVAL, NULL, 0);
+        return;
+    }
+
+    n = kv_scan(cursor, count, match, &next, body, sizeof(body));
+    if (n < 0) {
+        bin_reply(c, h, n == -EOPNOTSUPP ? KV_BIN_EUNKNOWN : KV_BIN_EIO, NULL, 0);
+        return;
+    }
+    len = snprintf(out, sizeof(out), "%llu\n%s", next, body);
+    if (len >= (int)sizeof(out)) {
+        /* Only a pathologically long bucket chain gets here */
+        bin_reply(c, h, KV_BIN_EIO, NULL, 0);
+        return;
+    }
+    bin_reply(c, h, KV_BIN_OK, out, (size_t)len);
+}
+
+int bin_handle_request(net_client *c)
+{
+    const char *p = c->rbuf + c->rstart;
+    size_t avail = c->rend - c->rstart;
+    char key[KV_MAX_KEY + 1];
+    char value[KV_MAX_VALUE + 1];
+    char stats[NET_STATS_SIZE];
+    kv_bin_hdr h;
+    size_t payload;
+    int n;
+
+    if (avail < KV_BIN_HDR_LEN)
+        return 0;
+
+    memcpy(&h, p, sizeof(h));
+    h.status = ntohs(h.status);
+    h.request_id = ntohl(h.request_id);
+    h.key_len = ntohs(h.key_len);
+    h.value_len = ntohl(h.value_len);
+
+    payload = (size_t)h.key_len + h.value_len;
+    if (h.magic != KV_BIN_MAGIC_REQ || h.value_len > KV_BIN_MAX_PAYLOAD ||
+        payload > KV_BIN_MAX_PAYLOAD) {
+        bin_protocol_error(c, &h);
+        return 0;
+    }
+    if (avail < KV_BIN_HDR_LEN + payload)
+        return 0;
+
+    p += KV_BIN_HDR_LEN;
+    c->rstart += KV_BIN_HDR_LEN + payload;
+
+    /* Keys and values go through the kernel's text parser: no whitespace */
+    if (h.opcode == KV_BIN_OP_GET || h.opcode == KV_BIN_OP_SET || h.opcode == KV_BIN_OP_DEL) {
+        if (!kv_valid_token(p, h.key_len, KV_MAX_KEY)) {
+            bin_reply(c, &h, KV_BIN_EINVAL, NULL, 0);
+            return 1;
+        }
+        memcpy(key, p, h.key_len);
+        key[h.key_len] = '\0';
+    }
+
+    if (c->shed && h.opcode != KV_BIN_OP_QUIT) {
+        admit_count_shed();
+        bin_reply(c, &h, KV_BIN_EBUSY, NULL, 0);
+        return 1;
+    }
+
+    switch (h.opcode) {
+    case KV_BIN_OP_NOOP:
+        bin_reply(c, &h, KV_BIN_OK, NULL, 0);
+        break;
+    case KV_BIN_OP_GET:
+        bin_kv(c, &h, key, "");
+        break;
+    case KV_BIN_OP_SET:
+        if (!kv_valid_token(p + h.key_len, h.value_len, KV_MAX_VALUE)) {
+            bin_reply(c, &h, KV_BIN_EINVAL, NULL, 0);
+            break;
+        }
+        memcpy(value, p + h.key_len, h.value_len);
+        value[h.value_len] = '\0';
+        debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s bin: insert %s %s",
+                    c->addr, c->port, c->username, key, value);
+        bin_kv(c, &h, key, value);
+        break;
+    case KV_BIN_OP_DEL:
+        debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s bin: delete %s",
+                    c->addr, c->port, c->username, key);
+        bin_kv(c, &h, key, "");
+        break;
+    case KV_BIN_OP_SCAN:
+        bin_scan(c, &h, p);
+        break;
+    case KV_BIN_OP_STATS:
+        n = net_format_stats(stats, sizeof(stats));
+        if (n < 0)
+            bin_reply(c, &h, KV_BIN_EIO, NULL, 0);
+        else
+            bin_reply(c, &h, KV_BIN_OK, stats, (size_t)n);
+        break;
+    case KV_BIN_OP_QUIT:
+        bin_reply(c, &h, KV_BIN_OK, NULL, 0);
+        c->close_after_flush = 1;
+        break;
+    default:
+        bin_reply(c, &h, KV_BIN_EUNKNOWN, NULL, 0);
+        break;
+    }
+    return 1;
+}
@@ -0,0 +1,70 @@
+#ifndef PROTO_BIN_H
+#define PROTO_BIN_H
+
+#include <stdint.h>
+
+/*
+ * Length-prefixed binary protocol, negotiated on a text connection by
+ * sending "BINARY" after AUTH OK (server answers "BINARY OK\n"). From
+ * then on both directions carry frames:
+ *
+ *   16-byte header (network byte order) | key (key_len) | value (value_len)
+ *
+ * Each request carries a client-chosen request_id that is echoed in its
+ * response. A connection's responses come back in the order its requests
+ * were sent: the server handles one frame at a time per connection, and
+ * a request routed to a backend pauses reading until it completes. A
+ * client can still pipeline many requests and check each response's
+ * request_id against the request it expects.
+ */
+
+#define KV_BIN_HDR_LEN 16
+#define KV_BIN_MAX_PAYLOAD 4096
+
+#define KV_BIN_MAGIC_REQ 0xB0
+#define KV_BIN_MAGIC_RES 0xB1
+
+/* Opcodes */
+#define KV_BIN_OP_NOOP  0x00
+#define KV_BIN_OP_GET   0x01
+#define KV_BIN_OP_SET   0x02
+#define KV_BIN_OP_DEL   0x03
+#define KV_BIN_OP_STATS 0x04
+#define KV_BIN_OP_QUIT  0x05
+#define KV_BIN_OP_SCAN  0x06
+
+/*
+ * SCAN request: key = match pattern (exact key or "prefix*", empty for
+ * all), value = "<cursor> <count>". Response value: "<next>\n" and one
+ * "key value\n" line per entry, as the text protocol's scan.
+ */
+#define KV_BIN_SCAN_MAX_COUNT 16    /* keeps a reply within KV_BIN_MAX_PAYLOAD */
+
+/* Response status */
+#define KV_BIN_OK         0
+#define KV_BIN_NOT_FOUND  1
+#define KV_BIN_EINVAL     2
+#define KV_BIN_EIO        3
+#define KV_BIN_EUNKNOWN   4
+#define KV_BIN_EPROTO     5
+#define KV_BIN_EBUSY      6         /* server overloaded, retry later */
+
+typedef struct {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t status;            /* 0 in requests */
+    uint32_t request_id;
+    uint16_t key_len;
+    uint16_t reserved;
+    uint32_t value_len;
+} kv_bin_hdr;
+
+struct net_client;
+
+/**
+ * Parse and execute one frame from the client's input buffer.
+ * @return 1 if a frame was consumed, 0 if more input is needed.
+ */
+int bin_handle_request(struct net_client *c);
+
+#endif /* PROTO_BIN_H */
@@ -0,0 +1,487 @@
+#include "proto_resp.h"
+#include "net_server.h"
+
+#include <strings.h>
+
+static void resp_puts(net_client *c, const char *s)
+{
+    net_client_write(c, s, strlen(s));
+}
+
+static void resp_error(net_client *c, const char *msg)
+{
+    net_client_write(c, "-", 1);
+    resp_puts(c, msg);
+    net_client_write(c, "\r\n", 2);
+}
+
+static void resp_int(net_client *c, long long v)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), ":%lld\r\n", v);
+    resp_puts(c, buf);
+}
+
+static void resp_bulk(net_client *c, const char *s, size_t len)
+{
+    char hdr[32];
+
+    snprintf(hdr, sizeof(hdr), "$%zu\r\n", len);
+    resp_puts(c, hdr);
+    net_client_write(c, s, len);
+    net_client_write(c, "\r\n", 2);
+}
+
+static void resp_array(net_client *c, int n)
+{
+    char hdr[32];
+
+    snprintf(hdr, sizeof(hdr), "*%d\r\n", n);
+    resp_puts(c, hdr);
+}
+
+/**
+ * Split one request into argv. Multibulk arguments are NUL-terminated
+ * in place (over their trailing CR).
+ * Returns bytes consumed, 0 if incomplete, -1 on a protocol error.
+ */
+static long resp_parse(net_client *c, char **argv, size_t *argl, int *argc)
+{
+    char *start = c->rbuf + c->rstart;
+    char *end = c->rbuf + c->rend;
+    char *p = start;
+    char *nl;
+    long n, len, i;
+
+    *argc = 0;
+    if (p == end)
+        return 0;
+
+    nl = memchr(p, '\n', (size_t)(end - p));
+    if (!nl)
+        return 0;
+
+    if (*p != '*') {
+        /* Inline command: space-separated words on one line */
+        char *save = NULL, *tok;
+
+        *nl = '\0';
+        if (nl > p && nl[-1] == '\r')
+            nl[-1] = '\0';
+        for (tok = strtok_r(p, " \t", &save); tok && *argc < RESP_MAX_ARGS;
+             tok = strtok_r(NULL, " \t", &save)) {
+            argv[*argc] = tok;
+            argl[*argc] = strlen(tok);
+            (*argc)++;
+        }
+        return (long)(nl + 1 - start);
+    }
+
+    n = strtol(p + 1, NULL, 10);
+    if (n > RESP_MAX_ARGS)
+        return -1;
+    p = nl + 1;
+
+    for (i = 0; i < n; i++) {
+        if (p >= end)
+            return 0;
+        if (*p != '$')
+            return -1;
+        nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl)
+            return 0;
+        len = strtol(p + 1, NULL, 10);
+        if (len < 0 || len > RESP_MAX_BULK)
+            return -1;
+        p = nl + 1;
+        if (end - p < len + 2)
+            return 0;
+        argv[i] = p;
+        argl[i] = (size_t)len;
+        p[len] = '\0';
+        p += len + 2;
+    }
+    *argc = (int)n;
+    return (long)(p - start);
+}
+
+static void resp_cmd_auth(net_client *c, int argc, char **argv)
+{
+    int ret;
+
+    if (argc == 2) {
+        /* AUTH <token>: session token issued to an earlier text-protocol AUTH */
+        if (auth_token_check(argv[1], c->username, sizeof(c->username)) != 0) {
+            resp_error(c, "WRONGPASS invalid username-password pair or user is disabled.");
+        } else if (net_client_login(c) != 0) {
+            resp_error(c, "ERR too many connections for this user");
+            c->close_after_flush = 1;
+        } else {
+            c->state = NET_CLIENT_READY;
+            resp_puts(c, "+OK\r\n");
+        }
+        return;
+    }
+    if (argc != 3) {
+        resp_error(c, "ERR wrong number of arguments for 'auth' command");
+        return;
+    }
+
+    snprintf(c->username, sizeof(c->username), "%s", argv[1]);
+    ret = net_client_auth(c, argv[1], argv[2]);
+    memset(argv[2], 0, strlen(argv[2]));
+    if (ret == AUTH_BUSY)
+        resp_error(c, "ERR authentication busy, retry later");
+    else if (ret == AUTH_BACKOFF)
+        resp_error(c, "ERR too many failed logins, retry later");
+}
+
+void resp_auth_done(net_client *c)
+{
+    if (c->auth_result == 0 && net_client_login(c) != 0) {
+        c->state = NET_CLIENT_AUTH;
+        resp_error(c, "ERR too many connections for this user");
+        c->close_after_flush = 1;
+    } else if (c->auth_result == 0) {
+        c->state = NET_CLIENT_READY;
+        resp_puts(c, "+OK\r\n");
+    } else {
+        c->state = NET_CLIENT_AUTH;
+        resp_error(c, "WRONGPASS invalid username-password pair or user is disabled.");
+    }
+}
+
+static void resp_cmd_info(net_client *c)
+{
+    char stats[NET_STATS_SIZE];
+    char info[2 * NET_STATS_SIZE];
+    char *tok, *save = NULL;
+    size_t len;
+
+    if (net_format_stats(stats, sizeof(stats)) < 0) {
+        resp_error(c, "ERR stats do not fit the reply buffer");
+        return;
+    }
+    len = (size_t)snprintf(info, sizeof(info),
+                           "# Server\r\nredis_version:7.0.0\r\nredis_mode:standalone\r\n"
+                           "kvstore:1\r\nprocess_id:%d\r\n# Stats\r\n", (int)getpid());
+
+    /* "STATS a=1 b=2" -> "a:1\r\nb:2\r\n" */
+    for (tok = strtok_r(stats + strlen("STATS "), " \n", &save); tok && len < sizeof(info);
+         tok = strtok_r(NULL, " \n", &save)) {
+        char *eq = strchr(tok, '=');
+        if (eq)
+            *eq = ':';
+        len += (size_t)snprintf(info + len, sizeof(info) - len, "%s\r\n", tok);
+    }
+    if (len > sizeof(info) - 1)
+        len = sizeof(info) - 1;
+    resp_bulk(c, info, len);
+}
+
+/* SCAN cursor [MATCH pattern] [COUNT n]: reply [next cursor, [keys...]] */
+static void resp_cmd_scan(net_client *c, int argc, char **argv)
+{
+    char buf[KV_SCAN_REPLY_MAX], cur[24];
+    const char *match = NULL, *line;
+    unsigned long long cursor, next;
+    char *end;
+    int i, n, count = 10;
+
+    cursor = strtoull(argv[1], &end, 10);
+    if (*end) {
+        resp_error(c, "ERR invalid cursor");
+        return;
+    }
+    for (i = 2; i + 1 < argc; i += 2) {
+        if (!strcasecmp(argv[i], "MATCH")) {
+            match = argv[i + 1];
+        } else if (!strcasecmp(argv[i], "COUNT")) {
+            count = atoi(argv[i + 1]);
+            /* Like Redis, COUNT is a hint: clamp rather than refuse */
+            if (count > KV_SCAN_MAX_COUNT)
+                count = KV_SCAN_MAX_COUNT;
+        } else {
+            break;
+        }
+    }
+    if (i != argc || count <= 0 || (match && !kv_valid_token(match, strlen(match), KV_MAX_KEY))) {
+        resp_error(c, "ERR syntax error");
+        return;
+    }
+
+    n = kv_scan(cursor, count, match, &next, buf, sizeof(buf));
+    if (n < 0) {
+        resp_error(c, "ERR kernel store unavailable");
+        return;
+    }
+    /* Size the array by the lines actually received */
+    for (n = 0, line = buf; (line = strchr(line, '\n')); line++)
+        n++;
+    resp_array(c, 2);
+    snprintf(cur, sizeof(cur), "%llu", next);
+    resp_bulk(c, cur, strlen(cur));
+    resp_array(c, n);
+    for (line = buf, i = 0; i < n; i++) {
+        resp_bulk(c, line, strcspn(line, " \n"));
+        line = strchr(line, '\n') + 1;
+    }
+}
+
+enum { RESP_KV_GET, RESP_KV_SET, RESP_KV_DEL, RESP_KV_MGET, RESP_KV_MSET };
+
+/* GET, SET, DEL, MGET or MSET, run on a router worker or inline, see resp_kv() */
+struct resp_route {
+    net_route r;
+    int cmd;
+    int n;                                  /* keys */
+    int ret;
+    char keys[RESP_MAX_ARGS][KV_MAX_KEY + 1];
+    char values[RESP_MAX_ARGS][KV_MAX_VALUE + 1];
+    int found[RESP_MAX_ARGS];               /* in: key is valid; out: key exists */
+};
+
+static void resp_route_run(net_route *r)
+{
+    struct resp_route *q = (struct resp_route *)r;
+    const char *keys[RESP_MAX_ARGS], *vals[RESP_MAX_ARGS];
+    char (*values)[KV_MAX_VALUE + 1];
+    int idx[RESP_MAX_ARGS], found[RESP_MAX_ARGS];
+    int i, n = 0, err = 0;
+
+    switch (q->cmd) {
+    case RESP_KV_GET:
+        /* Like the kernel store, a key that cannot exist is just not found */
+        q->ret = q->found[0] ? kv_lookup(q->keys[0], q->values[0], sizeof(q->values[0])) : -ENOENT;
+        break;
+    case RESP_KV_SET:
+        q->ret = kv_insert(q->keys[0], q->values[0]);
+        break;
+    case RESP_KV_DEL:
+        q->ret = 0;
+        for (i = 0; i < q->n; i++) {
+            int ret = q->found[i] ? kv_remove(q->keys[i]) : -ENOENT;
+
+            q->found[i] = ret == 0;
+            q->ret += q->found[i];
+            if (ret < 0 && ret != -ENOENT)
+                err = ret;
+        }
+        /* Nothing deleted because the store failed: an error, not 0 */
+        if (q->ret == 0 && err)
+            q->ret = err;
+        break;
+    case RESP_KV_MGET:
+        for (i = 0; i < q->n; i++) {
+            if (q->found[i]) {
+                idx[n] = i;
+                keys[n++] = q->keys[i];
+            }
+            q->found[i] = 0;
+        }
+        if (n == 0) {
+            q->ret = 0;
+            break;
+        }
+        /* One pass over /proc/hashtable, or one batch per backend, for all keys */
+        values = malloc((size_t)n * sizeof(*values));
+        if (!values) {
+            q->ret = -ENOMEM;
+            break;
+        }
+        q->ret = kv_mlookup(keys, n, values, found);
+        for (i = 0; i < n && q->ret == 0; i++) {
+            q->found[idx[i]] = found[i];
+            memcpy(q->values[idx[i]], values[i], sizeof(values[i]));
+        }
+        free(values);
+        break;
+    case RESP_KV_MSET:
+        for (i = 0; i < q->n; i++) {
+            keys[i] = q->keys[i];
+            vals[i] = q->values[i];
+        }
+        q->ret = kv_minsert(keys, vals, q->n);
+        break;
+    }
+}
+
+static void resp_route_done(net_client *c, net_route *r)
+{
+    struct resp_route *q = (struct resp_route *)r;
+    int i;
+
+    switch (q->cmd) {
+    case RESP_KV_GET:
+        if (q->ret == 0)
+            resp_bulk(c, q->values[0], strlen(q->values[0]));
+        else if (q->ret == -ENOENT)
+            resp_puts(c, "$-1\r\n");
+        else
+            resp_error(c, "ERR kernel store unavailable");
+        break;
+    case RESP_KV_SET:
+        if (q->ret == 0)
+            resp_puts(c, "+OK\r\n");
+        else
+            resp_error(c, "ERR kernel store unavailable");
+        break;
+    case RESP_KV_DEL:
+        for (i = 0; i < q->n; i++) {
+            if (q->found[i])
+                debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s resp: delete %s",
+                            c->addr, c->port, c->username, q->keys[i]);
+        }
+        if (q->ret < 0)
+            resp_error(c, "ERR kernel store unavailable");
+        else
+            resp_int(c, q->ret);
+        break;
+    case RESP_KV_MGET:
+        if (q->ret < 0) {
+            resp_error(c, "ERR kernel store unavailable");
+            break;
+        }
+        resp_array(c, q->n);
+        for (i = 0; i < q->n; i++) {
+            if (q->found[i])
+                resp_bulk(c, q->values[i], strlen(q->values[i]));
+            else
+                resp_puts(c, "$-1\r\n");
+        }
+        break;
+    case RESP_KV_MSET:
+        if (q->ret != 0) {
+            resp_error(c, "ERR kernel store unavailable");
+            break;
+        }
+        debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s resp: mset %d keys",
+                    c->addr, c->port, c->username, q->n);
+        resp_puts(c, "+OK\r\n");
+        break;
+    }
+}
+
+/*
+ * argv holds keys (GET, DEL, MGET) or key/value pairs (SET, MSET). On a
+ * router the backend calls leave the shard, see net_client_route().
+ */
+static void resp_kv(net_client *c, int cmd, int argc, char **argv, size_t *argl)
+{
+    struct resp_route local, *q = router_active() ? malloc(sizeof(*q)) : NULL;
+    int i, pairs = cmd == RESP_KV_SET || cmd == RESP_KV_MSET;
+
+    if (!q)
+        q = &local;
+    q->r.run = resp_route_run;
+    q->r.done = resp_route_done;
+    q->cmd = cmd;
+    q->n = pairs ? argc / 2 : argc;
+    for (i = 0; i < q->n; i++) {
+        int k = pairs ? 2 * i : i;
+
+        q->found[i] = kv_valid_token(argv[k], argl[k], KV_MAX_KEY);
+        snprintf(q->keys[i], sizeof(q->keys[i]), "%s", q->found[i] ? argv[k] : "");
+        snprintf(q->values[i], sizeof(q->values[i]), "%s", pairs ? argv[k + 1] : "");
+    }
+    if (q != &local) {
+        net_client_route(c, &q->r);
+        return;
+    }
+    resp_route_run(&q->r);
+    resp_route_done(c, &q->r);
+}
+
+static void resp_execute(net_client *c, int argc, char **argv, size_t *argl)
+{
+    char msg[NET_BUF_SIZE];
+    const char *cmd = argv[0];
+    int i;
+
+    if (!strcasecmp(cmd, "QUIT")) {
+        resp_puts(c, "+OK\r\n");
+        c->close_after_flush = 1;
+        return;
+    }
+    if (!strcasecmp(cmd, "AUTH")) {
+        resp_cmd_auth(c, argc, argv);
+        return;
+    }
+    if (c->state != NET_CLIENT_READY) {
+        resp_error(c, "NOAUTH Authentication required.");
+        return;
+    }
+    if (c->shed) {
+        admit_count_shed();
+        resp_error(c, "BUSY server overloaded, retry later");
+        return;
+    }
+
+    if (!strcasecmp(cmd, "PING")) {
+        if (argc > 1)
+            resp_bulk(c, argv[1], argl[1]);
+        else
+            resp_puts(c, "+PONG\r\n");
+    } else if (!strcasecmp(cmd, "GET") && argc == 2) {
+        resp_kv(c, RESP_KV_GET, 1, &argv[1], &argl[1]);
+    } else if (!strcasecmp(cmd, "SET") && argc == 3) {
+        if (!kv_valid_token(argv[1], argl[1], KV_MAX_KEY) ||
+            !kv_valid_token(argv[2], argl[2], KV_MAX_VALUE)) {
+            resp_error(c, "ERR key and value must be 1-63 bytes without whitespace");
+            return;
+        }
+        debug_sendf(DEBUG_CAT_REMOTE, "[REMOTE] from %s:%d user:%s resp: insert %s %s",
+                    c->addr, c->port, c->username, argv[1], argv[2]);
+        resp_kv(c, RESP_KV_SET, 2, &argv[1], &argl[1]);
+    } else if (!strcasecmp(cmd, "DEL") && argc >= 2) {
+        resp_kv(c, RESP_KV_DEL, argc - 1, &argv[1], &argl[1]);
+    } else if (!strcasecmp(cmd, "MGET") && argc >= 2) {
+        resp_kv(c, RESP_KV_MGET, argc - 1, &argv[1], &argl[1]);
+    } else if (!strcasecmp(cmd, "MSET") && argc >= 3 && argc % 2 == 1) {
+        for (i = 1; i < argc; i += 2) {
+            if (!kv_valid_token(argv[i], argl[i], KV_MAX_KEY) ||
+                !kv_valid_token(argv[i + 1], argl[i + 1], KV_MAX_VALUE)) {
+                resp_error(c, "ERR key and value must be 1-63 bytes without whitespace");
+                return;
+            }
+        }
+        resp_kv(c, RESP_KV_MSET, argc - 1, &argv[1], &argl[1]);
+    } else if (!strcasecmp(cmd, "SCAN") && argc >= 2) {
+        resp_cmd_scan(c, argc, argv);
+    } else if (!strcasecmp(cmd, "INFO")) {
+        resp_cmd_info(c);
+    } else if (!strcasecmp(cmd, "GET") || !strcasecmp(cmd, "SET") ||
+               !strcasecmp(cmd, "DEL") || !strcasecmp(cmd, "MGET") ||
+               !strcasecmp(cmd, "MSET") || !strcasecmp(cmd, "SCAN")) {
+        snprintf(msg, sizeof(msg),
+                 "ERR wrong number of arguments for '%.32s' command", cmd);
+        resp_error(c, msg);
+    } else {
+        snprintf(msg, sizeof(msg), "ERR unknown command '%.64s'", cmd);
+        resp_error(c, msg);
+    }
+}
+
+int resp_handle_request(net_client *c)
+{
+    char *argv[RESP_MAX_ARGS];
+    size_t argl[RESP_MAX_ARGS];
+    int argc;
+    long used;
+
+    used = resp_parse(c, argv, argl, &argc);
+    if (used == 0)
+        return 0;
+    if (used < 0) {
+        resp_error(c, "ERR Protocol error");
+        c->rstart = c->rend;
+        c->close_after_flush = 1;
+        return 0;
+    }
+
+    c->rstart += (size_t)used;
+    if (argc > 0)
+        resp_execute(c, argc, argv, argl);
+    return 1;
+}
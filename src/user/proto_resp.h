@@ -0,0 +1,28 @@
+#ifndef PROTO_RESP_H
+#define PROTO_RESP_H
+
+/*
+ * Redis protocol (RESP2) subset, spoken on the port given with
+ * --resp-port: AUTH, GET, SET, DEL, MGET, MSET, PING, INFO, QUIT.
+ * Requests may be multibulk arrays or inline commands and may be
+ * pipelined; replies are returned in request order.
+ */
+
+#define RESP_MAX_ARGS 65            /* MSET of 32 pairs */
+#define RESP_MAX_BULK 4096
+
+struct net_client;
+
+/**
+ * Parse and execute one RESP request from the client's input buffer.
+ * @return 1 if a request was consumed, 0 if more input is needed.
+ */
+int resp_handle_request(struct net_client *c);
+
+/**
+ * Reply to a password AUTH once the auth pool has answered
+ * (c->auth_result holds the result).
+ */
+void resp_auth_done(struct net_client *c);
+
+#endif /* PROTO_RESP_H */
@@ -0,0 +1,199 @@
+#include "repl.h"
+#include "net_server.h"
+
+/*
+ * One replica connection. The ring is filled by the feed thread and
+ * drained by the client's shard, both under lock.
+ */
+struct repl_peer {
+    net_client *client;
+    struct repl_peer *prev;
+    struct repl_peer *next;
+
+    pthread_mutex_t lock;
+    struct kv_event ring[REPL_QUEUE_MAX];
+    unsigned int head;              /* next event to send */
+    unsigned int tail;              /* next free slot */
+    int snapshot;                   /* a full snapshot is owed */
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct repl_peer *registry;
+static struct repl_stats counters;
+static unsigned long long feed_seq; /* last sequence seen from the feed */
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&counters.field, (n), __ATOMIC_RELAXED)
+
+int repl_attach(net_client *c)
+{
+    struct repl_peer *p;
+
+    if (c->repl)
+        return 0;
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return -ENOMEM;
+    p->client = c;
+    p->snapshot = 1;
+    pthread_mutex_init(&p->lock, NULL);
+    c->repl = p;
+
+    pthread_mutex_lock(&registry_lock);
+    p->next = registry;
+    if (registry)
+        registry->prev = p;
+    registry = p;
+    pthread_mutex_unlock(&registry_lock);
+    STAT_ADD(replicas, 1);
+    return 0;
+}
+
+void repl_client_close(net_client *c)
+{
+    struct repl_peer *p = c->repl;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        registry = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    pthread_mutex_unlock(&registry_lock);
+    STAT_ADD(replicas, -1UL);
+
+    c->repl = NULL;
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+void repl_on_event(const struct kv_event *ev, void *arg)
+{
+    struct repl_peer *p;
+
+    (void)arg;
+    __atomic_store_n(&feed_seq, ev->seq, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&registry_lock);
+    for (p = registry; p; p = p->next) {
+        pthread_mutex_lock(&p->lock);
+        if (!p->snapshot) {
+            if (ev->op == KV_EVENT_LOST || p->tail - p->head == REPL_QUEUE_MAX) {
+                /* Gap in the stream: only a full copy can repair it */
+                p->snapshot = 1;
+                p->head = p->tail = 0;
+                STAT_ADD(resyncs, 1);
+            } else {
+                p->ring[p->tail++ % REPL_QUEUE_MAX] = *ev;
+            }
+        }
+        pthread_mutex_unlock(&p->lock);
+        net_client_notify(p->client);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+ * Send the whole store. Events queued after the ring was cleared follow
+ * the snapshot; some may already be reflected in it, which is harmless
+ * because replaying a newer mutation on top gives the same final state.
+ * @return 0, or a negative errno if the store could not be read.
+ */
+static int send_snapshot(net_client *c, unsigned long long seq)
+{
+    char hdr[64];
+    char *buf, *line, *nl;
+    ssize_t n;
+    int count = 0;
+
+    n = kv_read_all(&buf);
+    if (n < 0)
+        return (int)n;
+    for (line = buf; *line; line = nl + 1) {
+        nl = strchr(line, '\n');
+        if (!nl)
+            break;
+        if (nl > line)
+            count++;
+    }
+
+    snprintf(hdr, sizeof(hdr), "SNAPSHOT %llu %d\n", seq, count);
+    net_client_write(c, hdr, strlen(hdr));
+    for (line = buf; *line; line = nl + 1) {
+        nl = strchr(line, '\n');
+        if (!nl)
+            break;
+        if (nl > line)
+            net_client_write(c, line, (size_t)(nl - line + 1));
+    }
+    net_client_write(c, "SNAPSHOT-END\n", 13);
+    free(buf);
+    STAT_ADD(snapshots, 1);
+    return 0;
+}
+
+int repl_flush(net_client *c)
+{
+    struct repl_peer *p = c->repl;
+    char line[32 + KV_MAX_KEY + KV_MAX_VALUE];
+    unsigned long sent = 0;
+    int more;
+
+    if (!p)
+        return 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->snapshot) {
+        unsigned long long seq = __atomic_load_n(&feed_seq, __ATOMIC_RELAXED);
+        int ret;
+
+        p->snapshot = 0;
+        p->head = p->tail = 0;
+        pthread_mutex_unlock(&p->lock);
+        ret = send_snapshot(c, seq);
+        if (ret < 0) {
+            /* An empty snapshot would wipe the replica: make it reconnect instead */
+            snprintf(line, sizeof(line), "ERROR: snapshot failed: %s\n", strerror(-ret));
+            net_client_write(c, line, strlen(line));
+            c->close_after_flush = 1;
+            return 0;
+        }
+        pthread_mutex_lock(&p->lock);
+    }
+    while (p->head != p->tail && c->wlen - c->woff < NET_WBUF_HIGH) {
+        const struct kv_event *ev = &p->ring[p->head++ % REPL_QUEUE_MAX];
+
+        if (ev->op == KV_EVENT_INSERT)
+            snprintf(line, sizeof(line), "REPL %llu insert %s %s\n", ev->seq, ev->key, ev->value);
+        else
+            snprintf(line, sizeof(line), "REPL %llu delete %s\n", ev->seq, ev->key);
+        net_client_write(c, line, strlen(line));
+        sent++;
+    }
+    more = p->head != p->tail || p->snapshot;
+    pthread_mutex_unlock(&p->lock);
+    if (sent)
+        STAT_ADD(events_sent, sent);
+    return more;
+}
+
+void repl_heartbeat(net_client *c)
+{
+    char line[48];
+
+    if (!c->repl)
+        return;
+    snprintf(line, sizeof(line), "REPL-PING %llu\n",
+             __atomic_load_n(&feed_seq, __ATOMIC_RELAXED));
+    net_client_write(c, line, strlen(line));
+}
+
+void repl_get_stats(struct repl_stats *st)
+{
+    st->replicas = __atomic_load_n(&counters.replicas, __ATOMIC_RELAXED);
+    st->events_sent = __atomic_load_n(&counters.events_sent, __ATOMIC_RELAXED);
+    st->snapshots = __atomic_load_n(&counters.snapshots, __ATOMIC_RELAXED);
+    st->resyncs = __atomic_load_n(&counters.resyncs, __ATOMIC_RELAXED);
+}
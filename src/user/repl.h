@@ -0,0 +1,67 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include "kvfeed.h"
+
+/*
+ * Primary side of streaming replication. A replica authenticates like
+ * any text client and sends REPLICATE; from then on the connection
+ * carries only
+ *
+ *   SNAPSHOT <seq> <count>         full copy of the store follows
+ *   <key> <value>                  count lines
+ *   SNAPSHOT-END
+ *   REPL <seq> insert <key> <value>
+ *   REPL <seq> delete <key>
+ *   REPL-PING <seq>                heartbeat, once a second
+ *   ERROR: snapshot failed: <why>  store unreadable; the connection closes
+ *
+ * Every mutation from the kernel feed is queued for every replica in
+ * order. If a replica falls more than REPL_QUEUE_MAX events behind, or
+ * the feed itself lost events, its queue is dropped and it is sent a
+ * fresh snapshot instead.
+ */
+
+#define REPL_QUEUE_MAX 8192         /* events pending per replica */
+
+struct net_client;
+
+struct repl_stats {
+    unsigned long replicas;         /* connections in replication mode */
+    unsigned long events_sent;      /* REPL lines written */
+    unsigned long snapshots;        /* SNAPSHOT blocks written */
+    unsigned long resyncs;          /* queues dropped for a snapshot */
+};
+
+/**
+ * Switch a client to replication mode. The first flush sends a snapshot.
+ * @return 0 on success, -ENOMEM.
+ */
+int repl_attach(struct net_client *c);
+
+/**
+ * Detach a closing client. Once this returns the feed thread no longer
+ * sees the client, so it may be freed.
+ */
+void repl_client_close(struct net_client *c);
+
+/**
+ * Move the snapshot or queued events into the client's output buffer,
+ * stopping at NET_WBUF_HIGH. Called on the client's shard thread.
+ * @return 1 if events are still queued, 0 otherwise.
+ */
+int repl_flush(struct net_client *c);
+
+/**
+ * Queue a REPL-PING line. Called once a second on the shard thread.
+ */
+void repl_heartbeat(struct net_client *c);
+
+/**
+ * kvfeed listener: queue an event for every replica and wake their shards.
+ */
+void repl_on_event(const struct kv_event *ev, void *arg);
+
+void repl_get_stats(struct repl_stats *st);
+
+#endif /* REPL_H */
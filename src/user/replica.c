@@ -0,0 +1,421 @@
+#include "replica.h"
+#include "kvproc.h"
+#include "metrics.h"
+#include "debug_net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define REPLICA_BUF_SIZE 65536
+
+struct replica_entry {
+    char key[KV_MAX_KEY + 1];
+    char value[KV_MAX_VALUE + 1];
+    int op;                         /* 1 = insert, 0 = delete */
+};
+
+/* Key/value pairs of a snapshot being received */
+struct replica_set {
+    struct replica_entry *items;
+    int n;
+    int cap;
+};
+
+static char primary_host[256];
+static int primary_port;
+static char auth_line[160];
+
+static int running;
+static int enabled;
+static pthread_t replica_thread;
+static struct replica_stats counters;
+static unsigned long long last_contact_us;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&counters.field, (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&counters.field, (v), __ATOMIC_RELAXED)
+
+static int set_add(struct replica_set *s, const char *key, const char *value)
+{
+    if (s->n == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 64;
+        struct replica_entry *items = realloc(s->items, (size_t)cap * sizeof(*items));
+
+        if (!items)
+            return -ENOMEM;
+        s->items = items;
+        s->cap = cap;
+    }
+    snprintf(s->items[s->n].key, sizeof(s->items[0].key), "%s", key);
+    snprintf(s->items[s->n].value, sizeof(s->items[0].value), "%s", value);
+    s->items[s->n].op = 1;
+    s->n++;
+    return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct replica_entry *)a)->key, ((const struct replica_entry *)b)->key);
+}
+
+/* @return 0, or a negative errno if the write did not reach the store */
+static int apply_write(const struct replica_entry *e)
+{
+    char cmd[16 + KV_MAX_KEY + KV_MAX_VALUE];
+    int ret;
+
+    if (e->op)
+        snprintf(cmd, sizeof(cmd), "insert %s %s", e->key, e->value);
+    else
+        snprintf(cmd, sizeof(cmd), "delete %s", e->key);
+    ret = kv_apply(cmd);
+    if (ret == 0)
+        STAT_ADD(applied, 1);
+    return ret;
+}
+
+/* Read the whole local store into a set */
+static int read_local(struct replica_set *local)
+{
+    char *buf, *line, *nl;
+    ssize_t n;
+    int ret = 0;
+
+    n = kv_read_all(&buf);
+    if (n < 0)
+        return (int)n;
+    for (line = buf; *line && ret == 0; line = nl ? nl + 1 : line + strlen(line)) {
+        char k[64], v[64];
+
+        nl = strchr(line, '\n');
+        if (nl)
+            *nl = '\0';
+        if (sscanf(line, "%63s %63s", k, v) == 2)
+            ret = set_add(local, k, v);
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+ * Make the local store equal to the snapshot: write keys that differ and
+ * delete local keys the primary does not have. Both sides are sorted and
+ * walked together. A key the primary sent twice (its snapshot scan saw
+ * it written) may get either value here; the stream that follows carries
+ * the write.
+ * @return 0, or a negative errno if the local store could not be read or
+ *         written.
+ */
+static int apply_snapshot(struct replica_set *snap)
+{
+    struct replica_set local = { 0 };
+    int i = 0, j = 0, cmp, ret;
+
+    ret = read_local(&local);
+    if (ret < 0) {
+        free(local.items);
+        return ret;
+    }
+    qsort(local.items, (size_t)local.n, sizeof(local.items[0]), entry_cmp);
+    qsort(snap->items, (size_t)snap->n, sizeof(snap->items[0]), entry_cmp);
+
+    while (ret == 0 && (i < local.n || j < snap->n)) {
+        if (j > 0 && j < snap->n && !strcmp(snap->items[j].key, snap->items[j - 1].key)) {
+            j++;
+            continue;
+        }
+        if (i == local.n)
+            cmp = 1;
+        else if (j == snap->n)
+            cmp = -1;
+        else
+            cmp = strcmp(local.items[i].key, snap->items[j].key);
+
+        if (cmp < 0) {
+            local.items[i].op = 0;
+            ret = apply_write(&local.items[i++]);
+        } else if (cmp > 0) {
+            ret = apply_write(&snap->items[j++]);
+        } else if (!strcmp(local.items[i++].value, snap->items[j].value)) {
+            STAT_ADD(skipped, 1);
+            j++;
+        } else {
+            ret = apply_write(&snap->items[j++]);
+        }
+    }
+    free(local.items);
+    if (ret == 0)
+        STAT_ADD(snapshots, 1);
+    return ret;
+}
+
+/*
+ * Apply a batch of coalesced stream events, skipping inserts whose value
+ * is already stored. Deletes are always written: a lookup that misses
+ * does not prove the key is absent (/proc/hashtable shows only part of
+ * a large table).
+ * @return 0, or the first write error.
+ */
+static int apply_batch(struct replica_entry *batch, int n)
+{
+    const char *keys[REPLICA_BATCH];
+    char values[REPLICA_BATCH][KV_MAX_VALUE + 1];
+    int found[REPLICA_BATCH];
+    int i, ret;
+
+    if (n == 0)
+        return 0;
+    for (i = 0; i < n; i++)
+        keys[i] = batch[i].key;
+    if (kv_mlookup(keys, n, values, found) != 0)
+        memset(found, 0, sizeof(found));   /* unknown local state: write everything */
+
+    for (i = 0; i < n; i++) {
+        if (batch[i].op && found[i] && !strcmp(values[i], batch[i].value)) {
+            STAT_ADD(skipped, 1);
+            continue;
+        }
+        ret = apply_write(&batch[i]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int batch_add(struct replica_entry *batch, int n, int op, const char *key, const char *value)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(batch[i].key, key))
+            break;
+    }
+    if (i == n)
+        snprintf(batch[n++].key, sizeof(batch[0].key), "%s", key);
+    else
+        STAT_ADD(skipped, 1);       /* superseded by this later event */
+    snprintf(batch[i].value, sizeof(batch[0].value), "%s", value);
+    batch[i].op = op;
+    return n;
+}
+
+static int primary_connect(void)
+{
+    struct addrinfo hints, *res, *ai;
+    char port[16];
+    int one = 1;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", primary_port);
+    if (getaddrinfo(primary_host, port, &hints, &res) != 0)
+        return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (write(fd, auth_line, strlen(auth_line)) != (ssize_t)strlen(auth_line)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Stream from one connection until it fails, goes silent or we are
+ * stopped. Returns 1 if replication was established (resets backoff).
+ */
+static int replica_session(int fd)
+{
+    static char buf[REPLICA_BUF_SIZE];
+    struct replica_entry batch[REPLICA_BATCH];
+    struct replica_set snap = { 0 };
+    unsigned long long snap_seq = 0, batch_seq = 0, seq;
+    size_t len = 0;
+    int n_batch = 0, in_snapshot = 0, established = 0, silent = 0, failed = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        char *line, *nl;
+        ssize_t n;
+
+        if (poll(&pfd, 1, 1000) == 0) {
+            /* The primary pings every second */
+            if (++silent >= REPLICA_PING_MISSES) {
+                fprintf(stderr, "replica: primary %s:%d silent, reconnecting\n",
+                        primary_host, primary_port);
+                break;
+            }
+            continue;
+        }
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            break;
+        silent = 0;
+        __atomic_store_n(&last_contact_us, metrics_now_us(), __ATOMIC_RELAXED);
+        len += (size_t)n;
+        buf[len] = '\0';
+
+        for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+            char op[16], k[64], v[64];
+
+            *nl = '\0';
+            if (in_snapshot) {
+                if (!strcmp(line, "SNAPSHOT-END")) {
+                    if ((failed = apply_snapshot(&snap)) < 0)
+                        goto out;
+                    snap.n = 0;
+                    in_snapshot = 0;
+                    batch_seq = snap_seq;
+                    STAT_SET(applied_seq, snap_seq);
+                } else if (sscanf(line, "%63s %63s", k, v) == 2) {
+                    /* A partial snapshot would delete the keys it lacks */
+                    if ((failed = set_add(&snap, k, v)) < 0)
+                        goto out;
+                }
+                continue;
+            }
+            if (sscanf(line, "REPL %llu %15s %63s %63s", &seq, op, k, v) >= 3) {
+                if (!strcmp(op, "insert"))
+                    n_batch = batch_add(batch, n_batch, 1, k, v);
+                else if (!strcmp(op, "delete"))
+                    n_batch = batch_add(batch, n_batch, 0, k, "");
+                batch_seq = seq;
+                if (n_batch == REPLICA_BATCH) {
+                    if ((failed = apply_batch(batch, n_batch)) < 0)
+                        goto out;
+                    n_batch = 0;
+                    STAT_SET(applied_seq, batch_seq);
+                }
+                if (seq > __atomic_load_n(&counters.primary_seq, __ATOMIC_RELAXED))
+                    STAT_SET(primary_seq, seq);
+            } else if (sscanf(line, "REPL-PING %llu", &seq) == 1) {
+                STAT_SET(primary_seq, seq);
+            } else if (sscanf(line, "SNAPSHOT %llu", &snap_seq) == 1) {
+                /* Supersedes anything still batched */
+                n_batch = 0;
+                snap.n = 0;
+                in_snapshot = 1;
+                STAT_SET(primary_seq, snap_seq);
+            } else if (!strcmp(line, "REPLICATING")) {
+                established = 1;
+                STAT_SET(connected, 1);
+                debug_send("[REPLICA] streaming from primary");
+            } else if (!strncmp(line, "AUTH FAIL", 9) || !strncmp(line, "ERROR", 5)) {
+                fprintf(stderr, "replica: primary %s:%d refused: %s\n",
+                        primary_host, primary_port, line);
+                goto out;
+            }
+        }
+        /* Nothing more buffered: apply what this read delivered */
+        if ((failed = apply_batch(batch, n_batch)) < 0)
+            goto out;
+        n_batch = 0;
+        /* applied_seq only moves once the writes are in */
+        if (!in_snapshot && batch_seq)
+            STAT_SET(applied_seq, batch_seq);
+
+        len -= (size_t)(line - buf);
+        memmove(buf, line, len);
+        if (len == sizeof(buf) - 1)
+            break;                  /* line longer than the buffer: protocol error */
+    }
+out:
+    if (failed)
+        fprintf(stderr, "replica: cannot update the local store, resyncing from %s:%d\n",
+                primary_host, primary_port);
+    STAT_SET(connected, 0);
+    free(snap.items);
+    return established;
+}
+
+static void *replica_main(void *arg)
+{
+    unsigned int backoff = 1;
+    int attempts = 0;
+
+    (void)arg;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        int fd = primary_connect();
+
+        if (fd >= 0) {
+            if (attempts++ > 0)
+                STAT_ADD(reconnects, 1);
+            if (replica_session(fd))
+                backoff = 1;
+            close(fd);
+        }
+        for (unsigned int i = 0; i < backoff && __atomic_load_n(&running, __ATOMIC_ACQUIRE); i++)
+            sleep(1);
+        if (backoff < REPLICA_BACKOFF_MAX)
+            backoff *= 2;
+    }
+    return NULL;
+}
+
+int replica_start(const char *host, int port, const char *user, const char *pass)
+{
+    if (!host || port <= 0 || port > 65535)
+        return -1;
+    snprintf(primary_host, sizeof(primary_host), "%s", host);
+    primary_port = port;
+    snprintf(auth_line, sizeof(auth_line), "AUTH %s %s\nREPLICATE\n",
+             user ? user : "", pass ? pass : "");
+
+    kv_set_read_only(1);
+    enabled = 1;
+    running = 1;
+    if (pthread_create(&replica_thread, NULL, replica_main, NULL) != 0) {
+        perror("replica_start: pthread_create");
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void replica_stop(void)
+{
+    if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL))
+        return;
+    pthread_join(replica_thread, NULL);
+}
+
+int replica_enabled(void)
+{
+    return enabled;
+}
+
+void replica_get_stats(struct replica_stats *st)
+{
+    unsigned long long contact = __atomic_load_n(&last_contact_us, __ATOMIC_RELAXED);
+
+    st->connected = __atomic_load_n(&counters.connected, __ATOMIC_RELAXED);
+    st->applied_seq = __atomic_load_n(&counters.applied_seq, __ATOMIC_RELAXED);
+    st->primary_seq = __atomic_load_n(&counters.primary_seq, __ATOMIC_RELAXED);
+    st->lag_events = st->primary_seq > st->applied_seq ? st->primary_seq - st->applied_seq : 0;
+    st->last_contact_ms = contact ? (metrics_now_us() - contact) / 1000 : 0;
+    st->applied = __atomic_load_n(&counters.applied, __ATOMIC_RELAXED);
+    st->skipped = __atomic_load_n(&counters.skipped, __ATOMIC_RELAXED);
+    st->snapshots = __atomic_load_n(&counters.snapshots, __ATOMIC_RELAXED);
+    st->reconnects = __atomic_load_n(&counters.reconnects, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,53 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+/*
+ * Replica side of streaming replication, see repl.h for the wire format.
+ * A background thread keeps one connection to the primary, applies the
+ * snapshot and the mutation stream to the local store, and reconnects
+ * with backoff when the primary goes away. Client writes are rejected
+ * while it runs (kv_set_read_only); reads are served from the local copy.
+ *
+ * Stream events are applied in batches of up to REPLICA_BATCH: several
+ * mutations of one key collapse to the last one, and a key whose local
+ * value already matches is skipped, so replaying events the local store
+ * has already seen (e.g. primary and replica on one host sharing a
+ * kernel module) does no writes at all.
+ */
+
+#define REPLICA_BATCH 128           /* stream events applied per batch */
+#define REPLICA_PING_MISSES 3       /* silent seconds before reconnecting */
+#define REPLICA_BACKOFF_MAX 30      /* seconds between reconnect attempts */
+
+struct replica_stats {
+    int connected;                  /* 1 while streaming from the primary */
+    unsigned long long applied_seq; /* primary sequence applied locally */
+    unsigned long long primary_seq; /* latest sequence the primary reported */
+    unsigned long long lag_events;  /* primary_seq - applied_seq */
+    unsigned long long last_contact_ms; /* since the last line from the primary */
+    unsigned long applied;          /* local writes made */
+    unsigned long skipped;          /* events already reflected locally */
+    unsigned long snapshots;        /* snapshots loaded */
+    unsigned long reconnects;       /* connections opened after the first */
+};
+
+/**
+ * Start following a primary daemon.
+ * @param user, pass  Credentials sent with AUTH.
+ * @return 0 on success, -1 on error.
+ */
+int replica_start(const char *host, int port, const char *user, const char *pass);
+
+/**
+ * Stop the replication thread and close the connection.
+ */
+void replica_stop(void);
+
+/**
+ * @return 1 if this daemon was started as a replica.
+ */
+int replica_enabled(void);
+
+void replica_get_stats(struct replica_stats *st);
+
+#endif /* REPLICA_H */
@@ -0,0 +1,714 @@
+#include "router.h"
+#include "hashring.h"
+#include "../client/kvclient.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define ROUTER_MOVE_LOCKS 64
+
+struct router_node {
+    char name[272];                 /* "host:port", also the ring name */
+    char host[256];
+    int port;
+    pthread_mutex_t lock;           /* guards opening kc */
+    kv_client *kc;                  /* NULL until the first successful open */
+    time_t retry_at;
+    unsigned long requests;
+    unsigned long errors;
+};
+
+/*
+ * Nodes are only ever appended, and a slot is filled before n_nodes is
+ * raised under ring_lock, so an index taken from a ring stays valid
+ * after the lock is dropped.
+ */
+static struct router_node nodes[ROUTER_MAX_NODES];
+static int n_nodes;
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hashring ring;
+static struct hashring prev_ring;
+static int prev_nodes;              /* nodes on prev_ring */
+static int migrating;
+static int sweeping;                /* sweep thread running */
+static int sweep_stop;
+static pthread_t sweep_thread;
+static int sweep_joinable;          /* sweep_thread started and not yet joined */
+static int ring_vnodes = HASHRING_DEFAULT_VNODES;
+
+static pthread_mutex_t move_locks[ROUTER_MOVE_LOCKS];
+static char backend_user[64];
+static char backend_pass[64];
+static int active;
+static struct router_stats counters;
+
+struct router_job {
+    router_job_fn fn;
+    void *arg;
+};
+
+/* Worker pool; everything below is protected by pool_lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct router_job *queue;
+static int queue_head;
+static int queue_len;
+static int queue_cap;
+static int pool_stop;
+static pthread_t pool_threads[ROUTER_WORKERS];
+static int pool_workers;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&counters.field, (n), __ATOMIC_RELAXED)
+
+static int node_init(struct router_node *nd, const char *spec, size_t len)
+{
+    const char *colon;
+    char *end;
+    long port;
+
+    if (len == 0 || len >= sizeof(nd->name))
+        return -EINVAL;
+    memcpy(nd->name, spec, len);
+    nd->name[len] = '\0';
+    colon = strrchr(nd->name, ':');
+    if (!colon || colon == nd->name || (size_t)(colon - nd->name) >= sizeof(nd->host))
+        return -EINVAL;
+    port = strtol(colon + 1, &end, 10);
+    if (*end || port <= 0 || port > 65535)
+        return -EINVAL;
+    memcpy(nd->host, nd->name, (size_t)(colon - nd->name));
+    nd->host[colon - nd->name] = '\0';
+    nd->port = (int)port;
+    nd->kc = NULL;
+    nd->retry_at = 0;
+    nd->requests = nd->errors = 0;
+    pthread_mutex_init(&nd->lock, NULL);
+    return 0;
+}
+
+/* Build a ring over the first n nodes */
+static int ring_build(struct hashring *r, int n)
+{
+    const char *names[ROUTER_MAX_NODES];
+
+    for (int i = 0; i < n; i++)
+        names[i] = nodes[i].name;
+    return hashring_build(r, names, n, ring_vnodes);
+}
+
+/* Owner of key on the current ring, and on the previous one while migrating */
+static int route(const char *key, int *old)
+{
+    int owner;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    owner = hashring_lookup(&ring, key);
+    *old = migrating ? hashring_lookup(&prev_ring, key) : owner;
+    pthread_rwlock_unlock(&ring_lock);
+    return owner;
+}
+
+/* The node's client, opened on first use and retried at most once a second */
+static kv_client *node_client(struct router_node *nd)
+{
+    kv_client *kc = __atomic_load_n(&nd->kc, __ATOMIC_ACQUIRE);
+    time_t now;
+
+    if (kc)
+        return kc;
+    pthread_mutex_lock(&nd->lock);
+    now = time(NULL);
+    if (!nd->kc && now >= nd->retry_at) {
+        kv_client_opts opts = {
+            .host = nd->host,
+            .port = nd->port,
+            .user = backend_user,
+            .pass = backend_pass,
+            .pool_size = ROUTER_POOL_SIZE,
+            .timeout_ms = ROUTER_TIMEOUT_MS,
+        };
+
+        kc = kv_client_open(&opts);
+        if (kc)
+            __atomic_store_n(&nd->kc, kc, __ATOMIC_RELEASE);
+        else
+            fprintf(stderr, "router: cannot reach %s: %s\n", nd->name, strerror(errno));
+        nd->retry_at = now + ROUTER_RETRY_SECS;
+    }
+    kc = nd->kc;
+    pthread_mutex_unlock(&nd->lock);
+    return kc;
+}
+
+/* Account one backend call; a missing key is an answer, not an error */
+static int node_result(struct router_node *nd, int ret)
+{
+    __atomic_add_fetch(&nd->requests, 1, __ATOMIC_RELAXED);
+    STAT_ADD(requests, 1);
+    if (ret < 0 && ret != -ENOENT) {
+        __atomic_add_fetch(&nd->errors, 1, __ATOMIC_RELAXED);
+        STAT_ADD(errors, 1);
+    }
+    return ret;
+}
+
+static int node_get(int idx, const char *key, char *value, size_t vlen)
+{
+    struct router_node *nd = &nodes[idx];
+    kv_client *kc = node_client(nd);
+
+    return node_result(nd, kc ? kv_get(kc, key, value, vlen) : -EHOSTUNREACH);
+}
+
+static int node_set(int idx, const char *key, const char *value)
+{
+    struct router_node *nd = &nodes[idx];
+    kv_client *kc = node_client(nd);
+
+    return node_result(nd, kc ? kv_set(kc, key, value) : -EHOSTUNREACH);
+}
+
+/* -ENOENT if the key was not there */
+static int node_remove(int idx, const char *key)
+{
+    struct router_node *nd = &nodes[idx];
+    kv_client *kc = node_client(nd);
+
+    return node_result(nd, kc ? kv_del(kc, key) : -EHOSTUNREACH);
+}
+
+static int node_del(int idx, const char *key)
+{
+    int ret = node_remove(idx, key);
+
+    return ret == -ENOENT ? 0 : ret;
+}
+
+static pthread_mutex_t *move_lock(const char *key)
+{
+    return &move_locks[hashring_hash(key) % ROUTER_MOVE_LOCKS];
+}
+
+/*
+ * Key missing on its new node during a migration: fetch it from the old
+ * node and move it. Writes take the same lock, so a move cannot put back
+ * a value that a concurrent write has just replaced.
+ */
+static int lookup_moved(int owner, int old, const char *key, char *value, size_t vlen)
+{
+    pthread_mutex_t *lock = move_lock(key);
+    int ret;
+
+    pthread_mutex_lock(lock);
+    ret = node_get(owner, key, value, vlen);
+    if (ret == -ENOENT) {
+        ret = node_get(old, key, value, vlen);
+        if (ret == 0 && node_set(owner, key, value) == 0 && node_del(old, key) == 0)
+            STAT_ADD(moved, 1);
+    }
+    pthread_mutex_unlock(lock);
+    return ret;
+}
+
+int router_lookup(const char *key, char *value, size_t vlen)
+{
+    int old, owner = route(key, &old);
+    int ret;
+
+    if (owner < 0)
+        return -EHOSTUNREACH;
+    ret = node_get(owner, key, value, vlen);
+    if (ret == -ENOENT && old >= 0 && old != owner)
+        ret = lookup_moved(owner, old, key, value, vlen);
+    return ret;
+}
+
+int router_mlookup(const char **keys, int n, char (*values)[KV_MAX_VALUE + 1], int *found)
+{
+    int owner[n], old[n], idx[n], status[n];
+    int i, j, node, parts = 0, err = 0;
+
+    for (i = 0; i < n; i++) {
+        owner[i] = route(keys[i], &old[i]);
+        if (owner[i] < 0)
+            return -EHOSTUNREACH;
+        found[i] = 0;
+        values[i][0] = '\0';
+    }
+
+    /* One pipelined kv_mget() per node holding some of the keys */
+    for (node = 0; node < ROUTER_MAX_NODES; node++) {
+        const char *part[n];
+        char (*pvals)[KV_MAX_VALUE + 1];
+        struct router_node *nd = &nodes[node];
+        kv_client *kc;
+        int cnt = 0, ret;
+
+        for (i = 0; i < n; i++) {
+            if (owner[i] == node) {
+                idx[cnt] = i;
+                part[cnt++] = keys[i];
+            }
+        }
+        if (cnt == 0)
+            continue;
+        parts++;
+
+        pvals = malloc((size_t)cnt * sizeof(*pvals));
+        if (!pvals)
+            return -ENOMEM;
+        kc = node_client(nd);
+        ret = node_result(nd, kc ? kv_mget(kc, part, (size_t)cnt, pvals, status) : -EHOSTUNREACH);
+        if (ret < 0) {
+            free(pvals);
+            err = ret;
+            break;
+        }
+        for (j = 0; j < cnt; j++) {
+            i = idx[j];
+            if (status[j] == 0) {
+                memcpy(values[i], pvals[j], sizeof(values[i]));
+                found[i] = 1;
+            }
+        }
+        free(pvals);
+    }
+    if (parts > 1)
+        STAT_ADD(split, 1);
+    if (err)
+        return err;
+
+    for (i = 0; i < n; i++) {
+        if (!found[i] && old[i] >= 0 && old[i] != owner[i])
+            found[i] = lookup_moved(owner[i], old[i], keys[i], values[i], KV_MAX_VALUE + 1) == 0;
+    }
+    return 0;
+}
+
+int router_insert(const char *key, const char *value)
+{
+    int old, owner = route(key, &old);
+    int ret;
+
+    if (owner < 0)
+        return -EHOSTUNREACH;
+    if (old < 0 || old == owner)
+        return node_set(owner, key, value);
+
+    pthread_mutex_lock(move_lock(key));
+    ret = node_set(owner, key, value);
+    if (ret == 0)
+        node_del(old, key);
+    pthread_mutex_unlock(move_lock(key));
+    return ret;
+}
+
+int router_delete(const char *key)
+{
+    int old, owner = route(key, &old);
+    int ret;
+
+    if (owner < 0)
+        return -EHOSTUNREACH;
+    if (old < 0 || old == owner)
+        return node_del(owner, key);
+
+    pthread_mutex_lock(move_lock(key));
+    ret = node_del(owner, key);
+    if (ret == 0)
+        ret = node_del(old, key);
+    pthread_mutex_unlock(move_lock(key));
+    return ret;
+}
+
+/* During a migration the key may still be on its old node */
+int router_remove(const char *key)
+{
+    int old, owner = route(key, &old);
+    int ret, prev;
+
+    if (owner < 0)
+        return -EHOSTUNREACH;
+    if (old < 0 || old == owner)
+        return node_remove(owner, key);
+
+    pthread_mutex_lock(move_lock(key));
+    ret = node_remove(owner, key);
+    if (ret == 0 || ret == -ENOENT) {
+        prev = node_remove(old, key);
+        if (prev != -ENOENT)
+            ret = prev;
+    }
+    pthread_mutex_unlock(move_lock(key));
+    return ret;
+}
+
+int router_minsert(const char **keys, const char **values, int n)
+{
+    int owner[n], old[n], status[n];
+    int i, node, parts = 0, err = 0, migrate = 0;
+
+    for (i = 0; i < n; i++) {
+        owner[i] = route(keys[i], &old[i]);
+        if (owner[i] < 0)
+            return -EHOSTUNREACH;
+        if (old[i] >= 0 && old[i] != owner[i])
+            migrate = 1;
+    }
+    /* Keys in flight between nodes take the per-key path */
+    if (migrate) {
+        for (i = 0; i < n && !err; i++)
+            err = router_insert(keys[i], values[i]);
+        return err;
+    }
+
+    for (node = 0; node < ROUTER_MAX_NODES && !err; node++) {
+        const char *pkeys[n], *pvals[n];
+        struct router_node *nd = &nodes[node];
+        kv_client *kc;
+        int cnt = 0;
+
+        for (i = 0; i < n; i++) {
+            if (owner[i] == node) {
+                pkeys[cnt] = keys[i];
+                pvals[cnt++] = values[i];
+            }
+        }
+        if (cnt == 0)
+            continue;
+        parts++;
+        kc = node_client(nd);
+        err = node_result(nd, kc ? kv_mset(kc, pkeys, pvals, (size_t)cnt, status) : -EHOSTUNREACH);
+        for (i = 0; i < cnt && !err; i++)
+            err = status[i];
+    }
+    if (parts > 1)
+        STAT_ADD(split, 1);
+    return err;
+}
+
+int router_add_node(const char *spec)
+{
+    struct hashring next;
+    int i, ret;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    if (migrating) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (n_nodes == ROUTER_MAX_NODES) {
+        ret = -E2BIG;
+        goto out;
+    }
+    ret = node_init(&nodes[n_nodes], spec, strlen(spec));
+    if (ret < 0)
+        goto out;
+    for (i = 0; i < n_nodes; i++) {
+        if (!strcmp(nodes[i].name, nodes[n_nodes].name)) {
+            ret = -EEXIST;
+            goto out;
+        }
+    }
+    ret = ring_build(&next, n_nodes + 1);
+    if (ret < 0)
+        goto out;
+    prev_ring = ring;
+    prev_nodes = n_nodes;
+    ring = next;
+    migrating = 1;
+    n_nodes++;
+out:
+    pthread_rwlock_unlock(&ring_lock);
+    return ret;
+}
+
+struct sweep_ctx {
+    int old;                    /* node being swept */
+    int failed;                 /* keys that could not be moved */
+};
+
+/*
+ * A key found on its old node by the sweep. Same rules as a move on
+ * lookup: if the new owner lacks the key, move it; if the owner has a
+ * different value, the old copy is stale and goes. An equal copy is
+ * left alone, since on one host both nodes may share one kernel store.
+ */
+static void sweep_key(const char *key, const char *scanned, void *arg)
+{
+    struct sweep_ctx *ctx = arg;
+    char value[KV_MAX_VALUE + 1], old_value[KV_MAX_VALUE + 1];
+    pthread_mutex_t *lock = move_lock(key);
+    int owner, ret;
+
+    (void)scanned;              /* read again under the move lock */
+    pthread_rwlock_rdlock(&ring_lock);
+    owner = hashring_lookup(&ring, key);
+    pthread_rwlock_unlock(&ring_lock);
+    if (owner < 0 || owner == ctx->old)
+        return;
+
+    pthread_mutex_lock(lock);
+    ret = node_get(ctx->old, key, old_value, sizeof(old_value));
+    if (ret == 0) {
+        ret = node_get(owner, key, value, sizeof(value));
+        if (ret == -ENOENT) {
+            ret = node_set(owner, key, old_value);
+            if (ret == 0)
+                ret = node_del(ctx->old, key);
+            if (ret == 0)
+                STAT_ADD(moved, 1);
+        } else if (ret == 0 && strcmp(value, old_value)) {
+            ret = node_del(ctx->old, key);
+        }
+    }
+    pthread_mutex_unlock(lock);
+    /* Gone from the old node meanwhile: a write or a lookup moved it */
+    if (ret < 0 && ret != -ENOENT)
+        ctx->failed++;
+}
+
+/*
+ * After ROUTER DONE: scan every node of the previous ring and move the
+ * keys the new ring places elsewhere, then drop the previous ring.
+ * Clients are served throughout, still falling back to the old owner.
+ */
+static void *router_sweep(void *arg)
+{
+    struct sweep_ctx ctx = { 0, 0 };
+    int ret = 0;
+
+    (void)arg;
+    for (ctx.old = 0; ctx.old < prev_nodes && ret >= 0; ctx.old++) {
+        struct router_node *nd = &nodes[ctx.old];
+        unsigned long long cursor = 0;
+
+        do {
+            kv_client *kc = node_client(nd);
+
+            if (__atomic_load_n(&sweep_stop, __ATOMIC_RELAXED)) {
+                ret = -ECANCELED;
+                break;
+            }
+            ret = node_result(nd, kc ? kv_scan_page(kc, cursor, KV_CLIENT_SCAN_MAX, NULL,
+                                                    &cursor, sweep_key, &ctx)
+                                     : -EHOSTUNREACH);
+        } while (ret >= 0 && cursor != 0);
+        if (ret < 0)
+            fprintf(stderr, "router: sweeping %s: %s\n", nd->name, strerror(-ret));
+    }
+
+    pthread_rwlock_wrlock(&ring_lock);
+    if (ret >= 0 && ctx.failed == 0) {
+        hashring_free(&prev_ring);
+        migrating = 0;
+    } else if (ret >= 0) {
+        fprintf(stderr, "router: %d keys not moved, send ROUTER DONE again\n", ctx.failed);
+    }
+    sweeping = 0;
+    pthread_rwlock_unlock(&ring_lock);
+    return NULL;
+}
+
+int router_finish_migration(void)
+{
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    if (!migrating) {
+        ret = -EALREADY;
+    } else if (sweeping) {
+        ret = -EINPROGRESS;
+    } else {
+        /* A finished sweep thread is joined before the next one starts */
+        if (sweep_joinable)
+            pthread_join(sweep_thread, NULL);
+        sweep_joinable = pthread_create(&sweep_thread, NULL, router_sweep, NULL) == 0;
+        if (sweep_joinable)
+            sweeping = 1;
+        else
+            ret = -EAGAIN;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return ret;
+}
+
+int router_start(const char *list, const char *user, const char *pass, int vnodes)
+{
+    const char *p = list;
+    int i, ret;
+
+    if (vnodes < 0 || vnodes > HASHRING_MAX_VNODES)
+        return -EINVAL;
+    if (vnodes)
+        ring_vnodes = vnodes;
+    snprintf(backend_user, sizeof(backend_user), "%s", user ? user : "");
+    snprintf(backend_pass, sizeof(backend_pass), "%s", pass ? pass : "");
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+
+        if (n_nodes == ROUTER_MAX_NODES)
+            return -E2BIG;
+        ret = node_init(&nodes[n_nodes], p, len);
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < n_nodes; i++) {
+            if (!strcmp(nodes[i].name, nodes[n_nodes].name))
+                return -EEXIST;
+        }
+        n_nodes++;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    if (n_nodes == 0)
+        return -EINVAL;
+    ret = ring_build(&ring, n_nodes);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < ROUTER_MOVE_LOCKS; i++)
+        pthread_mutex_init(&move_locks[i], NULL);
+    active = 1;
+    return 0;
+}
+
+static void *router_worker(void *arg)
+{
+    struct router_job job;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (queue_len == 0 && !pool_stop)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        if (pool_stop) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_cap;
+        queue_len--;
+        pthread_mutex_unlock(&pool_lock);
+
+        job.fn(job.arg);
+    }
+    return NULL;
+}
+
+int router_pool_start(int workers, int queue_max)
+{
+    if (workers <= 0 || queue_max <= 0)
+        return -1;
+    if (workers > ROUTER_WORKERS)
+        workers = ROUTER_WORKERS;
+
+    queue = calloc((size_t)queue_max, sizeof(*queue));
+    if (!queue)
+        return -1;
+    queue_cap = queue_max;
+
+    for (pool_workers = 0; pool_workers < workers; pool_workers++) {
+        if (pthread_create(&pool_threads[pool_workers], NULL, router_worker, NULL) != 0) {
+            perror("router_pool_start: pthread_create");
+            break;
+        }
+    }
+    if (pool_workers == 0) {
+        free(queue);
+        queue = NULL;
+        queue_cap = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int router_submit(router_job_fn fn, void *arg)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_workers == 0 || pool_stop || queue_len == queue_cap) {
+        ret = -EAGAIN;
+    } else {
+        queue[(queue_head + queue_len) % queue_cap] = (struct router_job){ fn, arg };
+        queue_len++;
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return ret;
+}
+
+void router_stop(void)
+{
+    if (!active)
+        return;
+    active = 0;
+    /* Workers finish the call they are in; the backends stay open until then */
+    pthread_mutex_lock(&pool_lock);
+    pool_stop = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < pool_workers; i++)
+        pthread_join(pool_threads[i], NULL);
+    pool_workers = 0;
+    free(queue);
+    queue = NULL;
+    __atomic_store_n(&sweep_stop, 1, __ATOMIC_RELAXED);
+    if (sweep_joinable)
+        pthread_join(sweep_thread, NULL);
+    sweep_joinable = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        if (nodes[i].kc)
+            kv_client_close(nodes[i].kc);
+        nodes[i].kc = NULL;
+    }
+    hashring_free(&ring);
+    hashring_free(&prev_ring);
+}
+
+int router_active(void)
+{
+    return active;
+}
+
+void router_format_nodes(char *out, size_t outlen)
+{
+    size_t off;
+    int i, n;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    n = n_nodes;
+    off = (size_t)snprintf(out, outlen, "NODES %d%s", n,
+                           sweeping ? " sweeping" : migrating ? " migrating" : "");
+    for (i = 0; i < n && off < outlen; i++) {
+        off += (size_t)snprintf(out + off, outlen - off, " %s=%lu/%lu", nodes[i].name,
+                                __atomic_load_n(&nodes[i].requests, __ATOMIC_RELAXED),
+                                __atomic_load_n(&nodes[i].errors, __ATOMIC_RELAXED));
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    if (off < outlen - 1)
+        snprintf(out + off, outlen - off, "\n");
+    else
+        out[outlen - 2] = '\n';
+}
+
+void router_get_stats(struct router_stats *st)
+{
+    pthread_rwlock_rdlock(&ring_lock);
+    st->nodes = n_nodes;
+    st->migrating = migrating;
+    st->sweeping = sweeping;
+    pthread_rwlock_unlock(&ring_lock);
+    st->requests = __atomic_load_n(&counters.requests, __ATOMIC_RELAXED);
+    st->errors = __atomic_load_n(&counters.errors, __ATOMIC_RELAXED);
+    st->split = __atomic_load_n(&counters.split, __ATOMIC_RELAXED);
+    st->moved = __atomic_load_n(&counters.moved, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool_lock);
+    st->queue_depth = (unsigned long)queue_len;
+    pthread_mutex_unlock(&pool_lock);
+}
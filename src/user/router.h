@@ -0,0 +1,116 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include "kvproc.h"
+
+/*
+ * Router mode: instead of the local kernel store, the daemon spreads
+ * keys over several backend daemons with a consistent-hash ring (see
+ * hashring.h). kvproc.c sends every lookup and write here while the
+ * router is active, so all three protocols are routed unchanged.
+ *
+ * Backends are reached with libkvclient (src/client/kvclient.h): one
+ * pooled client per node, opened on first use, speaking the binary
+ * protocol. Multi-key lookups and writes are split by node and each
+ * part is sent as one pipelined batch. The network shards never make
+ * these calls themselves: they hand each request to a pool of router
+ * workers (router_submit()) and serve other clients meanwhile.
+ *
+ * Adding a node moves about 1/(N+1) of the keys to it. Until the
+ * migration ends the previous ring is kept: a key missing on its new
+ * node is looked up on its old node and moved on first access, and
+ * writes also delete the key from its old node. router_finish_migration()
+ * then sweeps the old nodes for keys nobody touched, and drops the
+ * previous ring once all are moved. Moves are serialized per key inside
+ * this router, so only one router may serve clients during a migration.
+ */
+
+#define ROUTER_MAX_NODES 64
+#define ROUTER_POOL_SIZE 8          /* pooled connections per backend */
+#define ROUTER_TIMEOUT_MS 2000      /* per backend send/receive */
+#define ROUTER_RETRY_SECS 1         /* delay before reopening a failed backend */
+#define ROUTER_WORKERS 16           /* threads making backend calls for clients */
+#define ROUTER_QUEUE_MAX 1024       /* requests waiting for a worker */
+
+struct router_stats {
+    int nodes;
+    int migrating;                  /* 1 while the previous ring is kept */
+    int sweeping;                   /* 1 while the old nodes are swept */
+    unsigned long requests;         /* backend calls (a batch counts once) */
+    unsigned long errors;           /* backend calls that failed */
+    unsigned long split;            /* multi-key requests spread over several nodes */
+    unsigned long moved;            /* keys moved to a new node */
+    unsigned long queue_depth;      /* requests waiting for a worker */
+};
+
+typedef void (*router_job_fn)(void *arg);
+
+/**
+ * Enter router mode.
+ * @param nodes  Comma-separated "host:port" list.
+ * @param user, pass  Credentials for the backends.
+ * @param vnodes  Ring points per node, 0 = HASHRING_DEFAULT_VNODES.
+ * @return 0 on success, negative errno on a bad node list.
+ */
+int router_start(const char *nodes, const char *user, const char *pass, int vnodes);
+
+/**
+ * Start the worker threads that make backend calls for the network
+ * shards, so a slow backend only holds up the clients waiting on it.
+ * Call after daemonizing.
+ * @return 0 on success, -1 on error.
+ */
+int router_pool_start(int workers, int queue_max);
+
+/**
+ * Queue fn(arg) on a router worker.
+ * @return 0 if queued, -EAGAIN if the queue is full or no pool runs
+ *         (fn is not called).
+ */
+int router_submit(router_job_fn fn, void *arg);
+
+/**
+ * Stop the workers and close all backend connections. Jobs still
+ * queued are dropped.
+ */
+void router_stop(void);
+
+/**
+ * @return 1 if the daemon runs as a router.
+ */
+int router_active(void);
+
+/* Routed equivalents of the kvproc.h calls, same return values */
+int router_lookup(const char *key, char *value, size_t vlen);
+int router_mlookup(const char **keys, int n, char (*values)[KV_MAX_VALUE + 1], int *found);
+int router_insert(const char *key, const char *value);
+int router_delete(const char *key);
+int router_remove(const char *key);
+int router_minsert(const char **keys, const char **values, int n);
+
+/**
+ * Add a backend ("host:port") and start migrating keys to it.
+ * @return 0, -EBUSY while a migration is in progress, -EEXIST, -E2BIG,
+ *         -EINVAL or -ENOMEM.
+ */
+int router_add_node(const char *node);
+
+/**
+ * Start sweeping the old nodes on a background thread: every key the
+ * new ring places elsewhere is moved, then the previous ring is dropped
+ * and the migration ends. If a node cannot be scanned or a key cannot
+ * be moved, the migration stays in progress and this may be called again.
+ * @return 0 if the sweep started, -EALREADY if no migration is in
+ *         progress, -EINPROGRESS while a sweep runs, or -EAGAIN.
+ */
+int router_finish_migration(void);
+
+/**
+ * One-line node list: "NODES <n> <host:port>=<requests>/<errors> ...".
+ */
+void router_format_nodes(char *out, size_t outlen);
+
+void router_get_stats(struct router_stats *st);
+
+#endif /* ROUTER_H */
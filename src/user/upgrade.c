@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "auth.h"
+#include "metrics.h"
+#include "debug_net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+static int listen_fd = -1;
+static char listen_path[108];
+static pthread_t upgrade_thread;
+static void (*upgrade_done)(void);
+static int handed_off;
+static struct upgrade_stats counters;
+
+static void set_timeout(int fd, int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_str(int fd, const char *s, size_t len)
+{
+    return send(fd, s, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/* One message with up to UPGRADE_FDS_PER_MSG descriptors attached */
+static int send_fds(int fd, const int *fds, const char *kinds, int n)
+{
+    char payload[4 + UPGRADE_FDS_PER_MSG];
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+    struct iovec iov = { payload, 4 + (size_t)n };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    memcpy(payload, "FDS ", 4);
+    memcpy(payload + 4, kinds, (size_t)n);
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)n);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/* Session tokens go out in batches of whole lines */
+struct token_batch {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[UPGRADE_MSG_SIZE];
+};
+
+static void batch_flush(struct token_batch *b)
+{
+    if (b->len > strlen("TOKENS\n") && send_str(b->fd, b->buf, b->len) < 0)
+        b->failed = 1;
+    b->len = (size_t)snprintf(b->buf, sizeof(b->buf), "TOKENS\n");
+}
+
+static void batch_token(const char *token, const char *user, int ttl, void *arg)
+{
+    struct token_batch *b = arg;
+    char line[160];
+    int n = snprintf(line, sizeof(line), "%s %s %d\n", token, user, ttl);
+
+    if (n < 0 || (size_t)n >= sizeof(line))
+        return;
+    if (b->len + (size_t)n > sizeof(b->buf))
+        batch_flush(b);
+    memcpy(b->buf + b->len, line, (size_t)n);
+    b->len += (size_t)n;
+}
+
+/*
+ * Hand everything to the daemon on conn.
+ * @return 0 once it reported READY, -1 if it failed or went away.
+ */
+static int upgrade_serve(int conn)
+{
+    int fds[UPGRADE_MAX_FDS];
+    char kinds[UPGRADE_MAX_FDS];
+    char buf[64];
+    struct token_batch *batch;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    ssize_t got;
+    int n, i;
+
+    /* The socket file is owner-only; check anyway, these are our listeners */
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+        (cred.uid != geteuid() && cred.uid != 0)) {
+        fprintf(stderr, "upgrade: refusing takeover by uid %d\n", (int)cred.uid);
+        return -1;
+    }
+    set_timeout(conn, UPGRADE_TIMEOUT);
+    got = recv(conn, buf, sizeof(buf) - 1, 0);
+    if (got != (ssize_t)strlen("TAKEOVER") || memcmp(buf, "TAKEOVER", got))
+        return -1;
+
+    n = net_server_listeners(fds, kinds, UPGRADE_MAX_FDS - 1);
+    if (metrics_listener() >= 0) {
+        fds[n] = metrics_listener();
+        kinds[n++] = UPGRADE_FD_METRICS;
+    }
+    for (i = 0; i < n; i += UPGRADE_FDS_PER_MSG) {
+        int chunk = n - i < UPGRADE_FDS_PER_MSG ? n - i : UPGRADE_FDS_PER_MSG;
+
+        if (send_fds(conn, fds + i, kinds + i, chunk) < 0) {
+            perror("upgrade: send listeners");
+            return -1;
+        }
+    }
+
+    batch = malloc(sizeof(*batch));
+    if (!batch)
+        return -1;
+    batch->fd = conn;
+    batch->failed = 0;
+    batch->len = 0;
+    batch_flush(batch);
+    auth_token_foreach(batch_token, batch);
+    batch_flush(batch);
+    i = batch->failed;
+    free(batch);
+    if (i)
+        return -1;
+
+    n = snprintf(buf, sizeof(buf), "END %d", (int)getpid());
+    if (send_str(conn, buf, (size_t)n) < 0)
+        return -1;
+
+    debug_sendf(DEBUG_CAT_DAEMON, "[DAEMON] listeners sent to pid %d, waiting for it to serve",
+                (int)cred.pid);
+    set_timeout(conn, UPGRADE_READY_TIMEOUT);
+    got = recv(conn, buf, sizeof(buf) - 1, 0);
+    if (got != (ssize_t)strlen("READY") || memcmp(buf, "READY", got))
+        return -1;
+    return 0;
+}
+
+static void *upgrade_run(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;                  /* upgrade_stop() shut the socket down */
+        }
+        if (upgrade_serve(conn) == 0) {
+            close(conn);
+            __atomic_store_n(&handed_off, 1, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&counters.handoffs, 1, __ATOMIC_RELAXED);
+            upgrade_done();
+            break;
+        }
+        close(conn);
+        debug_send("[DAEMON] takeover did not complete, still serving");
+    }
+    return NULL;
+}
+
+int upgrade_listen(const char *path, void (*done)(void))
+{
+    struct sockaddr_un addr;
+    mode_t old_mask;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "upgrade: socket path too long: %s\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("upgrade: socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* Stale, or the socket of the daemon we just took over from */
+    unlink(path);
+
+    old_mask = umask(0077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("upgrade: bind/listen");
+        umask(old_mask);
+        close(fd);
+        return -1;
+    }
+    umask(old_mask);
+
+    listen_fd = fd;
+    snprintf(listen_path, sizeof(listen_path), "%s", path);
+    upgrade_done = done;
+    if (pthread_create(&upgrade_thread, NULL, upgrade_run, NULL) != 0) {
+        perror("upgrade: pthread_create");
+        close(fd);
+        unlink(path);
+        listen_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void upgrade_stop(void)
+{
+    if (listen_fd < 0)
+        return;
+    /* Wakes the thread if it is in accept(); after a handoff it has already exited */
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(upgrade_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    if (!__atomic_load_n(&handed_off, __ATOMIC_ACQUIRE))
+        unlink(listen_path);
+}
+
+/* Take the descriptors of one "FDS" message */
+static int take_fds(struct msghdr *msg, const char *kinds, size_t nkinds, upgrade_handoff *h)
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    size_t n, i;
+
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < n; i++) {
+        int fd;
+
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        if (i >= nkinds || h->n == UPGRADE_MAX_FDS) {
+            close(fd);
+            continue;
+        }
+        h->fds[h->n] = fd;
+        h->kinds[h->n++] = kinds[i];
+    }
+    return n == nkinds && !(msg->msg_flags & MSG_CTRUNC) ? 0 : -1;
+}
+
+static void take_tokens(char *lines, upgrade_handoff *h)
+{
+    char *line, *save = NULL;
+
+    for (line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char token[AUTH_TOKEN_LEN + 1], user[64];
+        int ttl;
+
+        if (sscanf(line, "%32s %63s %d", token, user, &ttl) == 3 &&
+            auth_token_import(token, user, ttl) == 0)
+            h->tokens++;
+    }
+}
+
+int upgrade_takeover(const char *path, upgrade_handoff *h)
+{
+    struct sockaddr_un addr;
+    char buf[UPGRADE_MSG_SIZE + 1];
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+    int fd, pid;
+
+    memset(h, 0, sizeof(*h));
+    h->conn = -1;
+    h->start_us = metrics_now_us();
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "upgrade: socket path too long: %s\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("upgrade: socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("upgrade: connect to running daemon");
+        close(fd);
+        return -1;
+    }
+    set_timeout(fd, UPGRADE_TIMEOUT);
+    if (send_str(fd, "TAKEOVER", strlen("TAKEOVER")) < 0)
+        goto fail;
+
+    for (;;) {
+        struct iovec iov = { buf, UPGRADE_MSG_SIZE };
+        struct msghdr msg = { 0 };
+        ssize_t got;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (got <= 0) {
+            fprintf(stderr, "upgrade: handoff interrupted: %s\n", got ? strerror(errno) : "closed");
+            goto fail;
+        }
+        buf[got] = '\0';
+        if (!strncmp(buf, "FDS ", 4)) {
+            if (take_fds(&msg, buf + 4, (size_t)got - 4, h) < 0)
+                goto fail;
+        } else if (!strncmp(buf, "TOKENS\n", 7)) {
+            take_tokens(buf + 7, h);
+        } else if (sscanf(buf, "END %d", &pid) == 1) {
+            h->pid = pid;
+            break;
+        } else {
+            fprintf(stderr, "upgrade: unexpected message from running daemon\n");
+            goto fail;
+        }
+    }
+
+    h->conn = fd;
+    __atomic_store_n(&counters.inherited, (unsigned long)h->n, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters.tokens, (unsigned long)h->tokens, __ATOMIC_RELAXED);
+    return 0;
+
+fail:
+    for (int i = 0; i < h->n; i++)
+        close(h->fds[i]);
+    h->n = 0;
+    close(fd);
+    return -1;
+}
+
+void upgrade_ready(upgrade_handoff *h)
+{
+    unsigned long long ms = (metrics_now_us() - h->start_us) / 1000;
+
+    if (h->conn < 0)
+        return;
+    if (send_str(h->conn, "READY", strlen("READY")) < 0)
+        perror("upgrade: READY");
+    close(h->conn);
+    h->conn = -1;
+    __atomic_store_n(&counters.takeover_ms, ms ? ms : 1, __ATOMIC_RELAXED); /* 0 = no takeover */
+}
+
+int upgrade_fd(const upgrade_handoff *h, char kind)
+{
+    for (int i = 0; i < h->n; i++) {
+        if (h->kinds[i] == kind)
+            return h->fds[i];
+    }
+    return -1;
+}
+
+void upgrade_get_stats(struct upgrade_stats *st)
+{
+    st->handoffs = __atomic_load_n(&counters.handoffs, __ATOMIC_RELAXED);
+    st->inherited = __atomic_load_n(&counters.inherited, __ATOMIC_RELAXED);
+    st->tokens = __atomic_load_n(&counters.tokens, __ATOMIC_RELAXED);
+    st->takeover_ms = __atomic_load_n(&counters.takeover_ms, __ATOMIC_RELAXED);
+}
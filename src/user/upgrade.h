@@ -0,0 +1,87 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+#include "net_server.h"
+
+/*
+ * Zero-downtime restart. A daemon started with --upgrade-socket PATH
+ * listens there (AF_UNIX, SOCK_SEQPACKET, owner only) for a successor.
+ * A new daemon started with --takeover connects and sends "TAKEOVER";
+ * the old one answers with
+ *
+ *   "FDS <kinds>"          its listening sockets, passed with SCM_RIGHTS,
+ *                          one kind character (NET_FD_*, UPGRADE_FD_*) each
+ *   "TOKENS\n<token> <user> <ttl>\n..."   live session tokens
+ *   "END <pid>"
+ *
+ * The new daemon starts serving on the same sockets and sends "READY".
+ * Only then does the old one stop accepting and drain its connections
+ * (net_server_drain()), so connections keep being accepted by one of
+ * the two throughout. If the new daemon fails before READY, the old
+ * one keeps serving and waits for the next attempt.
+ *
+ * The table itself lives in the kernel and is not part of the handoff.
+ */
+
+#define UPGRADE_FD_METRICS 'm'
+#define UPGRADE_MAX_FDS (NET_MAX_LISTENERS + 1)
+#define UPGRADE_FDS_PER_MSG 64          /* well below the kernel's SCM_MAX_FD */
+#define UPGRADE_MSG_SIZE 4096
+#define UPGRADE_TIMEOUT 10              /* seconds for each step of the handoff */
+#define UPGRADE_READY_TIMEOUT 60        /* seconds for the new daemon to start serving */
+#define UPGRADE_DEFAULT_DRAIN 30        /* --drain-timeout */
+
+/* What a new daemon received from the one it replaces */
+typedef struct {
+    int fds[UPGRADE_MAX_FDS];
+    char kinds[UPGRADE_MAX_FDS];
+    int n;
+    int tokens;                     /* session tokens imported */
+    pid_t pid;                      /* the old daemon */
+    int conn;                       /* control connection, until upgrade_ready() */
+    unsigned long long start_us;    /* when the takeover began */
+} upgrade_handoff;
+
+struct upgrade_stats {
+    unsigned long handoffs;         /* successors this daemon handed over to (0 or 1) */
+    unsigned long inherited;        /* listening sockets taken over at startup */
+    unsigned long tokens;           /* session tokens taken over */
+    unsigned long long takeover_ms; /* takeover start to serving, 0 if none */
+};
+
+/**
+ * Accept a successor on path. When one has started serving on our
+ * listeners, done() is called from the upgrade thread; the daemon
+ * should then drain with handed_off set and exit.
+ * @return 0 on success, -1 on error.
+ */
+int upgrade_listen(const char *path, void (*done)(void));
+
+/**
+ * Stop accepting successors. Removes the socket path unless a successor
+ * took over, since it is then listening on that path itself.
+ */
+void upgrade_stop(void);
+
+/**
+ * Take over from the daemon listening on path: receive its listening
+ * sockets into h and import its session tokens. Call after auth_init().
+ * @return 0 on success, -1 on error.
+ */
+int upgrade_takeover(const char *path, upgrade_handoff *h);
+
+/**
+ * Tell the old daemon that we are serving, so it stops accepting.
+ * Records the time since upgrade_takeover() began.
+ */
+void upgrade_ready(upgrade_handoff *h);
+
+/**
+ * The inherited fd of a kind, or -1.
+ */
+int upgrade_fd(const upgrade_handoff *h, char kind);
+
+void upgrade_get_stats(struct upgrade_stats *st);
+
+#endif /* UPGRADE_H */
@@ -0,0 +1,245 @@
+#include "watch.h"
+#include "net_server.h"
+
+struct watch_pattern {
+    char text[KV_MAX_KEY + 1];
+    size_t len;
+    int prefix;                     /* pattern ended in '*' */
+};
+
+/*
+ * Subscription state of one client. The pattern list is written by the
+ * client's shard under the registry write lock and read by the feed
+ * thread under the read lock; the queue is guarded by lock.
+ */
+struct watch_sub {
+    net_client *client;
+    struct watch_sub *prev;
+    struct watch_sub *next;
+    struct watch_pattern patterns[WATCH_MAX_PATTERNS];
+    int n_patterns;
+
+    pthread_mutex_t lock;
+    struct kv_event queue[WATCH_QUEUE_MAX];
+    int start;                      /* first unsent entry */
+    int count;                      /* entries in use, from index 0 */
+    int resync;                     /* events were dropped since the last flush */
+    unsigned long long resync_seq;
+};
+
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct watch_sub *registry;
+static struct watch_stats counters;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&counters.field, (n), __ATOMIC_RELAXED)
+
+static int pattern_match(const struct watch_pattern *p, const char *key)
+{
+    if (p->prefix)
+        return !strncmp(key, p->text, p->len);
+    return !strcmp(key, p->text);
+}
+
+static int sub_matches(const struct watch_sub *s, const char *key)
+{
+    int i;
+
+    for (i = 0; i < s->n_patterns; i++) {
+        if (pattern_match(&s->patterns[i], key))
+            return 1;
+    }
+    return 0;
+}
+
+static void sub_unlink(struct watch_sub *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        registry = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+int watch_add(net_client *c, const char *pattern)
+{
+    struct watch_sub *s = c->watch;
+    struct watch_pattern *p;
+    size_t len = strlen(pattern);
+    int i;
+
+    if (!kv_valid_token(pattern, len, KV_MAX_KEY))
+        return -EINVAL;
+
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        if (!s)
+            return -ENOMEM;
+        s->client = c;
+        pthread_mutex_init(&s->lock, NULL);
+        c->watch = s;
+    }
+
+    pthread_rwlock_wrlock(&registry_lock);
+    for (i = 0; i < s->n_patterns; i++) {
+        if (!strcmp(s->patterns[i].text, pattern)) {
+            pthread_rwlock_unlock(&registry_lock);
+            return 0;
+        }
+    }
+    if (s->n_patterns == WATCH_MAX_PATTERNS) {
+        pthread_rwlock_unlock(&registry_lock);
+        return -E2BIG;
+    }
+    p = &s->patterns[s->n_patterns];
+    memcpy(p->text, pattern, len + 1);
+    p->prefix = pattern[len - 1] == '*';
+    p->len = p->prefix ? len - 1 : len;
+    if (s->n_patterns++ == 0) {
+        s->next = registry;
+        if (registry)
+            registry->prev = s;
+        registry = s;
+        STAT_ADD(subscribers, 1);
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return 0;
+}
+
+int watch_remove(net_client *c, const char *pattern)
+{
+    struct watch_sub *s = c->watch;
+    int i, removed = 0;
+
+    if (!s)
+        return 0;
+
+    pthread_rwlock_wrlock(&registry_lock);
+    for (i = 0; i < s->n_patterns; ) {
+        if (!pattern || !strcmp(s->patterns[i].text, pattern)) {
+            s->patterns[i] = s->patterns[--s->n_patterns];
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    if (removed && s->n_patterns == 0) {
+        sub_unlink(s);
+        STAT_ADD(subscribers, -1UL);
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return removed;
+}
+
+void watch_client_close(net_client *c)
+{
+    struct watch_sub *s = c->watch;
+
+    if (!s)
+        return;
+    watch_remove(c, NULL);
+    c->watch = NULL;
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int watch_active(const net_client *c)
+{
+    return c->watch && c->watch->n_patterns > 0;
+}
+
+/* Queue ev for s, replacing a pending event for the same key */
+static void sub_enqueue(struct watch_sub *s, const struct kv_event *ev)
+{
+    int i;
+
+    if (ev->op == KV_EVENT_LOST) {
+        s->resync = 1;
+        s->resync_seq = ev->seq;
+        return;
+    }
+    for (i = s->start; i < s->count; i++) {
+        if (!strcmp(s->queue[i].key, ev->key)) {
+            s->queue[i] = *ev;
+            STAT_ADD(coalesced, 1);
+            return;
+        }
+    }
+    if (s->count == WATCH_QUEUE_MAX && s->start > 0) {
+        memmove(s->queue, s->queue + s->start, (size_t)(s->count - s->start) * sizeof(*ev));
+        s->count -= s->start;
+        s->start = 0;
+    }
+    if (s->count == WATCH_QUEUE_MAX) {
+        s->resync = 1;
+        s->resync_seq = ev->seq;
+        STAT_ADD(overflows, 1);
+        return;
+    }
+    s->queue[s->count++] = *ev;
+    STAT_ADD(queued, 1);
+}
+
+void watch_on_event(const struct kv_event *ev, void *arg)
+{
+    struct watch_sub *s;
+
+    (void)arg;
+    pthread_rwlock_rdlock(&registry_lock);
+    for (s = registry; s; s = s->next) {
+        if (ev->op != KV_EVENT_LOST && !sub_matches(s, ev->key))
+            continue;
+        pthread_mutex_lock(&s->lock);
+        sub_enqueue(s, ev);
+        pthread_mutex_unlock(&s->lock);
+        net_client_notify(s->client);
+    }
+    pthread_rwlock_unlock(&registry_lock);
+}
+
+int watch_flush(net_client *c)
+{
+    struct watch_sub *s = c->watch;
+    char line[32 + KV_MAX_KEY + KV_MAX_VALUE];
+    unsigned long pushed = 0;
+    int more;
+
+    if (!s)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->start < s->count && c->wlen - c->woff < NET_WBUF_HIGH) {
+        const struct kv_event *ev = &s->queue[s->start++];
+
+        if (ev->op == KV_EVENT_INSERT)
+            snprintf(line, sizeof(line), "EVENT %llu insert %s %s\n", ev->seq, ev->key, ev->value);
+        else
+            snprintf(line, sizeof(line), "EVENT %llu delete %s\n", ev->seq, ev->key);
+        net_client_write(c, line, strlen(line));
+        pushed++;
+    }
+    if (s->start == s->count) {
+        s->start = s->count = 0;
+        if (s->resync && c->wlen - c->woff < NET_WBUF_HIGH) {
+            snprintf(line, sizeof(line), "EVENT %llu resync\n", s->resync_seq);
+            net_client_write(c, line, strlen(line));
+            s->resync = 0;
+            pushed++;
+        }
+    }
+    more = s->start < s->count || s->resync;
+    pthread_mutex_unlock(&s->lock);
+    if (pushed)
+        STAT_ADD(pushed, pushed);
+    return more;
+}
+
+void watch_get_stats(struct watch_stats *st)
+{
+    st->subscribers = __atomic_load_n(&counters.subscribers, __ATOMIC_RELAXED);
+    st->queued = __atomic_load_n(&counters.queued, __ATOMIC_RELAXED);
+    st->coalesced = __atomic_load_n(&counters.coalesced, __ATOMIC_RELAXED);
+    st->overflows = __atomic_load_n(&counters.overflows, __ATOMIC_RELAXED);
+    st->pushed = __atomic_load_n(&counters.pushed, __ATOMIC_RELAXED);
+}
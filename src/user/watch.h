@@ -0,0 +1,78 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "kvfeed.h"
+
+/*
+ * Key-change subscriptions for text-protocol clients:
+ *
+ *   watch <key>        exact key
+ *   watch <prefix>*    every key starting with prefix ("*" = all keys)
+ *   unwatch [pattern]  drop one pattern, or all of them
+ *
+ * Matching mutations from the kernel feed are pushed to the client as
+ *
+ *   EVENT <seq> insert <key> <value>
+ *   EVENT <seq> delete <key>
+ *   EVENT <seq> resync            events were dropped; re-read your keys
+ *
+ * Each subscriber has a bounded queue. While the client is not reading,
+ * a newer event for a key already queued replaces the older one, so a
+ * slow subscriber sees the latest state of each key rather than every
+ * step. When more than WATCH_QUEUE_MAX distinct keys are pending, the
+ * rest are dropped and a resync line is sent.
+ */
+
+#define WATCH_MAX_PATTERNS 16       /* per client */
+#define WATCH_QUEUE_MAX 256         /* distinct keys pending per client */
+
+struct net_client;
+
+struct watch_stats {
+    unsigned long subscribers;      /* clients with at least one pattern */
+    unsigned long queued;           /* events queued for some subscriber */
+    unsigned long coalesced;        /* events that replaced a pending one */
+    unsigned long overflows;        /* events dropped because a queue was full */
+    unsigned long pushed;           /* EVENT lines written to clients */
+};
+
+/**
+ * Subscribe a client to a key or prefix pattern.
+ * @return 0 on success, -EINVAL for a bad pattern, -E2BIG when the client
+ *         has WATCH_MAX_PATTERNS already, -ENOMEM.
+ */
+int watch_add(struct net_client *c, const char *pattern);
+
+/**
+ * Drop one pattern, or every pattern if pattern is NULL.
+ * @return number of patterns removed.
+ */
+int watch_remove(struct net_client *c, const char *pattern);
+
+/**
+ * Detach a closing client. Once this returns the feed thread no longer
+ * sees the client, so it may be freed.
+ */
+void watch_client_close(struct net_client *c);
+
+/**
+ * Move queued events into the client's output buffer, stopping at
+ * NET_WBUF_HIGH. Called on the client's shard thread.
+ * @return 1 if events are still queued, 0 otherwise.
+ */
+int watch_flush(struct net_client *c);
+
+/**
+ * @return 1 if the client has patterns (exempt from the idle timeout).
+ */
+int watch_active(const struct net_client *c);
+
+/**
+ * kvfeed listener: queue an event for every matching subscriber and
+ * wake their shards.
+ */
+void watch_on_event(const struct kv_event *ev, void *arg);
+
+void watch_get_stats(struct watch_stats *st);
+
+#endif /* WATCH_H */
@@ -0,0 +1,162 @@
+/*
+ * Microbenchmarks for the hashtable core, built in user space against
+ * the kernel shims in tests/shim:
+ *
+ *   make bench-ht
+ *   ./bench_hashtable [filter]
+ *
+ * Each benchmark runs against a table prefilled with N keys. The
+ * iteration count doubles until a run takes at least BENCH_MIN_TIME.
+ * The report gives the time per operation, in the style of Google
+ * Benchmark.
+ */
+#include "../src/kernel/hashtable_module.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_MIN_TIME 0.2      /* seconds per benchmark */
+#define BENCH_KEY_LEN 24
+
+typedef void (*bench_fn)(ht *table, int n, long iters);
+
+static char (*keys)[BENCH_KEY_LEN];
+static char (*missing)[BENCH_KEY_LEN];
+static volatile unsigned long sink;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_keys(int n)
+{
+    keys = malloc((size_t)n * sizeof(*keys));
+    missing = malloc((size_t)n * sizeof(*missing));
+    if (!keys || !missing) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        snprintf(keys[i], BENCH_KEY_LEN, "user:%08d", i);
+        snprintf(missing[i], BENCH_KEY_LEN, "miss:%08d", i);
+    }
+}
+
+static ht *prefill(int n)
+{
+    ht *table = create_ht();
+
+    if (!table) {
+        fprintf(stderr, "create_ht failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++)
+        ht_insert(table, keys[i], "value-0123456789");
+    return table;
+}
+
+static void bm_hash_key(ht *table, int n, long iters)
+{
+    unsigned long acc = 0;
+
+    (void)table;
+    for (long i = 0; i < iters; i++)
+        acc += hash_key(keys[i % n]);
+    sink = acc;
+}
+
+static void bm_search_hit(ht *table, int n, long iters)
+{
+    unsigned long acc = 0;
+
+    for (long i = 0; i < iters; i++)
+        acc += (unsigned long)ht_search(table, keys[i % n]);
+    sink = acc;
+}
+
+static void bm_search_miss(ht *table, int n, long iters)
+{
+    unsigned long acc = 0;
+
+    for (long i = 0; i < iters; i++)
+        acc += (unsigned long)ht_search(table, missing[i % n]);
+    sink = acc;
+}
+
+/* Overwrite an existing key: lookup plus one value copy */
+static void bm_insert_overwrite(ht *table, int n, long iters)
+{
+    for (long i = 0; i < iters; i++)
+        ht_insert(table, keys[i % n], "value-9876543210");
+}
+
+/* Delete a present key and insert it again, so the size stays at N */
+static void bm_delete_insert(ht *table, int n, long iters)
+{
+    for (long i = 0; i < iters; i++) {
+        ht_delete(table, keys[i % n]);
+        ht_insert(table, keys[i % n], "value-0123456789");
+    }
+}
+
+static const struct {
+    const char *name;
+    bench_fn fn;
+} benchmarks[] = {
+    { "hash_key",         bm_hash_key },
+    { "search_hit",       bm_search_hit },
+    { "search_miss",      bm_search_miss },
+    { "insert_overwrite", bm_insert_overwrite },
+    { "delete_insert",    bm_delete_insert },
+};
+
+/* The table has a fixed number of buckets, so chains grow linearly with N */
+static const int sizes[] = { 16, 256, 4096 };
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    int max_n = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+    make_keys(max_n);
+    printf("%-32s %12s %14s\n", "Benchmark", "Time", "Iterations");
+    printf("--------------------------------------------------------------\n");
+
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            char name[64];
+            int n = sizes[s];
+            long iters = 1;
+            double elapsed;
+            ht *table;
+
+            snprintf(name, sizeof(name), "BM_%s/%d", benchmarks[b].name, n);
+            if (filter && !strstr(name, filter))
+                continue;
+
+            table = prefill(n);
+            for (;;) {
+                double start = now_sec();
+                benchmarks[b].fn(table, n, iters);
+                elapsed = now_sec() - start;
+                if (elapsed >= BENCH_MIN_TIME || iters >= (1L << 40))
+                    break;
+                /* Aim past the target instead of plain doubling when the run was short */
+                if (elapsed < BENCH_MIN_TIME / 100)
+                    iters *= 10;
+                else
+                    iters *= 2;
+            }
+            destroy_ht(table);
+
+            printf("%-32s %9.1f ns %14ld\n", name, elapsed * 1e9 / iters, iters);
+        }
+    }
+
+    free(keys);
+    free(missing);
+    return 0;
+}
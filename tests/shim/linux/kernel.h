@@ -0,0 +1,17 @@
+#ifndef SHIM_LINUX_KERNEL_H
+#define SHIM_LINUX_KERNEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define KERN_ERR     ""
+#define KERN_WARNING ""
+#define KERN_INFO    ""
+#define KERN_DEBUG   ""
+
+#define printk(...) printf(__VA_ARGS__)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#endif
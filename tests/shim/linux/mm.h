@@ -0,0 +1,6 @@
+#ifndef SHIM_LINUX_MM_H
+#define SHIM_LINUX_MM_H
+
+#include <linux/slab.h>
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * User-space stand-ins for the few kernel headers the hashtable core
+ * includes. Only used for tests/test_hashtable_user.c and
+ * tests/bench_hashtable.c, built with -Itests/shim so these shadow the
+ * real <linux/...> headers.
+ */
+#ifndef SHIM_LINUX_MODULE_H
+#define SHIM_LINUX_MODULE_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#endif
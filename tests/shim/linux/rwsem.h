@@ -0,0 +1,39 @@
+#ifndef SHIM_LINUX_RWSEM_H
+#define SHIM_LINUX_RWSEM_H
+
+#include <pthread.h>
+
+/* rw_semaphore on top of a pthread rwlock, same calls as the kernel */
+struct rw_semaphore {
+    pthread_rwlock_t lock;
+};
+
+#define DECLARE_RWSEM(name) \
+    struct rw_semaphore name = { PTHREAD_RWLOCK_INITIALIZER }
+
+static inline void init_rwsem(struct rw_semaphore *sem)
+{
+    pthread_rwlock_init(&sem->lock, NULL);
+}
+
+static inline void down_read(struct rw_semaphore *sem)
+{
+    pthread_rwlock_rdlock(&sem->lock);
+}
+
+static inline void up_read(struct rw_semaphore *sem)
+{
+    pthread_rwlock_unlock(&sem->lock);
+}
+
+static inline void down_write(struct rw_semaphore *sem)
+{
+    pthread_rwlock_wrlock(&sem->lock);
+}
+
+static inline void up_write(struct rw_semaphore *sem)
+{
+    pthread_rwlock_unlock(&sem->lock);
+}
+
+#endif
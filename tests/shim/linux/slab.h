@@ -0,0 +1,91 @@
+#ifndef SHIM_LINUX_SLAB_H
+#define SHIM_LINUX_SLAB_H
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0u
+#define GFP_ATOMIC 1u
+
+/*
+ * Allocation accounting and fault injection. shim_alloc_live counts
+ * blocks not yet freed, so tests can check for leaks. When
+ * shim_alloc_fail_after is >= 0 it counts down once per allocation, and
+ * every allocation after it reaches zero returns NULL. -1 disables it.
+ */
+extern long shim_alloc_live;
+extern long shim_alloc_fail_after;
+
+static inline int shim_alloc_should_fail(void)
+{
+    if (shim_alloc_fail_after < 0)
+        return 0;
+    if (shim_alloc_fail_after == 0)
+        return 1;
+    shim_alloc_fail_after--;
+    return 0;
+}
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+    void *p;
+
+    (void)flags;
+    if (shim_alloc_should_fail())
+        return NULL;
+    p = malloc(size);
+    if (p)
+        __atomic_add_fetch(&shim_alloc_live, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+    void *p = kmalloc(size, flags);
+
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+    if (size && n > (size_t)-1 / size)
+        return NULL;
+    return kzalloc(n * size, flags);
+}
+
+static inline void kfree(const void *p)
+{
+    if (p)
+        __atomic_sub_fetch(&shim_alloc_live, 1, __ATOMIC_RELAXED);
+    free((void *)p);
+}
+
+/* No vmalloc fallback here: the kv* variants only need to pair up */
+static inline void *kvcalloc(size_t n, size_t size, gfp_t flags)
+{
+    return kcalloc(n, size, flags);
+}
+
+static inline void kvfree(const void *p)
+{
+    kfree(p);
+}
+
+static inline char *kstrdup(const char *s, gfp_t flags)
+{
+    size_t len;
+    char *p;
+
+    if (!s)
+        return NULL;
+    len = strlen(s) + 1;
+    p = kmalloc(len, flags);
+    if (p)
+        memcpy(p, s, len);
+    return p;
+}
+
+#endif
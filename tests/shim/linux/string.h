@@ -0,0 +1,7 @@
+#ifndef SHIM_LINUX_STRING_H
+#define SHIM_LINUX_STRING_H
+
+#include <string.h>
+#include <linux/slab.h>
+
+#endif
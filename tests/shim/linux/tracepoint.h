@@ -0,0 +1,22 @@
+#ifndef SHIM_LINUX_TRACEPOINT_H
+#define SHIM_LINUX_TRACEPOINT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+
+/*
+ * Tracepoints compile to empty inline functions, as in a kernel built
+ * without CONFIG_TRACEPOINTS. Pair with the empty trace/define_trace.h.
+ */
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) {}
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) {}
+
+#endif
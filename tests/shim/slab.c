@@ -0,0 +1,4 @@
+#include <linux/slab.h>
+
+long shim_alloc_live;
+long shim_alloc_fail_after = -1;
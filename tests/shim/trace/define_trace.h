@@ -0,0 +1 @@
+/* Nothing to instantiate: see linux/tracepoint.h */
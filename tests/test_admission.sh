@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Starts a daemon with admission limits and checks each of them: the
+# per-IP connection cap, the per-user rate limit, and load shedding
+# past the in-flight cap.
+
+SERVER="127.0.0.1"
+PORT=5701
+DAEMON="./daemon"
+
+echo "=== TEST: Admission control ==="
+read -p "User: " USER
+read -s -p "Password: " PASS
+echo ""
+
+$DAEMON -n --port $PORT --backup /var/tmp/hashtable_admission.txt --auth-per-ip 64 \
+    --conns-per-ip 2 --rate-per-user 10 --rate-burst 5 &
+DAEMON_PID=$!
+sleep 2
+
+echo "--- Per-IP connection limit (2) ---"
+(sleep 3; echo QUIT) | nc $SERVER $PORT > /dev/null &
+HOLD1=$!
+(sleep 3; echo QUIT) | nc $SERVER $PORT > /dev/null &
+HOLD2=$!
+sleep 1
+resp=$(printf 'AUTH %s %s\nQUIT\n' "$USER" "$PASS" | nc $SERVER $PORT)
+if echo "$resp" | grep -q "^BUSY too many connections"; then
+    echo "PASS: third connection refused"
+else
+    echo "FAIL: third connection got: $resp"
+fi
+wait $HOLD1 $HOLD2
+
+echo "--- Per-user rate limit (10/s, burst 5) ---"
+start=$(date +%s%N)
+resp=$( (printf 'AUTH %s %s\n' "$USER" "$PASS"
+         for i in $(seq 1 25); do echo "lookup ratekey$i"; done
+         echo stats; echo QUIT) | nc $SERVER $PORT)
+ms=$(( ($(date +%s%N) - start) / 1000000 ))
+answered=$(echo "$resp" | grep -c "^Not found\|gave value")
+throttled=$(echo "$resp" | grep -o "admit_throttled=[0-9]*" | cut -d= -f2)
+echo "25 lookups: $answered answered in ${ms} ms, $throttled throttled"
+if [[ "$answered" -eq 25 && "$ms" -ge 1500 && "$throttled" -gt 0 ]]; then
+    echo "PASS: requests past the burst were held back, none lost"
+else
+    echo "FAIL: expected 25 answers taking at least 1.5 s"
+fi
+kill $DAEMON_PID 2>/dev/null
+wait $DAEMON_PID 2>/dev/null
+
+echo "--- In-flight cap (1) ---"
+$DAEMON -n --port $PORT --backup /var/tmp/hashtable_admission.txt --auth-per-ip 64 \
+    --max-inflight 1 &
+DAEMON_PID=$!
+sleep 2
+
+LOAD_PIDS=""
+for c in $(seq 1 8); do
+    (printf 'AUTH %s %s\n' "$USER" "$PASS"
+     for i in $(seq 1 200); do echo "lookup loadkey"; done
+     echo QUIT) | nc $SERVER $PORT > /tmp/admission_load.$c &
+    LOAD_PIDS="$LOAD_PIDS $!"
+done
+wait $LOAD_PIDS
+busy=$(cat /tmp/admission_load.* | grep -c "^BUSY")
+answered=$(cat /tmp/admission_load.* | grep -c "^Not found\|gave value")
+echo "1600 lookups from 8 clients: $answered answered, $busy BUSY"
+if [[ $((answered + busy)) -eq 1600 ]]; then
+    echo "PASS: every request answered or shed with BUSY"
+else
+    echo "FAIL: $((1600 - answered - busy)) requests got no answer"
+fi
+
+# Cleanup
+kill $DAEMON_PID 2>/dev/null
+wait 2>/dev/null
+rm -f /tmp/admission_load.* /var/tmp/hashtable_admission.txt
+echo "=== DONE ==="
@@ -0,0 +1,127 @@
+/*
+ * Unit tests for admission control (src/user/admit.c), mainly what
+ * happens once its tables are full. Pure user space, no daemon needed:
+ *
+ *   make test
+ */
+#include "../src/user/admit.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* admit.c reads the clock through metrics.c; a fixed clock keeps buckets still */
+static unsigned long long fake_now = 1000000;
+
+unsigned long long metrics_now_us(void)
+{
+    return fake_now;
+}
+
+static admit_slot *held[2 * ADMIT_SLOTS];
+
+/* Open one connection for each of n new IPs; returns how many were admitted */
+static int fill(const char *prefix, int n)
+{
+    char ip[64];
+    int ok = 0;
+
+    for (int i = 0; i < n; i++) {
+        snprintf(ip, sizeof(ip), "%s.%d.%d", prefix, i / 256, i % 256);
+        held[i] = NULL;
+        if (admit_ip_open(ip, &held[i]) == 0)
+            ok++;
+    }
+    return ok;
+}
+
+static void release(int n)
+{
+    for (int i = 0; i < n; i++)
+        admit_close(held[i]);
+}
+
+static void test_no_limits(void)
+{
+    admit_opts opts = { 0 };
+    admit_slot *s = (admit_slot *)1;
+
+    admit_init(&opts);
+    CHECK(admit_ip_open("10.0.0.1", &s) == 0);
+    CHECK(s == NULL);
+    CHECK(admit_charge(NULL, NULL) == 0);
+}
+
+/* Twice as many IPs as slots, one connection each allowed */
+static void test_full_table_conns(void)
+{
+    admit_opts opts = { .ip_conns = 1 };
+    struct admit_stats before, after;
+    admit_slot *a, *b;
+    int ok;
+
+    admit_init(&opts);
+    admit_get_stats(&before);
+    ok = fill("10.1", 2 * ADMIT_SLOTS);
+    admit_get_stats(&after);
+
+    /* The tracked IPs, plus one connection for all the others together */
+    CHECK(ok <= ADMIT_SLOTS + 1);
+    CHECK(ok > ADMIT_SLOTS / 2);
+    CHECK(after.overflowed > before.overflowed);
+    CHECK(after.refused_ip - before.refused_ip == (unsigned long)(2 * ADMIT_SLOTS - ok));
+
+    /* Untracked newcomers are refused, not let in without a limit */
+    CHECK(admit_ip_open("10.2.0.1", &a) != 0);
+    CHECK(admit_ip_open("10.2.0.2", &b) != 0);
+
+    /* Once the table has room again, new IPs get slots of their own */
+    release(2 * ADMIT_SLOTS);
+    CHECK(admit_ip_open("10.2.0.1", &a) == 0);
+    CHECK(admit_ip_open("10.2.0.2", &b) == 0);
+    CHECK(a != NULL && b != NULL && a != b);
+    CHECK(admit_ip_open("10.2.0.1", &held[0]) != 0);
+    admit_close(a);
+    admit_close(b);
+}
+
+/* IPs that share the overflow slot share its token bucket */
+static void test_full_table_rate(void)
+{
+    admit_opts opts = { .ip_rate = 10, .burst = 1 };
+    admit_slot *a, *b;
+
+    admit_init(&opts);
+    fill("10.3", 2 * ADMIT_SLOTS);
+    CHECK(admit_ip_open("10.4.0.1", &a) == 0);
+    CHECK(admit_ip_open("10.4.0.2", &b) == 0);
+    CHECK(a != NULL && a == b);
+    CHECK(admit_charge(a, NULL) == 0);
+    CHECK(admit_charge(b, NULL) > 0);
+
+    /* 200 ms at 10/s pays off the debt and earns the next token */
+    fake_now += 200000;
+    CHECK(admit_charge(b, NULL) == 0);
+    admit_close(a);
+    admit_close(b);
+    release(2 * ADMIT_SLOTS);
+}
+
+int main(void)
+{
+    test_no_limits();
+    test_full_table_conns();
+    test_full_table_rate();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
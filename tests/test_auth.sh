@@ -4,7 +4,7 @@ SERVER="127.0.0.1"
 PORT=5555
 
 echo "=== TEST: Wrong Password ==="
-(echo "AUTH fakeuser wrongpass"; sleep 0.1; echo "lookup dog") | nc $SERVER $PORT
+printf "AUTH fakeuser wrongpass\nlookup dog\n" | nc $SERVER $PORT
 
 echo "=== TEST: No AUTH ==="
 (echo "lookup dog") | nc $SERVER $PORT
@@ -14,5 +14,16 @@ read -p "User: " USER
 read -s -p "Password: " PASS
 echo ""
 
-(echo "AUTH $USER $PASS"; sleep 0.1; echo "insert dog baileys") | nc $SERVER $PORT
-(echo "AUTH $USER $PASS"; sleep 0.1; echo "lookup dog") | nc $SERVER $PORT
\ No newline at end of file
+printf "AUTH %s %s\ninsert dog baileys\nQUIT\n" "$USER" "$PASS" | nc $SERVER $PORT
+printf "AUTH %s %s\nlookup dog\nQUIT\n" "$USER" "$PASS" | nc $SERVER $PORT
+
+echo "=== TEST: Session token ==="
+TOKEN=$(printf "AUTH %s %s\nQUIT\n" "$USER" "$PASS" | nc $SERVER $PORT | awk '/^AUTH OK/ {print $3}')
+if [[ -n "$TOKEN" ]]; then
+    printf "AUTH-TOKEN %s\nlookup dog\nQUIT\n" "$TOKEN" | nc $SERVER $PORT
+else
+    echo "No token issued (tokens disabled?)"
+fi
+
+echo "=== TEST: Bogus token ==="
+printf "AUTH-TOKEN 00000000000000000000000000000000\nlookup dog\n" | nc $SERVER $PORT
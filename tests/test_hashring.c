@@ -0,0 +1,148 @@
+/*
+ * Unit tests for the router's consistent-hash ring (src/user/hashring.c).
+ * Pure user space, no daemon needed:
+ *
+ *   make test
+ */
+#include "../src/user/hashring.h"
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_KEYS 100000
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const char *names[] = {
+    "127.0.0.1:5601", "127.0.0.1:5602", "127.0.0.1:5603",
+    "127.0.0.1:5604", "127.0.0.1:5605",
+};
+
+static void key_name(char *buf, size_t len, int i)
+{
+    snprintf(buf, len, "user:%d", i);
+}
+
+static void test_empty_and_single(void)
+{
+    struct hashring r;
+
+    CHECK(hashring_build(&r, names, 0, 16) == 0);
+    CHECK(hashring_lookup(&r, "a") == -1);
+    hashring_free(&r);
+
+    CHECK(hashring_build(&r, names, 1, 16) == 0);
+    CHECK(hashring_lookup(&r, "a") == 0);
+    CHECK(hashring_lookup(&r, "zzz") == 0);
+    hashring_free(&r);
+
+    CHECK(hashring_build(&r, names, 2, 0) < 0);
+    CHECK(hashring_build(&r, names, 2, HASHRING_MAX_VNODES + 1) < 0);
+}
+
+/* Same names, same ring: two routers must agree on every key */
+static void test_deterministic(void)
+{
+    struct hashring a, b;
+    char key[32];
+    int same = 1;
+
+    CHECK(hashring_build(&a, names, 4, HASHRING_DEFAULT_VNODES) == 0);
+    CHECK(hashring_build(&b, names, 4, HASHRING_DEFAULT_VNODES) == 0);
+    for (int i = 0; i < 1000; i++) {
+        key_name(key, sizeof(key), i);
+        if (hashring_lookup(&a, key) != hashring_lookup(&b, key))
+            same = 0;
+    }
+    CHECK(same);
+    hashring_free(&a);
+    hashring_free(&b);
+}
+
+/* With the default virtual nodes each backend gets close to 1/N */
+static void test_balance(void)
+{
+    struct hashring r;
+    int count[4] = { 0 };
+    char key[32];
+
+    CHECK(hashring_build(&r, names, 4, HASHRING_DEFAULT_VNODES) == 0);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_name(key, sizeof(key), i);
+        count[hashring_lookup(&r, key)]++;
+    }
+    for (int n = 0; n < 4; n++) {
+        printf("  node %d: %d keys\n", n, count[n]);
+        CHECK(count[n] > NUM_KEYS / 4 * 8 / 10);
+        CHECK(count[n] < NUM_KEYS / 4 * 12 / 10);
+    }
+    hashring_free(&r);
+}
+
+/* Adding a fifth node moves about 1/5 of the keys, all to the new node */
+static void test_add_node(void)
+{
+    struct hashring before, after;
+    int moved = 0, moved_elsewhere = 0;
+    char key[32];
+
+    CHECK(hashring_build(&before, names, 4, HASHRING_DEFAULT_VNODES) == 0);
+    CHECK(hashring_build(&after, names, 5, HASHRING_DEFAULT_VNODES) == 0);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        int a, b;
+
+        key_name(key, sizeof(key), i);
+        a = hashring_lookup(&before, key);
+        b = hashring_lookup(&after, key);
+        if (a != b) {
+            moved++;
+            if (b != 4)
+                moved_elsewhere++;
+        }
+    }
+    printf("  add node: %d of %d keys moved (%.1f%%)\n", moved, NUM_KEYS, 100.0 * moved / NUM_KEYS);
+    CHECK(moved_elsewhere == 0);
+    CHECK(moved > NUM_KEYS * 15 / 100);
+    CHECK(moved < NUM_KEYS * 25 / 100);
+    hashring_free(&before);
+    hashring_free(&after);
+}
+
+/* Keys differing only in the last byte must not cluster on one node */
+static void test_similar_keys(void)
+{
+    struct hashring r;
+    int seen[4] = { 0 }, distinct = 0;
+    char key[8];
+
+    CHECK(hashring_build(&r, names, 4, HASHRING_DEFAULT_VNODES) == 0);
+    for (char c = 'a'; c <= 'p'; c++) {
+        snprintf(key, sizeof(key), "key%c", c);
+        seen[hashring_lookup(&r, key)] = 1;
+    }
+    for (int n = 0; n < 4; n++)
+        distinct += seen[n];
+    CHECK(distinct >= 3);
+    hashring_free(&r);
+}
+
+int main(void)
+{
+    printf("hashring tests\n");
+    test_empty_and_single();
+    test_deterministic();
+    test_balance();
+    test_add_node();
+    test_similar_keys();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,744 @@
+/*
+ * User-space unit tests for the hashtable core. hashtable_module.c is
+ * compiled unchanged against the kernel shims in tests/shim, so this
+ * runs in a second without root or a loaded module:
+ *
+ *   make test
+ */
+#include "../src/kernel/hashtable_module.h"
+#include <linux/rwsem.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define DIFF_KEYS 300
+#define DIFF_OPS 200000
+#define NUM_THREADS 4
+#define THREAD_OPS 50000
+#define THREAD_KEYS 64
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define CHECK_STR(got, want) do { \
+    const char *g_ = (got), *w_ = (want); \
+    checks++; \
+    if (!g_ || strcmp(g_, w_)) { \
+        fprintf(stderr, "%s:%d: expected \"%s\", got %s%s%s\n", __FILE__, __LINE__, \
+                w_, g_ ? "\"" : "", g_ ? g_ : "NULL", g_ ? "\"" : ""); \
+        failures++; \
+    } \
+} while (0)
+
+/* Count entries by walking every chain */
+static int ht_count(ht *table)
+{
+    int n = 0;
+
+    for (int i = 0; i < table->capacity; i++)
+        for (ht_entry *e = table->entries[i]; e; e = e->next)
+            n++;
+    return n;
+}
+
+/*
+ * Every key sits in the bucket its hash selects and appears only once,
+ * and the entry count and chain histogram match the buckets
+ */
+static int ht_consistent(ht *table)
+{
+    unsigned long chains[HT_CHAIN_LENGTHS] = { 0 };
+
+    for (int i = 0; i < table->capacity; i++) {
+        int len = 0;
+
+        for (ht_entry *e = table->entries[i]; e; e = e->next)
+            len++;
+        chains[len < HT_CHAIN_LENGTHS ? len : HT_CHAIN_LENGTHS - 1]++;
+    }
+    if (memcmp(chains, table->chains, sizeof(chains)) ||
+        table->count != (unsigned long)ht_count(table))
+        return 0;
+
+    for (int i = 0; i < table->capacity; i++) {
+        for (ht_entry *e = table->entries[i]; e; e = e->next) {
+            if ((int)(hash_key(e->key) % table->capacity) != i)
+                return 0;
+            for (ht_entry *d = e->next; d; d = d->next)
+                if (!strcmp(d->key, e->key))
+                    return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_basic(void)
+{
+    ht *table = create_ht();
+
+    CHECK(table != NULL);
+    CHECK(ht_search(table, "name") == NULL);
+
+    CHECK(ht_insert(table, "name", "jack") == 0);
+    CHECK(ht_insert(table, "course", "os") == 0);
+    CHECK(ht_insert(table, "year", "2026") == 0);
+    CHECK_STR(ht_search(table, "name"), "jack");
+    CHECK_STR(ht_search(table, "course"), "os");
+    CHECK_STR(ht_search(table, "year"), "2026");
+    CHECK(ht_count(table) == 3);
+
+    /* Overwrite keeps one entry */
+    CHECK(ht_insert(table, "name", "jack2") == 0);
+    CHECK_STR(ht_search(table, "name"), "jack2");
+    CHECK(ht_count(table) == 3);
+
+    /* The table owns copies, not the caller's buffers */
+    {
+        char key[8] = "tmp", val[8] = "before";
+        CHECK(ht_insert(table, key, val) == 0);
+        strcpy(key, "xxx");
+        strcpy(val, "after");
+        CHECK_STR(ht_search(table, "tmp"), "before");
+    }
+
+    CHECK(ht_delete(table, "course") == 0);
+    CHECK(ht_search(table, "course") == NULL);
+    CHECK(ht_delete(table, "course") == -ENOENT);
+    CHECK(ht_delete(table, "does-not-exist") == -ENOENT);
+
+    CHECK(ht_insert(table, "", "empty") == 0);
+    CHECK_STR(ht_search(table, ""), "empty");
+
+    CHECK(ht_insert(table, "this_is_a_very_long_key_to_test_hashing_and_memory_handling",
+                    "longvalue") == 0);
+    CHECK_STR(ht_search(table, "this_is_a_very_long_key_to_test_hashing_and_memory_handling"),
+              "longvalue");
+
+    CHECK(ht_consistent(table));
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+static void test_hash(void)
+{
+    /* FNV-1a 64-bit reference values */
+    CHECK(hash_key("") == 14695981039346656037UL);
+    CHECK(hash_key("a") == 0xaf63dc4c8601ec8cUL);
+    CHECK(hash_key("foobar") == 0x85944171f73967e8UL);
+}
+
+/* Many keys per bucket: delete from head, middle and tail of chains */
+static void test_collisions(void)
+{
+    ht *table = create_ht();
+    char key[16], val[16];
+
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(val, sizeof(val), "v%d", i);
+        CHECK(ht_insert(table, key, val) == 0);
+    }
+    CHECK(ht_count(table) == 500);
+    CHECK(ht_consistent(table));
+
+    for (int i = 0; i < 500; i += 3) {
+        snprintf(key, sizeof(key), "k%d", i);
+        CHECK(ht_delete(table, key) == 0);
+    }
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(val, sizeof(val), "v%d", i);
+        if (i % 3 == 0)
+            CHECK(ht_search(table, key) == NULL);
+        else
+            CHECK_STR(ht_search(table, key), val);
+    }
+    CHECK(ht_count(table) == 500 - 167);
+    CHECK(ht_consistent(table));
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* One bucket's chain past the last histogram class, then emptied again */
+static void test_chain_histogram(void)
+{
+    ht *table = create_ht();
+    char keys[40][16];
+    int n = 0;
+
+    CHECK(table->chains[0] == (unsigned long)table->capacity);
+    /* 40 keys in bucket 0 stay below the grow threshold of 64 entries */
+    for (int i = 0; n < 40; i++) {
+        snprintf(keys[n], sizeof(keys[n]), "c%d", i);
+        if ((hash_key(keys[n]) & (uint64_t)(table->capacity - 1)) == 0)
+            CHECK(ht_insert(table, keys[n++], "v") == 0);
+    }
+    CHECK(table->capacity == 32);
+    CHECK(table->chains[HT_CHAIN_LENGTHS - 1] == 1);
+    CHECK(table->chains[0] == 31);
+    CHECK(ht_consistent(table));
+
+    for (int i = 0; i < 40; i += 2)
+        CHECK(ht_delete(table, keys[i]) == 0);
+    CHECK(table->chains[20] == 1);
+    CHECK(ht_consistent(table));
+    for (int i = 1; i < 40; i += 2)
+        CHECK(ht_delete(table, keys[i]) == 0);
+    CHECK(table->chains[0] == 32);
+    CHECK(table->count == 0);
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Allocation failures must leave the table unchanged and leak nothing */
+static void test_enomem(void)
+{
+    ht *table;
+    long live;
+
+    for (long n = 0; n < 2; n++) {
+        shim_alloc_fail_after = n;
+        CHECK(create_ht() == NULL);
+        shim_alloc_fail_after = -1;
+        CHECK(shim_alloc_live == 0);
+    }
+
+    table = create_ht();
+    CHECK(ht_insert(table, "keep", "old") == 0);
+    live = shim_alloc_live;
+
+    /* New key: entry, key copy or value copy can fail */
+    for (long n = 0; n < 3; n++) {
+        shim_alloc_fail_after = n;
+        CHECK(ht_insert(table, "new", "value") == -ENOMEM);
+        shim_alloc_fail_after = -1;
+        CHECK(ht_search(table, "new") == NULL);
+        CHECK(shim_alloc_live == live);
+    }
+
+    /* Overwrite: the old value survives a failed copy */
+    shim_alloc_fail_after = 0;
+    CHECK(ht_insert(table, "keep", "new") == -ENOMEM);
+    shim_alloc_fail_after = -1;
+    CHECK_STR(ht_search(table, "keep"), "old");
+    CHECK(shim_alloc_live == live);
+    CHECK(ht_count(table) == 1);
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Every write bumps the version; deleted keys read as version 0 */
+static void test_versions(void)
+{
+    ht *table = create_ht();
+    uint64_t v1, v2;
+
+    CHECK(ht_version(table, "a") == 0);
+    CHECK(ht_insert(table, "a", "1") == 0);
+    v1 = ht_version(table, "a");
+    CHECK(v1 != 0);
+    CHECK(ht_insert(table, "b", "1") == 0);
+    CHECK(ht_version(table, "a") == v1);
+    CHECK(ht_insert(table, "a", "2") == 0);
+    v2 = ht_version(table, "a");
+    CHECK(v2 > v1);
+
+    /* Delete and re-insert must not bring back an old version */
+    CHECK(ht_delete(table, "a") == 0);
+    CHECK(ht_version(table, "a") == 0);
+    CHECK(ht_insert(table, "a", "1") == 0);
+    CHECK(ht_version(table, "a") > v2);
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Two-phase insert used by transactions: new key, overwrite, unused entry */
+static void test_insert_entry(int intern)
+{
+    ht *table = create_ht();
+    ht_entry *e;
+    uint64_t v;
+
+    if (intern)
+        CHECK(ht_intern_values(table) == 0);
+    e = ht_entry_alloc(table, "x", "1");
+    CHECK(e != NULL);
+    ht_insert_entry(table, e);
+    CHECK_STR(ht_search(table, "x"), "1");
+    v = ht_version(table, "x");
+    CHECK(v != 0);
+
+    e = ht_entry_alloc(table, "x", "2");
+    CHECK(ht_insert_entry(table, e) == ht_search(table, "x"));
+    CHECK_STR(ht_search(table, "x"), "2");
+    CHECK(ht_version(table, "x") > v);
+    CHECK(ht_count(table) == 1);
+    CHECK(ht_consistent(table));
+
+    /* A value already stored: when interned, the entry's copy is freed */
+    e = ht_entry_alloc(table, "z", "2");
+    CHECK(ht_insert_entry(table, e) == ht_search(table, "z"));
+    CHECK_STR(ht_search(table, "z"), "2");
+    if (intern)
+        CHECK(ht_search(table, "z") == ht_search(table, "x"));
+    CHECK(ht_count(table) == 2);
+
+    ht_entry_free(table, ht_entry_alloc(table, "y", "unused"));
+    ht_entry_free(table, NULL);
+    for (long n = 0; n < 3; n++) {
+        shim_alloc_fail_after = n;
+        CHECK(ht_entry_alloc(table, "y", "value") == NULL);
+        shim_alloc_fail_after = -1;
+    }
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* The table doubles under load and keeps every entry */
+static void test_grow(void)
+{
+    ht *table = create_ht();
+    int capacity = table->capacity;
+    char key[16], val[16];
+
+    CHECK((capacity & (capacity - 1)) == 0);
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "g%d", i);
+        snprintf(val, sizeof(val), "v%d", i);
+        CHECK(ht_insert(table, key, val) == 0);
+    }
+    CHECK(table->capacity > capacity);
+    CHECK((table->capacity & (table->capacity - 1)) == 0);
+    CHECK(table->count == 2000);
+    CHECK(ht_count(table) == 2000);
+    CHECK(ht_consistent(table));
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "g%d", i);
+        snprintf(val, sizeof(val), "v%d", i);
+        CHECK_STR(ht_search(table, key), val);
+    }
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "g%d", i);
+        CHECK(ht_delete(table, key) == 0);
+    }
+    CHECK(table->count == 0);
+
+    /* A failed grow keeps the old buckets */
+    capacity = table->capacity;
+    for (int i = 0; table->capacity == capacity; i++) {
+        snprintf(key, sizeof(key), "f%d", i);
+        if (table->count == (unsigned long)capacity * 2) {
+            shim_alloc_fail_after = 3;      /* entry, key, value, then the grow */
+            CHECK(ht_insert(table, key, "x") == 0);
+            shim_alloc_fail_after = -1;
+            CHECK(table->capacity == capacity);
+            CHECK(ht_consistent(table));
+            break;
+        }
+        CHECK(ht_insert(table, key, "x") == 0);
+    }
+    CHECK(table->capacity == capacity);
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Visit the bucket at cursor: mark its keys in seen[], return the next cursor */
+static uint64_t scan_step(ht *table, uint64_t cursor, int *seen, int n)
+{
+    for (ht_entry *e = ht_scan_bucket(table, cursor); e; e = e->next) {
+        int k;
+
+        if (sscanf(e->key, "s%d", &k) == 1 && k >= 0 && k < n)
+            seen[k]++;
+    }
+    return ht_scan_next(table, cursor);
+}
+
+/* A scan visits every key, including when the table grows midway */
+static void test_scan(void)
+{
+    static int seen[4000];
+    ht *table = create_ht();
+    uint64_t cursor = 0;
+    char key[16];
+    int steps = 0, missed = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "s%d", i);
+        CHECK(ht_insert(table, key, "v") == 0);
+    }
+
+    /* Plain scan: each key exactly once, one step per bucket */
+    memset(seen, 0, sizeof(seen));
+    do {
+        cursor = scan_step(table, cursor, seen, 4000);
+        steps++;
+    } while (cursor);
+    CHECK(steps == table->capacity);
+    for (int i = 0; i < 1000; i++)
+        missed += seen[i] != 1;
+    CHECK(missed == 0);
+
+    /* Grow twice in the middle of a scan; the first 1000 keys must all be seen */
+    memset(seen, 0, sizeof(seen));
+    cursor = 0;
+    for (int i = 0; i < table->capacity / 3; i++)
+        cursor = scan_step(table, cursor, seen, 4000);
+    for (int i = 1000; i < 4000; i++) {
+        snprintf(key, sizeof(key), "s%d", i);
+        CHECK(ht_insert(table, key, "v") == 0);
+    }
+    while (cursor)
+        cursor = scan_step(table, cursor, seen, 4000);
+    missed = 0;
+    for (int i = 0; i < 1000; i++)
+        missed += seen[i] == 0;
+    CHECK(missed == 0);
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Record the snapshot's view of key s<k> in vals[k]; returns entries returned */
+static int snap_take(ht *table, ht_entry *e, char vals[][16], int n)
+{
+    int k;
+
+    if (sscanf(e->key, "s%d", &k) != 1 || k < 0 || k >= n || vals[k][0])
+        return -1;             /* unknown key or seen twice */
+    snprintf(vals[k], 16, "%s", e->value);
+    return 1;
+}
+
+/*
+ * A snapshot returns the table as of ht_snapshot_begin(), read the way
+ * /proc/htsnap does, while writes and a grow happen halfway through
+ */
+static void test_snapshot(int intern)
+{
+    static char vals[2000][16];
+    ht *table = create_ht();
+    uint64_t cursor = 0;
+    char key[16], value[16];
+    int returned = 0, bad = 0, steps = 0, capacity;
+
+    if (intern)
+        CHECK(ht_intern_values(table) == 0);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "s%d", i);
+        snprintf(value, sizeof(value), "v%d", i % 7);
+        CHECK(ht_insert(table, key, value) == 0);
+    }
+    CHECK(ht_snapshot_begin(table) == 0);
+    CHECK(ht_snapshot_begin(table) == -EBUSY);
+    capacity = table->capacity;
+
+    memset(vals, 0, sizeof(vals));
+    do {
+        for (ht_entry *e = ht_scan_bucket(table, cursor); e; e = e->next) {
+            if (!ht_snapshot_visible(table, e))
+                continue;
+            if (snap_take(table, e, vals, 2000) < 0)
+                bad++;
+            ht_snapshot_mark(table, e);
+            returned++;
+        }
+        cursor = ht_scan_next(table, cursor);
+        if (++steps == capacity / 2) {
+            /* Overwrite, delete and add keys; the adds grow the table */
+            for (int i = 0; i < 1000; i += 3) {
+                snprintf(key, sizeof(key), "s%d", i);
+                CHECK(ht_insert(table, key, "changed") == 0);
+                CHECK(ht_insert(table, key, "twice") == 0);
+            }
+            for (int i = 1; i < 1000; i += 3) {
+                snprintf(key, sizeof(key), "s%d", i);
+                CHECK(ht_delete(table, key) == 0);
+            }
+            for (int i = 1000; i < 2000; i++) {
+                snprintf(key, sizeof(key), "s%d", i);
+                CHECK(ht_insert(table, key, "new") == 0);
+            }
+        }
+    } while (cursor);
+    CHECK(table->capacity > capacity);
+    ht_snapshot_live_done(table);
+    CHECK(table->snap->preserved_count > 0);
+    for (ht_entry *e = table->snap->preserved; e; e = e->next) {
+        if (snap_take(table, e, vals, 2000) < 0)
+            bad++;
+        returned++;
+    }
+
+    CHECK(bad == 0);
+    CHECK(returned == 1000);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(value, sizeof(value), "v%d", i % 7);
+        if (strcmp(vals[i], value))
+            bad++;
+    }
+    CHECK(bad == 0);
+    CHECK(!table->snap->failed);
+
+    /* Writes after the live walk no longer copy */
+    returned = table->snap->preserved_count;
+    CHECK(ht_insert(table, "s2", "later") == 0);
+    CHECK(ht_delete(table, "s5") == 0);
+    CHECK((int)table->snap->preserved_count == returned);
+
+    ht_snapshot_end(table);
+    CHECK(table->snap == NULL);
+    CHECK_STR(ht_search(table, "s0"), "twice");
+    CHECK(ht_search(table, "s1") == NULL);
+    CHECK(ht_consistent(table));
+
+    /* A copy that cannot be allocated fails the snapshot, not the write */
+    CHECK(ht_snapshot_begin(table) == 0);
+    shim_alloc_fail_after = 1;
+    CHECK(ht_insert(table, "s3", "lost") == 0);
+    shim_alloc_fail_after = -1;
+    CHECK(table->snap->failed);
+    CHECK_STR(ht_search(table, "s3"), "lost");
+
+    /* Destroying the table frees an open snapshot too */
+    CHECK(ht_delete(table, "s6") == 0);
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/* Interned values: shared per content, released by overwrite and delete */
+static void test_interning(void)
+{
+    ht *table = create_ht();
+    char key[16];
+    long live;
+
+    CHECK(ht_intern_values(table) == 0);
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        CHECK(ht_insert(table, key, i % 2 ? "on" : "off") == 0);
+    }
+    CHECK(table->values->count == 2);
+    CHECK(table->values->refs == 100);
+    CHECK(ht_search(table, "k1") == ht_search(table, "k3"));
+    CHECK(ht_search(table, "k0") != ht_search(table, "k1"));
+    CHECK(table->values->ref_bytes == 50 * 3 + 50 * 4);
+
+    /* Overwrite moves a reference; the last one frees the value */
+    CHECK(ht_insert(table, "k0", "on") == 0);
+    CHECK(table->values->refs == 100);
+    CHECK_STR(ht_search(table, "k0"), "on");
+    for (int i = 2; i < 100; i += 2) {
+        snprintf(key, sizeof(key), "k%d", i);
+        CHECK(ht_delete(table, key) == 0);
+    }
+    CHECK(table->values->count == 1);
+    CHECK(table->values->refs == 51);
+
+    /* Rewriting a key with its own value must not free it in between */
+    CHECK(ht_insert(table, "k1", "on") == 0);
+    CHECK_STR(ht_search(table, "k1"), "on");
+
+    /* A duplicate costs no allocation beyond the entry and key */
+    live = shim_alloc_live;
+    CHECK(ht_insert(table, "new", "on") == 0);
+    CHECK(shim_alloc_live == live + 2);
+
+    /* A failed new value leaves nothing behind */
+    live = shim_alloc_live;
+    shim_alloc_fail_after = 0;
+    CHECK(ht_insert(table, "k1", "fresh") == -ENOMEM);
+    shim_alloc_fail_after = -1;
+    CHECK_STR(ht_search(table, "k1"), "on");
+    CHECK(shim_alloc_live == live);
+    CHECK(table->values->count == 1);
+
+    CHECK(ht_insert(table, "x", "y") == 0);
+    CHECK(ht_intern_values(table) == -EBUSY);
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/*
+ * Randomized differential test: apply the same random operations to
+ * the hashtable and to a trivial reference map (an array indexed by key
+ * number) and compare every result.
+ */
+static void test_differential(unsigned int seed, int intern)
+{
+    static char ref[DIFF_KEYS][16];
+    static int present[DIFF_KEYS];
+    ht *table = create_ht();
+    int count = 0;
+    int mismatches = 0;
+    char key[16], val[16];
+
+    memset(present, 0, sizeof(present));
+    srand(seed);
+    if (intern)
+        CHECK(ht_intern_values(table) == 0);
+
+    for (int op = 0; op < DIFF_OPS && mismatches < 10; op++) {
+        int k = rand() % DIFF_KEYS;
+        int r = rand() % 10;
+        char *found;
+
+        snprintf(key, sizeof(key), "key%d", k);
+        if (r < 4) {
+            /* Few distinct values when interning, so references are shared */
+            snprintf(val, sizeof(val), "v%d", intern ? rand() % 8 : rand());
+            if (ht_insert(table, key, val) != 0) {
+                mismatches++;
+                continue;
+            }
+            if (!present[k])
+                count++;
+            present[k] = 1;
+            strcpy(ref[k], val);
+        } else if (r < 7) {
+            int ret = ht_delete(table, key);
+            if (ret != (present[k] ? 0 : -ENOENT))
+                mismatches++;
+            if (present[k])
+                count--;
+            present[k] = 0;
+        } else {
+            found = ht_search(table, key);
+            if (present[k] ? (!found || strcmp(found, ref[k])) : found != NULL)
+                mismatches++;
+        }
+    }
+
+    if (mismatches)
+        fprintf(stderr, "differential test (seed %u): %d mismatches\n", seed, mismatches);
+    CHECK(mismatches == 0);
+    CHECK(ht_count(table) == count);
+    CHECK(ht_consistent(table));
+    if (intern)
+        CHECK(table->values->refs == (unsigned long)count);
+    for (int k = 0; k < DIFF_KEYS; k++) {
+        snprintf(key, sizeof(key), "key%d", k);
+        if (present[k])
+            CHECK_STR(ht_search(table, key), ref[k]);
+        else
+            CHECK(ht_search(table, key) == NULL);
+    }
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+/*
+ * Concurrent use under an rw_semaphore, the way /proc/ht drives the
+ * table: lookups take the lock shared, insert and delete exclusive.
+ * Each thread owns a key range, so it can check its own results.
+ */
+struct thread_args {
+    ht *table;
+    struct rw_semaphore *sem;
+    int id;
+    int errors;
+};
+
+static void *hashtable_thread(void *data)
+{
+    struct thread_args *args = data;
+    unsigned int seed = (unsigned int)args->id * 7919u + 1;
+    int present[THREAD_KEYS] = {0};
+    char key[16], val[16];
+
+    for (int i = 0; i < THREAD_OPS; i++) {
+        int k = rand_r(&seed) % THREAD_KEYS;
+        int op = rand_r(&seed) % 3;
+
+        snprintf(key, sizeof(key), "t%d-%d", args->id, k);
+        snprintf(val, sizeof(val), "v%d", k);
+        if (op == 0) {
+            down_write(args->sem);
+            if (ht_insert(args->table, key, val) != 0)
+                args->errors++;
+            up_write(args->sem);
+            present[k] = 1;
+        } else if (op == 1) {
+            char *found;
+            int ok;
+
+            down_read(args->sem);
+            found = ht_search(args->table, key);
+            ok = present[k] ? (found && !strcmp(found, val)) : !found;
+            up_read(args->sem);
+            if (!ok)
+                args->errors++;
+        } else {
+            down_write(args->sem);
+            if (ht_delete(args->table, key) != (present[k] ? 0 : -ENOENT))
+                args->errors++;
+            up_write(args->sem);
+            present[k] = 0;
+        }
+    }
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    DECLARE_RWSEM(sem);
+    ht *table = create_ht();
+    pthread_t threads[NUM_THREADS];
+    struct thread_args args[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        args[i].table = table;
+        args[i].sem = &sem;
+        args[i].id = i;
+        args[i].errors = 0;
+        pthread_create(&threads[i], NULL, hashtable_thread, &args[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(args[i].errors == 0);
+    }
+    CHECK(ht_consistent(table));
+
+    destroy_ht(table);
+    CHECK(shim_alloc_live == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int seed = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 0) : 1;
+
+    test_hash();
+    test_basic();
+    test_collisions();
+    test_chain_histogram();
+    test_enomem();
+    test_versions();
+    test_insert_entry(0);
+    test_insert_entry(1);
+    test_interning();
+    test_grow();
+    test_scan();
+    test_snapshot(0);
+    test_snapshot(1);
+    for (unsigned int s = seed; s < seed + 5; s++)
+        test_differential(s, 0);
+    test_differential(seed, 1);
+    test_concurrent();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
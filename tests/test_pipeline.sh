@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SERVER="127.0.0.1"
+PORT=5555
+COUNT=200
+
+echo "=== TEST: Pipelined commands on one connection ==="
+read -p "User: " USER
+read -s -p "Password: " PASS
+echo ""
+
+# Build one request stream: AUTH, COUNT inserts, COUNT lookups, QUIT
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 $COUNT); do
+        echo "insert pipe$i val$i"
+    done
+    for i in $(seq 1 $COUNT); do
+        echo "lookup pipe$i"
+    done
+    echo "QUIT"
+} > /tmp/pipeline_req.txt
+
+start=$(date +%s%N)
+nc $SERVER $PORT < /tmp/pipeline_req.txt > /tmp/pipeline_resp.txt
+end=$(date +%s%N)
+
+lines=$(wc -l < /tmp/pipeline_resp.txt)
+expected=$(( COUNT * 2 + 2 ))  # AUTH OK + responses + BYE
+if [[ "$lines" -eq "$expected" ]]; then
+    echo "PASS: got $lines response lines"
+else
+    echo "FAIL: expected $expected response lines, got $lines"
+fi
+
+if [[ "$(sed -n "$(( COUNT + 2 ))p" /tmp/pipeline_resp.txt)" == "Lookup on key: pipe1, gave value: val1" ]]; then
+    echo "PASS: responses returned in order"
+else
+    echo "FAIL: responses out of order"
+fi
+
+echo "Elapsed: $(( (end - start) / 1000000 )) ms"
+
+# Cleanup
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 $COUNT); do
+        echo "delete pipe$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $PORT > /dev/null
+
+rm -f /tmp/pipeline_req.txt /tmp/pipeline_resp.txt
+echo "=== DONE ==="
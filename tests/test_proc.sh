@@ -40,4 +40,133 @@ else
     echo "FAIL: delete failed"
 fi
 
+echo "[6] Stats count the operations above"
+ins_before=$(awk '$1 == "inserts" {print $2}' /proc/htstats)
+echo "insert statkey 1" > $HT
+echo "lookup statkey" > $HT
+ins_after=$(awk '$1 == "inserts" {print $2}' /proc/htstats)
+entries=$(awk '$1 == "entries" {print $2}' /proc/htstats)
+if [[ $((ins_after - ins_before)) -eq 1 && "$entries" -ge 1 ]]; then
+    echo "PASS: /proc/htstats counts inserts"
+else
+    echo "FAIL: /proc/htstats inserts $ins_before -> $ins_after, entries $entries"
+fi
+echo "delete statkey" > $HT
+
+echo "[7] Mutations appear on /proc/htevents"
+events=$(mktemp)
+timeout 2 cat /proc/htevents > "$events" &
+reader=$!
+sleep 0.2
+echo "insert evkey 1" > $HT
+echo "delete evkey" > $HT
+wait $reader
+if grep -q "^[0-9]* insert evkey 1$" "$events" && grep -q "^[0-9]* delete evkey$" "$events"; then
+    echo "PASS: /proc/htevents reports insert and delete"
+else
+    echo "FAIL: /proc/htevents got: $(cat "$events")"
+fi
+rm -f "$events"
+
+echo "[8] Replies and versions are read back on the same fd"
+exec 3<>$HT
+printf 'insert txkey 1' >&3
+read -r reply <&3
+printf 'version txkey' >&3
+read -r version <&3
+exec 3>&-
+ver=${version##* }
+if [[ "$reply" == "Inserted key: txkey, value: 1" && "$ver" -gt 0 ]]; then
+    echo "PASS: /proc/ht replies ($version)"
+else
+    echo "FAIL: /proc/ht replies: '$reply' '$version'"
+fi
+
+echo "[9] Multi-key transactions check versions"
+if printf 'multi\ncheck txkey %s\ninsert txkey 2\ninsert txkey2 2\nexec\n' "$ver" > $HT &&
+   ! printf 'multi\ncheck txkey %s\ndelete txkey\nexec\n' "$ver" > $HT 2>/dev/null &&
+   [[ $(grep -c "^txkey2\? 2$" $RAW) -eq 2 ]]; then
+    echo "PASS: transaction applied, stale check aborted"
+else
+    echo "FAIL: transactions: $(grep "^txkey" $RAW)"
+fi
+echo "delete txkey" > $HT
+echo "delete txkey2" > $HT
+
+echo "[10] Hot keys are replicated per CPU and see writes"
+echo "insert hotkey v1" > $HT
+taskset -c 0 bash -c 'for i in $(seq 1 20000); do echo "lookup hotkey" > /proc/ht; done'
+exec 3<>$HT
+printf 'insert hotkey v2' >&3
+read -r reply <&3
+printf 'lookup hotkey' >&3
+read -r reply <&3
+exec 3>&-
+if grep -q "^hotkey " /proc/hthot && [[ "$reply" == "Lookup on key: hotkey, gave value: v2" ]]; then
+    echo "PASS: $(grep "^hotkey " /proc/hthot), lookup after write sees v2"
+else
+    echo "FAIL: hot keys: '$(cat /proc/hthot)' '$reply'"
+fi
+echo "delete hotkey" > $HT
+
+echo "[11] Scan returns every key in batches"
+for i in $(seq 1 200); do echo "insert scan$i v$i" > $HT; done
+cursor=0
+found=0
+while :; do
+    exec 3<>$HT
+    printf 'scan %s 20 scan*' "$cursor" >&3
+    reply=$(cat <&3)
+    exec 3>&-
+    cursor=$(echo "$reply" | head -1 | awk '{print $3}')
+    found=$((found + $(echo "$reply" | grep -c "^scan[0-9]* v")))
+    [[ "$cursor" == "0" || -z "$cursor" ]] && break
+done
+if [[ "$found" -ge 200 && "$cursor" == "0" ]]; then
+    echo "PASS: scan returned $found entries for 200 keys"
+else
+    echo "FAIL: scan returned $found entries, last cursor '$cursor'"
+fi
+for i in $(seq 1 200); do echo "delete scan$i" > $HT; done
+
+echo "[12] Snapshot is point-in-time while writes go on"
+for i in $(seq 1 100); do echo "insert snap$i old$i" > $HT; done
+exec 4</proc/htsnap
+if cat /proc/htsnap 2>/dev/null >/dev/null; then
+    echo "FAIL: second snapshot opened while one is active"
+else
+    echo "PASS: second snapshot refused"
+fi
+head -c 100 <&4 > /tmp/htsnap.txt
+echo "insert snap1 new1" > $HT
+echo "delete snap2" > $HT
+echo "insert snapnew x" > $HT
+cat <&4 >> /tmp/htsnap.txt
+exec 4<&-
+if [[ $(grep -c "^snap[0-9]* old" /tmp/htsnap.txt) -eq 100 ]] &&
+   ! grep -q "^snapnew " /tmp/htsnap.txt && ! grep -q " new1$" /tmp/htsnap.txt; then
+    echo "PASS: snapshot shows the table as of open"
+else
+    echo "FAIL: snapshot mixed in later writes"
+fi
+for i in $(seq 1 100); do echo "delete snap$i" > $HT; done
+echo "delete snapnew" > $HT
+rm -f /tmp/htsnap.txt
+
+echo "[13] Command history records results from every CPU"
+for cpu in 0 1; do
+    taskset -c $cpu bash -c 'echo "insert histkey$0 v" > /proc/ht; echo "lookup histmiss" > /proc/ht' $cpu
+done
+hist=$(cat /proc/hthistory)
+if echo "$hist" | grep -q "^[0-9]* 0 insert histkey0 0 [0-9]*$" &&
+   echo "$hist" | grep -q "^[0-9]* 1 insert histkey1 0 [0-9]*$" &&
+   [[ $(echo "$hist" | grep -c " lookup histmiss -2 ") -eq 2 ]] &&
+   [[ "$(echo "$hist" | awk '{print $1}')" == "$(echo "$hist" | awk '{print $1}' | sort -n)" ]]; then
+    echo "PASS: both CPUs' commands listed in time order"
+else
+    echo "FAIL: history: '$(echo "$hist" | tail -4)'"
+fi
+echo "delete histkey0" > $HT
+echo "delete histkey1" > $HT
+
 echo "=== DONE ==="
\ No newline at end of file
@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# Replicates a primary on another host, with its own kernel module, into
+# this host's store. The primary gets far more than the 512 bytes that
+# /proc/hashtable shows, and this store starts with keys the primary
+# lacks: after the snapshot both must hold exactly the same entries.
+# Run as root on the replica host, with the module loaded and no daemon
+# running.
+#
+#   PRIMARY_HOST=10.0.0.1 sudo -E tests/test_replication_snapshot.sh
+
+SERVER="${PRIMARY_HOST:?set PRIMARY_HOST to a host running a primary daemon}"
+PRIMARY_PORT=5555
+REPLICA_PORT=5556
+DAEMON="./daemon"
+COUNT=400
+STALE=20
+
+echo "=== TEST: Replication snapshot of a large store ==="
+read -p "User: " USER
+read -s -p "Password: " PASS
+echo ""
+
+stat_value() {
+    tr ' ' '\n' | grep "^$1=" | cut -d= -f2
+}
+
+# The whole local store, sorted, from the snapshot file
+local_entries() {
+    sort /proc/htsnap
+}
+
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 $COUNT); do
+        echo "insert snapkey$i snapvalue$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $PRIMARY_PORT > /dev/null
+
+for i in $(seq 1 $STALE); do
+    echo "insert stalekey$i x" > /proc/ht
+done
+
+$DAEMON -n --port $REPLICA_PORT --replica-of $SERVER:$PRIMARY_PORT \
+    --replica-auth "$USER:$PASS" &
+REPLICA_PID=$!
+sleep 5
+
+have=$(local_entries | grep -c "^snapkey")
+stale=$(local_entries | grep -c "^stalekey")
+wrong=$(local_entries | grep "^snapkey" | awk '{ sub("snapkey", "", $1); sub("snapvalue", "", $2); if ($1 != $2) n++ } END { print n + 0 }')
+if [[ "$have" -eq $COUNT && "$wrong" -eq 0 ]]; then
+    echo "PASS: all $COUNT keys copied ($(local_entries | wc -c) bytes)"
+else
+    echo "FAIL: $have of $COUNT keys copied, $wrong with a wrong value"
+fi
+if [[ "$stale" -eq 0 ]]; then
+    echo "PASS: local keys the primary lacks were deleted"
+else
+    echo "FAIL: $stale stale keys left"
+fi
+
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 2 $COUNT); do
+        echo "delete snapkey$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $PRIMARY_PORT > /dev/null
+sleep 2
+
+have=$(local_entries | grep -c "^snapkey")
+stats=$(printf 'AUTH %s %s\nstats\nQUIT\n' "$USER" "$PASS" | nc 127.0.0.1 $REPLICA_PORT | grep "^STATS")
+lag=$(echo "$stats" | stat_value replica_lag_events)
+if [[ "$have" -eq $((COUNT / 2)) && "$lag" == "0" ]]; then
+    echo "PASS: streamed deletes applied, lag $lag events"
+else
+    echo "FAIL: $have keys left (want $((COUNT / 2))), replica_lag_events=$lag"
+fi
+
+# Cleanup
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 2 2 $COUNT); do
+        echo "delete snapkey$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $PRIMARY_PORT > /dev/null
+sleep 1
+
+kill $REPLICA_PID
+wait $REPLICA_PID 2>/dev/null
+echo "=== DONE ==="
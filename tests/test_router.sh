@@ -0,0 +1,106 @@
+#!/bin/bash
+
+# Starts three backend daemons and a router in front of them, then adds
+# a fourth backend. On one host every daemon uses the same kernel
+# module, so this checks routing (answers, spread of requests over the
+# backends, node addition and the sweep that ends it), not where the
+# keys end up stored.
+
+SERVER="127.0.0.1"
+ROUTER_PORT=5600
+DAEMON="./daemon"
+COUNT=200
+
+echo "=== TEST: Consistent-hash router ==="
+read -p "User: " USER
+read -s -p "Password: " PASS
+echo ""
+
+PIDS=""
+for port in 5601 5602 5603 5604; do
+    $DAEMON -n --port $port --backup /var/tmp/hashtable_backend_$port.txt &
+    PIDS="$PIDS $!"
+done
+$DAEMON -n --port $ROUTER_PORT --backup /var/tmp/hashtable_router.txt \
+    --router $SERVER:5601,$SERVER:5602,$SERVER:5603 --router-auth "$USER:$PASS" &
+PIDS="$PIDS $!"
+sleep 2
+
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 $COUNT); do
+        echo "insert route$i val$i"
+    done
+    for i in $(seq 1 $COUNT); do
+        echo "lookup route$i"
+    done
+    echo "ROUTER NODES"
+    echo "QUIT"
+} | nc $SERVER $ROUTER_PORT > /tmp/router_resp.txt
+
+found=$(grep -c "^Lookup on key: route[0-9]*, gave value: val" /tmp/router_resp.txt)
+if [[ "$found" -eq "$COUNT" ]]; then
+    echo "PASS: $found lookups answered through the router"
+else
+    echo "FAIL: expected $COUNT lookups, got $found"
+fi
+
+# Each backend should see a share of the 2 * COUNT requests
+nodes=$(grep "^NODES" /tmp/router_resp.txt)
+echo "$nodes"
+idle=0
+for n in $(echo "$nodes" | tr ' ' '\n' | grep "=" | cut -d= -f2 | cut -d/ -f1); do
+    [[ "$n" -lt $(( COUNT / 4 )) ]] && idle=1
+done
+if [[ "$idle" -eq 0 ]]; then
+    echo "PASS: requests spread over all backends"
+else
+    echo "FAIL: a backend got less than a fair share"
+fi
+
+resp=$(printf 'AUTH %s %s\nROUTER ADD %s:5604\nlookup route1\nROUTER DONE\nROUTER NODES\nQUIT\n' \
+       "$USER" "$PASS" $SERVER | nc $SERVER $ROUTER_PORT)
+if echo "$resp" | grep -q "ROUTER ADDED" && echo "$resp" | grep -q "ROUTER SWEEPING" &&
+   echo "$resp" | grep -q "^NODES 4 " &&
+   echo "$resp" | grep -q "Lookup on key: route1, gave value: val1"; then
+    echo "PASS: node added, keys still reachable"
+else
+    echo "FAIL: adding a node"
+fi
+
+# Wait for the sweep, after which the previous ring is gone
+for try in $(seq 1 20); do
+    printf 'AUTH %s %s\nstats\nQUIT\n' "$USER" "$PASS" | nc $SERVER $ROUTER_PORT |
+        grep -q "router_migrating=0" && break
+    sleep 0.5
+done
+
+# route2..COUNT were not touched since ROUTER ADD: only the sweep moved them
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 2 $COUNT); do
+        echo "lookup route$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $ROUTER_PORT > /tmp/router_resp.txt
+
+found=$(grep -c "^Lookup on key: route[0-9]*, gave value: val" /tmp/router_resp.txt)
+if [[ "$found" -eq $(( COUNT - 1 )) ]]; then
+    echo "PASS: untouched keys found after the sweep"
+else
+    echo "FAIL: expected $(( COUNT - 1 )) keys after the sweep, got $found"
+fi
+
+# Cleanup
+{
+    echo "AUTH $USER $PASS"
+    for i in $(seq 1 $COUNT); do
+        echo "delete route$i"
+    done
+    echo "QUIT"
+} | nc $SERVER $ROUTER_PORT > /dev/null
+
+kill $PIDS
+wait 2>/dev/null
+rm -f /tmp/router_resp.txt /var/tmp/hashtable_backend_*.txt /var/tmp/hashtable_router.txt
+echo "=== DONE ==="
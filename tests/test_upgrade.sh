@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Starts a daemon with an upgrade socket, keeps opening short client
+# connections against it, and replaces it with a second daemon started
+# with --takeover. Every request must be answered, and the old daemon
+# must exit once its connections have drained.
+
+SERVER="127.0.0.1"
+PORT=5700
+UPGRADE_SOCK="/var/tmp/kvstore_upgrade_test.sock"
+DAEMON="./daemon"
+SECONDS_OF_LOAD=6
+
+echo "=== TEST: Zero-downtime upgrade ==="
+read -p "User: " USER
+read -s -p "Password: " PASS
+echo ""
+
+$DAEMON -n --port $PORT --backup /var/tmp/hashtable_upgrade.txt \
+    --upgrade-socket $UPGRADE_SOCK --drain-timeout 5 &
+OLD_PID=$!
+sleep 2
+
+printf 'AUTH %s %s\ninsert upgradekey before\nQUIT\n' "$USER" "$PASS" | nc $SERVER $PORT > /dev/null
+token=$(printf 'AUTH %s %s\nQUIT\n' "$USER" "$PASS" | nc $SERVER $PORT | awk '/^AUTH OK/ {print $3}')
+
+# One connection per request; count the ones not answered and the slowest one
+(
+    ok=0; failed=0; max_ms=0
+    end=$(( $(date +%s) + SECONDS_OF_LOAD ))
+    while [[ $(date +%s) -lt $end ]]; do
+        start=$(date +%s%N)
+        if printf 'AUTH %s %s\nlookup upgradekey\nQUIT\n' "$USER" "$PASS" | nc $SERVER $PORT |
+           grep -q "gave value: before"; then
+            ok=$((ok + 1))
+        else
+            failed=$((failed + 1))
+        fi
+        ms=$(( ($(date +%s%N) - start) / 1000000 ))
+        [[ $ms -gt $max_ms ]] && max_ms=$ms
+    done
+    echo "$ok $failed $max_ms" > /tmp/upgrade_load.txt
+) &
+LOAD_PID=$!
+sleep 2
+
+$DAEMON -n --port $PORT --backup /var/tmp/hashtable_upgrade.txt \
+    --upgrade-socket $UPGRADE_SOCK --takeover &
+NEW_PID=$!
+
+wait $LOAD_PID
+read ok failed max_ms < /tmp/upgrade_load.txt
+echo "requests: $ok answered, $failed failed, slowest ${max_ms} ms"
+if [[ "$failed" -eq 0 && "$ok" -gt 0 ]]; then
+    echo "PASS: no request lost during the upgrade"
+else
+    echo "FAIL: $failed requests lost during the upgrade"
+fi
+
+sleep 2
+if kill -0 $OLD_PID 2>/dev/null; then
+    echo "FAIL: old daemon still running"
+else
+    echo "PASS: old daemon drained and exited"
+fi
+
+resp=$(printf 'AUTH-TOKEN %s\nlookup upgradekey\nQUIT\n' "$token" | nc $SERVER $PORT)
+if echo "$resp" | grep -q "gave value: before"; then
+    echo "PASS: session token issued by the old daemon still valid"
+else
+    echo "FAIL: session token lost in the upgrade"
+fi
+
+# Cleanup
+printf 'AUTH %s %s\ndelete upgradekey\nQUIT\n' "$USER" "$PASS" | nc $SERVER $PORT > /dev/null
+kill $OLD_PID $NEW_PID 2>/dev/null
+wait 2>/dev/null
+rm -f /tmp/upgrade_load.txt /var/tmp/hashtable_upgrade.txt
+echo "=== DONE ==="